@@ -6,13 +6,17 @@ use crate::cxxrsutil::*;
 use crate::ffi::BubblewrapMutability;
 use anyhow::{Context, Result};
 use fn_error_context::context;
+use nix::sys::time::{TimeSpec, TimeValLike};
 use openat_ext::OpenatDirExt;
 use std::convert::TryInto;
+use std::ffi::{CStr, CString, OsStr};
 use std::num::NonZeroUsize;
+use std::os::unix::ffi::OsStrExt;
 use std::os::unix::io::AsRawFd;
 use std::path::Path;
 use std::pin::Pin;
 use std::process::Command;
+use std::rc::Rc;
 
 // Links in the rootfs to /usr
 static USR_LINKS: &[&str] = &["lib", "lib32", "lib64", "bin", "sbin"];
@@ -43,6 +47,9 @@ static RO_BINDS: &[&str] = &[
     "/sys/devices",
 ];
 
+/// Paths which are protected via rofiles-fuse in `BubblewrapMutability::RoFiles` mode.
+static ROFILES_PATHS: &[&str] = &["/usr", "/etc"];
+
 pub(crate) struct Bubblewrap {
     pub(crate) rootfs_fd: openat::Dir,
 
@@ -51,7 +58,22 @@ pub(crate) struct Bubblewrap {
     child_argv0: Option<NonZeroUsize>,
     launcher: gio::SubprocessLauncher, // 🚀
 
-    rofiles_mounts: Vec<RoFilesMount>,
+    rofiles_mounts: Vec<Rc<RoFilesMount>>,
+    overlay_mounts: Vec<OverlayMount>,
+}
+
+/// A factory for `Bubblewrap` instances sharing one root filesystem and
+/// mutability level, used for e.g. all of the `%post` scripts in a transaction.
+/// The expensive part of setting up a container for a script is spawning
+/// rofiles-fuse for `/usr` and `/etc`; here that is done lazily on first use
+/// and the mounts are then shared by every container created afterwards.
+/// The mounts are torn down when the sandbox and all its containers are dropped.
+/// Anything modifying the rootfs other than through the sandbox must call
+/// `invalidate()` afterwards.
+pub(crate) struct BubblewrapSandbox {
+    rootfs_fd: openat::Dir,
+    mutability: BubblewrapMutability,
+    rofiles_mounts: Vec<Rc<RoFilesMount>>,
 }
 
 // nspawn by default doesn't give us CAP_NET_ADMIN; see
@@ -136,6 +158,323 @@ impl Drop for RoFilesMount {
     }
 }
 
+/// An overlayfs mount protecting a subdirectory of the rootfs.  This gives
+/// the same guarantee as rofiles-fuse (hardlinked files are never mutated
+/// in place), but copy-up is handled by the kernel rather than paying a FUSE
+/// round trip for every file operation.  Changes land in an upper directory,
+/// which is merged back into the rootfs by `finish()` once the container has
+/// exited.  Requires `CAP_SYS_ADMIN`.
+struct OverlayMount {
+    /// Holds the `upper`, `work` and `merged` directories; this lives next to
+    /// the rootfs (which is always in a tmpdir, e.g. the repo's `tmp/`), so
+    /// that upper files can be renamed into place without scripts seeing it.
+    /// Only an Option<T> so we can take ownership of it in drop().  Its path
+    /// is relative to `parent` below, so it must be declared (i.e. dropped) first.
+    tempdir: Option<tempfile::TempDir>,
+    mounted: bool,
+    /// The subdirectory we are protecting, e.g. `usr`
+    path: String,
+    rootfs: openat::Dir,
+    /// Keeps the fd in the `tempdir` path open
+    _parent: openat::Dir,
+}
+
+impl OverlayMount {
+    /// Create a new overlayfs mount point
+    fn new(rootfs: &openat::Dir, path: &str) -> Result<Self> {
+        let path = path.trim_start_matches('/');
+        let rootfs = rootfs.sub_dir(".")?;
+        let rootfs_path = format!("/proc/self/fd/{}", rootfs.as_raw_fd());
+        let parent = rootfs.sub_dir("..")?;
+        if parent.self_metadata()?.stat().st_dev != rootfs.self_metadata()?.stat().st_dev {
+            anyhow::bail!("overlayfs requires the rootfs parent to be on the same filesystem");
+        }
+        let tempdir = tempfile::Builder::new()
+            .prefix("rpmostree-overlay")
+            .tempdir_in(format!("/proc/self/fd/{}", parent.as_raw_fd()))?;
+        for d in &["upper", "work", "merged"] {
+            std::fs::create_dir(tempdir.path().join(d))?;
+        }
+        let mut ret = Self {
+            tempdir: Some(tempdir),
+            mounted: false,
+            path: path.to_string(),
+            rootfs,
+            _parent: parent,
+        };
+        let tmp = ret.tempdir.as_ref().unwrap().path();
+        // Renamed directories and metadata-only copy-ups would be stored as
+        // xattrs that finish() doesn't know how to merge; turn them off.
+        let opts = format!(
+            "lowerdir={}/{},upperdir={}/upper,workdir={}/work,index=off,metacopy=off,redirect_dir=off",
+            rootfs_path,
+            path,
+            tmp.display(),
+            tmp.display()
+        );
+        let merged = tmp.join("merged");
+        nix::mount::mount(
+            Some("overlay"),
+            &merged,
+            Some("overlay"),
+            nix::mount::MsFlags::empty(),
+            Some(opts.as_str()),
+        )
+        .with_context(|| format!("Mounting overlayfs for /{}", path))?;
+        ret.mounted = true;
+        Ok(ret)
+    }
+
+    /// Return the mount point path, relative to the rootfs
+    fn path(&self) -> String {
+        // Safety: We only use the Option<T> here around drop handling, it should always
+        // be `Some` until `drop()` is called.
+        let tempdir = self.tempdir.as_ref().unwrap().path();
+        let name = tempdir.file_name().expect("tempdir name");
+        format!("../{}/merged", name.to_str().expect("tempdir str"))
+    }
+
+    fn unmount(&mut self) -> Result<()> {
+        if self.mounted {
+            let merged = self.tempdir.as_ref().unwrap().path().join("merged");
+            nix::mount::umount2(&merged, nix::mount::MntFlags::MNT_DETACH)?;
+            self.mounted = false;
+        }
+        Ok(())
+    }
+
+    /// Unmount, and merge the contents of the upper directory into the rootfs.
+    fn finish(&mut self) -> Result<()> {
+        self.unmount()?;
+        let upper = openat::Dir::open(&self.tempdir.as_ref().unwrap().path().join("upper"))?;
+        let target = self.rootfs.sub_dir(self.path.as_str())?;
+        merge_overlay_upper(&upper, &target)
+            .with_context(|| format!("Merging overlayfs changes to /{}", self.path))
+    }
+}
+
+impl Drop for OverlayMount {
+    fn drop(&mut self) {
+        if let Err(e) = self.unmount() {
+            systemd::journal::print(4, &format!("{}", e));
+            // If we cannot unmount, then we cannot remove it; just leak it.
+            if let Some(d) = self.tempdir.take() {
+                let _ = d.into_path();
+            }
+        }
+    }
+}
+
+/// Path to `name` in `d`, for the `l*xattr()` family which has no `*at()` variant.
+fn fd_path(d: &openat::Dir, name: &OsStr) -> Result<CString> {
+    let mut buf = format!("/proc/self/fd/{}/", d.as_raw_fd()).into_bytes();
+    buf.extend_from_slice(name.as_bytes());
+    Ok(CString::new(buf)?)
+}
+
+fn llistxattr(path: &CStr) -> Result<Vec<CString>> {
+    let mut buf = Vec::new();
+    loop {
+        let r = unsafe {
+            libc::llistxattr(
+                path.as_ptr(),
+                buf.as_mut_ptr() as *mut libc::c_char,
+                buf.len(),
+            )
+        };
+        if r < 0 {
+            let e = std::io::Error::last_os_error();
+            if e.raw_os_error() == Some(libc::ERANGE) {
+                buf.clear();
+                continue;
+            }
+            return Err(e.into());
+        }
+        let r = r as usize;
+        if r > buf.len() {
+            buf.resize(r, 0);
+            continue;
+        }
+        buf.truncate(r);
+        break;
+    }
+    Ok(buf
+        .split(|&c| c == 0)
+        .filter(|n| !n.is_empty())
+        .map(|n| CString::new(n).expect("xattr name"))
+        .collect())
+}
+
+/// Returns `None` if the xattr doesn't exist.
+fn lgetxattr(path: &CStr, name: &CStr) -> Result<Option<Vec<u8>>> {
+    let mut buf = Vec::new();
+    loop {
+        let r = unsafe {
+            libc::lgetxattr(
+                path.as_ptr(),
+                name.as_ptr(),
+                buf.as_mut_ptr() as *mut libc::c_void,
+                buf.len(),
+            )
+        };
+        if r < 0 {
+            let e = std::io::Error::last_os_error();
+            match e.raw_os_error() {
+                Some(libc::ENODATA) => return Ok(None),
+                Some(libc::ERANGE) => {
+                    buf.clear();
+                    continue;
+                }
+                _ => return Err(e.into()),
+            }
+        }
+        let r = r as usize;
+        if r > buf.len() {
+            buf.resize(r, 0);
+            continue;
+        }
+        buf.truncate(r);
+        return Ok(Some(buf));
+    }
+}
+
+fn lsetxattr(path: &CStr, name: &CStr, value: &[u8]) -> Result<()> {
+    let r = unsafe {
+        libc::lsetxattr(
+            path.as_ptr(),
+            name.as_ptr(),
+            value.as_ptr() as *const libc::c_void,
+            value.len(),
+            0,
+        )
+    };
+    if r < 0 {
+        return Err(std::io::Error::last_os_error())
+            .with_context(|| format!("Setting xattr {:?}", name));
+    }
+    Ok(())
+}
+
+fn lremovexattr(path: &CStr, name: &CStr) -> Result<()> {
+    let r = unsafe { libc::lremovexattr(path.as_ptr(), name.as_ptr()) };
+    if r < 0 {
+        return Err(std::io::Error::last_os_error())
+            .with_context(|| format!("Removing xattr {:?}", name));
+    }
+    Ok(())
+}
+
+/// Whether this is one of the xattrs overlayfs uses for its own bookkeeping
+/// (`origin`, `impure`, `opaque`...), which must not end up in the rootfs.
+fn is_overlay_xattr(name: &CStr) -> bool {
+    name.to_bytes().starts_with(b"trusted.overlay.")
+}
+
+/// Whether a directory in an overlayfs upper layer hides the lower directory.
+fn overlay_dir_is_opaque(upper: &openat::Dir, name: &OsStr) -> Result<bool> {
+    let xattr = CStr::from_bytes_with_nul(b"trusted.overlay.opaque\0").unwrap();
+    let v = lgetxattr(&fd_path(upper, name)?, xattr)?;
+    Ok(v.as_deref() == Some(b"y".as_ref()))
+}
+
+/// Remove overlayfs' xattrs from `name` in `d`, and everything below it.
+fn strip_overlay_xattrs(d: &openat::Dir, name: &OsStr) -> Result<()> {
+    let path = fd_path(d, name)?;
+    for x in llistxattr(&path)? {
+        if is_overlay_xattr(&x) {
+            lremovexattr(&path, &x)?;
+        }
+    }
+    if d.metadata(name)?.simple_type() == openat::SimpleType::Dir {
+        let sub = d.sub_dir(name)?;
+        for entry in sub.list_dir(".")? {
+            strip_overlay_xattrs(&sub, entry?.file_name())?;
+        }
+    }
+    Ok(())
+}
+
+/// Make the xattrs of `name` in `target` the same as in `upper`, except for
+/// the ones belonging to overlayfs.
+fn merge_xattrs(upper: &openat::Dir, target: &openat::Dir, name: &OsStr) -> Result<()> {
+    let src = fd_path(upper, name)?;
+    let dest = fd_path(target, name)?;
+    let wanted: Vec<CString> = llistxattr(&src)?
+        .into_iter()
+        .filter(|x| !is_overlay_xattr(x))
+        .collect();
+    for x in llistxattr(&dest)? {
+        if !wanted.contains(&x) {
+            lremovexattr(&dest, &x)?;
+        }
+    }
+    for x in wanted.iter() {
+        if let Some(v) = lgetxattr(&src, x)? {
+            if lgetxattr(&dest, x)?.as_ref() != Some(&v) {
+                lsetxattr(&dest, x, &v)?;
+            }
+        }
+    }
+    Ok(())
+}
+
+/// Apply the changes recorded in an overlayfs upper directory to `target`:
+/// whiteouts are deleted, directories present on both sides are recursed
+/// into and get the upper metadata, and everything else is renamed into place.
+fn merge_overlay_upper(upper: &openat::Dir, target: &openat::Dir) -> Result<()> {
+    for entry in upper.list_dir(".")? {
+        let entry = entry?;
+        let name = entry.file_name();
+        let meta = upper.metadata(name)?;
+        let st = meta.stat();
+        if (st.st_mode & libc::S_IFMT) == libc::S_IFCHR && st.st_rdev == 0 {
+            target.remove_all(name)?;
+            continue;
+        }
+        if meta.simple_type() == openat::SimpleType::Dir {
+            let target_is_dir = target
+                .metadata_optional(name)?
+                .map(|m| m.simple_type() == openat::SimpleType::Dir)
+                .unwrap_or(false);
+            if target_is_dir && !overlay_dir_is_opaque(upper, name)? {
+                merge_overlay_upper(&upper.sub_dir(name)?, &target.sub_dir(name)?)?;
+                nix::unistd::fchownat(
+                    Some(target.as_raw_fd()),
+                    name,
+                    Some(nix::unistd::Uid::from_raw(st.st_uid)),
+                    Some(nix::unistd::Gid::from_raw(st.st_gid)),
+                    nix::unistd::FchownatFlags::NoFollowSymlink,
+                )?;
+                nix::sys::stat::fchmodat(
+                    Some(target.as_raw_fd()),
+                    name,
+                    nix::sys::stat::Mode::from_bits_truncate(st.st_mode),
+                    nix::sys::stat::FchmodatFlags::FollowSymlink,
+                )?;
+                merge_xattrs(upper, target, name)?;
+                // Last, since merging the contents changed it
+                let atime =
+                    TimeSpec::seconds(st.st_atime) + TimeSpec::nanoseconds(st.st_atime_nsec);
+                let mtime =
+                    TimeSpec::seconds(st.st_mtime) + TimeSpec::nanoseconds(st.st_mtime_nsec);
+                nix::sys::stat::utimensat(
+                    Some(target.as_raw_fd()),
+                    name,
+                    &atime,
+                    &mtime,
+                    nix::sys::stat::UtimensatFlags::NoFollowSymlink,
+                )?;
+                continue;
+            }
+        }
+        strip_overlay_xattrs(upper, name)?;
+        target.remove_all(name)?;
+        openat::rename(upper, name, target, name)
+            .with_context(|| format!("Renaming {:?}", name))?;
+    }
+    Ok(())
+}
+
 /// Helper wrapper that waits for a child and checks its exit status.
 /// Further if the wait is cancelled then the child is force killed.
 fn child_wait_check(
@@ -252,6 +591,7 @@ impl Bubblewrap {
             launcher,
             child_argv0: None,
             rofiles_mounts: Vec::new(),
+            overlay_mounts: Vec::new(),
         })
     }
 
@@ -267,8 +607,14 @@ impl Bubblewrap {
                 ret.bind_read("etc", "/etc");
             }
             BubblewrapMutability::RoFiles => {
-                ret.setup_rofiles("/usr")?;
-                ret.setup_rofiles("/etc")?;
+                for path in ROFILES_PATHS {
+                    ret.setup_rofiles(path)?;
+                }
+            }
+            BubblewrapMutability::Overlay => {
+                for path in ROFILES_PATHS {
+                    ret.setup_overlay(path)?;
+                }
             }
             BubblewrapMutability::MutateFreely => {
                 ret.bind_readwrite("usr", "/usr");
@@ -283,10 +629,32 @@ impl Bubblewrap {
 
     fn setup_rofiles(&mut self, path: &str) -> Result<()> {
         let mnt = RoFilesMount::new(&self.rootfs_fd, path)?;
+        self.bind_rofiles(Rc::new(mnt), path);
+        Ok(())
+    }
+
+    fn setup_overlay(&mut self, path: &str) -> Result<()> {
+        let mnt = OverlayMount::new(&self.rootfs_fd, path)?;
+        self.bind_readwrite(&mnt.path(), path);
+        self.overlay_mounts.push(mnt);
+        Ok(())
+    }
+
+    /// Merge back any changes made via overlayfs; called after the child
+    /// successfully exited.  On failure, the changes are discarded on drop.
+    fn finish_overlays(&mut self) -> Result<()> {
+        for mnt in self.overlay_mounts.iter_mut() {
+            mnt.finish()?;
+        }
+        Ok(())
+    }
+
+    /// Bind an existing rofiles-fuse mount to `path`, keeping it alive
+    /// for as long as this instance.
+    fn bind_rofiles(&mut self, mnt: Rc<RoFilesMount>, path: &str) {
         let tmpdir_path = mnt.path().to_str().expect("tempdir str");
         self.bind_readwrite(tmpdir_path, path);
         self.rofiles_mounts.push(mnt);
-        Ok(())
     }
 
     /// Access the underlying rootfs file descriptor (should only be used by C)
@@ -395,6 +763,7 @@ impl Bubblewrap {
         let stdout = stdout.expect("stdout");
 
         child_wait_check(child, cancellable).context(argv0)?;
+        self.finish_overlays()?;
 
         Ok(stdout)
     }
@@ -403,6 +772,7 @@ impl Bubblewrap {
     fn run_inner(&mut self, cancellable: Option<&gio::Cancellable>) -> Result<()> {
         let (child, argv0) = self.spawn()?;
         child_wait_check(child, cancellable).context(argv0)?;
+        self.finish_overlays()?;
         Ok(())
     }
 
@@ -417,6 +787,62 @@ impl Bubblewrap {
     }
 }
 
+impl BubblewrapSandbox {
+    /// Create a new sandbox; no mounts are set up until the first container is requested.
+    pub(crate) fn new(rootfs_fd: &openat::Dir, mutability: BubblewrapMutability) -> Result<Self> {
+        Ok(Self {
+            rootfs_fd: rootfs_fd.sub_dir(".")?,
+            mutability,
+            rofiles_mounts: Vec::new(),
+        })
+    }
+
+    /// Access the underlying rootfs file descriptor (should only be used by C)
+    pub(crate) fn get_rootfs_fd(&self) -> i32 {
+        self.rootfs_fd.as_raw_fd()
+    }
+
+    /// Create a new container in this sandbox.
+    pub(crate) fn new_bwrap(&mut self) -> CxxResult<Box<Bubblewrap>> {
+        if self.mutability != BubblewrapMutability::RoFiles {
+            return Ok(Box::new(Bubblewrap::new_with_mutability(
+                &self.rootfs_fd,
+                self.mutability,
+            )?));
+        }
+        if self.rofiles_mounts.is_empty() {
+            for path in ROFILES_PATHS {
+                let mnt = RoFilesMount::new(&self.rootfs_fd, path)
+                    .with_context(|| format!("Mounting rofiles-fuse for {}", path))?;
+                self.rofiles_mounts.push(Rc::new(mnt));
+            }
+        }
+        let mut ret = Bubblewrap::new(&self.rootfs_fd)?;
+        for (mnt, path) in self.rofiles_mounts.iter().zip(ROFILES_PATHS) {
+            ret.bind_rofiles(Rc::clone(mnt), path);
+        }
+        Ok(Box::new(ret))
+    }
+
+    /// Drop the shared mounts, so that the next container gets new ones.  The
+    /// kernel caches attributes and directory entries of FUSE filesystems, so
+    /// after e.g. a chown or a `MutateFreely` script on the underlying rootfs
+    /// an existing rofiles-fuse mount may not reflect the change.
+    pub(crate) fn invalidate(&mut self) {
+        self.rofiles_mounts.clear();
+    }
+}
+
+#[context("Creating bwrap sandbox")]
+/// Create a new BubblewrapSandbox with provided mutability
+pub(crate) fn bubblewrap_sandbox_new(
+    rootfs_fd: i32,
+    mutability: crate::ffi::BubblewrapMutability,
+) -> Result<Box<BubblewrapSandbox>> {
+    let rootfs_fd = crate::ffiutil::ffi_view_openat_dir(rootfs_fd);
+    Ok(Box::new(BubblewrapSandbox::new(&rootfs_fd, mutability)?))
+}
+
 #[context("Creating bwrap instance")]
 /// Create a new Bubblewrap instance
 pub(crate) fn bubblewrap_new(rootfs_fd: i32) -> CxxResult<Box<Bubblewrap>> {
@@ -486,3 +912,131 @@ pub(crate) fn bubblewrap_selftest() -> CxxResult<()> {
     bwrap.run_inner(cancellable)?;
     Ok(())
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Set an xattr on `name` in `d`; returns `false` if we lack the privileges
+    /// (e.g. for `trusted.*`) or the filesystem doesn't support it.
+    fn try_setxattr(d: &openat::Dir, name: &str, xattr: &str, value: &[u8]) -> Result<bool> {
+        let path = fd_path(d, OsStr::new(name))?;
+        let xattr = CString::new(xattr)?;
+        match lsetxattr(&path, &xattr, value) {
+            Ok(()) => Ok(true),
+            Err(e) => match e
+                .downcast_ref::<std::io::Error>()
+                .and_then(|e| e.raw_os_error())
+            {
+                Some(libc::EPERM) | Some(libc::EOPNOTSUPP) => Ok(false),
+                _ => Err(e),
+            },
+        }
+    }
+
+    fn getxattr(d: &openat::Dir, name: &str, xattr: &str) -> Result<Option<Vec<u8>>> {
+        lgetxattr(&fd_path(d, OsStr::new(name))?, &CString::new(xattr)?)
+    }
+
+    fn new_upper_and_target() -> Result<(tempfile::TempDir, openat::Dir, openat::Dir)> {
+        let td = tempfile::tempdir()?;
+        let d = openat::Dir::open(td.path())?;
+        for &p in &["upper", "target"] {
+            d.ensure_dir_all(p, 0o755)?;
+        }
+        let upper = d.sub_dir("upper")?;
+        let target = d.sub_dir("target")?;
+        Ok((td, upper, target))
+    }
+
+    #[test]
+    fn test_merge_overlay_whiteout() -> Result<()> {
+        let (_td, upper, target) = new_upper_and_target()?;
+        target.ensure_dir_all("d/sub", 0o755)?;
+        target.write_file_contents("d/a", 0o644, "a")?;
+        target.write_file_contents("d/b", 0o644, "b")?;
+        target.write_file_contents("d/sub/c", 0o644, "c")?;
+        upper.ensure_dir_all("d", 0o755)?;
+        let whiteout = |name: &str| {
+            nix::sys::stat::mknodat(
+                upper.as_raw_fd(),
+                name,
+                nix::sys::stat::SFlag::S_IFCHR,
+                nix::sys::stat::Mode::from_bits_truncate(0o000),
+                0,
+            )
+        };
+        // Creating whiteouts needs CAP_MKNOD
+        if whiteout("d/a").is_err() {
+            return Ok(());
+        }
+        whiteout("d/sub").unwrap();
+        upper.write_file_contents("d/new", 0o644, "new")?;
+        merge_overlay_upper(&upper, &target)?;
+        assert!(!target.exists("d/a")?);
+        assert!(!target.exists("d/sub")?);
+        assert_eq!(target.read_to_string("d/b")?, "b");
+        assert_eq!(target.read_to_string("d/new")?, "new");
+        Ok(())
+    }
+
+    #[test]
+    fn test_merge_overlay_opaque() -> Result<()> {
+        let (_td, upper, target) = new_upper_and_target()?;
+        target.ensure_dir_all("merged", 0o755)?;
+        target.ensure_dir_all("opaque", 0o755)?;
+        for &d in &["merged", "opaque"] {
+            target.write_file_contents(format!("{}/old", d), 0o644, "old")?;
+            upper.ensure_dir_all(d, 0o755)?;
+            upper.write_file_contents(format!("{}/new", d), 0o644, "new")?;
+        }
+        if !try_setxattr(&upper, "opaque", "trusted.overlay.opaque", b"y")? {
+            return Ok(());
+        }
+        merge_overlay_upper(&upper, &target)?;
+        assert!(target.exists("merged/old")?);
+        assert!(target.exists("merged/new")?);
+        assert!(!target.exists("opaque/old")?);
+        assert!(target.exists("opaque/new")?);
+        assert_eq!(getxattr(&target, "opaque", "trusted.overlay.opaque")?, None);
+        Ok(())
+    }
+
+    #[test]
+    fn test_merge_overlay_xattrs() -> Result<()> {
+        let (_td, upper, target) = new_upper_and_target()?;
+        target.ensure_dir_all("d", 0o755)?;
+        upper.ensure_dir_all("d", 0o700)?;
+        upper.write_file_contents("d/f", 0o644, "f")?;
+        if !try_setxattr(&target, "d", "user.removed", b"1")? {
+            return Ok(());
+        }
+        assert!(try_setxattr(&upper, "d", "user.added", b"2")?);
+        let mtime = TimeSpec::seconds(42);
+        nix::sys::stat::utimensat(
+            Some(upper.as_raw_fd()),
+            "d",
+            &mtime,
+            &mtime,
+            nix::sys::stat::UtimensatFlags::NoFollowSymlink,
+        )?;
+        let have_trusted = try_setxattr(&upper, "d", "trusted.overlay.impure", b"y")?
+            && try_setxattr(&upper, "d/f", "trusted.overlay.origin", b"x")?;
+
+        merge_overlay_upper(&upper, &target)?;
+        assert_eq!(getxattr(&target, "d", "user.removed")?, None);
+        assert_eq!(
+            getxattr(&target, "d", "user.added")?.as_deref(),
+            Some(b"2".as_ref())
+        );
+        let st = target.metadata("d")?;
+        assert_eq!(st.stat().st_mode & 0o7777, 0o700);
+        assert_eq!(st.stat().st_mtime, 42);
+        assert_eq!(target.read_to_string("d/f")?, "f");
+        if have_trusted {
+            assert_eq!(getxattr(&target, "d", "trusted.overlay.impure")?, None);
+            assert_eq!(getxattr(&target, "d/f", "trusted.overlay.origin")?, None);
+        }
+        Ok(())
+    }
+}
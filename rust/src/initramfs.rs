@@ -2,10 +2,13 @@
 // SPDX-License-Identifier: Apache-2.0 OR MIT
 
 use crate::cxxrsutil::*;
+use crate::repo_cache::RepoCache;
 use anyhow::{Context, Result};
 use camino::Utf8Path;
 use gio::prelude::*;
 use openat::SimpleType;
+use openat_ext::OpenatDirExt;
+use rayon::prelude::*;
 use std::collections::BTreeSet;
 use std::collections::HashSet;
 use std::convert::TryInto;
@@ -85,16 +88,68 @@ fn gather_filelist<P: glib::IsA<gio::Cancellable>>(
     Ok(filelist)
 }
 
-fn generate_initramfs_overlay<P: glib::IsA<gio::Cancellable>>(
-    root: &openat::Dir,
-    files: &HashSet<String>,
-    cancellable: Option<&P>,
-) -> Result<fs::File> {
-    let filelist = {
-        let etcd = root.sub_dir("etc")?;
-        gather_filelist(&etcd, files, cancellable)?
+/// Unchanged initramfs-etc file sets are served from this cache in the repo,
+/// keyed by a fingerprint of the file list and metadata.
+const OVERLAY_CACHE_NAME: &str = "initramfs-overlay-cache";
+/// Bump this if anything affecting the generated archive changes.
+const OVERLAY_CACHE_VERSION: u32 = 1;
+/// Keep a few entries so that rolling back and forth between deployments
+/// with different file sets still hits.
+const OVERLAY_CACHE_MAX_ENTRIES: usize = 4;
+/// Below this many files, splitting the archive isn't worth the extra processes.
+const PARALLEL_MIN_FILES: usize = 128;
+
+/// Compute a fingerprint of `filelist` (relative to `/etc`, as returned by
+/// `gather_filelist()`).  We use the metadata rather than the contents; these
+/// files may be secrets, and the change time covers any modification.
+/// Returns `None` if any file isn't world-readable: the archive would then
+/// contain a copy of a secret, which we don't want to keep around in the repo
+/// after the file is untracked or changed.
+fn fingerprint_filelist(d: &openat::Dir, filelist: &BTreeSet<String>) -> Result<Option<String>> {
+    let entries = filelist
+        .par_iter()
+        .map(|path| -> Result<Option<String>> {
+            let meta = d.metadata(path.as_str()).context("stat")?;
+            let st = meta.stat();
+            if matches!(meta.simple_type(), SimpleType::File) && st.st_mode & 0o004 == 0 {
+                return Ok(None);
+            }
+            let mut entry = format!(
+                "{}\t{}\t{}\t{}\t{}\t{}\t{}.{}\t{}.{}\n",
+                path,
+                st.st_mode,
+                st.st_uid,
+                st.st_gid,
+                st.st_ino,
+                st.st_size,
+                st.st_mtime,
+                st.st_mtime_nsec,
+                st.st_ctime,
+                st.st_ctime_nsec
+            );
+            if matches!(meta.simple_type(), SimpleType::Symlink) {
+                let target = d.read_link(path.as_str()).context("readlink")?;
+                entry.push_str(&target.to_string_lossy());
+                entry.push('\n');
+            }
+            Ok(Some(entry))
+        })
+        .collect::<Result<Option<Vec<String>>>>()?;
+    let entries = match entries {
+        Some(e) => e,
+        None => return Ok(None),
     };
-    let out_tmpf = std::rc::Rc::new(tempfile::tempfile()?);
+    let mut hasher = glib::Checksum::new(glib::ChecksumType::Sha256);
+    hasher.update(format!("{}\n", OVERLAY_CACHE_VERSION).as_bytes());
+    for entry in entries {
+        hasher.update(entry.as_bytes());
+    }
+    Ok(Some(hasher.get_string().expect("hash")))
+}
+
+/// Write a gzip-compressed cpio archive of `files` (relative to `/etc`) to `out`.
+fn write_cpio_gz(root: &openat::Dir, files: &[&String], out: fs::File) -> Result<fs::File> {
+    let out = std::rc::Rc::new(out);
     {
         let cmd = Exec::cmd("cpio")
             .args(&[
@@ -109,12 +164,12 @@ fn generate_initramfs_overlay<P: glib::IsA<gio::Cancellable>>(
             | Exec::cmd("gzip").arg("-1");
         let mut children = cmd
             .stdin(subprocess::Redirection::Pipe)
-            .stdout(subprocess::Redirection::RcFile(out_tmpf.clone()))
+            .stdout(subprocess::Redirection::RcFile(out.clone()))
             .popen()
             .context("spawn")?;
         {
             let mut cstdin = std::io::BufWriter::new(children[0].stdin.take().expect("stdin"));
-            for f in filelist {
+            for f in files {
                 cstdin.write_all(b"etc/")?;
                 cstdin.write_all(f.as_bytes())?;
                 let nul = [0u8];
@@ -129,17 +184,115 @@ fn generate_initramfs_overlay<P: glib::IsA<gio::Cancellable>>(
             }
         }
     }
-    let mut out_tmpf = rc::Rc::try_unwrap(out_tmpf).expect("initramfs rc unexpected count");
+    Ok(rc::Rc::try_unwrap(out).expect("initramfs rc unexpected count"))
+}
+
+fn generate_initramfs_overlay_from_filelist(
+    root: &openat::Dir,
+    filelist: &BTreeSet<String>,
+) -> Result<fs::File> {
+    let files: Vec<&String> = filelist.iter().collect();
+    let n_chunks = if files.len() < PARALLEL_MIN_FILES {
+        1
+    } else {
+        rayon::current_num_threads().min(files.len() / (PARALLEL_MIN_FILES / 2))
+    };
+    let mut out_tmpf = if n_chunks <= 1 {
+        write_cpio_gz(root, &files, tempfile::tempfile()?)?
+    } else {
+        // Large file sets are split into chunks which are archived and
+        // compressed in parallel.  The kernel (like dracut, and ostree which
+        // appends this to the main initramfs) handles a concatenation of
+        // compressed cpio archives, extracting them in order; since the list
+        // is sorted, leading directories always precede their contents.
+        let chunk_size = (files.len() + n_chunks - 1) / n_chunks;
+        let chunks = files
+            .par_chunks(chunk_size)
+            .map(|chunk| -> Result<fs::File> {
+                let mut f = write_cpio_gz(root, chunk, tempfile::tempfile()?)?;
+                f.seek(io::SeekFrom::Start(0)).context("seek")?;
+                Ok(f)
+            })
+            .collect::<Result<Vec<fs::File>>>()?;
+        let mut out_tmpf = tempfile::tempfile()?;
+        for mut chunk in chunks {
+            io::copy(&mut chunk, &mut out_tmpf).context("concatenating archives")?;
+        }
+        out_tmpf
+    };
     out_tmpf.seek(io::SeekFrom::Start(0)).context("seek")?;
     Ok(out_tmpf)
 }
 
+fn generate_initramfs_overlay<P: glib::IsA<gio::Cancellable>>(
+    root: &openat::Dir,
+    files: &HashSet<String>,
+    cancellable: Option<&P>,
+) -> Result<fs::File> {
+    let filelist = {
+        let etcd = root.sub_dir("etc")?;
+        gather_filelist(&etcd, files, cancellable)?
+    };
+    generate_initramfs_overlay_from_filelist(root, &filelist)
+}
+
+/// Look up `fingerprint` in the overlay cache, returning the cached archive.
+fn overlay_cache_lookup(cache: &RepoCache, fingerprint: &str) -> Result<Option<fs::File>> {
+    let name = format!("{}.img", fingerprint);
+    // This also marks it as most recently used
+    if !cache.touch(&name)? {
+        return Ok(None);
+    }
+    Ok(Some(cache.dir().open_file(name.as_str())?))
+}
+
+/// Add `f` to the overlay cache under `fingerprint`, evicting the least
+/// recently used entries beyond `OVERLAY_CACHE_MAX_ENTRIES`.
+fn overlay_cache_store(cache: &RepoCache, fingerprint: &str, f: &mut fs::File) -> Result<()> {
+    let name = format!("{}.img", fingerprint);
+    cache
+        .dir()
+        .write_file_with(name.as_str(), 0o600, |w| -> Result<()> {
+            io::copy(f, w)?;
+            Ok(())
+        })?;
+    f.seek(io::SeekFrom::Start(0)).context("seek")?;
+    cache.prune(&name)?;
+    Ok(())
+}
+
+fn generate_initramfs_overlay_cached<P: glib::IsA<gio::Cancellable>>(
+    root: &openat::Dir,
+    repo_dfd: &openat::Dir,
+    files: &HashSet<String>,
+    cancellable: Option<&P>,
+) -> Result<fs::File> {
+    let etcd = root.sub_dir("etc")?;
+    let filelist = gather_filelist(&etcd, files, cancellable)?;
+    let fingerprint = match fingerprint_filelist(&etcd, &filelist)? {
+        Some(f) => f,
+        None => return generate_initramfs_overlay_from_filelist(root, &filelist),
+    };
+    let cache = RepoCache::open(repo_dfd, OVERLAY_CACHE_NAME, OVERLAY_CACHE_MAX_ENTRIES)?;
+    if let Some(f) = overlay_cache_lookup(&cache, &fingerprint)? {
+        return Ok(f);
+    }
+    let mut f = generate_initramfs_overlay_from_filelist(root, &filelist)?;
+    // Failing to populate the cache isn't fatal
+    if let Err(e) = overlay_cache_store(&cache, &fingerprint, &mut f) {
+        systemd::journal::print(4, &format!("Failed to cache initramfs overlay: {:#}", e));
+        f.seek(io::SeekFrom::Start(0)).context("seek")?;
+    }
+    Ok(f)
+}
+
 fn generate_initramfs_overlay_etc<P: glib::IsA<gio::Cancellable>>(
+    repo_dfd: &openat::Dir,
     files: &HashSet<String>,
     cancellable: Option<&P>,
 ) -> Result<fs::File> {
     let root = openat::Dir::open("/")?;
-    generate_initramfs_overlay(&root, files, cancellable)
+    generate_initramfs_overlay_cached(&root, repo_dfd, files, cancellable)
 }
 
 pub(crate) fn get_dracut_random_cpio() -> &'static [u8] {
@@ -149,12 +302,15 @@ pub(crate) fn get_dracut_random_cpio() -> &'static [u8] {
 
 /// cxx-rs entrypoint; we can't use generics and need to return a raw integer for fd
 pub(crate) fn initramfs_overlay_generate(
+    mut repo: Pin<&mut crate::FFIOstreeRepo>,
     files: &Vec<String>,
     mut cancellable: Pin<&mut crate::FFIGCancellable>,
 ) -> CxxResult<i32> {
+    let repo = &repo.gobj_wrap();
+    let repo_dfd = crate::ffiutil::ffi_view_openat_dir(repo.get_dfd());
     let cancellable = &cancellable.gobj_wrap();
     let files: HashSet<String> = files.iter().cloned().collect();
-    let r = generate_initramfs_overlay_etc(&files, Some(cancellable))?;
+    let r = generate_initramfs_overlay_etc(&repo_dfd, &files, Some(cancellable))?;
     Ok(r.into_raw_fd())
 }
 
@@ -181,4 +337,51 @@ mod test {
         let _ = tmpd.metadata("initramfs").context("stat")?;
         Ok(())
     }
+
+    #[test]
+    fn test_initramfs_overlay_cached() -> Result<()> {
+        let cancellable = gio::NONE_CANCELLABLE;
+        let tmpd = tempfile::tempdir()?;
+        std::fs::create_dir_all(tmpd.path().join("etc/foo"))?;
+        std::fs::create_dir_all(tmpd.path().join("repo"))?;
+        for i in 0..(PARALLEL_MIN_FILES * 2) {
+            std::fs::write(tmpd.path().join(format!("etc/foo/f{}", i)), "contents")?;
+        }
+        let repo_dfd = openat::Dir::open(&tmpd.path().join("repo"))?;
+        let tmpd = openat::Dir::open(tmpd.path())?;
+        let cachedir = "extensions/rpmostree/initramfs-overlay-cache";
+        let list_cached = || -> Result<Vec<String>> {
+            let mut r = Vec::new();
+            for e in repo_dfd.list_dir(cachedir)? {
+                let name = e?.file_name().to_string_lossy().into_owned();
+                if !name.starts_with('.') {
+                    r.push(name);
+                }
+            }
+            Ok(r)
+        };
+        let mut h = HashSet::new();
+        h.insert("/etc/foo".to_string());
+        let _ = generate_initramfs_overlay_cached(&tmpd, &repo_dfd, &h, cancellable)?;
+        let cached = list_cached()?;
+        assert_eq!(cached.len(), 1);
+        // Replace the cached archive; a hit must return it as is
+        let entry = format!("{}/{}", cachedir, cached[0]);
+        repo_dfd.write_file_contents(entry.as_str(), 0o600, "cached")?;
+        let mut second = generate_initramfs_overlay_cached(&tmpd, &repo_dfd, &h, cancellable)?;
+        let mut buf = String::new();
+        second.read_to_string(&mut buf)?;
+        assert_eq!(buf, "cached");
+        assert_eq!(list_cached()?, cached);
+        // Changing a file in the set must miss
+        tmpd.write_file_contents("etc/foo/f0", 0o644, "changed")?;
+        let third = generate_initramfs_overlay_cached(&tmpd, &repo_dfd, &h, cancellable)?;
+        assert_ne!(third.metadata()?.len(), "cached".len() as u64);
+        assert_eq!(list_cached()?.len(), 2);
+        // Files which aren't world-readable aren't cached at all
+        tmpd.write_file_contents("etc/foo/secret", 0o600, "secret")?;
+        let _ = generate_initramfs_overlay_cached(&tmpd, &repo_dfd, &h, cancellable)?;
+        assert_eq!(list_cached()?.len(), 2);
+        Ok(())
+    }
 }
@@ -71,9 +71,18 @@ pub mod ffi {
     pub(crate) enum BubblewrapMutability {
         Immutable,
         RoFiles,
+        Overlay,
         MutateFreely,
     }
 
+    #[derive(Debug)]
+    pub(crate) enum ConcurrencyPhase {
+        Relabel,
+        PostScripts,
+        RpmmdRefresh,
+        Checkout,
+    }
+
     // bubblewrap.rs
     extern "Rust" {
         type Bubblewrap;
@@ -110,6 +119,19 @@ pub mod ffi {
         fn run(&mut self, cancellable: Pin<&mut GCancellable>) -> Result<()>;
     }
 
+    // bubblewrap.rs
+    extern "Rust" {
+        type BubblewrapSandbox;
+
+        fn bubblewrap_sandbox_new(
+            rootfs_fd: i32,
+            mutability: BubblewrapMutability,
+        ) -> Result<Box<BubblewrapSandbox>>;
+        fn get_rootfs_fd(&self) -> i32;
+        fn new_bwrap(&mut self) -> Result<Box<Bubblewrap>>;
+        fn invalidate(&mut self);
+    }
+
     // builtins/apply_live.rs
     extern "Rust" {
         fn applylive_entrypoint(args: &Vec<String>) -> Result<()>;
@@ -247,11 +269,40 @@ pub mod ffi {
     extern "Rust" {
         fn get_dracut_random_cpio() -> &'static [u8];
         fn initramfs_overlay_generate(
+            repo: Pin<&mut OstreeRepo>,
             files: &Vec<String>,
             cancellable: Pin<&mut GCancellable>,
         ) -> Result<i32>;
     }
 
+    // repo_cache.rs
+    extern "Rust" {
+        type RepoCache;
+
+        fn repo_cache_open(
+            repo: Pin<&mut OstreeRepo>,
+            name: &str,
+            max_entries: u32,
+        ) -> Result<Box<RepoCache>>;
+        fn get_dfd(self: &RepoCache) -> i32;
+        fn touch(self: &RepoCache, entry: &str) -> Result<bool>;
+        fn prune(self: &RepoCache, keep: &str) -> Result<()>;
+        fn repo_caches_cleanup(repo: Pin<&mut OstreeRepo>, all: bool) -> Result<()>;
+    }
+
+    // profile.rs
+    extern "Rust" {
+        type ProfileSpan;
+
+        fn profile_set_enabled(enabled: bool);
+        fn profile_is_enabled() -> bool;
+        fn profile_span_begin(name: &str) -> Box<ProfileSpan>;
+        fn add_counter(self: &mut ProfileSpan, key: &str, value: u64);
+        fn end(self: &mut ProfileSpan);
+        fn profile_write_chrome_trace(path: &str) -> Result<()>;
+        fn profile_journal_log(title: &str);
+    }
+
     // journal.rs
     extern "Rust" {
         fn journal_print_staging_failure();
@@ -299,6 +350,7 @@ pub mod ffi {
     // scripts.rs
     extern "Rust" {
         fn script_is_ignored(pkg: &str, script: &str) -> bool;
+        fn script_is_parallel_safe(pkg: &str, script: &str) -> bool;
     }
 
     // testutils.rs
@@ -339,6 +391,7 @@ pub mod ffi {
         fn get_ref(&self) -> &str;
         fn get_cliwrap(&self) -> bool;
         fn get_readonly_executables(&self) -> bool;
+        fn get_script_overlayfs(&self) -> bool;
         fn get_documentation(&self) -> bool;
         fn get_recommends(&self) -> bool;
         fn get_selinux(&self) -> bool;
@@ -347,6 +400,8 @@ pub mod ffi {
         fn validate_rpmdb(&self) -> Result<()>;
         fn rpmdb_backend_is_default(&self) -> bool;
         fn get_files_remove_regex(&self, package: &str) -> Vec<String>;
+        fn get_concurrency(&self, phase: ConcurrencyPhase) -> u32;
+        fn get_commit_shard_depth(&self) -> u32;
         fn print_deprecation_warnings(&self);
         fn sanitycheck_externals(&self) -> Result<()>;
         fn get_checksum(&self, repo: Pin<&mut OstreeRepo>) -> Result<String>;
@@ -624,11 +679,15 @@ mod passwd;
 use passwd::*;
 mod console_progress;
 pub(crate) use self::console_progress::*;
+mod profile;
+pub(crate) use self::profile::*;
 mod progress;
 mod scripts;
 pub(crate) use self::scripts::*;
 mod sysroot_upgrade;
 pub(crate) use crate::sysroot_upgrade::*;
+mod repo_cache;
+pub(crate) use self::repo_cache::*;
 mod rpmutils;
 pub(crate) use self::rpmutils::*;
 mod testutils;
@@ -0,0 +1,315 @@
+//! Per-phase timing of an assembly (upgrade, compose...), for finding out
+//! where the time goes.  Phases are recorded as spans with monotonic start and
+//! end times plus counters (bytes, objects, ...), and can be written out as a
+//! Chrome trace (viewable in e.g. https://ui.perfetto.dev) or summarized in
+//! the journal as structured fields.  Nothing is recorded unless enabled via
+//! `profile_set_enabled()`.
+
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+use crate::cxxrsutil::*;
+use anyhow::{Context, Result};
+use lazy_static::lazy_static;
+use serde_json::json;
+use std::io::Write;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Mutex;
+use std::time::Instant;
+
+/// A completed span.
+#[derive(Debug)]
+struct ProfileEvent {
+    name: String,
+    tid: i32,
+    /// Microseconds since `EPOCH`
+    start: u64,
+    duration: u64,
+    counters: Vec<(String, u64)>,
+}
+
+lazy_static! {
+    /// All timestamps are relative to this.
+    static ref EPOCH: Instant = Instant::now();
+    static ref EVENTS: Mutex<Vec<ProfileEvent>> = Mutex::new(Vec::new());
+}
+
+/// Don't let a long-running process (i.e. the daemon) grow without bound if
+/// nothing drains the events.
+const MAX_EVENTS: usize = 100_000;
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+
+/// Turn recording spans on or off; turning it off also drops the spans
+/// recorded so far.
+pub(crate) fn profile_set_enabled(enabled: bool) {
+    ENABLED.store(enabled, Ordering::Relaxed);
+    if !enabled {
+        take_events();
+    }
+}
+
+/// Whether spans are being recorded; lets callers skip e.g. formatting span
+/// names otherwise.
+pub(crate) fn profile_is_enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+/// A phase in progress; it's recorded when ended (or dropped).
+pub struct ProfileSpan {
+    name: String,
+    start: Instant,
+    counters: Vec<(String, u64)>,
+    ended: bool,
+}
+
+/// Begin a span named `name`; note spans may nest and may run concurrently on
+/// different threads.  If recording is disabled, this returns a span which is
+/// already ended.
+pub(crate) fn profile_span_begin(name: &str) -> Box<ProfileSpan> {
+    let enabled = profile_is_enabled();
+    if enabled {
+        // Make sure the epoch predates the span
+        lazy_static::initialize(&EPOCH);
+    }
+    Box::new(ProfileSpan {
+        name: if enabled {
+            name.to_string()
+        } else {
+            String::new()
+        },
+        start: Instant::now(),
+        counters: Vec::new(),
+        ended: !enabled,
+    })
+}
+
+impl ProfileSpan {
+    /// Add `value` to the counter named `key`.
+    pub(crate) fn add_counter(&mut self, key: &str, value: u64) {
+        if self.ended {
+            return;
+        }
+        match self.counters.iter_mut().find(|(k, _)| k == key) {
+            Some((_, v)) => *v += value,
+            None => self.counters.push((key.to_string(), value)),
+        }
+    }
+
+    pub(crate) fn end(&mut self) {
+        if self.ended {
+            return;
+        }
+        self.ended = true;
+        let event = ProfileEvent {
+            name: std::mem::take(&mut self.name),
+            tid: nix::unistd::gettid().as_raw(),
+            start: self.start.saturating_duration_since(*EPOCH).as_micros() as u64,
+            duration: self.start.elapsed().as_micros() as u64,
+            counters: std::mem::take(&mut self.counters),
+        };
+        let mut events = EVENTS.lock().unwrap();
+        if events.len() < MAX_EVENTS {
+            events.push(event);
+        }
+    }
+}
+
+impl Drop for ProfileSpan {
+    fn drop(&mut self) {
+        self.end()
+    }
+}
+
+fn take_events() -> Vec<ProfileEvent> {
+    std::mem::take(&mut *EVENTS.lock().unwrap())
+}
+
+fn chrome_trace(events: &[ProfileEvent]) -> serde_json::Value {
+    let pid = std::process::id();
+    let trace_events: Vec<_> = events
+        .iter()
+        .map(|e| {
+            let args: serde_json::Map<_, _> = e
+                .counters
+                .iter()
+                .map(|(k, v)| (k.clone(), json!(v)))
+                .collect();
+            json!({
+                "name": e.name,
+                "cat": "rpm-ostree",
+                "ph": "X",
+                "ts": e.start,
+                "dur": e.duration,
+                "pid": pid,
+                "tid": e.tid,
+                "args": args,
+            })
+        })
+        .collect();
+    json!({
+        "traceEvents": trace_events,
+        "displayTimeUnit": "ms",
+    })
+}
+
+/// Write the spans recorded so far to `path` as Chrome trace JSON, and forget them.
+pub(crate) fn profile_write_chrome_trace(path: &str) -> CxxResult<()> {
+    let trace = chrome_trace(&take_events());
+    let mut f = std::io::BufWriter::new(
+        std::fs::File::create(path).with_context(|| format!("Creating {}", path))?,
+    );
+    serde_json::to_writer(&mut f, &trace)?;
+    f.flush()?;
+    Ok(())
+}
+
+/// Convert e.g. `download-bytes` into `DOWNLOAD_BYTES` for a journal field name.
+fn journal_field_name(key: &str) -> String {
+    key.chars()
+        .map(|c| match c {
+            'a'..='z' => c.to_ascii_uppercase(),
+            'A'..='Z' | '0'..='9' => c,
+            _ => '_',
+        })
+        .collect()
+}
+
+/// The totals of all spans of one phase.
+#[derive(Debug, Default, PartialEq)]
+struct PhaseTotal {
+    name: String,
+    n_spans: u64,
+    /// Summed over the spans, so can exceed the wall-clock time for spans
+    /// which ran concurrently.
+    duration: u64,
+    counters: Vec<(String, u64)>,
+}
+
+/// Sum up `events` per phase, in order of the phases' first start.  Spans
+/// for one item of a phase like `script:foo` count towards `script`.
+fn phase_totals(events: &[ProfileEvent]) -> Vec<PhaseTotal> {
+    let mut events: Vec<&ProfileEvent> = events.iter().collect();
+    events.sort_by_key(|e| e.start);
+    let mut totals: Vec<PhaseTotal> = Vec::new();
+    for e in events {
+        let phase = e.name.split(':').next().unwrap_or_default();
+        let i = match totals.iter().position(|t| t.name == phase) {
+            Some(i) => i,
+            None => {
+                totals.push(PhaseTotal {
+                    name: phase.to_string(),
+                    ..Default::default()
+                });
+                totals.len() - 1
+            }
+        };
+        let total = &mut totals[i];
+        total.n_spans += 1;
+        total.duration += e.duration;
+        for (k, v) in e.counters.iter() {
+            match total.counters.iter_mut().find(|(tk, _)| tk == k) {
+                Some((_, tv)) => *tv += v,
+                None => total.counters.push((k.clone(), *v)),
+            }
+        }
+    }
+    totals
+}
+
+fn impl_profile_journal_log(title: &str) -> Result<()> {
+    let events = take_events();
+    if events.is_empty() {
+        return Ok(());
+    }
+    let totals = phase_totals(&events);
+    let summary: Vec<String> = totals
+        .iter()
+        .map(|t| format!("{} {}ms", t.name, t.duration / 1000))
+        .collect();
+    let mut fields = vec![
+        format!("MESSAGE={} timings: {}", title, summary.join(", ")),
+        "PRIORITY=7".to_string(),
+        format!("PROFILE_TITLE={}", title),
+    ];
+    for t in totals.iter() {
+        let phase = journal_field_name(&t.name);
+        fields.push(format!("PROFILE_{}_USEC={}", phase, t.duration));
+        if t.n_spans > 1 {
+            fields.push(format!("PROFILE_{}_SPANS={}", phase, t.n_spans));
+        }
+        for (k, v) in t.counters.iter() {
+            fields.push(format!("PROFILE_{}_{}={}", phase, journal_field_name(k), v));
+        }
+    }
+    let fields: Vec<&str> = fields.iter().map(|s| s.as_str()).collect();
+    let r = systemd::journal::send(&fields);
+    if r < 0 {
+        return Err(std::io::Error::from_raw_os_error(-r)).context("sd_journal_send");
+    }
+    Ok(())
+}
+
+/// Send a summary of the spans recorded so far to the journal, as a single
+/// entry tagged with `title` with per-phase totals as structured fields, and
+/// forget them.
+pub(crate) fn profile_journal_log(title: &str) {
+    if let Err(e) = impl_profile_journal_log(title) {
+        systemd::journal::print(4, &format!("Failed to log profile: {:#}", e));
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_chrome_trace() {
+        profile_set_enabled(true);
+        {
+            let mut outer = profile_span_begin("outer");
+            outer.add_counter("bytes", 10);
+            outer.add_counter("bytes", 5);
+            let _inner = profile_span_begin("inner");
+        }
+        let events = take_events();
+        assert_eq!(events.len(), 2);
+        // Inner ends first
+        assert_eq!(events[0].name, "inner");
+        assert_eq!(events[1].counters, vec![("bytes".to_string(), 15)]);
+        assert!(events[1].start <= events[0].start);
+        let trace = chrome_trace(&events);
+        assert_eq!(trace["traceEvents"][1]["args"]["bytes"], 15);
+        assert_eq!(trace["traceEvents"][0]["ph"], "X");
+    }
+
+    #[test]
+    fn test_phase_totals() {
+        let ev = |name: &str, start, duration, counters: &[(&str, u64)]| ProfileEvent {
+            name: name.to_string(),
+            tid: 0,
+            start,
+            duration,
+            counters: counters.iter().map(|(k, v)| (k.to_string(), *v)).collect(),
+        };
+        let events = vec![
+            ev("script:foo", 20, 5, &[]),
+            ev("download", 0, 10, &[("bytes", 100)]),
+            ev("script:bar", 25, 7, &[]),
+            ev("download", 40, 10, &[("bytes", 50)]),
+        ];
+        let totals = phase_totals(&events);
+        assert_eq!(totals.len(), 2);
+        assert_eq!(totals[0].name, "download");
+        assert_eq!(totals[0].n_spans, 2);
+        assert_eq!(totals[0].duration, 20);
+        assert_eq!(totals[0].counters, vec![("bytes".to_string(), 150)]);
+        assert_eq!(totals[1].name, "script");
+        assert_eq!(totals[1].duration, 12);
+    }
+
+    #[test]
+    fn test_journal_field_name() {
+        assert_eq!(journal_field_name("download-bytes"), "DOWNLOAD_BYTES");
+        assert_eq!(journal_field_name("n_pkgs"), "N_PKGS");
+    }
+}
@@ -0,0 +1,277 @@
+//! Small caches of data derived from commits, kept in the repo under
+//! `extensions/rpmostree/` and evicted least recently used first.
+
+// SPDX-License-Identifier: Apache-2.0 OR MIT
+
+use crate::cxxrsutil::*;
+use anyhow::{Context, Result};
+use nix::fcntl::{flock, FlockArg};
+use openat_ext::OpenatDirExt;
+use std::convert::TryInto;
+use std::os::unix::io::AsRawFd;
+use std::pin::Pin;
+use std::time::{Duration, SystemTime};
+
+/// Parent directory of all caches, relative to the repo.
+const CACHES_DIR: &str = "extensions/rpmostree";
+/// All of the caches; `rpm-ostree cleanup` expires entries in these.
+const CACHES: &[&str] = &["initramfs-cache", "initramfs-overlay-cache", "solv-cache"];
+/// Held shared while using a cache, and exclusively while pruning it.
+const LOCKFILE: &str = ".lock";
+/// Entries in the process of being created have this in their name.
+const TMP_INFIX: &str = ".tmp-";
+/// On cleanup, entries (and leftover temporary ones) not used in this long
+/// are deleted even if there's room for them.
+const MAX_AGE: Duration = Duration::from_secs(30 * 24 * 60 * 60);
+
+/// An open cache directory.  Entries are files or directories; their mtime
+/// is the last time they were used.  Entries may be deleted by `prune()` as
+/// soon as the last `RepoCache` using them is dropped.
+pub(crate) struct RepoCache {
+    dir: openat::Dir,
+    lock: std::fs::File,
+    max_entries: usize,
+}
+
+impl RepoCache {
+    /// Open (creating if necessary) the cache `name`, keeping at most
+    /// `max_entries` in it.
+    pub(crate) fn open(repo_dfd: &openat::Dir, name: &str, max_entries: usize) -> Result<Self> {
+        let path = format!("{}/{}", CACHES_DIR, name);
+        repo_dfd.ensure_dir_all(path.as_str(), 0o755)?;
+        let dir = repo_dfd.sub_dir(path.as_str())?;
+        let lock = dir.update_file(LOCKFILE, 0o600)?;
+        flock(lock.as_raw_fd(), FlockArg::LockShared).context("Locking cache")?;
+        Ok(Self {
+            dir,
+            lock,
+            max_entries,
+        })
+    }
+
+    /// The cache directory.
+    pub(crate) fn dir(&self) -> &openat::Dir {
+        &self.dir
+    }
+
+    /// Directory fd of the cache (should only be used by C)
+    pub(crate) fn get_dfd(&self) -> i32 {
+        self.dir.as_raw_fd()
+    }
+
+    /// Mark `entry` as used, returning whether it exists.
+    pub(crate) fn touch(&self, entry: &str) -> CxxResult<bool> {
+        let c_entry = std::ffi::CString::new(entry).context("Invalid cache entry name")?;
+        let r = unsafe {
+            libc::utimensat(
+                self.dir.as_raw_fd(),
+                c_entry.as_ptr(),
+                std::ptr::null(),
+                libc::AT_SYMLINK_NOFOLLOW,
+            )
+        };
+        if r < 0 {
+            let e = std::io::Error::last_os_error();
+            if e.kind() == std::io::ErrorKind::NotFound {
+                return Ok(false);
+            }
+            return Err(anyhow::Error::new(e)
+                .context(format!("Updating mtime of {}", entry))
+                .into());
+        }
+        Ok(true)
+    }
+
+    /// Delete the least recently used entries beyond the maximum, except for
+    /// `keep`, which was just added.  If another process is using the cache,
+    /// this is skipped; it will happen the next time around.
+    pub(crate) fn prune(&self, keep: &str) -> CxxResult<()> {
+        self.with_exclusive_lock(|| {
+            let mut entries = self.list_entries()?;
+            entries.retain(|(_, name)| name != keep);
+            // Newest first; `keep` takes up one of the slots
+            entries.sort_by(|a, b| b.cmp(a));
+            for (_, name) in entries.iter().skip(self.max_entries.saturating_sub(1)) {
+                self.dir.remove_all(name.as_str())?;
+            }
+            Ok(())
+        })?;
+        Ok(())
+    }
+
+    /// Delete entries not used since `cutoff` (or all of them, if `None`),
+    /// including temporary ones.
+    fn expire(&self, cutoff: Option<SystemTime>) -> Result<()> {
+        self.with_exclusive_lock(|| {
+            for e in self.dir.list_dir(".")? {
+                let e = e?;
+                let name = match e.file_name().to_str() {
+                    Some(n) if n != LOCKFILE => n.to_string(),
+                    _ => continue,
+                };
+                let expired = match cutoff {
+                    Some(cutoff) => {
+                        self.dir.metadata(name.as_str())?.stat().st_mtime
+                            < cutoff
+                                .duration_since(SystemTime::UNIX_EPOCH)?
+                                .as_secs()
+                                .try_into()?
+                    }
+                    None => true,
+                };
+                if expired {
+                    self.dir.remove_all(name.as_str())?;
+                }
+            }
+            Ok(())
+        })
+    }
+
+    /// Entries that are complete, along with their last use.
+    fn list_entries(&self) -> Result<Vec<((i64, i64), String)>> {
+        let mut entries = Vec::new();
+        for e in self.dir.list_dir(".")? {
+            let e = e?;
+            let name = match e.file_name().to_str() {
+                Some(n) => n,
+                None => continue,
+            };
+            if name.starts_with('.') || name.contains(TMP_INFIX) {
+                continue;
+            }
+            let st = self.dir.metadata(name)?;
+            let st = st.stat();
+            entries.push(((st.st_mtime, st.st_mtime_nsec), name.to_string()));
+        }
+        Ok(entries)
+    }
+
+    /// Run `f` holding the lock exclusively, i.e. when nobody else is
+    /// using the cache; if they are, do nothing.
+    fn with_exclusive_lock(&self, f: impl FnOnce() -> Result<()>) -> Result<()> {
+        let fd = self.lock.as_raw_fd();
+        // Converting a lock isn't atomic, so if this fails we lost our shared
+        // lock and need to take it again.
+        let r = match flock(fd, FlockArg::LockExclusiveNonblock) {
+            Ok(()) => f(),
+            Err(nix::errno::Errno::EWOULDBLOCK) => Ok(()),
+            Err(e) => Err(e.into()),
+        };
+        flock(fd, FlockArg::LockShared).context("Locking cache")?;
+        r
+    }
+}
+
+/// Open `name` for use from C++; see `RepoCache::open()`.
+pub(crate) fn repo_cache_open(
+    mut repo: Pin<&mut crate::FFIOstreeRepo>,
+    name: &str,
+    max_entries: u32,
+) -> CxxResult<Box<RepoCache>> {
+    let repo = &repo.gobj_wrap();
+    let repo_dfd = crate::ffiutil::ffi_view_openat_dir(repo.get_dfd());
+    Ok(Box::new(RepoCache::open(
+        &repo_dfd,
+        name,
+        max_entries as usize,
+    )?))
+}
+
+/// Called on `rpm-ostree cleanup`: delete cache entries which haven't been
+/// used in a while, or all of them if `all` is set.
+pub(crate) fn repo_caches_cleanup(
+    mut repo: Pin<&mut crate::FFIOstreeRepo>,
+    all: bool,
+) -> CxxResult<()> {
+    let repo = &repo.gobj_wrap();
+    let repo_dfd = crate::ffiutil::ffi_view_openat_dir(repo.get_dfd());
+    let cutoff = if all {
+        None
+    } else {
+        Some(SystemTime::now() - MAX_AGE)
+    };
+    for &name in CACHES {
+        if !repo_dfd.exists(format!("{}/{}", CACHES_DIR, name).as_str())? {
+            continue;
+        }
+        let cache = RepoCache::open(&repo_dfd, name, 0)?;
+        cache
+            .expire(cutoff)
+            .with_context(|| format!("Cleaning up {}", name))?;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use nix::sys::time::{TimeSpec, TimeValLike};
+
+    fn set_mtime(d: &openat::Dir, name: &str, secs: i64) -> Result<()> {
+        let t = TimeSpec::seconds(secs);
+        nix::sys::stat::utimensat(
+            Some(d.as_raw_fd()),
+            name,
+            &t,
+            &t,
+            nix::sys::stat::UtimensatFlags::NoFollowSymlink,
+        )?;
+        Ok(())
+    }
+
+    #[test]
+    fn test_prune() -> Result<()> {
+        let td = tempfile::tempdir()?;
+        let repo = openat::Dir::open(td.path())?;
+        let cache = RepoCache::open(&repo, "test-cache", 3)?;
+        let d = repo.sub_dir("extensions/rpmostree/test-cache")?;
+        for (i, name) in ["a", "b", "c", "d"].iter().enumerate() {
+            d.write_file_contents(*name, 0o644, name)?;
+            set_mtime(&d, name, 1000 + i as i64)?;
+        }
+        d.ensure_dir_all("e.tmp-123", 0o755)?;
+        // Using "a" makes it the newest, so "b" goes instead
+        assert!(cache.touch("a")?);
+        assert!(!cache.touch("nonexistent")?);
+        cache.prune("d")?;
+        assert!(d.exists("a")?);
+        assert!(!d.exists("b")?);
+        assert!(d.exists("c")?);
+        assert!(d.exists("d")?);
+        assert!(d.exists("e.tmp-123")?);
+
+        // Somebody else using the cache blocks pruning
+        let other = RepoCache::open(&repo, "test-cache", 1)?;
+        other.prune("d")?;
+        assert!(d.exists("a")?);
+        drop(cache);
+        other.prune("d")?;
+        assert!(!d.exists("a")?);
+        assert!(d.exists("d")?);
+        Ok(())
+    }
+
+    #[test]
+    fn test_expire() -> Result<()> {
+        let td = tempfile::tempdir()?;
+        let repo = openat::Dir::open(td.path())?;
+        let d = {
+            let cache = RepoCache::open(&repo, "test-cache", 3)?;
+            let d = repo.sub_dir("extensions/rpmostree/test-cache")?;
+            d.write_file_contents("old", 0o644, "old")?;
+            set_mtime(&d, "old", 1000)?;
+            d.ensure_dir_all("old.tmp-123", 0o755)?;
+            set_mtime(&d, "old.tmp-123", 1000)?;
+            d.write_file_contents("new", 0o644, "new")?;
+            cache.expire(Some(SystemTime::now() - MAX_AGE))?;
+            d
+        };
+        assert!(!d.exists("old")?);
+        assert!(!d.exists("old.tmp-123")?);
+        assert!(d.exists("new")?);
+        RepoCache::open(&repo, "test-cache", 3)?.expire(None)?;
+        assert!(!d.exists("new")?);
+        Ok(())
+    }
+}
@@ -58,3 +58,30 @@ pub(crate) fn script_is_ignored(pkg: &str, script: &str) -> bool {
     let pkgscript = format!("{}.{}", pkg, script);
     IGNORED_PKG_SCRIPTS.contains(pkgscript.as_str())
 }
+
+/// Scripts which are known to only write files of their own package, and so
+/// may run concurrently with other scripts; anything else runs alone.  Note
+/// that for scripts we replace (see rpmostree-scripts.cxx), this applies to
+/// our replacement.  Only add scripts whose content we control or which have
+/// been checked not to touch shared state (caches, databases, the passwd
+/// files, enablement symlinks...), as this is keyed on just the name.
+static PARALLEL_SAFE_PKG_SCRIPTS: phf::Set<&'static str> = phf_set! {
+    // Our replacements; see lua_replacements.  Not glibc-common.post, which
+    // runs outside the sandbox, nor the fedora-release ones, which all race
+    // to create /usr/lib/os-release.
+    "glibc.post",
+    "crypto-policies.post",
+    // Just for the tests
+    "rpmostree-lua-override-test.post",
+    "rpmostree-lua-override-test-expand.post",
+    "rpmostree-parallel-post-test.post",
+    "rpmostree-parallel-post-test-dep.post",
+};
+
+/// Returns true if an RPM script is known to be safe to run concurrently with
+/// other scripts.  The format is the same as for `script_is_ignored()`.
+pub(crate) fn script_is_parallel_safe(pkg: &str, script: &str) -> bool {
+    let script = script.trim_start_matches('%');
+    let pkgscript = format!("{}.{}", pkg, script);
+    PARALLEL_SAFE_PKG_SCRIPTS.contains(pkgscript.as_str())
+}
@@ -365,7 +365,10 @@ fn treefile_merge(dest: &mut TreeComposeConfig, src: &mut TreeComposeConfig) {
         preserve_passwd,
         check_passwd,
         check_groups,
-        postprocess_script
+        postprocess_script,
+        concurrency,
+        script_overlayfs,
+        commit_shard_depth
     );
     merge_hashsets!(ignore_removed_groups, ignore_removed_users);
     merge_maps!(add_commit_metadata);
@@ -551,6 +554,29 @@ impl Treefile {
             .expect("add-file")
     }
 
+    /// Returns the configured number of workers for a phase, or 0 if unset.
+    pub(crate) fn get_concurrency(&self, phase: crate::ffi::ConcurrencyPhase) -> u32 {
+        use crate::ffi::ConcurrencyPhase;
+        let c = match self.parsed.concurrency.as_ref() {
+            Some(c) => c,
+            None => return 0,
+        };
+        let v = match phase {
+            ConcurrencyPhase::Relabel => c.relabel,
+            ConcurrencyPhase::PostScripts => c.post_scripts,
+            ConcurrencyPhase::RpmmdRefresh => c.rpmmd_refresh,
+            ConcurrencyPhase::Checkout => c.checkout,
+            _ => unreachable!(),
+        };
+        v.unwrap_or(0)
+    }
+
+    /// Returns the configured depth at which the rootfs is split for committing,
+    /// or 0 if unset.
+    pub(crate) fn get_commit_shard_depth(&self) -> u32 {
+        self.parsed.commit_shard_depth.unwrap_or(0)
+    }
+
     /// Returns the "ref" entry in treefile, or the empty string if unset.
     pub(crate) fn get_ostree_ref(&self) -> String {
         self.parsed.treeref.clone().unwrap_or_default()
@@ -656,6 +682,10 @@ impl Treefile {
         self.parsed.readonly_executables.unwrap_or(false)
     }
 
+    pub(crate) fn get_script_overlayfs(&self) -> bool {
+        self.parsed.script_overlayfs.unwrap_or(false)
+    }
+
     pub(crate) fn get_documentation(&self) -> bool {
         self.parsed.documentation.unwrap_or(true)
     }
@@ -1056,6 +1086,21 @@ pub(crate) struct Rojig {
     pub(crate) description: Option<String>,
 }
 
+#[derive(Serialize, Deserialize, Debug, Default, PartialEq, Eq)]
+#[serde(rename_all = "kebab-case")]
+/// Number of worker threads for the parallelized phases; unset means the
+/// default for that phase.
+pub(crate) struct Concurrency {
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub(crate) relabel: Option<u32>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub(crate) post_scripts: Option<u32>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub(crate) rpmmd_refresh: Option<u32>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub(crate) checkout: Option<u32>,
+}
+
 #[derive(Serialize, Deserialize, Debug, PartialEq, Eq)]
 #[serde(untagged)]
 pub(crate) enum Include {
@@ -1221,6 +1266,18 @@ pub(crate) struct TreeComposeConfig {
     // The database backend
     #[serde(skip_serializing_if = "Option::is_none")]
     pub(crate) rpmdb: Option<RpmdbBackend>,
+    // Build tunables; these don't change the output, so they're not
+    // serialized (and hence not part of the treefile checksum).
+    #[serde(skip_serializing)]
+    pub(crate) concurrency: Option<Concurrency>,
+    #[serde(skip_serializing)]
+    #[serde(rename = "script-overlayfs")]
+    pub(crate) script_overlayfs: Option<bool>,
+    // Doesn't change the output either, but changing it means the next
+    // compose can't reuse any shards.
+    #[serde(skip_serializing)]
+    #[serde(rename = "commit-shard-depth")]
+    pub(crate) commit_shard_depth: Option<u32>,
 
     #[serde(flatten)]
     pub(crate) legacy_fields: LegacyTreeComposeConfigFields,
@@ -1569,6 +1626,25 @@ pub(crate) mod tests {
         assert!(treefile.automatic_version_prefix.unwrap() == "${releasever}");
     }
 
+    #[test]
+    fn test_concurrency() {
+        let treefile = append_and_parse(indoc! {"
+            concurrency:
+              post-scripts: 4
+              checkout: 8
+            commit-shard-depth: 3
+        "});
+        let c = treefile.concurrency.as_ref().unwrap();
+        assert_eq!(c.post_scripts, Some(4));
+        assert_eq!(c.checkout, Some(8));
+        assert_eq!(c.relabel, None);
+        assert_eq!(treefile.commit_shard_depth, Some(3));
+        // Not part of the serialization, and hence the checksum
+        let buf = serde_json::to_string(&treefile).unwrap();
+        assert!(!buf.contains("concurrency"));
+        assert!(!buf.contains("commit-shard-depth"));
+    }
+
     #[test]
     fn basic_valid_legacy() {
         let treefile = append_and_parse(indoc! {"
@@ -158,7 +158,8 @@ rpmostree_testutils_builtin_script_shell (int argc, char **argv,
   if (!glnx_opendirat (AT_FDCWD, rootpath, TRUE, &rootfs_dfd, error))
     return FALSE;
 
-  return rpmostree_run_script_in_bwrap_container (rootfs_dfd, NULL, TRUE, "testscript",
+  auto sandbox = rpmostreecxx::bubblewrap_sandbox_new (rootfs_dfd, rpmostreecxx::BubblewrapMutability::RoFiles);
+  return rpmostree_run_script_in_bwrap_container (rootfs_dfd, NULL, *sandbox, "testscript",
                                                   NULL, NULL, NULL, NULL, 
                                                   STDIN_FILENO, cancellable, error);
 }
@@ -75,7 +75,9 @@ static gboolean opt_print_only;
 static char *opt_write_commitid_to;
 static char *opt_write_composejson_to;
 static gboolean opt_no_parent;
+static gboolean opt_write_solv_cache;
 static char *opt_write_lockfile_to;
+static char *opt_profile_to;
 static char **opt_lockfiles;
 static gboolean opt_lockfile_strict;
 static char *opt_parent;
@@ -107,6 +109,7 @@ static GOptionEntry install_option_entries[] = {
   { "ex-write-lockfile-to", 0, 0, G_OPTION_ARG_STRING, &opt_write_lockfile_to, "Write lockfile to FILE", "FILE" },
   { "ex-lockfile", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_lockfiles, "Read lockfile from FILE", "FILE" },
   { "ex-lockfile-strict", 0, 0, G_OPTION_ARG_NONE, &opt_lockfile_strict, "With --ex-lockfile, only allow installing locked packages", NULL },
+  { "profile-to", 0, 0, G_OPTION_ARG_STRING, &opt_profile_to, "Write per-phase timings to FILE in Chrome trace format", "FILE" },
   { NULL }
 };
 
@@ -121,6 +124,7 @@ static GOptionEntry commit_option_entries[] = {
   { "write-composejson-to", 0, 0, G_OPTION_ARG_STRING, &opt_write_composejson_to, "Write JSON to FILE containing information about the compose run", "FILE" },
   { "no-parent", 0, 0, G_OPTION_ARG_NONE, &opt_no_parent, "Always commit without a parent", NULL },
   { "parent", 0, 0, G_OPTION_ARG_STRING, &opt_parent, "Commit with specific parent", "REV" },
+  { "ex-write-solv-cache", 0, 0, G_OPTION_ARG_NONE, &opt_write_solv_cache, "Cache the package set of the new commit in the repo, so later loads of it needn't parse its rpmdb", NULL },
   { NULL }
 };
 
@@ -415,14 +419,16 @@ install_packages (RpmOstreeTreeComposeContext  *self,
   (*self->treefile_rs)->sanitycheck_externals();
 
   /* --- Downloading packages --- */
-  if (!rpmostree_context_download (self->corectx, cancellable, error))
-    return FALSE;
-
   if (opt_download_only || opt_download_only_rpms)
     {
       if (opt_unified_core && !opt_download_only_rpms)
         {
-          if (!rpmostree_context_import (self->corectx, cancellable, error))
+          if (!rpmostree_context_download_and_import (self->corectx, cancellable, error))
+            return FALSE;
+        }
+      else
+        {
+          if (!rpmostree_context_download (self->corectx, cancellable, error))
             return FALSE;
         }
       return TRUE; /* 🔚 Early return */
@@ -436,7 +442,8 @@ install_packages (RpmOstreeTreeComposeContext  *self,
 
   if (opt_unified_core)
     {
-      if (!rpmostree_context_import (self->corectx, cancellable, error))
+      /* In unified core mode, we unpack into the pkgcache as packages arrive */
+      if (!rpmostree_context_download_and_import (self->corectx, cancellable, error))
         return FALSE;
       rpmostree_context_set_tmprootfs_dfd (self->corectx, rootfs_dfd);
       if (!rpmostree_context_assemble (self->corectx, cancellable, error))
@@ -457,6 +464,8 @@ install_packages (RpmOstreeTreeComposeContext  *self,
   else
     {
       /* The non-unified core path */
+      if (!rpmostree_context_download (self->corectx, cancellable, error))
+        return FALSE;
 
       /* Before we install packages, drop a file to suppress the kernel.rpm dracut run.
        * <https://github.com/systemd/systemd/pull/4174> */
@@ -949,6 +958,7 @@ impl_install_tree (RpmOstreeTreeComposeContext *self,
     return FALSE;
 
   /* Start postprocessing */
+  auto postprocess_span = rpmostreecxx::profile_span_begin("postprocess");
   rpmostreecxx::compose_postprocess(self->rootfs_dfd, **self->treefile_rs, next_version, self->unified_core_and_fuse);
 
   /* Until here, we targeted "rootfs.tmp" in the working directory. Most
@@ -1062,12 +1072,14 @@ impl_commit_tree (RpmOstreeTreeComposeContext *self,
   g_autoptr(GVariant) metadata = rpmostree_composeutil_finalize_metadata (self->metadata, self->rootfs_dfd, error);
   if (!metadata)
     return FALSE;
+  auto postprocess_span = rpmostreecxx::profile_span_begin("postprocess-final");
   if (!rpmostree_rootfs_postprocess_common (self->rootfs_dfd, cancellable, error))
     return FALSE;
   if (!rpmostree_postprocess_final (self->rootfs_dfd,
                                     self->treefile, self->unified_core_and_fuse,
                                     cancellable, error))
     return FALSE;
+  postprocess_span->end();
 
   if (self->treefile_rs)
     {
@@ -1104,9 +1116,11 @@ impl_commit_tree (RpmOstreeTreeComposeContext *self,
     }
 
   /* The penultimate step, just basically `ostree commit` */
+  auto commit_span = rpmostreecxx::profile_span_begin("commit");
   g_autofree char *new_revision = NULL;
   if (!rpmostree_compose_commit (self->rootfs_dfd, self->build_repo, parent_revision,
-                                 metadata, gpgkey, selinux, self->devino_cache,
+                                 self->previous_checksum, metadata, gpgkey, selinux, self->devino_cache,
+                                 (*self->treefile_rs)->get_commit_shard_depth(),
                                  &new_revision, cancellable, error))
     return glnx_prefix_error (error, "Writing commit");
   g_assert(new_revision != NULL);
@@ -1119,7 +1133,11 @@ impl_commit_tree (RpmOstreeTreeComposeContext *self,
       if (!ostree_repo_commit_transaction (self->build_repo, &stats, cancellable, error))
         return glnx_prefix_error (error, "Commit");
       statsp = &stats;
+      commit_span->add_counter("metadata-objects-written", stats.metadata_objects_written);
+      commit_span->add_counter("content-objects-written", stats.content_objects_written);
+      commit_span->add_counter("content-bytes-written", stats.content_bytes_written);
     }
+  commit_span->end();
 
   if (!opt_unified_core)
     g_assert (self->repo == self->build_repo);
@@ -1137,6 +1155,16 @@ impl_commit_tree (RpmOstreeTreeComposeContext *self,
   if (!ostree_repo_load_commit (self->repo, new_revision, &new_commit, NULL, error))
     return FALSE;
 
+  /* Prime the solv cache for the new commit.  This is opt-in since it writes
+   * to extensions/rpmostree/ of the target repo, which may be published. */
+  if (opt_write_solv_cache)
+    {
+      g_autoptr(RpmOstreeRefSack) rsack =
+        rpmostree_get_refsack_for_commit (self->repo, new_revision, cancellable, error);
+      if (!rsack)
+        return glnx_prefix_error (error, "Caching package set");
+    }
+
   /* --write-commitid-to overrides writing the ref */
   if (self->ref && !opt_write_commitid_to)
     {
@@ -1218,6 +1246,9 @@ rpmostree_compose_builtin_install (int             argc,
   const char *destdir = argv[2];
   opt_workdir = g_strdup (destdir);
 
+  if (opt_profile_to)
+    rpmostreecxx::profile_set_enabled (true);
+
   g_autoptr(RpmOstreeTreeComposeContext) self = NULL;
   if (!rpm_ostree_compose_context_new (treefile_path, &self, cancellable, error))
     return FALSE;
@@ -1244,6 +1275,9 @@ rpmostree_compose_builtin_install (int             argc,
     }
   g_print ("rootfs: %s/rootfs\n", destdir);
 
+  if (opt_profile_to)
+    rpmostreecxx::profile_write_chrome_trace(opt_profile_to);
+
   return TRUE;
 }
 
@@ -1390,6 +1424,9 @@ rpmostree_compose_builtin_tree (int             argc,
       return FALSE;
     }
 
+  if (opt_profile_to)
+    rpmostreecxx::profile_set_enabled (true);
+
   g_autoptr(RpmOstreeTreeComposeContext) self = NULL;
   if (!rpm_ostree_compose_context_new (treefile_path, &self, cancellable, error))
     return FALSE;
@@ -1419,6 +1456,8 @@ rpmostree_compose_builtin_tree (int             argc,
         return FALSE;
     }
 
+  if (opt_profile_to)
+    rpmostreecxx::profile_write_chrome_trace(opt_profile_to);
 
   return TRUE;
 }
@@ -268,6 +268,8 @@ rpmostree_syscore_cleanup (OstreeSysroot            *sysroot,
     return glnx_prefix_error (error, "cleaning tmp rootfs");
   /* also delete extra history entries */
   rpmostreecxx::history_prune();
+  /* and cache entries (e.g. initramfs images) that haven't been used in a while */
+  rpmostreecxx::repo_caches_cleanup (*repo, false);
 
   /* Regenerate all refs */
   guint n_pkgcache_freed = 0;
@@ -101,6 +101,7 @@ struct RpmOstreeSysrootUpgrader {
   /* Used during tree construction */
   OstreeRepoDevInoCache *devino_cache;
   int tmprootfs_dfd;
+  gboolean tmprootfs_sparse; /* Only has the paths from rpmostree_sparse_paths_new() */
   RpmOstreeRefSack *rsack; /* sack of base layer */
   GLnxTmpDir metatmpdir;
   RpmOstreeContext *ctx;
@@ -109,6 +110,7 @@ struct RpmOstreeSysrootUpgrader {
   gboolean layering_initialized; /* Whether layering_type is known */
   RpmOstreeSysrootUpgraderLayeringType layering_type;
   gboolean layering_changed; /* Whether changes to layering should result in a new commit */
+  gboolean final_revision_reusable; /* Whether final_revision can be deployed as is */
   gboolean pkgs_imported; /* Whether pkgs to be layered have been downloaded & imported */
   char *base_revision; /* Non-layered replicated commit */
   char *final_revision; /* Computed by layering; if NULL, only using base_revision */
@@ -591,14 +593,19 @@ checkout_base_tree (RpmOstreeSysrootUpgrader *self,
     return FALSE;
 
   /* NB: we let ostree create the dir for us so that the root dir has the
-   * correct xattrs (e.g. selinux label) */
+   * correct xattrs (e.g. selinux label).  We start with just what's needed
+   * to set up the context; the rest is checked out (or not) by
+   * complete_base_tree() once we know what the transaction is.
+   */
   self->devino_cache = ostree_repo_devino_cache_new ();
-  OstreeRepoCheckoutAtOptions checkout_options =
-    { .devino_to_csum_cache = self->devino_cache };
-  if (!ostree_repo_checkout_at (self->repo, &checkout_options,
-                                repo_dfd, RPMOSTREE_TMP_ROOTFS_DIR,
-                                self->base_revision, cancellable, error))
+  g_autoptr(GHashTable) dirs = NULL;
+  g_autoptr(GHashTable) subtrees = NULL;
+  rpmostree_sparse_paths_new (&dirs, &subtrees);
+  if (!rpmostree_checkout_sparse (self->repo, self->base_revision,
+                                  repo_dfd, RPMOSTREE_TMP_ROOTFS_DIR, self->devino_cache,
+                                  dirs, subtrees, NULL, cancellable, error))
     return FALSE;
+  self->tmprootfs_sparse = TRUE;
 
   if (!glnx_opendirat (repo_dfd, RPMOSTREE_TMP_ROOTFS_DIR, FALSE,
                        &self->tmprootfs_dfd, error))
@@ -607,6 +614,55 @@ checkout_base_tree (RpmOstreeSysrootUpgrader *self,
   return TRUE;
 }
 
+/* Whether what we do to the tree after assembly only touches the paths
+ * from rpmostree_sparse_paths_new().  Regenerating the initramfs reads all of
+ * /usr, and the cliwrap wrappers replace binaries all over it.  The kernel
+ * isn't in here since rpmostree_context_get_sparse_paths() already makes
+ * removing it use the full tree.
+ */
+static gboolean
+postprocess_allows_sparse (RpmOstreeSysrootUpgrader *self)
+{
+  return !rpmostree_origin_get_cliwrap (self->computed_origin) &&
+         !rpmostree_origin_get_regenerate_initramfs (self->computed_origin);
+}
+
+/* Check out the rest of the base tree that assembly needs; when only
+ * removing packages, that's just the directories they're in, and the
+ * rest is grafted back in at commit time.
+ */
+static gboolean
+complete_base_tree (RpmOstreeSysrootUpgrader *self,
+                    GCancellable             *cancellable,
+                    GError                  **error)
+{
+  if (!self->tmprootfs_sparse)
+    return TRUE;
+
+  g_autoptr(GHashTable) dirs = NULL;
+  g_autoptr(GHashTable) subtrees = NULL;
+  if (self->layering_type == RPMOSTREE_SYSROOT_UPGRADER_LAYERING_RPMMD_REPOS &&
+      postprocess_allows_sparse (self))
+    {
+      if (!rpmostree_context_get_sparse_paths (self->ctx, self->tmprootfs_dfd,
+                                               &dirs, &subtrees, error))
+        return FALSE;
+    }
+
+  auto task = rpmostreecxx::progress_begin_task(dirs ? "Checking out modified directories"
+                                                     : "Checking out base tree");
+  g_autoptr(GPtrArray) skipped = NULL;
+  if (!rpmostree_checkout_sparse (self->repo, self->base_revision,
+                                  self->tmprootfs_dfd, ".", self->devino_cache,
+                                  dirs, subtrees, &skipped, cancellable, error))
+    return FALSE;
+  if (skipped->len > 0)
+    rpmostree_context_set_sparse_base (self->ctx, self->base_revision, skipped);
+  self->tmprootfs_sparse = FALSE;
+
+  return TRUE;
+}
+
 /* Optimization: use the already checked out base rpmdb of the pending deployment if the
  * base layer matches. Returns FALSE on error, TRUE otherwise. Check self->rsack to
  * determine if it worked. */
@@ -939,6 +995,10 @@ prep_local_assembly (RpmOstreeSysrootUpgrader *self,
     return FALSE;
 
   self->ctx = rpmostree_context_new_client (self->repo);
+  rpmostree_context_set_relabel_concurrency (self->ctx,
+    rpmostreed_get_relabel_concurrency (rpmostreed_daemon_get ()));
+  rpmostree_context_set_checkout_concurrency (self->ctx,
+    rpmostreed_get_checkout_concurrency (rpmostreed_daemon_get ()));
 
   g_autofree char *tmprootfs_abspath = glnx_fdrel_abspath (self->tmprootfs_dfd, ".");
 
@@ -999,6 +1059,25 @@ prep_local_assembly (RpmOstreeSysrootUpgrader *self,
         return FALSE;
 
       self->layering_changed = strcmp (previous_state_sha512, new_state_sha512) != 0;
+
+      /* If the layered commit is on top of the same base, and nothing else which
+       * goes into it changed, there's no point in assembling it again (e.g. we're
+       * only redeploying for new kargs).  The SELinux policy comes from the base,
+       * so it's the same too.  Layered files are owned by users and groups from
+       * the host's passwd and group, so those need to match as well.  Initramfs
+       * regeneration uses all of the host's /etc, so we can't tell if that changed.
+       */
+      g_autofree char *prev_parent = ostree_commit_get_parent (prev_commit);
+      const char *prev_passwd_sha256 = NULL;
+      g_variant_dict_lookup (metadata_dict, "rpmostree.passwd-sha256", "&s", &prev_passwd_sha256);
+      g_autofree char *new_passwd_sha256 = NULL;
+      if (!rpmostree_context_get_passwd_sha256 (self->ctx, &new_passwd_sha256, error))
+        return FALSE;
+      self->final_revision_reusable =
+        !self->layering_changed &&
+        g_strcmp0 (prev_parent, self->base_revision) == 0 &&
+        prev_passwd_sha256 && g_strcmp0 (prev_passwd_sha256, new_passwd_sha256) == 0 &&
+        !rpmostree_origin_get_regenerate_initramfs (self->computed_origin);
     }
   else
     /* Otherwise, we're transitioning from not-layered to layered, so it
@@ -1021,6 +1100,17 @@ perform_local_assembly (RpmOstreeSysrootUpgrader *self,
   if (self->layering_type == RPMOSTREE_SYSROOT_UPGRADER_LAYERING_NONE)
     return TRUE;
 
+  if (self->final_revision_reusable)
+    {
+      rpmostree_output_message ("Reusing layered commit %.7s", self->final_revision);
+      g_clear_object (&self->ctx);
+      glnx_close_fd (&self->tmprootfs_dfd);
+      return TRUE;
+    }
+
+  if (!complete_base_tree (self, cancellable, error))
+    return FALSE;
+
   rpmostree_context_set_devino_cache (self->ctx, self->devino_cache);
   rpmostree_context_set_tmprootfs_dfd (self->ctx, self->tmprootfs_dfd);
 
@@ -1121,13 +1211,48 @@ perform_local_assembly (RpmOstreeSysrootUpgrader *self,
       /* NB: We only use the real root's /etc if initramfs regeneration is explicitly
        * requested. IOW, just replacing the kernel still gets use stock settings, like the
        * server side. */
-      if (!rpmostree_run_dracut (self->tmprootfs_dfd,
-                                 (const char* const*)initramfs_args->pdata,
-                                 kver, initramfs_path,
-                                 rpmostree_origin_get_regenerate_initramfs (self->computed_origin),
-                                 NULL, &initramfs_tmpf, cancellable, error))
+      const gboolean use_root_etc = rpmostree_origin_get_regenerate_initramfs (self->computed_origin);
+
+      /* The assembled tree is fully determined by the base commit and the
+       * state checksum (treefile + resolved packages), so if we've already run
+       * dracut over an identical tree with the same arguments, reuse that. */
+      g_autofree char *state_checksum = NULL;
+      if (!rpmostree_context_get_state_sha512 (self->ctx, &state_checksum, error))
+        return FALSE;
+      g_autofree char *input_checksum = g_strconcat (self->base_revision, ":", state_checksum, NULL);
+      g_autofree char *cache_key =
+        rpmostree_initramfs_cache_key (input_checksum, kver,
+                                       (const char* const*)initramfs_args->pdata,
+                                       initramfs_path, use_root_etc, cancellable, error);
+      if (!cache_key)
+        return FALSE;
+      if (!rpmostree_initramfs_cache_lookup (self->repo, cache_key, self->tmprootfs_dfd,
+                                             &initramfs_tmpf, cancellable, error))
         return FALSE;
 
+      if (initramfs_tmpf.initialized)
+        {
+          /* Match what dracut --rebuild would have done */
+          if (initramfs_path)
+            (void) unlinkat (self->tmprootfs_dfd, initramfs_path, 0);
+          sd_journal_send ("MESSAGE=Reusing cached initramfs %s", cache_key,
+                           "INITRAMFS_CACHE_KEY=%s", cache_key,
+                           NULL);
+        }
+      else
+        {
+          if (!rpmostree_run_dracut (self->tmprootfs_dfd,
+                                     (const char* const*)initramfs_args->pdata,
+                                     kver, initramfs_path, use_root_etc,
+                                     NULL, &initramfs_tmpf, cancellable, error))
+            return FALSE;
+          /* Failing to populate the cache isn't fatal */
+          g_autoptr(GError) local_error = NULL;
+          if (!rpmostree_initramfs_cache_store (self->repo, cache_key, &initramfs_tmpf,
+                                                cancellable, &local_error))
+            sd_journal_print (LOG_WARNING, "%s", local_error->message);
+        }
+
       if (!rpmostree_finalize_kernel (self->tmprootfs_dfd, bootdir, kver, kernel_path,
                                       &initramfs_tmpf, RPMOSTREE_FINALIZE_KERNEL_AUTO,
                                       cancellable, error))
@@ -1225,12 +1350,12 @@ rpmostree_sysroot_upgrader_import_pkgs (RpmOstreeSysrootUpgrader *self,
   /* any layering actually required? */
   if (self->layering_type == RPMOSTREE_SYSROOT_UPGRADER_LAYERING_NONE)
     return TRUE;
+  if (self->final_revision_reusable)
+    return TRUE;
 
   if (self->layering_type == RPMOSTREE_SYSROOT_UPGRADER_LAYERING_RPMMD_REPOS)
     {
-      if (!rpmostree_context_download (self->ctx, cancellable, error))
-        return FALSE;
-      if (!rpmostree_context_import (self->ctx, cancellable, error))
+      if (!rpmostree_context_download_and_import (self->ctx, cancellable, error))
         return FALSE;
     }
 
@@ -1398,7 +1523,7 @@ rpmostree_sysroot_upgrader_deploy (RpmOstreeSysrootUpgrader *self,
           etc_files.push_back(std::string(key));
         }
       try {
-        fd = rpmostreecxx::initramfs_overlay_generate (etc_files, *cancellable);
+        fd = rpmostreecxx::initramfs_overlay_generate (*self->repo, etc_files, *cancellable);
       } catch (std::exception& e) {
         util::rethrow_prefixed(e, "Generating initramfs overlay");
       }
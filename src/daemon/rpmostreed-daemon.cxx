@@ -23,6 +23,7 @@
 #include "rpmostreed-types.h"
 #include "rpmostreed-utils.h"
 #include "rpmostree-util.h"
+#include "rpmostree-cxxrs.h"
 
 #include <libglnx.h>
 #include <systemd/sd-journal.h>
@@ -71,6 +72,8 @@ struct _RpmostreedDaemon {
   /* Settings from the config file */
   guint idle_exit_timeout;
   RpmostreedAutomaticUpdatePolicy auto_update_policy;
+  guint relabel_concurrency;
+  guint checkout_concurrency;
 
   GDBusConnection *connection;
   GDBusObjectManagerServer *object_manager;
@@ -357,6 +360,24 @@ get_config_str (GKeyFile   *keyfile,
   return util::move_nullify (val) ?: g_strdup (default_val);
 }
 
+static gboolean
+get_config_boolean (GKeyFile   *keyfile,
+                    const char *key,
+                    gboolean    default_val)
+{
+  if (keyfile && g_key_file_has_key (keyfile, DAEMON_CONFIG_GROUP, key, NULL))
+    {
+      g_autoptr(GError) local_error = NULL;
+      gboolean r = g_key_file_get_boolean (keyfile, DAEMON_CONFIG_GROUP, key, &local_error);
+      if (!local_error)
+        return r;
+      if (g_error_matches (local_error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE))
+        sd_journal_print (LOG_WARNING, "Bad boolean for '%s': %s; using compiled defaults",
+                          key, local_error->message);
+    }
+  return default_val;
+}
+
 static guint64
 get_config_uint64 (GKeyFile   *keyfile,
                    const char *key,
@@ -381,6 +402,18 @@ rpmostreed_get_automatic_update_policy (RpmostreedDaemon *self)
   return self->auto_update_policy;
 }
 
+guint
+rpmostreed_get_relabel_concurrency (RpmostreedDaemon *self)
+{
+  return self->relabel_concurrency;
+}
+
+guint
+rpmostreed_get_checkout_concurrency (RpmostreedDaemon *self)
+{
+  return self->checkout_concurrency;
+}
+
 /* in-place version of g_ascii_strdown */
 static inline void
 ascii_strdown_inplace (char *str)
@@ -402,6 +435,14 @@ rpmostreed_daemon_reload_config (RpmostreedDaemon *self,
    * follow-up requests are more responsive */
   guint64 idle_exit_timeout = get_config_uint64 (config, "IdleExitTimeout", 60);
 
+  /* off by default, since it's only useful when investigating slow transactions */
+  gboolean profile_transactions = get_config_boolean (config, "ProfileTransactions", FALSE);
+
+  /* 0 means one worker per processor, like for composes */
+  guint64 relabel_concurrency = get_config_uint64 (config, "RelabelConcurrency", 0);
+  /* serial by default, like for composes */
+  guint64 checkout_concurrency = get_config_uint64 (config, "CheckoutConcurrency", 1);
+
   /* default to off for now; we will change it to "check" in a later release */
   RpmostreedAutomaticUpdatePolicy auto_update_policy =
     RPMOSTREED_AUTOMATIC_UPDATE_POLICY_NONE;
@@ -419,6 +460,9 @@ rpmostreed_daemon_reload_config (RpmostreedDaemon *self,
   /* don't update changed for this; it's contained to RpmostreedDaemon so no other objects
    * need to be reloaded if it changes */
   self->idle_exit_timeout = idle_exit_timeout;
+  self->relabel_concurrency = MIN (relabel_concurrency, G_MAXUINT);
+  self->checkout_concurrency = MIN (checkout_concurrency, G_MAXUINT);
+  rpmostreecxx::profile_set_enabled (profile_transactions);
 
   gboolean changed = FALSE;
 
@@ -71,4 +71,10 @@ gboolean           rpmostreed_daemon_reload_config  (RpmostreedDaemon *self,
 RpmostreedAutomaticUpdatePolicy
 rpmostreed_get_automatic_update_policy (RpmostreedDaemon *self);
 
+guint
+rpmostreed_get_relabel_concurrency (RpmostreedDaemon *self);
+
+guint
+rpmostreed_get_checkout_concurrency (RpmostreedDaemon *self);
+
 G_END_DECLS
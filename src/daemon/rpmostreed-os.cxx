@@ -43,6 +43,7 @@ struct _RpmostreedOS
   RPMOSTreeOSSkeleton parent_instance;
   gboolean on_session_bus;
   guint signal_id;
+  guint cached_update_signal_id;
 };
 
 struct _RpmostreedOSClass
@@ -83,6 +84,25 @@ sysroot_changed (RpmostreedSysroot *sysroot,
     g_warning ("%s", local_error->message);
 }
 
+static gboolean
+refresh_cached_update (RpmostreedOS*, GError **error);
+
+/* Only the cached update file changed; no need to regenerate the deployments */
+static void
+cached_update_changed (RpmostreedSysroot *sysroot,
+                       gpointer user_data)
+{
+  RpmostreedOS *self = RPMOSTREED_OS (user_data);
+  g_autoptr(GError) local_error = NULL;
+
+  if (!refresh_cached_update (self, &local_error))
+    {
+      g_warning ("%s", local_error->message);
+      return;
+    }
+  g_dbus_interface_skeleton_flush (G_DBUS_INTERFACE_SKELETON (self));
+}
+
 static gboolean
 os_authorize_method (GDBusInterfaceSkeleton *interface,
                      GDBusMethodInvocation  *invocation)
@@ -275,8 +295,11 @@ os_dispose (GObject *object)
 
   if (self->signal_id > 0)
       g_signal_handler_disconnect (rpmostreed_sysroot_get (), self->signal_id);
+  if (self->cached_update_signal_id > 0)
+      g_signal_handler_disconnect (rpmostreed_sysroot_get (), self->cached_update_signal_id);
 
   self->signal_id = 0;
+  self->cached_update_signal_id = 0;
 
   G_OBJECT_CLASS (rpmostreed_os_parent_class)->dispose (object);
 }
@@ -289,6 +312,9 @@ os_constructed (GObject *object)
   self->signal_id = g_signal_connect (rpmostreed_sysroot_get (),
                                       "updated",
                                       G_CALLBACK (sysroot_changed), self);
+  self->cached_update_signal_id = g_signal_connect (rpmostreed_sysroot_get (),
+                                                    "cached-update-changed",
+                                                    G_CALLBACK (cached_update_changed), self);
   G_OBJECT_CLASS (rpmostreed_os_parent_class)->constructed (object);
 }
 
@@ -459,9 +485,6 @@ out:
   return TRUE;
 }
 
-static gboolean
-refresh_cached_update (RpmostreedOS*, GError **error);
-
 static void
 on_auto_update_done (RpmostreedTransaction *transaction, RpmostreedOS *self)
 {
@@ -1797,8 +1820,8 @@ rpmostreed_os_load_internals (RpmostreedOS *self, GError **error)
   const gchar *name = rpmostree_os_get_name (RPMOSTREE_OS (self));
   g_debug ("loading %s", name);
 
-  OstreeSysroot *ot_sysroot = rpmostreed_sysroot_get_root (rpmostreed_sysroot_get ());
-  OstreeRepo *ot_repo = rpmostreed_sysroot_get_repo (rpmostreed_sysroot_get ());
+  RpmostreedSysroot *sysroot = rpmostreed_sysroot_get ();
+  OstreeSysroot *ot_sysroot = rpmostreed_sysroot_get_root (sysroot);
 
   /* Booted */
   g_autofree gchar* booted_id = NULL;
@@ -1807,9 +1830,7 @@ rpmostreed_os_load_internals (RpmostreedOS *self, GError **error)
   if (booted_deployment && g_strcmp0 (ostree_deployment_get_osname (booted_deployment), name) == 0)
     {
       booted_variant =
-        g_variant_ref_sink (
-            rpmostreed_deployment_generate_variant (ot_sysroot, booted_deployment,
-                                                    booted_id, ot_repo, TRUE, error));
+        rpmostreed_sysroot_get_deployment_variant (sysroot, booted_deployment, booted_id, error);
       if (!booted_variant)
         return FALSE;
       auto bootedid_v = rpmostreecxx::deployment_generate_id(*booted_deployment);
@@ -1829,10 +1850,7 @@ rpmostreed_os_load_internals (RpmostreedOS *self, GError **error)
   if (pending_deployment)
     {
       default_variant =
-        g_variant_ref_sink (rpmostreed_deployment_generate_variant (ot_sysroot,
-                                                                    pending_deployment,
-                                                                    booted_id,
-                                                                    ot_repo, TRUE, error));
+        rpmostreed_sysroot_get_deployment_variant (sysroot, pending_deployment, booted_id, error);
       if (!default_variant)
         return FALSE;
     }
@@ -1840,17 +1858,16 @@ rpmostreed_os_load_internals (RpmostreedOS *self, GError **error)
     default_variant = g_variant_ref (booted_variant); /* Default to booted */
   rpmostree_os_set_default_deployment (RPMOSTREE_OS (self), default_variant);
 
-  GVariant *rollback_variant = NULL; /* Floating */
+  g_autoptr(GVariant) rollback_variant = NULL;
   if (rollback_deployment)
     {
       rollback_variant =
-        rpmostreed_deployment_generate_variant (ot_sysroot, rollback_deployment, booted_id,
-                                                ot_repo, TRUE, error);
+        rpmostreed_sysroot_get_deployment_variant (sysroot, rollback_deployment, booted_id, error);
       if (!rollback_variant)
         return FALSE;
     }
   else
-    rollback_variant = rpmostreed_deployment_generate_blank_variant ();
+    rollback_variant = g_variant_ref_sink (rpmostreed_deployment_generate_blank_variant ());
   rpmostree_os_set_rollback_deployment (RPMOSTREE_OS (self), rollback_variant);
 
   if (!refresh_cached_update (self, error))
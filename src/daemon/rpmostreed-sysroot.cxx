@@ -29,6 +29,9 @@
 #include "rpmostreed-errors.h"
 #include "rpmostreed-transaction.h"
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-origin.h"
+#include "rpmostree-core.h"
+#include "rpmostree-rpm-util.h"
 
 #include "rpmostree-output.h"
 
@@ -41,6 +44,10 @@
 
 /* Avoid clients leaking their bus connections keeping the transaction open */
 #define FORCE_CLOSE_TXN_TIMEOUT_SECS 30
+/* Coalesce bursts of repo changes, e.g. a pull updating several refs */
+#define REPO_CHANGED_DEBOUNCE_MSECS 500
+/* Warm sacks take a fair amount of memory; drop them if unused this long */
+#define SACK_CACHE_IDLE_SECS (5 * 60)
 
 static gboolean
 sysroot_reload_ostree_configs_and_deployments (RpmostreedSysroot *self,
@@ -79,6 +86,27 @@ struct _RpmostreedSysroot {
 
   GFileMonitor *monitor;
   guint sig_changed;
+  GFileMonitor *repo_monitor;
+  guint sig_repo_changed;
+  guint repo_changed_id;
+  GFileMonitor *cached_update_monitor;
+  guint sig_cached_update_changed;
+
+  /* Cache key (see deployment_variant_cache_key()) -> deployment a{sv} */
+  GHashTable *deployment_variants;
+  guint64 deployment_variant_hits;
+  guint64 deployment_variant_misses;
+
+  /* Warm sacks for read-only package queries, reused across transactions;
+   * see rpmostreed_sysroot_get_rpmmd_sack() and rpmostreed_sysroot_get_base_refsack().
+   * Transactions run in their own thread, hence the lock. */
+  GMutex sack_cache_lock;
+  char *rpmmd_sack_key;
+  DnfSack *rpmmd_sack;
+  char *base_rsack_commit;
+  RpmOstreeRefSack *base_rsack;
+  gint64 sack_cache_last_used; /* monotonic */
+  guint sack_cache_expiry_id;
 };
 
 struct _RpmostreedSysrootClass {
@@ -87,6 +115,7 @@ struct _RpmostreedSysrootClass {
 
 enum {
   UPDATED,
+  CACHED_UPDATE_CHANGED,
   NUM_SIGNALS
 };
 
@@ -232,6 +261,259 @@ handle_get_os (RPMOSTreeSysroot *object,
   return TRUE;
 }
 
+static void
+cache_key_append_stat (GString    *key,
+                       int         dfd,
+                       const char *path)
+{
+  struct stat stbuf;
+  if (fstatat (dfd, path, &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+    g_string_append_printf (key, ";%" G_GUINT64_FORMAT ".%ld.%ld", (guint64)stbuf.st_ino,
+                            (long)stbuf.st_mtim.tv_sec, (long)stbuf.st_mtim.tv_nsec);
+  else
+    g_string_append (key, ";-");
+}
+
+/* Generating a deployment's variant means loading its commits and layering
+ * info, and GPG verifying it; that only needs redoing when one of the inputs
+ * captured here changes, not e.g. on every unrelated pull into the repo.
+ */
+static char *
+deployment_variant_cache_key (RpmostreedSysroot *self,
+                              OstreeDeployment  *deployment,
+                              GError           **error)
+{
+  auto id = rpmostreecxx::deployment_generate_id (*deployment);
+  OstreeDeployment *booted = ostree_sysroot_get_booted_deployment (self->ot_sysroot);
+  g_autoptr(GString) key = g_string_new (id.c_str());
+  g_string_append_printf (key, ";%d;%d;%d;%d;%d", ostree_deployment_get_bootserial (deployment),
+                          ostree_deployment_is_staged (deployment),
+                          ostree_deployment_is_pinned (deployment),
+                          (int)ostree_deployment_get_unlocked (deployment),
+                          booted && ostree_deployment_equal (booted, deployment));
+
+  GKeyFile *origin_kf = ostree_deployment_get_origin (deployment);
+  g_autofree char *origin_data = origin_kf ? g_key_file_to_data (origin_kf, NULL, NULL) : NULL;
+  g_autofree char *origin_csum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, origin_data ?: "", -1);
+  g_string_append_printf (key, ";%s", origin_csum);
+
+  /* For ostree refspecs we also show the pending update, and the remote's GPG state */
+  g_autoptr(RpmOstreeOrigin) origin = rpmostree_origin_parse_deployment (deployment, error);
+  if (!origin)
+    return NULL;
+  RpmOstreeRefspecType refspec_type;
+  g_autofree char *refspec = rpmostree_origin_get_full_refspec (origin, &refspec_type);
+  if (refspec_type == RPMOSTREE_REFSPEC_TYPE_OSTREE)
+    {
+      g_autofree char *rev = NULL;
+      if (!ostree_repo_resolve_rev (self->repo, refspec, TRUE, &rev, error))
+        return NULL;
+      g_string_append_printf (key, ";%s", rev ?: "");
+
+      g_autofree char *remote = NULL;
+      if (!ostree_parse_refspec (refspec, &remote, NULL, error))
+        return NULL;
+      const int repo_dfd = ostree_repo_get_dfd (self->repo);
+      cache_key_append_stat (key, repo_dfd, "config");
+      cache_key_append_stat (key, AT_FDCWD, "/etc/ostree/remotes.d");
+      if (remote)
+        {
+          g_autofree char *keyring = g_strconcat (remote, ".trustedkeys.gpg", NULL);
+          cache_key_append_stat (key, repo_dfd, keyring);
+        }
+    }
+
+  return g_string_free (util::move_nullify (key), FALSE);
+}
+
+/* Return the variant for @deployment, reusing the one from the last reload
+ * if its cache key is unchanged; @new_cache receives the entry either way.
+ */
+static GVariant *
+sysroot_get_deployment_variant (RpmostreedSysroot *self,
+                                OstreeDeployment  *deployment,
+                                const char        *booted_id,
+                                GHashTable        *new_cache,
+                                GError           **error)
+{
+  g_autofree char *key = deployment_variant_cache_key (self, deployment, error);
+  if (!key)
+    return NULL;
+
+  auto cached = static_cast<GVariant*>(g_hash_table_lookup (self->deployment_variants, key));
+  g_autoptr(GVariant) variant = NULL;
+  if (cached)
+    {
+      self->deployment_variant_hits++;
+      /* Refresh the cheap bits which aren't part of the key, e.g. live state */
+      g_autoptr(GVariantDict) dict = g_variant_dict_new (cached);
+      g_variant_dict_remove (dict, "live-inprogress");
+      g_variant_dict_remove (dict, "live-replaced");
+      g_variant_dict_remove (dict, "finalization-locked");
+      rpmostreecxx::deployment_populate_variant (*self->ot_sysroot, *deployment, *dict);
+      variant = g_variant_ref_sink (g_variant_dict_end (dict));
+    }
+  else
+    {
+      self->deployment_variant_misses++;
+      variant = rpmostreed_deployment_generate_variant (self->ot_sysroot, deployment,
+                                                        booted_id, self->repo, TRUE, error);
+      if (!variant)
+        return NULL;
+      g_variant_ref_sink (variant);
+    }
+
+  g_hash_table_replace (new_cache, util::move_nullify (key), g_variant_ref (variant));
+  return util::move_nullify (variant);
+}
+
+/* Like rpmostreed_deployment_generate_variant() (with filtering), but served
+ * from the cache of the last reload where possible.
+ */
+GVariant *
+rpmostreed_sysroot_get_deployment_variant (RpmostreedSysroot *self,
+                                           OstreeDeployment  *deployment,
+                                           const char        *booted_id,
+                                           GError           **error)
+{
+  return sysroot_get_deployment_variant (self, deployment, booted_id,
+                                         self->deployment_variants, error);
+}
+
+/* Must be called with sack_cache_lock held */
+static void
+sysroot_clear_sack_cache_unlocked (RpmostreedSysroot *self)
+{
+  g_clear_pointer (&self->rpmmd_sack_key, g_free);
+  g_clear_object (&self->rpmmd_sack);
+  g_clear_pointer (&self->base_rsack_commit, g_free);
+  g_clear_pointer (&self->base_rsack, rpmostree_refsack_unref);
+}
+
+static void
+sysroot_clear_sack_cache (RpmostreedSysroot *self)
+{
+  g_mutex_lock (&self->sack_cache_lock);
+  sysroot_clear_sack_cache_unlocked (self);
+  g_mutex_unlock (&self->sack_cache_lock);
+}
+
+static gboolean
+on_sack_cache_expiry (gpointer user_data)
+{
+  auto self = static_cast<RpmostreedSysroot*>(user_data);
+  g_mutex_lock (&self->sack_cache_lock);
+  gint64 idle_usecs = g_get_monotonic_time () - self->sack_cache_last_used;
+  gboolean expired = idle_usecs >= SACK_CACHE_IDLE_SECS * G_USEC_PER_SEC;
+  if (expired)
+    {
+      sysroot_clear_sack_cache_unlocked (self);
+      self->sack_cache_expiry_id = 0;
+    }
+  g_mutex_unlock (&self->sack_cache_lock);
+  if (!expired)
+    return G_SOURCE_CONTINUE;
+  sd_journal_print (LOG_DEBUG, "Dropping idle warm sacks");
+  return G_SOURCE_REMOVE;
+}
+
+/* Note that the warm sacks are in use; they're dropped once they haven't
+ * been for SACK_CACHE_IDLE_SECS.  Must be called with sack_cache_lock held.
+ */
+static void
+sysroot_touch_sack_cache_unlocked (RpmostreedSysroot *self)
+{
+  self->sack_cache_last_used = g_get_monotonic_time ();
+  /* Just check periodically rather than rescheduling on every use */
+  if (self->sack_cache_expiry_id == 0)
+    self->sack_cache_expiry_id =
+      g_timeout_add_seconds (SACK_CACHE_IDLE_SECS / 5, on_sack_cache_expiry, self);
+}
+
+/* Return the rpm-md sack for @ctx, which must have been set up and have had
+ * rpmostree_context_fetch_rpmmd() called.  If the fetched metadata, @flags
+ * and @base_commit match the last call, the previously imported sack is
+ * returned instead of importing it again.  Only suitable for read-only
+ * queries, e.g. update checks; callers must not add packages or excludes.
+ */
+DnfSack *
+rpmostreed_sysroot_get_rpmmd_sack (RpmostreedSysroot        *self,
+                                   RpmOstreeContext         *ctx,
+                                   const char               *base_commit,
+                                   DnfContextSetupSackFlags  flags,
+                                   GCancellable             *cancellable,
+                                   GError                  **error)
+{
+  g_autofree char *rpmmd_checksum = NULL;
+  if (!rpmostree_context_get_rpmmd_checksum (ctx, &rpmmd_checksum, error))
+    return NULL;
+  g_autofree char *key = g_strdup_printf ("%s;%u;%s", base_commit, (guint)flags, rpmmd_checksum);
+
+  g_mutex_lock (&self->sack_cache_lock);
+  g_autoptr(DnfSack) sack = NULL;
+  if (g_strcmp0 (self->rpmmd_sack_key, key) == 0)
+    {
+      sack = (DnfSack*)g_object_ref (self->rpmmd_sack);
+      sysroot_touch_sack_cache_unlocked (self);
+    }
+  g_mutex_unlock (&self->sack_cache_lock);
+  if (sack)
+    {
+      sd_journal_print (LOG_DEBUG, "Reusing warm rpm-md sack");
+      return util::move_nullify (sack);
+    }
+
+  if (!rpmostree_context_import_rpmmd (ctx, flags, cancellable, error))
+    return NULL;
+  sack = (DnfSack*)g_object_ref (dnf_context_get_sack (rpmostree_context_get_dnf (ctx)));
+
+  g_mutex_lock (&self->sack_cache_lock);
+  g_free (self->rpmmd_sack_key);
+  self->rpmmd_sack_key = util::move_nullify (key);
+  g_clear_object (&self->rpmmd_sack);
+  self->rpmmd_sack = (DnfSack*)g_object_ref (sack);
+  sysroot_touch_sack_cache_unlocked (self);
+  g_mutex_unlock (&self->sack_cache_lock);
+
+  return util::move_nullify (sack);
+}
+
+/* Like rpmostree_get_refsack_for_commit(), but the sack for the last
+ * @commit requested is kept around.  Only suitable for read-only queries.
+ */
+RpmOstreeRefSack *
+rpmostreed_sysroot_get_base_refsack (RpmostreedSysroot *self,
+                                     OstreeRepo        *repo,
+                                     const char        *commit,
+                                     GCancellable      *cancellable,
+                                     GError           **error)
+{
+  g_mutex_lock (&self->sack_cache_lock);
+  RpmOstreeRefSack *rsack = NULL;
+  if (g_strcmp0 (self->base_rsack_commit, commit) == 0)
+    {
+      rsack = rpmostree_refsack_ref (self->base_rsack);
+      sysroot_touch_sack_cache_unlocked (self);
+    }
+  g_mutex_unlock (&self->sack_cache_lock);
+  if (rsack)
+    return rsack;
+
+  rsack = rpmostree_get_refsack_for_commit (repo, commit, cancellable, error);
+  if (!rsack)
+    return NULL;
+
+  g_mutex_lock (&self->sack_cache_lock);
+  g_free (self->base_rsack_commit);
+  self->base_rsack_commit = g_strdup (commit);
+  g_clear_pointer (&self->base_rsack, rpmostree_refsack_unref);
+  self->base_rsack = rpmostree_refsack_ref (rsack);
+  sysroot_touch_sack_cache_unlocked (self);
+  g_mutex_unlock (&self->sack_cache_lock);
+
+  return rsack;
+}
+
 static gboolean
 sysroot_populate_deployments_unlocked (RpmostreedSysroot *self,
                                        gboolean *out_changed,
@@ -284,13 +566,16 @@ sysroot_populate_deployments_unlocked (RpmostreedSysroot *self,
 
   /* Add deployment interfaces */
   g_autoptr(GPtrArray) deployments = ostree_sysroot_get_deployments (self->ot_sysroot);
+  /* Only entries for current deployments carry over */
+  g_autoptr(GHashTable) new_variants =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+  const guint64 prev_misses = self->deployment_variant_misses;
 
   for (guint i = 0; deployments != NULL && i < deployments->len; i++)
     {
       auto deployment = static_cast<OstreeDeployment *>(deployments->pdata[i]);
-      GVariant *variant =
-        rpmostreed_deployment_generate_variant (self->ot_sysroot, deployment,
-                                                booted_id, self->repo, TRUE, error);
+      g_autoptr(GVariant) variant =
+        sysroot_get_deployment_variant (self, deployment, booted_id, new_variants, error);
       if (!variant)
         return glnx_prefix_error (error, "Reading deployment %u", i);
 
@@ -328,12 +613,29 @@ sysroot_populate_deployments_unlocked (RpmostreedSysroot *self,
         }
     }
 
-  rpmostree_sysroot_set_deployments (RPMOSTREE_SYSROOT (self),
-                                     g_variant_builder_end (&builder));
+  /* Only notify (and make the OS interfaces reload) if something actually changed,
+   * rather than e.g. on every pull of an unrelated ref */
+  g_autoptr(GVariant) new_deployments = g_variant_ref_sink (g_variant_builder_end (&builder));
+  GVariant *old_deployments = rpmostree_sysroot_get_deployments (RPMOSTREE_SYSROOT (self));
+  const gboolean deployments_changed =
+    !old_deployments || !g_variant_equal (old_deployments, new_deployments);
+  if (deployments_changed)
+    {
+      rpmostree_sysroot_set_deployments (RPMOSTREE_SYSROOT (self), new_deployments);
+      /* The cached sacks may be for a base which is now gone */
+      sysroot_clear_sack_cache (self);
+    }
+  g_hash_table_unref (self->deployment_variants);
+  self->deployment_variants = util::move_nullify (new_variants);
+  sd_journal_send ("MESSAGE=Reloaded deployments; regenerated %u", (guint)(self->deployment_variant_misses - prev_misses),
+                   "PRIORITY=%d", LOG_DEBUG,
+                   "DEPLOYMENT_VARIANT_CACHE_HITS=%" G_GUINT64_FORMAT, self->deployment_variant_hits,
+                   "DEPLOYMENT_VARIANT_CACHE_MISSES=%" G_GUINT64_FORMAT, self->deployment_variant_misses,
+                   NULL);
   g_debug ("finished deployments");
 
   if (out_changed)
-    *out_changed = TRUE;
+    *out_changed = sysroot_changed || deployments_changed;
   return TRUE;
 }
 
@@ -501,6 +803,24 @@ sysroot_dispose (GObject *object)
         }
     }
 
+  if (self->repo_monitor)
+    {
+      g_signal_handler_disconnect (self->repo_monitor, self->sig_repo_changed);
+      self->sig_repo_changed = 0;
+      g_file_monitor_cancel (self->repo_monitor);
+    }
+  if (self->repo_changed_id > 0)
+    {
+      g_source_remove (self->repo_changed_id);
+      self->repo_changed_id = 0;
+    }
+  if (self->cached_update_monitor)
+    {
+      g_signal_handler_disconnect (self->cached_update_monitor, self->sig_cached_update_changed);
+      self->sig_cached_update_changed = 0;
+      g_file_monitor_cancel (self->cached_update_monitor);
+    }
+
   /* Tracked os paths are responsible to unpublish themselves */
   GLNX_HASH_TABLE_FOREACH_KV (self->os_interfaces, const char*, k, GObject*, value)
     g_object_run_dispose (value);
@@ -521,8 +841,15 @@ sysroot_finalize (GObject *object)
 
   g_hash_table_unref (self->os_interfaces);
   g_hash_table_unref (self->osexperimental_interfaces);
+  g_hash_table_unref (self->deployment_variants);
+  if (self->sack_cache_expiry_id > 0)
+    g_source_remove (self->sack_cache_expiry_id);
+  sysroot_clear_sack_cache (self);
+  g_mutex_clear (&self->sack_cache_lock);
 
   g_clear_object (&self->monitor);
+  g_clear_object (&self->repo_monitor);
+  g_clear_object (&self->cached_update_monitor);
 
   rpmostree_output_set_callback (NULL, NULL);
 
@@ -539,6 +866,9 @@ rpmostreed_sysroot_init (RpmostreedSysroot *self)
                                                (GDestroyNotify) g_object_unref);
   self->osexperimental_interfaces = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
                                                            (GDestroyNotify) g_object_unref);
+  self->deployment_variants = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                     (GDestroyNotify) g_variant_unref);
+  g_mutex_init (&self->sack_cache_lock);
 
   self->monitor = NULL;
 
@@ -663,6 +993,14 @@ rpmostreed_sysroot_class_init (RpmostreedSysrootClass *klass)
                                    NULL, NULL, NULL,
                                    G_TYPE_NONE, 0);
 
+  /* Emitted when only the cached update file changed; see rpmostreed-os.cxx */
+  signals[CACHED_UPDATE_CHANGED] = g_signal_new ("cached-update-changed",
+                                                 RPMOSTREED_TYPE_SYSROOT,
+                                                 G_SIGNAL_RUN_LAST,
+                                                 0,
+                                                 NULL, NULL, NULL,
+                                                 G_TYPE_NONE, 0);
+
   gdbus_interface_skeleton_class = G_DBUS_INTERFACE_SKELETON_CLASS (klass);
   gdbus_interface_skeleton_class->g_authorize_method = sysroot_authorize_method;
 }
@@ -718,6 +1056,72 @@ on_deploy_changed (GFileMonitor *monitor,
     sd_journal_print (LOG_ERR, "Unable to update state: %s", error->message);
 }
 
+static gboolean
+on_repo_changed_debounced (gpointer user_data)
+{
+  RpmostreedSysroot *self = RPMOSTREED_SYSROOT (user_data);
+  g_autoptr(GError) local_error = NULL;
+
+  self->repo_changed_id = 0;
+  /* See below; a transaction may have started in the meantime */
+  if (self->transaction)
+    return G_SOURCE_REMOVE;
+
+  if (!sysroot_reload_ostree_configs_and_deployments (self, NULL, &local_error))
+    sd_journal_print (LOG_ERR, "Unable to update state: %s", local_error->message);
+  return G_SOURCE_REMOVE;
+}
+
+/* ostree bumps the repo mtime whenever refs change; thanks to the deployment
+ * variant cache, this only regenerates the deployments tracking a changed ref.
+ */
+static void
+on_repo_changed (GFileMonitor *monitor,
+                 GFile *file,
+                 GFile *other_file,
+                 GFileMonitorEvent event_type,
+                 gpointer user_data)
+{
+  RpmostreedSysroot *self = RPMOSTREED_SYSROOT (user_data);
+
+  /* Only the repo dir itself; not e.g. its tmp/ churning during a pull */
+  if (event_type != G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED ||
+      !g_file_equal (file, g_file_monitor_get_file (monitor)))
+    return;
+
+  /* Changes made by our own transactions are picked up by the reload when
+   * they complete */
+  if (self->transaction)
+    return;
+
+  if (self->repo_changed_id > 0)
+    g_source_remove (self->repo_changed_id);
+  self->repo_changed_id =
+    g_timeout_add (REPO_CHANGED_DEBOUNCE_MSECS, on_repo_changed_debounced, self);
+}
+
+static void
+on_cached_update_changed (GFileMonitor *monitor,
+                          GFile *file,
+                          GFile *other_file,
+                          GFileMonitorEvent event_type,
+                          gpointer user_data)
+{
+  RpmostreedSysroot *self = RPMOSTREED_SYSROOT (user_data);
+
+  switch (event_type)
+    {
+    case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+    case G_FILE_MONITOR_EVENT_DELETED:
+    case G_FILE_MONITOR_EVENT_MOVED_IN:
+    case G_FILE_MONITOR_EVENT_RENAMED:
+      g_signal_emit (self, signals[CACHED_UPDATE_CHANGED], 0);
+      break;
+    default:
+      break;
+    }
+}
+
 static void
 rpmostreed_sysroot_iface_init (RPMOSTreeSysrootIface *iface)
 {
@@ -782,6 +1186,28 @@ rpmostreed_sysroot_populate (RpmostreedSysroot *self,
                                             self);
     }
 
+  if (self->repo_monitor == NULL)
+    {
+      GFile *repo_path = ostree_repo_get_path (self->repo);
+      self->repo_monitor = g_file_monitor_directory (repo_path, G_FILE_MONITOR_NONE, NULL, error);
+      if (self->repo_monitor == NULL)
+        return FALSE;
+      self->sig_repo_changed = g_signal_connect (self->repo_monitor, "changed",
+                                                 G_CALLBACK (on_repo_changed), self);
+    }
+
+  if (self->cached_update_monitor == NULL)
+    {
+      g_autoptr(GFile) cached_update = g_file_new_for_path (RPMOSTREE_AUTOUPDATES_CACHE_FILE);
+      self->cached_update_monitor = g_file_monitor_file (cached_update, G_FILE_MONITOR_WATCH_MOVES,
+                                                         NULL, error);
+      if (self->cached_update_monitor == NULL)
+        return FALSE;
+      self->sig_cached_update_changed =
+        g_signal_connect (self->cached_update_monitor, "changed",
+                          G_CALLBACK (on_cached_update_changed), self);
+    }
+
   return TRUE;
 }
 
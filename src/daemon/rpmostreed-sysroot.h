@@ -20,6 +20,8 @@
 
 #include "ostree.h"
 #include "rpmostreed-types.h"
+#include "rpmostree-core.h"
+#include "rpmostree-refsack.h"
 #include <polkit/polkit.h>
 
 G_BEGIN_DECLS
@@ -45,6 +47,23 @@ OstreeRepo *        rpmostreed_sysroot_get_repo         (RpmostreedSysroot *self
 PolkitAuthority *   rpmostreed_sysroot_get_polkit_authority (RpmostreedSysroot *self);
 gboolean            rpmostreed_sysroot_is_on_session_bus    (RpmostreedSysroot *self);
 
+GVariant *          rpmostreed_sysroot_get_deployment_variant (RpmostreedSysroot *self,
+                                                               OstreeDeployment  *deployment,
+                                                               const char        *booted_id,
+                                                               GError           **error);
+
+DnfSack *           rpmostreed_sysroot_get_rpmmd_sack   (RpmostreedSysroot        *self,
+                                                         RpmOstreeContext         *ctx,
+                                                         const char               *base_commit,
+                                                         DnfContextSetupSackFlags  flags,
+                                                         GCancellable             *cancellable,
+                                                         GError                  **error);
+RpmOstreeRefSack *  rpmostreed_sysroot_get_base_refsack (RpmostreedSysroot *self,
+                                                         OstreeRepo        *repo,
+                                                         const char        *commit,
+                                                         GCancellable      *cancellable,
+                                                         GError           **error);
+
 gboolean            rpmostreed_sysroot_load_state       (RpmostreedSysroot *self,
                                                          GCancellable *cancellable,
                                                          OstreeSysroot **out_sysroot,
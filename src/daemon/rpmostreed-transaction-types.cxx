@@ -655,7 +655,7 @@ import_local_rpm (OstreeRepo    *repo,
   if (policy == NULL)
     return FALSE;
 
-  g_autoptr(RpmOstreeImporter) unpacker = rpmostree_importer_new_take_fd (fd, repo, NULL, static_cast<RpmOstreeImporterFlags>(0), policy, error);
+  g_autoptr(RpmOstreeImporter) unpacker = rpmostree_importer_new_take_fd (fd, repo, NULL, static_cast<RpmOstreeImporterFlags>(0), policy, 1, error);
   if (unpacker == NULL)
     return FALSE;
 
@@ -759,8 +759,6 @@ get_sack_for_booted (OstreeSysroot    *sysroot,
   if (!rpmostree_context_setup (ctx, NULL, source_root, cancellable, error))
     return FALSE;
 
-  DnfContext *dnfctx = rpmostree_context_get_dnf (ctx);
-
   /* we always want to force a refetch of the metadata */
   rpmostree_context_set_dnf_caching (ctx, RPMOSTREE_CONTEXT_DNF_CACHE_NEVER);
 
@@ -768,14 +766,17 @@ get_sack_for_booted (OstreeSysroot    *sysroot,
   rpmostree_context_configure_from_deployment (ctx, sysroot, booted_deployment);
 
   /* streamline: we don't need rpmdb or filelists, but we *do* need updateinfo */
-  if (!rpmostree_context_download_metadata (ctx,
-        (DnfContextSetupSackFlags)(DNF_CONTEXT_SETUP_SACK_FLAG_SKIP_RPMDB |
-        DNF_CONTEXT_SETUP_SACK_FLAG_SKIP_FILELISTS |
-        DNF_CONTEXT_SETUP_SACK_FLAG_LOAD_UPDATEINFO), cancellable, error))
+  auto flags = (DnfContextSetupSackFlags)(DNF_CONTEXT_SETUP_SACK_FLAG_SKIP_RPMDB |
+                                          DNF_CONTEXT_SETUP_SACK_FLAG_SKIP_FILELISTS |
+                                          DNF_CONTEXT_SETUP_SACK_FLAG_LOAD_UPDATEINFO);
+  if (!rpmostree_context_fetch_rpmmd (ctx, flags, cancellable, error))
     return FALSE;
 
-  *out_sack = (DnfSack*)g_object_ref (dnf_context_get_sack (dnfctx));
-  return TRUE;
+  /* If the rpm-md didn't change since the last check, reuse the sack we imported then */
+  *out_sack = rpmostreed_sysroot_get_rpmmd_sack (rpmostreed_sysroot_get (), ctx,
+                                                 ostree_deployment_get_csum (booted_deployment),
+                                                 flags, cancellable, error);
+  return *out_sack != NULL;
 }
 
 static gboolean
@@ -1170,7 +1171,8 @@ deploy_transaction_execute (RpmostreedTransaction *transaction,
       if (!base_rsack)
         {
           const char *base = rpmostree_sysroot_upgrader_get_base (upgrader);
-          base_rsack = rpmostree_get_refsack_for_commit (repo, base, cancellable, error);
+          base_rsack = rpmostreed_sysroot_get_base_refsack (rpmostreed_sysroot_get (), repo, base,
+                                                            cancellable, error);
           if (base_rsack == NULL)
             return FALSE;
         }
@@ -1401,7 +1403,8 @@ deploy_transaction_execute (RpmostreedTransaction *transaction,
       if (!base_rsack)
         {
           const char *base = rpmostree_sysroot_upgrader_get_base (upgrader);
-          base_rsack = rpmostree_get_refsack_for_commit (repo, base, cancellable, error);
+          base_rsack = rpmostreed_sysroot_get_base_refsack (rpmostreed_sysroot_get (), repo, base,
+                                                            cancellable, error);
           if (base_rsack == NULL)
             return FALSE;
         }
@@ -2251,6 +2254,8 @@ cleanup_transaction_execute (RpmostreedTransaction *transaction,
     {
       if (!rpmostree_syscore_cleanup (sysroot, repo, cancellable, error))
         return FALSE;
+      /* An explicit cleanup also drops caches which are still in use */
+      rpmostreecxx::repo_caches_cleanup (*repo, true);
     }
   if (self->flags & RPMOSTREE_TRANSACTION_CLEANUP_REPOMD)
     {
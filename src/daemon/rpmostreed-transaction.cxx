@@ -28,6 +28,7 @@
 #include "rpmostreed-errors.h"
 #include "rpmostreed-sysroot.h"
 #include "rpmostreed-daemon.h"
+#include "rpmostree-cxxrs.h"
 
 struct _RpmostreedTransactionPrivate {
   GDBusMethodInvocation *invocation;
@@ -340,14 +341,19 @@ transaction_execute_thread (GTask *task,
    */
   g_main_context_push_thread_default (mctx);
 
+  const char *method_name = g_dbus_method_invocation_get_method_name (priv->invocation);
   if (clazz->execute != NULL)
     {
+      auto span = rpmostreecxx::profile_span_begin(method_name);
       try {
         success = clazz->execute (self, cancellable, &local_error);
       } catch (std::exception& e) {
         success = glnx_throw (&local_error, "%s", e.what());
       }
+      span->end();
     }
+  /* If ProfileTransactions= is enabled, log where the time went */
+  rpmostreecxx::profile_journal_log(method_name);
 
   if (local_error != NULL)
     {
@@ -50,6 +50,8 @@ struct _RpmOstreeContext {
   gboolean unprivileged;
   OstreeSePolicy *sepolicy;
   char *passwd_dir;
+  guint relabel_concurrency; /* 0 means the default */
+  guint checkout_concurrency; /* 0 means the default */
 
   guint async_index; /* Offset into array if applicable */
   guint n_async_running;
@@ -61,10 +63,24 @@ struct _RpmOstreeContext {
   GPtrArray *pkgs; /* All packages */
   GPtrArray *pkgs_to_download;
   GPtrArray *pkgs_to_import;
+  GPtrArray *pkgs_ready_to_import; /* Subset of pkgs_to_import available locally */
   guint n_async_pkgs_imported;
+  GPtrArray *async_download_batches; /* Pipelined mode: queue of DownloadBatch */
+  guint async_download_index;
+  gboolean async_downloading;
+  guint n_async_pkgs_downloaded;
+  gint64 async_start_time;
+  guint64 async_bytes_imported;
+  guint64 async_busy_usec; /* Summed across importer threads */
   GPtrArray *pkgs_to_relabel;
   guint n_async_pkgs_relabeled;
 
+  GHashTable *pkgcache_refs;  /* cache branch --> commit; see find_pkg_in_ostree() */
+  GHashTable *pkgcache_index; /* cache branch --> GVariant (sssb) */
+  gboolean pkgcache_index_dirty;
+
+  GHashTable *rpmmd_updated_repos; /* DnfRepo set; see rpmostree_context_fetch_rpmmd() */
+
   GHashTable *pkgs_to_remove;  /* pkgname --> gv_nevra */
   GHashTable *pkgs_to_replace; /* new gv_nevra --> old gv_nevra */
 
@@ -76,6 +92,8 @@ struct _RpmOstreeContext {
   gboolean kernel_changed;
 
   int tmprootfs_dfd; /* Borrowed */
+  char *sparse_base_commit; /* If set, tmprootfs is a sparse checkout of this */
+  GPtrArray *sparse_skipped; /* Directories of sparse_base_commit not checked out */
   GHashTable *rootfs_usrlinks;
   GLnxTmpDir repo_tmpdir; /* Used to assemble+commit if no base rootfs provided */
 };
@@ -107,8 +107,14 @@ rpmostree_context_finalize (GObject *object)
   g_clear_pointer (&rctx->pkgs, g_ptr_array_unref);
   g_clear_pointer (&rctx->pkgs_to_download, g_ptr_array_unref);
   g_clear_pointer (&rctx->pkgs_to_import, g_ptr_array_unref);
+  g_clear_pointer (&rctx->pkgs_ready_to_import, g_ptr_array_unref);
+  g_clear_pointer (&rctx->async_download_batches, g_ptr_array_unref);
   g_clear_pointer (&rctx->pkgs_to_relabel, g_ptr_array_unref);
 
+  g_clear_pointer (&rctx->pkgcache_refs, g_hash_table_unref);
+  g_clear_pointer (&rctx->pkgcache_index, g_hash_table_unref);
+
+  g_clear_pointer (&rctx->rpmmd_updated_repos, g_hash_table_unref);
   g_clear_pointer (&rctx->pkgs_to_remove, g_hash_table_unref);
   g_clear_pointer (&rctx->pkgs_to_replace, g_hash_table_unref);
 
@@ -116,6 +122,8 @@ rpmostree_context_finalize (GObject *object)
   (void)glnx_tmpdir_delete (&rctx->repo_tmpdir, NULL, NULL);
 
   g_clear_pointer (&rctx->rootfs_usrlinks, g_hash_table_unref);
+  g_free (rctx->sparse_base_commit);
+  g_clear_pointer (&rctx->sparse_skipped, g_ptr_array_unref);
 
   G_OBJECT_CLASS (rpmostree_context_parent_class)->finalize (object);
 }
@@ -361,6 +369,24 @@ rpmostree_context_set_sepolicy (RpmOstreeContext *self,
   g_set_object (&self->sepolicy, sepolicy);
 }
 
+/* Number of relabeling workers when the treefile doesn't say; this is how
+ * the daemon applies its RelabelConcurrency= setting.  0 means the default.
+ */
+void
+rpmostree_context_set_relabel_concurrency (RpmOstreeContext *self,
+                                           guint             n_workers)
+{
+  self->relabel_concurrency = n_workers;
+}
+
+/* Likewise for CheckoutConcurrency= */
+void
+rpmostree_context_set_checkout_concurrency (RpmOstreeContext *self,
+                                            guint             n_workers)
+{
+  self->checkout_concurrency = n_workers;
+}
+
 void
 rpmostree_context_set_devino_cache (RpmOstreeContext *self,
                                     OstreeRepoDevInoCache *devino_cache)
@@ -863,12 +889,294 @@ checkout_pkg_metadata_by_nevra (RpmOstreeContext *self,
   return checkout_pkg_metadata (self, nevra, header, cancellable, error);
 }
 
-/* Initiate download of rpm-md */
+/* Begin a profiling span for @pkg in @phase; the name is only formatted if
+ * profiling is enabled, as this is called for every package.
+ */
+static rust::Box<rpmostreecxx::ProfileSpan>
+profile_pkg_span_begin (const char *phase,
+                        DnfPackage *pkg)
+{
+  if (!rpmostreecxx::profile_is_enabled ())
+    return rpmostreecxx::profile_span_begin ("");
+  g_autofree char *name = g_strdup_printf ("%s:%s", phase, dnf_package_get_name (pkg));
+  return rpmostreecxx::profile_span_begin (name);
+}
+
+/* Number of workers to use for a parallelized phase; this is the treefile's
+ * `concurrency` entry for @phase if set (or for relabeling and checkouts, the
+ * value from rpmostree_context_set_{relabel,checkout}_concurrency()), and
+ * otherwise the phase's default: rpm-md fetches are mostly network bound, so
+ * we refresh a few repos at a time, relabeling is CPU bound, and %post scripts
+ * and package checkouts are serial unless opted into.
+ */
+static guint
+get_concurrency (RpmOstreeContext               *self,
+                 rpmostreecxx::ConcurrencyPhase  phase)
+{
+  guint n = self->treefile_rs ? self->treefile_rs->get_concurrency (phase) : 0;
+  if (n > 0)
+    return n;
+  switch (phase)
+    {
+    case rpmostreecxx::ConcurrencyPhase::RpmmdRefresh:
+      return 4;
+    case rpmostreecxx::ConcurrencyPhase::Relabel:
+      return self->relabel_concurrency ?: g_get_num_processors ();
+    case rpmostreecxx::ConcurrencyPhase::Checkout:
+      return self->checkout_concurrency ?: 1;
+    default:
+      return 1;
+    }
+}
+
+/* Create a DnfContext configured like @src for use by an rpm-md refresh
+ * worker.  libdnf doesn't document DnfContext (or the DnfRepo objects it
+ * owns) as safe to use from several threads at once, so each worker updates
+ * its repos through its own context.  Must be called from the main thread.
+ */
+static DnfContext *
+new_rpmmd_refresh_context (DnfContext    *src,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  g_autoptr(DnfContext) ctx = dnf_context_new ();
+  dnf_context_set_http_proxy (ctx, dnf_context_get_http_proxy (src));
+  dnf_context_set_repo_dir (ctx, dnf_context_get_repo_dir (src));
+  dnf_context_set_cache_dir (ctx, dnf_context_get_cache_dir (src));
+  dnf_context_set_solv_dir (ctx, dnf_context_get_solv_dir (src));
+  dnf_context_set_lock_dir (ctx, dnf_context_get_lock_dir (src));
+  dnf_context_set_user_agent (ctx, dnf_context_get_user_agent (src));
+  dnf_context_set_release_ver (ctx, dnf_context_get_release_ver (src));
+  dnf_context_set_install_root (ctx, dnf_context_get_install_root (src));
+  dnf_context_set_source_root (ctx, dnf_context_get_source_root (src));
+  dnf_context_set_keep_cache (ctx, dnf_context_get_keep_cache (src));
+  /* These determine which metadata files get downloaded */
+  dnf_context_set_enable_filelists (ctx, dnf_context_get_enable_filelists (src));
+  dnf_context_set_zchunk (ctx, dnf_context_get_zchunk (src));
+  dnf_context_set_write_history (ctx, FALSE);
+  dnf_context_set_check_disk_space (ctx, FALSE);
+  dnf_context_set_check_transaction (ctx, FALSE);
+  dnf_context_set_plugins_dir (ctx, NULL);
+
+  DECLARE_RPMSIGHANDLER_RESET;
+  if (!dnf_context_setup (ctx, cancellable, error))
+    return (DnfContext*)glnx_prefix_error_null (error, "Setting up rpm-md refresh context");
+  /* Load the .repo files now rather than lazily from the worker */
+  (void) dnf_context_get_repos (ctx);
+  return util::move_nullify (ctx);
+}
+
+struct RpmMdRefreshScheduler;
+
+typedef struct {
+  DnfRepo *repo;
+  struct RpmMdRefreshScheduler *sched;
+  gboolean started;
+  gboolean done;
+  guint percentage;
+} RpmMdRefreshJob;
+
+struct RpmMdRefreshScheduler {
+  GArray *jobs;
+  guint next_job;
+  GMutex lock;
+  GCond cond;
+  GError *error;
+  GCancellable *cancellable;
+};
+
+typedef struct {
+  struct RpmMdRefreshScheduler *sched;
+  DnfContext *dnfctx; /* Owned by this worker */
+} RpmMdRefreshWorker;
+
+static void
+on_rpmmd_refresh_percentage_changed (DnfState   *hifstate,
+                                     guint       percentage,
+                                     gpointer    user_data)
+{
+  auto job = static_cast<RpmMdRefreshJob*>(user_data);
+  g_mutex_lock (&job->sched->lock);
+  job->percentage = percentage;
+  g_cond_broadcast (&job->sched->cond);
+  g_mutex_unlock (&job->sched->lock);
+}
+
+static DnfRepo *
+find_repo_by_id (DnfContext *dnfctx,
+                 const char *id)
+{
+  GPtrArray *repos = dnf_context_get_repos (dnfctx);
+  for (guint i = 0; i < repos->len; i++)
+    {
+      auto repo = static_cast<DnfRepo*>(repos->pdata[i]);
+      if (g_str_equal (dnf_repo_get_id (repo), id))
+        return repo;
+    }
+  return NULL;
+}
+
+static gpointer
+rpmmd_refresh_worker (gpointer data)
+{
+  auto worker = static_cast<RpmMdRefreshWorker*>(data);
+  auto sched = worker->sched;
+
+  g_mutex_lock (&sched->lock);
+  while (sched->next_job < sched->jobs->len && !sched->error)
+    {
+      auto job = &g_array_index (sched->jobs, RpmMdRefreshJob, sched->next_job++);
+      job->started = TRUE;
+      const char *id = dnf_repo_get_id (job->repo);
+      g_mutex_unlock (&sched->lock);
+
+      g_autoptr(GError) local_error = NULL;
+      DnfRepo *repo = find_repo_by_id (worker->dnfctx, id);
+      if (!repo)
+        glnx_throw (&local_error, "Couldn't find rpm-md repo '%s'", id);
+      else if (!g_cancellable_set_error_if_cancelled (sched->cancellable, &local_error))
+        {
+          g_autoptr(DnfState) hifstate = dnf_state_new ();
+          dnf_state_set_cancellable (hifstate, sched->cancellable);
+          guint progress_sigid = g_signal_connect (hifstate, "percentage-changed",
+                                                   G_CALLBACK (on_rpmmd_refresh_percentage_changed),
+                                                   job);
+          if (!dnf_repo_update (repo, DNF_REPO_UPDATE_FLAG_FORCE, hifstate, &local_error))
+            g_prefix_error (&local_error, "Updating rpm-md repo '%s': ", id);
+          g_signal_handler_disconnect (hifstate, progress_sigid);
+        }
+
+      g_mutex_lock (&sched->lock);
+      job->done = TRUE;
+      if (local_error && !sched->error)
+        sched->error = util::move_nullify (local_error);
+      g_cond_broadcast (&sched->cond);
+    }
+  g_mutex_unlock (&sched->lock);
+
+  return NULL;
+}
+
+/* Check each of @rpmmd_repos, and update those whose metadata is older than
+ * @cache_age.  The checks only read the local cache and run here; the
+ * updates run on at most @concurrency worker threads, each with its own
+ * DnfContext (see new_rpmmd_refresh_context()), after which the original
+ * repos are checked again to load the new metadata.  Progress is still
+ * reported one repo at a time in order, which keeps the output the same as
+ * a serial refresh; later repos keep downloading in the meantime.  Updated
+ * repos are added to @updated_repos.
+ */
+static gboolean
+refresh_rpmmd_repos (DnfContext    *dnfctx,
+                     GPtrArray     *rpmmd_repos,
+                     guint          cache_age,
+                     guint          concurrency,
+                     GHashTable    *updated_repos,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  g_autoptr(GArray) jobs = g_array_new (FALSE, TRUE, sizeof (RpmMdRefreshJob));
+  RpmMdRefreshScheduler sched = { jobs, };
+  sched.cancellable = cancellable;
+  for (guint i = 0; i < rpmmd_repos->len; i++)
+    {
+      auto repo = static_cast<DnfRepo *>(rpmmd_repos->pdata[i]);
+      /* Until libdnf speaks GCancellable: https://github.com/projectatomic/rpm-ostree/issues/897 */
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+      g_autoptr(DnfState) hifstate = dnf_state_new ();
+      if (dnf_repo_check (repo, cache_age, hifstate, NULL))
+        continue;
+      RpmMdRefreshJob job = { repo, &sched, };
+      g_array_append_val (jobs, job);
+    }
+  if (jobs->len == 0)
+    return TRUE;
+
+  const guint n_workers = MIN (concurrency, jobs->len);
+  g_autofree RpmMdRefreshWorker *worker_data = g_new0 (RpmMdRefreshWorker, n_workers);
+  for (guint i = 0; i < n_workers; i++)
+    {
+      worker_data[i].sched = &sched;
+      worker_data[i].dnfctx = new_rpmmd_refresh_context (dnfctx, cancellable, error);
+      if (!worker_data[i].dnfctx)
+        {
+          for (guint j = 0; j < i; j++)
+            g_object_unref (worker_data[j].dnfctx);
+          return FALSE;
+        }
+    }
+
+  g_mutex_init (&sched.lock);
+  g_cond_init (&sched.cond);
+  g_autoptr(GPtrArray) workers = g_ptr_array_new ();
+  for (guint i = 0; i < n_workers; i++)
+    g_ptr_array_add (workers, g_thread_new ("rpmmd-refresh", rpmmd_refresh_worker, &worker_data[i]));
+
+  g_mutex_lock (&sched.lock);
+  for (guint i = 0; i < jobs->len && !sched.error; i++)
+    {
+      auto job = &g_array_index (jobs, RpmMdRefreshJob, i);
+      g_autofree char *msg = g_strdup_printf ("Updating metadata for '%s'", dnf_repo_get_id (job->repo));
+      g_mutex_unlock (&sched.lock);
+      auto progress = rpmostreecxx::progress_percent_begin(msg);
+      g_mutex_lock (&sched.lock);
+      guint last_percentage = 0;
+      /* Jobs after a failure never start */
+      while (!job->done && !(sched.error && !job->started))
+        {
+          if (job->percentage != last_percentage)
+            {
+              last_percentage = job->percentage;
+              g_mutex_unlock (&sched.lock);
+              progress->percent_update(last_percentage);
+              g_mutex_lock (&sched.lock);
+              continue;
+            }
+          g_cond_wait (&sched.cond, &sched.lock);
+        }
+      g_mutex_unlock (&sched.lock);
+      progress->end("");
+      g_mutex_lock (&sched.lock);
+    }
+  g_mutex_unlock (&sched.lock);
+
+  for (guint i = 0; i < workers->len; i++)
+    g_thread_join (static_cast<GThread*>(workers->pdata[i]));
+  for (guint i = 0; i < n_workers; i++)
+    g_object_unref (worker_data[i].dnfctx);
+  g_mutex_clear (&sched.lock);
+  g_cond_clear (&sched.cond);
+
+  if (sched.error)
+    {
+      g_propagate_error (error, sched.error);
+      return FALSE;
+    }
+
+  for (guint i = 0; i < jobs->len; i++)
+    {
+      auto job = &g_array_index (jobs, RpmMdRefreshJob, i);
+      g_autoptr(DnfState) hifstate = dnf_state_new ();
+      if (!dnf_repo_check (job->repo, G_MAXUINT, hifstate, error))
+        return glnx_prefix_error (error, "Loading updated rpm-md repo '%s'", dnf_repo_get_id (job->repo));
+      g_hash_table_add (updated_repos, job->repo);
+    }
+
+  return TRUE;
+}
+
+/* Check the enabled rpm-md repos, and download new metadata for those which
+ * are out of date per the context's caching policy.  This is the first half
+ * of rpmostree_context_download_metadata(); callers which can reuse an
+ * already imported sack (see rpmostree_context_get_rpmmd_checksum()) can stop
+ * here, and otherwise must follow up with rpmostree_context_import_rpmmd().
+ */
 gboolean
-rpmostree_context_download_metadata (RpmOstreeContext *self,
-                                     DnfContextSetupSackFlags flags,
-                                     GCancellable     *cancellable,
-                                     GError          **error)
+rpmostree_context_fetch_rpmmd (RpmOstreeContext *self,
+                               DnfContextSetupSackFlags flags,
+                               GCancellable     *cancellable,
+                               GError          **error)
 {
   g_assert (!self->empty);
 
@@ -881,16 +1189,13 @@ rpmostree_context_download_metadata (RpmOstreeContext *self,
   g_autoptr(GPtrArray) rpmmd_repos =
     rpmostree_get_enabled_rpmmd_repos (self->dnfctx, DNF_REPO_ENABLED_PACKAGES);
 
+  g_clear_pointer (&self->rpmmd_updated_repos, g_hash_table_unref);
+  self->rpmmd_updated_repos = g_hash_table_new (NULL, NULL);
+
   if (self->pkgcache_only)
     {
       /* we already disabled all the repos in setup */
       g_assert_cmpint (rpmmd_repos->len, ==, 0);
-
-      /* this is essentially a no-op */
-      g_autoptr(DnfState) hifstate = dnf_state_new ();
-      if (!dnf_context_setup_sack_with_flags (self->dnfctx, hifstate, flags, error))
-        return FALSE;
-
       /* Note early return; no repos to fetch. */
       return TRUE;
     }
@@ -911,57 +1216,113 @@ rpmostree_context_download_metadata (RpmOstreeContext *self,
     }
   rpmostree_output_message ("%s", enabled_repos->str);
 
-  g_autoptr(GHashTable) updated_repos = g_hash_table_new (NULL, NULL);
-  /* Update each repo individually, and print its timestamp, so users can keep
-   * track of repo up-to-dateness more easily.
+  /* For the cache_age bits, see https://github.com/projectatomic/rpm-ostree/pull/1562
+   * AKA a7bbf5bc142d9dac5b1bfb86d0466944d38baa24
+   * We have our own cache age as we want to default to G_MAXUINT so we
+   * respect the repo's metadata_expire if set.  But the compose tree path
+   * also sets this to 0 to force expiry.
    */
+  guint cache_age = G_MAXUINT-1;
+  switch (self->dnf_cache_policy)
+    {
+    case RPMOSTREE_CONTEXT_DNF_CACHE_FOREVER:
+      cache_age = G_MAXUINT;
+      break;
+    case RPMOSTREE_CONTEXT_DNF_CACHE_DEFAULT:
+      /* Handled above */
+      break;
+    case RPMOSTREE_CONTEXT_DNF_CACHE_NEVER:
+      cache_age = 0;
+      break;
+    }
+
+  if (!refresh_rpmmd_repos (self->dnfctx, rpmmd_repos, cache_age,
+                            get_concurrency (self, rpmostreecxx::ConcurrencyPhase::RpmmdRefresh),
+                            self->rpmmd_updated_repos,
+                            cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Return a checksum identifying the rpm-md currently on disk for the enabled
+ * repos and their configuration (e.g. excludepkgs or priority); only valid
+ * after rpmostree_context_fetch_rpmmd().  Two contexts with the same checksum
+ * (and the same sack flags and rpmdb) import the same sack.
+ */
+gboolean
+rpmostree_context_get_rpmmd_checksum (RpmOstreeContext *self,
+                                      char            **out_checksum,
+                                      GError          **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr(GPtrArray) rpmmd_repos =
+    rpmostree_get_enabled_rpmmd_repos (self->dnfctx, DNF_REPO_ENABLED_PACKAGES);
   for (guint i = 0; i < rpmmd_repos->len; i++)
     {
       auto repo = static_cast<DnfRepo *>(rpmmd_repos->pdata[i]);
-      g_autoptr(DnfState) hifstate = dnf_state_new ();
-
-      /* Until libdnf speaks GCancellable: https://github.com/projectatomic/rpm-ostree/issues/897 */
-      if (g_cancellable_set_error_if_cancelled (cancellable, error))
-        return FALSE;
+      const char *id = dnf_repo_get_id (repo);
+      g_checksum_update (checksum, (const guint8*)id, strlen (id) + 1);
 
-      /* For the cache_age bits, see https://github.com/projectatomic/rpm-ostree/pull/1562
-       * AKA a7bbf5bc142d9dac5b1bfb86d0466944d38baa24
-       * We have our own cache age as we want to default to G_MAXUINT so we
-       * respect the repo's metadata_expire if set.  But the compose tree path
-       * also sets this to 0 to force expiry.
-       */
-      guint cache_age = G_MAXUINT-1;
-      switch (self->dnf_cache_policy)
+      /* The .repo file holds the options applied on import */
+      const char *repo_filename = dnf_repo_get_filename (repo);
+      if (repo_filename)
         {
-        case RPMOSTREE_CONTEXT_DNF_CACHE_FOREVER:
-          cache_age = G_MAXUINT;
-          break;
-        case RPMOSTREE_CONTEXT_DNF_CACHE_DEFAULT:
-          /* Handled above */
-          break;
-        case RPMOSTREE_CONTEXT_DNF_CACHE_NEVER:
-          cache_age = 0;
-          break;
+          g_autofree char *contents =
+            glnx_file_get_contents_utf8_at (AT_FDCWD, repo_filename, NULL, NULL, error);
+          if (!contents)
+            return FALSE;
+          g_checksum_update (checksum, (const guint8*)contents, strlen (contents) + 1);
         }
-      if (!dnf_repo_check(repo,
-                          cache_age,
-                          hifstate,
-                          NULL))
+
+      /* repomd.xml lists the checksums of all the other metadata files */
+      g_autofree char *repomd_path =
+        g_build_filename (dnf_repo_get_location (repo), "repodata/repomd.xml", NULL);
+      glnx_autofd int fd = -1;
+      g_autoptr(GError) local_error = NULL;
+      if (!glnx_openat_rdonly (AT_FDCWD, repomd_path, TRUE, &fd, &local_error))
         {
-          dnf_state_reset (hifstate);
-          auto msg = g_strdup_printf ("Updating metadata for '%s'", dnf_repo_get_id (repo));
-          auto progress = rpmostreecxx::progress_percent_begin(msg);
-          guint progress_sigid = g_signal_connect (hifstate, "percentage-changed",
-                                                   G_CALLBACK (on_hifstate_percentage_changed),
-                                                   (void*)progress.get());
-          if (!dnf_repo_update (repo, DNF_REPO_UPDATE_FLAG_FORCE, hifstate, error))
-            return glnx_prefix_error (error, "Updating rpm-md repo '%s'", dnf_repo_get_id (repo));
+          if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            return g_propagate_error (error, util::move_nullify (local_error)), FALSE;
+          /* Shouldn't happen after a fetch, but fall back to the timestamp */
+          g_autofree char *ts =
+            g_strdup_printf ("%" G_GUINT64_FORMAT, dnf_repo_get_timestamp_generated (repo));
+          g_checksum_update (checksum, (const guint8*)ts, strlen (ts) + 1);
+          continue;
+        }
+      g_autoptr(GBytes) repomd = glnx_fd_readall_bytes (fd, NULL, error);
+      if (!repomd)
+        return FALSE;
+      gsize len;
+      auto data = static_cast<const guint8*>(g_bytes_get_data (repomd, &len));
+      g_checksum_update (checksum, data, len);
+    }
 
-          g_hash_table_add (updated_repos, repo);
+  *out_checksum = g_strdup (g_checksum_get_string (checksum));
+  return TRUE;
+}
 
-          g_signal_handler_disconnect (hifstate, progress_sigid);
-          progress->end("");
-        }
+/* Import the rpm-md fetched by rpmostree_context_fetch_rpmmd() (and unless
+ * skipped in @flags, the rpmdb) into the sack.
+ */
+gboolean
+rpmostree_context_import_rpmmd (RpmOstreeContext *self,
+                                DnfContextSetupSackFlags flags,
+                                GCancellable     *cancellable,
+                                GError          **error)
+{
+  g_assert (!self->empty);
+  g_assert (self->rpmmd_updated_repos);
+
+  if (self->pkgcache_only)
+    {
+      /* this is essentially a no-op */
+      g_autoptr(DnfState) hifstate = dnf_state_new ();
+      if (!dnf_context_setup_sack_with_flags (self->dnfctx, hifstate, flags, error))
+        return FALSE;
+
+      /* Note early return; no repos to import. */
+      return TRUE;
     }
 
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
@@ -1004,7 +1365,7 @@ rpmostree_context_download_metadata (RpmOstreeContext *self,
   for (guint i = 0; i < repos->len; i++)
     {
       auto repo = static_cast<DnfRepo*>(repos->pdata[i]);
-      gboolean updated = g_hash_table_contains (updated_repos, repo);
+      gboolean updated = g_hash_table_contains (self->rpmmd_updated_repos, repo);
       guint64 ts = dnf_repo_get_timestamp_generated (repo);
       g_autofree char *repo_ts_str = rpmostree_timestamp_str_from_unix_utc (ts);
       rpmostree_output_message ("rpm-md repo '%s'%s; generated: %s solvables: %u",
@@ -1015,6 +1376,18 @@ rpmostree_context_download_metadata (RpmOstreeContext *self,
   return TRUE;
 }
 
+/* Initiate download of rpm-md */
+gboolean
+rpmostree_context_download_metadata (RpmOstreeContext *self,
+                                     DnfContextSetupSackFlags flags,
+                                     GCancellable     *cancellable,
+                                     GError          **error)
+{
+  if (!rpmostree_context_fetch_rpmmd (self, flags, cancellable, error))
+    return FALSE;
+  return rpmostree_context_import_rpmmd (self, flags, cancellable, error);
+}
+
 static void
 journal_rpmmd_info (RpmOstreeContext *self)
 {
@@ -1106,27 +1479,6 @@ get_pkgcache_repodata_chksum_repr (GVariant    *commit,
   return TRUE;
 }
 
-static gboolean
-commit_has_matching_repodata_chksum_repr (GVariant    *commit,
-                                          const char  *expected,
-                                          gboolean    *out_matches,
-                                          GError     **error)
-{
-  g_autofree char *chksum_repr = NULL;
-  if (!get_pkgcache_repodata_chksum_repr (commit, &chksum_repr, TRUE, error))
-    return FALSE;
-
-  /* never match pkgs unpacked with older versions that didn't embed chksum_repr */
-  if (chksum_repr == NULL)
-    {
-      *out_matches = FALSE;
-      return TRUE;
-    }
-
-  *out_matches = g_str_equal (expected, chksum_repr);
-  return TRUE;
-}
-
 static gboolean
 pkg_is_cached (DnfPackage *pkg)
 {
@@ -1143,72 +1495,259 @@ pkg_is_cached (DnfPackage *pkg)
   return g_file_test (dnf_package_get_filename (pkg), G_FILE_TEST_EXISTS);
 }
 
-/* Given @pkg, return its state in the pkgcache repo. It could be not present,
- * or present but have been imported with a different SELinux policy version
- * (and hence in need of relabeling).
+/* The pkgcache index caches the bits of pkgcache commit metadata that
+ * find_pkg_in_ostree() needs, so that classifying a transaction doesn't
+ * require loading and parsing one commit per package.  Entries are keyed by
+ * cache branch, but also record the commit they were derived from; since
+ * commits are immutable, an entry is valid as long as its branch still points
+ * there.  It lives in the pkgcache repo and is purely an optimization; if it's
+ * missing or corrupt, we just rebuild it.
  */
+#define RPMOSTREE_PKGCACHE_INDEX_PATH "extensions/rpmostree/pkgcache-index.gv"
+#define RPMOSTREE_PKGCACHE_INDEX_VERSION 1
+/* version, { cache branch: (commit, repodata chksum repr, sepolicy csum, nodocs) } */
+#define RPMOSTREE_PKGCACHE_INDEX_GVARIANT_FORMAT "(ua{s(sssb)})"
+#define RPMOSTREE_PKGCACHE_INDEX_ENTRY_FORMAT "(sssb)"
+
 static gboolean
-find_pkg_in_ostree (RpmOstreeContext *self,
-                    DnfPackage     *pkg,
-                    OstreeSePolicy *sepolicy,
-                    gboolean       *out_in_ostree,
-                    gboolean       *out_selinux_match,
-                    GError        **error)
+pkgcache_index_load (RpmOstreeContext *self,
+                     OstreeRepo       *repo,
+                     GError          **error)
 {
-  OstreeRepo *repo = get_pkgcache_repo (self);
-  /* Init output here, since we have several early returns */
-  *out_in_ostree = FALSE;
-  /* If there's no sepolicy, then we always match */
-  *out_selinux_match = (sepolicy == NULL);
+  self->pkgcache_index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify)g_variant_unref);
+  self->pkgcache_index_dirty = FALSE;
 
-  /* NB: we're not using a pkgcache yet in the compose path */
-  if (repo == NULL)
-    return TRUE; /* Note early return */
+  glnx_autofd int fd = -1;
+  g_autoptr(GError) local_error = NULL;
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), RPMOSTREE_PKGCACHE_INDEX_PATH, TRUE,
+                           &fd, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return g_propagate_error (error, util::move_nullify (local_error)), FALSE;
+      return TRUE; /* Note early return */
+    }
 
-  g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
-  g_autofree char *cached_rev = NULL;
-  if (!ostree_repo_resolve_rev (repo, cachebranch, TRUE,
-                                &cached_rev, error))
+  g_autoptr(GMappedFile) mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
     return FALSE;
+  g_autoptr(GBytes) bytes = g_mapped_file_get_bytes (mfile);
+  g_autoptr(GVariant) index =
+    g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (RPMOSTREE_PKGCACHE_INDEX_GVARIANT_FORMAT),
+                                                  bytes, FALSE));
+  guint32 version;
+  g_autoptr(GVariant) entries = NULL;
+  g_variant_get (index, "(u@a{s(sssb)})", &version, &entries);
+  if (version != RPMOSTREE_PKGCACHE_INDEX_VERSION)
+    return TRUE; /* Note early return; we'll overwrite it */
+
+  GVariantIter iter;
+  g_variant_iter_init (&iter, entries);
+  const char *branch;
+  GVariant *entry;
+  while (g_variant_iter_loop (&iter, "{&s@" RPMOSTREE_PKGCACHE_INDEX_ENTRY_FORMAT "}", &branch, &entry))
+    g_hash_table_insert (self->pkgcache_index, g_strdup (branch), g_variant_ref (entry));
 
-  if (!cached_rev)
-    return TRUE; /* Note early return */
+  return TRUE;
+}
 
-  /* Below here prefix with the branch */
-  const char *errprefix = glnx_strjoina ("Loading pkgcache branch ", cachebranch);
-  GLNX_AUTO_PREFIX_ERROR (errprefix, error);
+/* Write back the index if anything changed, dropping entries for branches
+ * which no longer exist.  Also forget the ref snapshot, since the pkgcache may
+ * be about to change (e.g. by importing or relabeling).
+ */
+static gboolean
+pkgcache_index_flush (RpmOstreeContext *self,
+                      GCancellable     *cancellable,
+                      GError          **error)
+{
+  g_autoptr(GHashTable) refs = util::move_nullify (self->pkgcache_refs);
+  if (!self->pkgcache_index || !self->pkgcache_index_dirty || !refs)
+    return TRUE;
+  self->pkgcache_index_dirty = FALSE;
 
-  g_autoptr(GVariant) commit = NULL;
-  OstreeRepoCommitState commitstate;
-  if (!ostree_repo_load_commit (repo, cached_rev, &commit, &commitstate, error))
-    return FALSE;
-  g_assert (commit);
+  OstreeRepo *repo = get_pkgcache_repo (self);
+  g_autoptr(GPtrArray) branches = g_ptr_array_new ();
+  GLNX_HASH_TABLE_FOREACH_KV (self->pkgcache_index, const char*, branch, GVariant*, entry)
+    {
+      const char *commit;
+      g_variant_get_child (entry, 0, "&s", &commit);
+      if (g_strcmp0 (static_cast<const char*>(g_hash_table_lookup (refs, branch)), commit) == 0)
+        g_ptr_array_add (branches, (gpointer)branch);
+    }
+  /* Sorted, so that the file is stable for the same pkgcache */
+  g_ptr_array_sort (branches, (GCompareFunc)rpmostree_ptrarray_sort_compare_strings);
 
-  /* If the commit is partial, then we need to redownload. This can happen if e.g. corrupted
-   * commit objects were deleted with `ostree fsck --delete`. */
-  if (commitstate & OSTREE_REPO_COMMIT_STATE_PARTIAL)
-    return TRUE; /* Note early return */
+  g_autoptr(GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("a{s(sssb)}"));
+  for (guint i = 0; i < branches->len; i++)
+    {
+      auto branch = static_cast<const char *>(branches->pdata[i]);
+      g_variant_builder_add (builder, "{s@" RPMOSTREE_PKGCACHE_INDEX_ENTRY_FORMAT "}", branch,
+                             static_cast<GVariant*>(g_hash_table_lookup (self->pkgcache_index, branch)));
+    }
+  g_autoptr(GVariant) index =
+    g_variant_ref_sink (g_variant_new ("(ua{s(sssb)})", RPMOSTREE_PKGCACHE_INDEX_VERSION, builder));
 
-  g_autoptr(GVariant) metadata = g_variant_get_child_value (commit, 0);
-  g_autoptr(GVariantDict) metadata_dict = g_variant_dict_new (metadata);
+  int repo_dfd = ostree_repo_get_dfd (repo);
+  g_autofree char *dir = g_path_get_dirname (RPMOSTREE_PKGCACHE_INDEX_PATH);
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, dir, 0755, cancellable, error))
+    return FALSE;
+  if (!glnx_file_replace_contents_at (repo_dfd, RPMOSTREE_PKGCACHE_INDEX_PATH,
+                                      static_cast<const guint8*>(g_variant_get_data (index)),
+                                      g_variant_get_size (index),
+                                      GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+    return FALSE;
 
-  /* NB: we do an exception for LocalPackages here; we've already checked that
-   * its cache is valid and matches what's in the origin. We never want to fetch
-   * newer versions of LocalPackages from the repos. But we do want to check
-   * whether a relabel will be necessary. */
+  return TRUE;
+}
 
-  const char *reponame = dnf_package_get_reponame (pkg);
+/* The index is just a cache, so failing to write it out (e.g. a read-only
+ * repo) shouldn't fail the operation.
+ */
+static void
+pkgcache_index_flush_or_warn (RpmOstreeContext *self,
+                              GCancellable     *cancellable)
+{
+  g_autoptr(GError) local_error = NULL;
+  if (!pkgcache_index_flush (self, cancellable, &local_error))
+    sd_journal_print (LOG_WARNING, "Failed to write pkgcache index: %s", local_error->message);
+}
+
+/* Return the pkgcache index entry for @cachebranch, or %NULL if it's not in
+ * the pkgcache (or only partially).  Loads the commit if the index is stale.
+ */
+static gboolean
+pkgcache_index_lookup (RpmOstreeContext *self,
+                       OstreeRepo       *repo,
+                       const char       *cachebranch,
+                       GVariant        **out_entry,
+                       GCancellable     *cancellable,
+                       GError          **error)
+{
+  *out_entry = NULL;
+
+  if (!self->pkgcache_index)
+    {
+      if (!pkgcache_index_load (self, repo, error))
+        return glnx_prefix_error (error, "Loading pkgcache index");
+    }
+  /* Snapshot all the refs in one go, rather than resolving them one by one */
+  if (!self->pkgcache_refs)
+    {
+      if (!ostree_repo_list_refs_ext (repo, "rpmostree/pkg", &self->pkgcache_refs,
+                                      OSTREE_REPO_LIST_REFS_EXT_NONE, cancellable, error))
+        return FALSE;
+    }
+
+  auto cached_rev = static_cast<const char *>(g_hash_table_lookup (self->pkgcache_refs, cachebranch));
+  if (!cached_rev)
+    return TRUE; /* Note early return */
+
+  auto entry = static_cast<GVariant *>(g_hash_table_lookup (self->pkgcache_index, cachebranch));
+  if (entry)
+    {
+      const char *commit;
+      g_variant_get_child (entry, 0, "&s", &commit);
+      if (g_str_equal (commit, cached_rev))
+        {
+          /* Commits can still become partial after the fact if e.g. corrupted
+           * objects were deleted with `ostree fsck --delete`; that's cheap
+           * to check without loading the commit.
+           */
+          g_autofree char *partial_path = g_strconcat ("state/", cached_rev, ".commitpartial", NULL);
+          if (!glnx_fstatat_allow_noent (ostree_repo_get_dfd (repo), partial_path, NULL, 0, error))
+            return FALSE;
+          if (errno == ENOENT)
+            *out_entry = g_variant_ref (entry);
+          return TRUE; /* Note early return */
+        }
+    }
+
+  /* Below here prefix with the branch */
+  const char *errprefix = glnx_strjoina ("Loading pkgcache branch ", cachebranch);
+  GLNX_AUTO_PREFIX_ERROR (errprefix, error);
+
+  g_autoptr(GVariant) commit = NULL;
+  OstreeRepoCommitState commitstate;
+  if (!ostree_repo_load_commit (repo, cached_rev, &commit, &commitstate, error))
+    return FALSE;
+  g_assert (commit);
+
+  /* If the commit is partial, then we need to redownload. This can happen if e.g. corrupted
+   * commit objects were deleted with `ostree fsck --delete`. */
+  if (commitstate & OSTREE_REPO_COMMIT_STATE_PARTIAL)
+    return TRUE; /* Note early return */
+
+  g_autoptr(GVariant) metadata = g_variant_get_child_value (commit, 0);
+  g_autoptr(GVariantDict) metadata_dict = g_variant_dict_new (metadata);
+
+  /* Packages imported with older versions didn't embed chksum_repr */
+  g_autofree char *chksum_repr = NULL;
+  if (!get_pkgcache_repodata_chksum_repr (commit, &chksum_repr, TRUE, error))
+    return FALSE;
+  const char *sepolicy_csum = NULL;
+  if (!g_variant_dict_lookup (metadata_dict, "rpmostree.sepolicy", "&s", &sepolicy_csum))
+    sepolicy_csum = NULL;
+  gboolean nodocs;
+  if (!g_variant_dict_lookup (metadata_dict, "rpmostree.nodocs", "b", &nodocs))
+    nodocs = FALSE;
+
+  entry = g_variant_ref_sink (g_variant_new (RPMOSTREE_PKGCACHE_INDEX_ENTRY_FORMAT, cached_rev,
+                                             chksum_repr ?: "", sepolicy_csum ?: "", nodocs));
+  g_hash_table_replace (self->pkgcache_index, g_strdup (cachebranch), entry);
+  self->pkgcache_index_dirty = TRUE;
+
+  *out_entry = g_variant_ref (entry);
+  return TRUE;
+}
+
+/* Given @pkg, return its state in the pkgcache repo. It could be not present,
+ * or present but have been imported with a different SELinux policy version
+ * (and hence in need of relabeling).
+ */
+static gboolean
+find_pkg_in_ostree (RpmOstreeContext *self,
+                    DnfPackage     *pkg,
+                    OstreeSePolicy *sepolicy,
+                    gboolean       *out_in_ostree,
+                    gboolean       *out_selinux_match,
+                    GError        **error)
+{
+  OstreeRepo *repo = get_pkgcache_repo (self);
+  /* Init output here, since we have several early returns */
+  *out_in_ostree = FALSE;
+  /* If there's no sepolicy, then we always match */
+  *out_selinux_match = (sepolicy == NULL);
+
+  /* NB: we're not using a pkgcache yet in the compose path */
+  if (repo == NULL)
+    return TRUE; /* Note early return */
+
+  g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
+  g_autoptr(GVariant) entry = NULL;
+  if (!pkgcache_index_lookup (self, repo, cachebranch, &entry, NULL, error))
+    return FALSE;
+
+  if (!entry)
+    return TRUE; /* Note early return */
+
+  const char *chksum_repr;
+  const char *sepolicy_csum;
+  gboolean pkgcache_commit_is_nodocs;
+  g_variant_get (entry, "(&s&s&sb)", NULL, &chksum_repr, &sepolicy_csum,
+                 &pkgcache_commit_is_nodocs);
+
+  /* NB: we do an exception for LocalPackages here; we've already checked that
+   * its cache is valid and matches what's in the origin. We never want to fetch
+   * newer versions of LocalPackages from the repos. But we do want to check
+   * whether a relabel will be necessary. */
+
+  const char *reponame = dnf_package_get_reponame (pkg);
   if (g_strcmp0 (reponame, HY_CMDLINE_REPO_NAME) != 0)
     {
       auto expected_chksum_repr = rpmostreecxx::get_repodata_chksum_repr(*pkg);
 
-      gboolean same_pkg_chksum = FALSE;
-      if (!commit_has_matching_repodata_chksum_repr (commit,
-                                                     expected_chksum_repr.c_str(),
-                                                     &same_pkg_chksum, error))
-        return FALSE;
-
-      if (!same_pkg_chksum)
+      /* never match pkgs unpacked with older versions that didn't embed chksum_repr */
+      if (!g_str_equal (expected_chksum_repr.c_str(), chksum_repr))
         return TRUE; /* Note early return */
 
       /* We need to handle things like the nodocs flag changing; in that case we
@@ -1216,10 +1755,6 @@ find_pkg_in_ostree (RpmOstreeContext *self,
        */
       const bool global_nodocs = (self->treefile_rs && !self->treefile_rs->get_documentation());
 
-      gboolean pkgcache_commit_is_nodocs;
-      if (!g_variant_dict_lookup (metadata_dict, "rpmostree.nodocs", "b", &pkgcache_commit_is_nodocs))
-        pkgcache_commit_is_nodocs = FALSE;
-
       /* We treat a mismatch of documentation state as simply not being
        * imported at all.
        */
@@ -1227,13 +1762,18 @@ find_pkg_in_ostree (RpmOstreeContext *self,
         return TRUE;
     }
 
-  /* We found an import, let's load the sepolicy state */
+  /* We found an import, let's check the sepolicy state */
   *out_in_ostree = TRUE;
   if (sepolicy)
     {
-      if (!commit_has_matching_sepolicy (commit, sepolicy,
-                                         out_selinux_match, error))
-        return FALSE;
+      const char *sepolicy_csum_wanted = ostree_sepolicy_get_csum (sepolicy);
+      if (!sepolicy_csum_wanted)
+        return glnx_throw (error, "SELinux enabled, but no policy found");
+      if (!*sepolicy_csum)
+        return glnx_throw (error, "Loading pkgcache branch %s: Missing key: rpmostree.sepolicy",
+                           cachebranch);
+
+      *out_selinux_match = g_str_equal (sepolicy_csum, sepolicy_csum_wanted);
     }
 
   return TRUE;
@@ -1334,6 +1874,8 @@ sort_packages (RpmOstreeContext *self,
       }
     }
 
+  pkgcache_index_flush_or_warn (self, cancellable);
+
   return TRUE;
 }
 
@@ -1701,6 +2243,7 @@ rpmostree_context_prepare (RpmOstreeContext *self,
 {
   g_assert (!self->empty);
 
+  auto span = rpmostreecxx::profile_span_begin("prepare");
   DnfContext *dnfctx = self->dnfctx;
 
   auto packages = self->treefile_rs->get_packages();
@@ -2113,6 +2656,43 @@ rpmostree_context_get_state_sha512 (RpmOstreeContext *self,
   return TRUE;
 }
 
+/* The passwd and group files of the merge deployment are used to look up the
+ * users and groups of layered files, but aren't part of the state checksum:
+ * adding a user on the host shouldn't make for a new deployment.  Sets
+ * @out_checksum to %NULL if we're not using them.
+ */
+gboolean
+rpmostree_context_get_passwd_sha256 (RpmOstreeContext *self,
+                                     char            **out_checksum,
+                                     GError          **error)
+{
+  *out_checksum = NULL;
+  if (!self->passwd_dir)
+    return TRUE;
+
+  glnx_autofd int dfd = -1;
+  if (!glnx_opendirat (AT_FDCWD, self->passwd_dir, TRUE, &dfd, error))
+    return FALSE;
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  const char *files[] = { "passwd", "group" };
+  for (guint i = 0; i < G_N_ELEMENTS (files); i++)
+    {
+      g_checksum_update (checksum, (const guint8*)files[i], strlen (files[i]) + 1);
+      if (!glnx_fstatat_allow_noent (dfd, files[i], NULL, 0, error))
+        return FALSE;
+      if (errno == ENOENT)
+        continue;
+      gsize len;
+      g_autofree char *contents = glnx_file_get_contents_utf8_at (dfd, files[i], &len, NULL, error);
+      if (!contents)
+        return FALSE;
+      g_checksum_update (checksum, (const guint8*)contents, len);
+    }
+
+  *out_checksum = g_strdup (g_checksum_get_string (checksum));
+  return TRUE;
+}
+
 static GHashTable *
 gather_source_to_packages (GPtrArray *packages)
 {
@@ -2154,6 +2734,7 @@ rpmostree_download_packages (GPtrArray      *packages,
   GLNX_HASH_TABLE_FOREACH_KV (source_to_packages, DnfRepo*, src, GPtrArray*, src_packages)
     {
       glnx_unref_object DnfState *hifstate = dnf_state_new ();
+      dnf_state_set_cancellable (hifstate, cancellable);
       auto msg = g_strdup_printf("Downloading from '%s'", dnf_repo_get_id(src));
       auto progress = rpmostreecxx::progress_percent_begin(msg);
       progress_sigid = g_signal_connect (hifstate, "percentage-changed",
@@ -2190,9 +2771,87 @@ rpmostree_context_download (RpmOstreeContext *self,
   else
     return TRUE;
 
+  auto span = rpmostreecxx::profile_span_begin("download");
+  span->add_counter("packages", n);
+  span->add_counter("bytes", dnf_package_array_get_download_size (self->pkgs_to_download));
   return rpmostree_download_packages (self->pkgs_to_download, cancellable, error);
 }
 
+/* In pipelined mode, the number of packages we hand to librepo at once.  This
+ * should be large enough that librepo can still make use of parallel
+ * downloads, but small enough that the importers get fed early.
+ */
+#define RPMOSTREE_PIPELINE_DOWNLOAD_BATCH 16
+
+typedef struct {
+  DnfRepo *repo; /* Borrowed */
+  GPtrArray *pkgs; /* Borrowed from pkgs_to_download */
+  /* Position among the batches for the same repo, for progress */
+  guint repo_batch_index;
+  guint repo_n_batches;
+  /* Written by the download thread */
+  gint percent;
+  GMainContext *mainctx; /* Borrowed */
+} DownloadBatch;
+
+static void
+download_batch_free (DownloadBatch *batch)
+{
+  g_ptr_array_unref (batch->pkgs);
+  g_free (batch);
+}
+
+/* We schedule imports largest-first, so that e.g. kernel-modules or
+ * linux-firmware get started early rather than becoming the long tail while
+ * all other workers sit idle.  Ties are broken by NEVRA so the order is
+ * deterministic.
+ */
+static int
+compare_pkgs_largest_first (gconstpointer ap,
+                            gconstpointer bp)
+{
+  auto a = *((DnfPackage**)ap);
+  auto b = *((DnfPackage**)bp);
+  guint64 a_size = dnf_package_get_installsize (a);
+  guint64 b_size = dnf_package_get_installsize (b);
+  if (a_size != b_size)
+    return a_size > b_size ? -1 : 1;
+  return dnf_package_cmp (a, b);
+}
+
+/* Keep the sub-message of the import progress bar up to date with the
+ * download state (in pipelined mode) and the import throughput.
+ */
+static void
+update_import_progress_sub_message (RpmOstreeContext *self)
+{
+  g_autoptr(GString) msg = g_string_new ("");
+  if (self->async_downloading)
+    {
+      auto batch = static_cast<DownloadBatch *>(self->async_download_batches->pdata[self->async_download_index - 1]);
+      const guint percent = (batch->repo_batch_index * 100 + g_atomic_int_get (&batch->percent)) / batch->repo_n_batches;
+      g_string_append_printf (msg, "'%s' %u%%, ", dnf_repo_get_id (batch->repo), percent);
+    }
+  if (self->async_download_batches)
+    g_string_append_printf (msg, "downloaded %u/%u", self->n_async_pkgs_downloaded,
+                            self->pkgs_to_download->len);
+
+  const gint64 elapsed = g_get_monotonic_time () - self->async_start_time;
+  if (self->async_busy_usec > 0 && elapsed > 0)
+    {
+      /* Bytes per usec is MB/s */
+      const guint64 per_worker = self->async_bytes_imported / self->async_busy_usec;
+      const guint64 total = self->async_bytes_imported / elapsed;
+      if (msg->len > 0)
+        g_string_append (msg, ", ");
+      g_string_append_printf (msg, "%" G_GUINT64_FORMAT " MB/s (%" G_GUINT64_FORMAT " MB/s/worker)",
+                              total, per_worker);
+    }
+
+  if (msg->len > 0)
+    self->async_progress->set_sub_message(msg->str);
+}
+
 static gboolean
 async_imports_mainctx_iter (gpointer user_data);
 
@@ -2213,12 +2872,20 @@ on_async_import_done (GObject                    *obj,
         g_cancellable_cancel (self->async_cancellable);
       g_assert (self->async_error != NULL);
     }
+  else
+    {
+      guint64 bytes, usec;
+      rpmostree_importer_get_stats (importer, &bytes, &usec);
+      self->async_bytes_imported += bytes;
+      self->async_busy_usec += usec;
+    }
 
   g_assert_cmpint (self->n_async_pkgs_imported, <, self->pkgs_to_import->len);
   self->n_async_pkgs_imported++;
   g_assert_cmpint (self->n_async_running, >, 0);
   self->n_async_running--;
   self->async_progress->nitems_update(self->n_async_pkgs_imported);
+  update_import_progress_sub_message (self);
   async_imports_mainctx_iter (self);
 }
 
@@ -2249,11 +2916,21 @@ start_async_import_one_package (RpmOstreeContext *self, DnfPackage *pkg,
   if (self->treefile_rs->get_readonly_executables())
     flags |= RPMOSTREE_IMPORTER_FLAGS_RO_EXECUTABLES;
 
+  /* The payload decoder gets a share of the processors according to how
+   * many imports will actually run alongside it; towards the end of the
+   * queue, e.g. a large kernel-modules or firmware package can then use the
+   * workers that would otherwise sit idle.  This counts the imports still
+   * running and queued, including this one.
+   */
+  g_assert_cmpint (self->n_async_pkgs_imported, <, self->pkgs_to_import->len);
+  const guint n_remaining = self->pkgs_to_import->len - self->n_async_pkgs_imported;
+  const guint n_concurrent = MIN (self->n_async_max, n_remaining);
+
   /* TODO - tweak the unpacker flags for containers */
   OstreeRepo *ostreerepo = get_pkgcache_repo (self);
   g_autoptr(RpmOstreeImporter) unpacker =
     rpmostree_importer_new_take_fd (&fd, ostreerepo, pkg, static_cast<RpmOstreeImporterFlags>(flags),
-                                    self->sepolicy, error);
+                                    self->sepolicy, n_concurrent, error);
   if (!unpacker)
     return glnx_prefix_error (error, "creating importer");
 
@@ -2262,6 +2939,112 @@ start_async_import_one_package (RpmOstreeContext *self, DnfPackage *pkg,
   return TRUE;
 }
 
+/* The progress bar may only be used from the main thread, so just record the
+ * percentage and wake it up; see run_async_imports().
+ */
+static void
+on_download_batch_percentage_changed (DnfState   *hifstate,
+                                      guint       percentage,
+                                      gpointer    user_data)
+{
+  auto batch = static_cast<DownloadBatch *>(user_data);
+  g_atomic_int_set (&batch->percent, percentage);
+  g_main_context_wakeup (batch->mainctx);
+}
+
+/* Fetch one batch of packages; runs in a worker thread */
+static gboolean
+download_batch (DownloadBatch *batch,
+                GCancellable  *cancellable,
+                GError       **error)
+{
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  const char *errprefix = glnx_strjoina ("Downloading from '", dnf_repo_get_id (batch->repo), "'");
+  GLNX_AUTO_PREFIX_ERROR (errprefix, error);
+
+  glnx_unref_object DnfState *hifstate = dnf_state_new ();
+  dnf_state_set_cancellable (hifstate, cancellable);
+  g_signal_connect (hifstate, "percentage-changed",
+                    G_CALLBACK (on_download_batch_percentage_changed), batch);
+  g_autofree char *target_dir = g_build_filename (dnf_repo_get_location (batch->repo), "/packages/", NULL);
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, target_dir, 0755, cancellable, error))
+    return FALSE;
+
+  return dnf_repo_download_packages (batch->repo, batch->pkgs, target_dir, hifstate, error);
+}
+
+static void
+download_batch_in_thread (GTask            *task,
+                          gpointer          source,
+                          gpointer          task_data,
+                          GCancellable     *cancellable)
+{
+  g_autoptr(GError) local_error = NULL;
+  auto batch = static_cast<DownloadBatch *>(task_data);
+
+  if (!download_batch (batch, cancellable, &local_error))
+    g_task_return_error (task, util::move_nullify (local_error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/* Called on completion of a download batch; runs on main thread */
+static void
+on_async_download_done (GObject                    *obj,
+                        GAsyncResult               *res,
+                        gpointer                    user_data)
+{
+  auto self = RPMOSTREE_CONTEXT (obj);
+  auto task = G_TASK (res);
+  auto batch = static_cast<DownloadBatch *>(g_task_get_task_data (task));
+
+  g_assert (self->async_downloading);
+  self->async_downloading = FALSE;
+
+  if (!g_task_propagate_boolean (task, self->async_error ? NULL : &self->async_error))
+    {
+      if (self->async_cancellable)
+        g_cancellable_cancel (self->async_cancellable);
+    }
+  else
+    {
+      for (guint i = 0; i < batch->pkgs->len; i++)
+        g_ptr_array_add (self->pkgs_ready_to_import, g_object_ref (batch->pkgs->pdata[i]));
+      self->n_async_pkgs_downloaded += batch->pkgs->len;
+      update_import_progress_sub_message (self);
+    }
+
+  async_imports_mainctx_iter (self);
+}
+
+/* In pipelined mode, start fetching the next batch of packages, unless there
+ * are already enough downloaded packages waiting for an importer; we don't
+ * want to fill up the disk with RPMs faster than we can consume them.
+ */
+static void
+async_download_maybe_start_batch (RpmOstreeContext *self)
+{
+  g_assert (!self->async_downloading);
+  if (self->async_download_index == self->async_download_batches->len)
+    return;
+
+  const guint n_pending = (self->pkgs_ready_to_import->len - self->async_index) + self->n_async_running;
+  if (n_pending >= self->n_async_max + RPMOSTREE_PIPELINE_DOWNLOAD_BATCH)
+    return;
+
+  auto batch = static_cast<DownloadBatch *>(self->async_download_batches->pdata[self->async_download_index]);
+  g_autoptr(GTask) task = g_task_new (self, self->async_cancellable, on_async_download_done, NULL);
+  /* Owned by async_download_batches, which outlives the task */
+  g_task_set_task_data (task, batch, NULL);
+  batch->mainctx = g_main_context_get_thread_default ();
+  g_task_run_in_thread (task, download_batch_in_thread);
+  self->async_download_index++;
+  self->async_downloading = TRUE;
+  update_import_progress_sub_message (self);
+}
+
 /* First function run on mainloop, and called after completion as well. Ensures
  * that we have a bounded number of tasks concurrently executing until
  * finishing.
@@ -2271,11 +3054,11 @@ async_imports_mainctx_iter (gpointer user_data)
 {
   auto self = static_cast<RpmOstreeContext *>(user_data);
 
-  while (self->async_index < self->pkgs_to_import->len &&
+  while (self->async_index < self->pkgs_ready_to_import->len &&
          self->n_async_running < self->n_async_max &&
          self->async_error == NULL)
     {
-      auto pkg = static_cast<DnfPackage *>(self->pkgs_to_import->pdata[self->async_index]);
+      auto pkg = static_cast<DnfPackage *>(self->pkgs_ready_to_import->pdata[self->async_index]);
       if (!start_async_import_one_package (self, pkg, self->async_cancellable, &self->async_error))
         {
           g_cancellable_cancel (self->async_cancellable);
@@ -2285,7 +3068,14 @@ async_imports_mainctx_iter (gpointer user_data)
       self->n_async_running++;
     }
 
-  if (self->n_async_running == 0)
+  if (self->async_download_batches && !self->async_downloading &&
+      self->async_error == NULL)
+    async_download_maybe_start_batch (self);
+
+  /* Note in pipelined mode we also need to wait for an in-flight download
+   * (even on error), since it references us.
+   */
+  if (self->n_async_running == 0 && !self->async_downloading)
     {
       self->async_running = FALSE;
       g_main_context_wakeup (g_main_context_get_thread_default ());
@@ -2294,15 +3084,19 @@ async_imports_mainctx_iter (gpointer user_data)
   return FALSE;
 }
 
-gboolean
-rpmostree_context_import (RpmOstreeContext *self,
-                          GCancellable     *cancellable,
-                          GError          **error)
+/* Shared implementation of rpmostree_context_import() and
+ * rpmostree_context_download_and_import(); imports everything in
+ * pkgs_ready_to_import, plus (in pipelined mode) everything in
+ * async_download_batches as it arrives.
+ */
+static gboolean
+run_async_imports (RpmOstreeContext *self,
+                   const char       *progress_msg,
+                   GCancellable     *cancellable,
+                   GError          **error)
 {
   DnfContext *dnfctx = self->dnfctx;
   const int n = self->pkgs_to_import->len;
-  if (n == 0)
-    return TRUE;
 
   OstreeRepo *repo = get_pkgcache_repo (self);
   g_assert (repo != NULL);
@@ -2321,8 +3115,16 @@ rpmostree_context_import (RpmOstreeContext *self,
   /* We're CPU bound, so just use processors */
   self->n_async_max = g_get_num_processors ();
   self->async_cancellable = cancellable;
+  self->async_download_index = 0;
+  self->async_downloading = FALSE;
+  self->n_async_pkgs_downloaded = 0;
+  self->async_start_time = g_get_monotonic_time ();
+  self->async_bytes_imported = 0;
+  self->async_busy_usec = 0;
 
-  self->async_progress = rpmostreecxx::progress_nitems_begin(self->pkgs_to_import->len, "Importing packages");
+  self->async_progress = rpmostreecxx::progress_nitems_begin(self->pkgs_to_import->len, progress_msg);
+  /* In pipelined mode this also covers the downloads */
+  auto span = rpmostreecxx::profile_span_begin(self->async_download_batches ? "download-and-import" : "import");
 
   /* Process imports */
   GMainContext *mainctx = g_main_context_get_thread_default ();
@@ -2334,7 +3136,14 @@ rpmostree_context_import (RpmOstreeContext *self,
 
   self->async_error = NULL;
   while (self->async_running)
-    g_main_context_iteration (mainctx, TRUE);
+    {
+      g_main_context_iteration (mainctx, TRUE);
+      /* We may have been woken up for download progress */
+      if (self->async_downloading)
+        update_import_progress_sub_message (self);
+    }
+  g_clear_pointer (&self->async_download_batches, g_ptr_array_unref);
+  g_clear_pointer (&self->pkgs_ready_to_import, g_ptr_array_unref);
   if (self->async_error)
     {
       g_propagate_error (error, util::move_nullify (self->async_error));
@@ -2348,14 +3157,100 @@ rpmostree_context_import (RpmOstreeContext *self,
     return FALSE;
   txn.initialized = FALSE;
 
+  const guint64 elapsed_usec = g_get_monotonic_time () - self->async_start_time;
+  span->add_counter("packages", n);
+  span->add_counter("bytes", self->async_bytes_imported);
+  span->end();
   sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
                    SD_ID128_FORMAT_VAL(RPMOSTREE_MESSAGE_PKG_IMPORT),
                    "MESSAGE=Imported %u pkg%s", n, _NS(n),
-                   "IMPORTED_N_PKGS=%u", n, NULL);
+                   "IMPORTED_N_PKGS=%u", n,
+                   "IMPORTED_BYTES=%" G_GUINT64_FORMAT, self->async_bytes_imported,
+                   "IMPORT_ELAPSED_USEC=%" G_GUINT64_FORMAT, elapsed_usec,
+                   "IMPORT_WORKER_USEC=%" G_GUINT64_FORMAT, self->async_busy_usec,
+                   "IMPORT_WORKERS=%u", self->n_async_max,
+                   NULL);
 
   return TRUE;
 }
 
+gboolean
+rpmostree_context_import (RpmOstreeContext *self,
+                          GCancellable     *cancellable,
+                          GError          **error)
+{
+  const int n = self->pkgs_to_import->len;
+  if (n == 0)
+    return TRUE;
+
+  /* Everything was already downloaded by rpmostree_context_download() */
+  g_clear_pointer (&self->pkgs_ready_to_import, g_ptr_array_unref);
+  self->pkgs_ready_to_import = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
+  for (guint i = 0; i < self->pkgs_to_import->len; i++)
+    g_ptr_array_add (self->pkgs_ready_to_import, g_object_ref (self->pkgs_to_import->pdata[i]));
+  g_ptr_array_sort (self->pkgs_ready_to_import, compare_pkgs_largest_first);
+
+  return run_async_imports (self, "Importing packages", cancellable, error);
+}
+
+/* Like rpmostree_context_download() followed by rpmostree_context_import(),
+ * except that packages are queued for import as soon as the batch containing
+ * them has been fetched, so that network I/O and unpacking overlap.
+ */
+gboolean
+rpmostree_context_download_and_import (RpmOstreeContext *self,
+                                       GCancellable     *cancellable,
+                                       GError          **error)
+{
+  const guint n_download = self->pkgs_to_download->len;
+  if (n_download == 0)
+    return rpmostree_context_import (self, cancellable, error);
+
+  guint64 size = dnf_package_array_get_download_size (self->pkgs_to_download);
+  g_autofree char *sizestr = g_format_size (size);
+  rpmostree_output_message ("Will download: %u package%s (%s)", n_download, _NS(n_download), sizestr);
+
+  /* Anything we download also needs importing; see sort_packages() */
+  g_assert_cmpuint (n_download, <=, self->pkgs_to_import->len);
+  g_autoptr(GHashTable) to_download = g_hash_table_new (NULL, NULL);
+  for (guint i = 0; i < n_download; i++)
+    g_hash_table_add (to_download, self->pkgs_to_download->pdata[i]);
+
+  /* Packages already cached on disk can be imported right away */
+  g_clear_pointer (&self->pkgs_ready_to_import, g_ptr_array_unref);
+  self->pkgs_ready_to_import = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
+  for (guint i = 0; i < self->pkgs_to_import->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *>(self->pkgs_to_import->pdata[i]);
+      if (!g_hash_table_contains (to_download, pkg))
+        g_ptr_array_add (self->pkgs_ready_to_import, g_object_ref (pkg));
+    }
+  g_ptr_array_sort (self->pkgs_ready_to_import, compare_pkgs_largest_first);
+
+  g_clear_pointer (&self->async_download_batches, g_ptr_array_unref);
+  self->async_download_batches = g_ptr_array_new_with_free_func ((GDestroyNotify)download_batch_free);
+  g_autoptr(GHashTable) source_to_packages = gather_source_to_packages (self->pkgs_to_download);
+  GLNX_HASH_TABLE_FOREACH_KV (source_to_packages, DnfRepo*, src, GPtrArray*, src_packages)
+    {
+      /* Fetch big packages first too, so their import starts early */
+      g_ptr_array_sort (src_packages, compare_pkgs_largest_first);
+      const guint n_batches = (src_packages->len + RPMOSTREE_PIPELINE_DOWNLOAD_BATCH - 1) / RPMOSTREE_PIPELINE_DOWNLOAD_BATCH;
+      for (guint i = 0; i < src_packages->len; i += RPMOSTREE_PIPELINE_DOWNLOAD_BATCH)
+        {
+          DownloadBatch *batch = g_new0 (DownloadBatch, 1);
+          batch->repo = src;
+          batch->repo_batch_index = i / RPMOSTREE_PIPELINE_DOWNLOAD_BATCH;
+          batch->repo_n_batches = n_batches;
+          batch->pkgs = g_ptr_array_new ();
+          for (guint j = i; j < MIN (i + RPMOSTREE_PIPELINE_DOWNLOAD_BATCH, src_packages->len); j++)
+            g_ptr_array_add (batch->pkgs, src_packages->pdata[j]);
+          g_ptr_array_add (self->async_download_batches, batch);
+        }
+    }
+
+  return run_async_imports (self, "Downloading and importing packages", cancellable, error);
+}
+
 /* Given a single package, verify its GPG signature (if enabled), open a file
  * descriptor for it, and delete the on-disk downloaded copy.
  */
@@ -2630,17 +3525,17 @@ checkout_package (OstreeRepo   *repo,
                                   pkg_commit, cancellable, error);
 }
 
+/* The parts of checking out @pkg which need the context: the treefile's
+ * files to remove from it, and on the --unified-core path, making its content
+ * available in the pkgcache repo.
+ */
 static gboolean
-checkout_package_into_root (RpmOstreeContext *self,
-                            DnfPackage   *pkg,
-                            int           dfd,
-                            const char   *path,
-                            OstreeRepoDevInoCache *devino_cache,
-                            const char   *pkg_commit,
-                            GHashTable   *files_skip,
-                            OstreeRepoCheckoutOverwriteMode ovwmode,
-                            GCancellable *cancellable,
-                            GError      **error)
+prepare_package_checkout (RpmOstreeContext *self,
+                          DnfPackage   *pkg,
+                          const char   *pkg_commit,
+                          GPtrArray   **out_files_remove_regex,
+                          GCancellable *cancellable,
+                          GError      **error)
 {
   /* If called on compose-side, there may be files to remove from packages specified in the treefile. */
   g_autoptr(GPtrArray) files_remove_regex = NULL;
@@ -2648,7 +3543,7 @@ checkout_package_into_root (RpmOstreeContext *self,
   files_remove_regex = g_ptr_array_new_full (files_remove_regex_patterns.size(), (GDestroyNotify)g_regex_unref);
   for (auto pattern : files_remove_regex_patterns) 
     {
-      GRegex *regex = g_regex_new (pattern.c_str(), G_REGEX_JAVASCRIPT_COMPAT, static_cast<GRegexMatchFlags>(0), NULL);
+      GRegex *regex = g_regex_new (pattern.c_str(), G_REGEX_JAVASCRIPT_COMPAT, static_cast<GRegexMatchFlags>(0), error);
       if (!regex)
         return FALSE;
       g_ptr_array_add (files_remove_regex, regex);
@@ -2670,29 +3565,52 @@ checkout_package_into_root (RpmOstreeContext *self,
         }
     }
 
-  if (!checkout_package (pkgcache_repo, dfd, path,
-                         devino_cache, pkg_commit, files_skip, files_remove_regex, ovwmode,
-                         !self->enable_rofiles,
-                         cancellable, error))
-    return glnx_prefix_error (error, "Checkout %s", dnf_package_get_nevra (pkg));
-
+  *out_files_remove_regex = util::move_nullify (files_remove_regex);
   return TRUE;
 }
 
-static Header
-get_rpmdb_pkg_header (rpmts rpmdb_ts,
-                      DnfPackage *pkg,
-                      GCancellable *cancellable,
-                      GError **error)
-{
-  g_auto(rpmts) rpmdb_ts_owned = NULL;
-  if (!rpmdb_ts) /* allow callers to pass NULL */
-    rpmdb_ts = rpmdb_ts_owned = rpmtsCreate ();
-  (void)rpmdb_ts_owned; /* Pacify static analysis */
-
-  unsigned int dbid = dnf_package_get_rpmdbid (pkg);
-  g_assert (dbid > 0);
-
+static gboolean
+checkout_package_into_root (RpmOstreeContext *self,
+                            DnfPackage   *pkg,
+                            int           dfd,
+                            const char   *path,
+                            OstreeRepoDevInoCache *devino_cache,
+                            const char   *pkg_commit,
+                            GHashTable   *files_skip,
+                            OstreeRepoCheckoutOverwriteMode ovwmode,
+                            GCancellable *cancellable,
+                            GError      **error)
+{
+  auto span = profile_pkg_span_begin ("checkout", pkg);
+
+  g_autoptr(GPtrArray) files_remove_regex = NULL;
+  if (!prepare_package_checkout (self, pkg, pkg_commit, &files_remove_regex,
+                                 cancellable, error))
+    return FALSE;
+
+  if (!checkout_package (get_pkgcache_repo (self), dfd, path,
+                         devino_cache, pkg_commit, files_skip, files_remove_regex, ovwmode,
+                         !self->enable_rofiles,
+                         cancellable, error))
+    return glnx_prefix_error (error, "Checkout %s", dnf_package_get_nevra (pkg));
+
+  return TRUE;
+}
+
+static Header
+get_rpmdb_pkg_header (rpmts rpmdb_ts,
+                      DnfPackage *pkg,
+                      GCancellable *cancellable,
+                      GError **error)
+{
+  g_auto(rpmts) rpmdb_ts_owned = NULL;
+  if (!rpmdb_ts) /* allow callers to pass NULL */
+    rpmdb_ts = rpmdb_ts_owned = rpmtsCreate ();
+  (void)rpmdb_ts_owned; /* Pacify static analysis */
+
+  unsigned int dbid = dnf_package_get_rpmdbid (pkg);
+  g_assert (dbid > 0);
+
   g_auto(rpmdbMatchIterator) it =
     rpmtsInitIterator (rpmdb_ts, RPMDBI_PACKAGES, &dbid, sizeof(dbid));
 
@@ -2704,16 +3622,14 @@ get_rpmdb_pkg_header (rpmts rpmdb_ts,
   return headerLink (hdr);
 }
 
-/* Scan rootfs and build up a mapping like lib → usr/lib, etc. */
+/* Scan the rootfs at @rootfs_dfd and add mappings like lib → usr/lib, etc. to @usrlinks */
 static gboolean
-build_rootfs_usrlinks (RpmOstreeContext *self,
-                       GError          **error)
+scan_rootfs_usrlinks (int          rootfs_dfd,
+                      GHashTable  *usrlinks,
+                      GError     **error)
 {
-  g_assert (!self->rootfs_usrlinks);
-  self->rootfs_usrlinks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-
   g_auto(GLnxDirFdIterator) dfd_iter = { FALSE, };
-  if (!glnx_dirfd_iterator_init_at (self->tmprootfs_dfd, ".", TRUE, &dfd_iter, error))
+  if (!glnx_dirfd_iterator_init_at (rootfs_dfd, ".", TRUE, &dfd_iter, error))
     return FALSE;
   while (TRUE)
     {
@@ -2731,13 +3647,24 @@ build_rootfs_usrlinks (RpmOstreeContext *self,
         return FALSE;
       const char *link_rel = link + strspn (link, "/");
       if (g_str_has_prefix (link_rel, "usr/"))
-        g_hash_table_insert (self->rootfs_usrlinks, g_strdup (dent->d_name),
-                             g_strdup (link_rel));
+        g_hash_table_insert (usrlinks, g_strdup (dent->d_name), g_strdup (link_rel));
     }
 
   return TRUE;
 }
 
+static gboolean
+build_rootfs_usrlinks (RpmOstreeContext *self,
+                       int               rootfs_dfd,
+                       GError          **error)
+{
+  /* May have been built from a sparse checkout of the same tree already */
+  if (self->rootfs_usrlinks)
+    return TRUE;
+  self->rootfs_usrlinks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  return scan_rootfs_usrlinks (rootfs_dfd, self->rootfs_usrlinks, error);
+}
+
 /* Order by decreasing string length, used by package removals/replacements */
 static int
 compare_strlen (const void *a,
@@ -2885,19 +3812,215 @@ break_hardlinks_at (int             dfd,
 }
 
 typedef struct {
-  int tmpdir_dfd;
+  DnfPackage *pkg;
   const char *name;
   const char *evr;
   const char *arch;
+  /* Output */
+  guint64 elapsed_usec;
 } RelabelTaskData;
 
+/* Given the @xattrs of an object at @path, return in @out_xattrs a copy with
+ * security.selinux set to what @sepolicy wants, or %NULL if it's already
+ * correct.
+ */
+static gboolean
+relabel_xattrs (OstreeSePolicy *sepolicy,
+                const char     *path,
+                guint32         mode,
+                GVariant       *xattrs,
+                GVariant      **out_xattrs,
+                GCancellable   *cancellable,
+                GError        **error)
+{
+  *out_xattrs = NULL;
+
+  g_autofree char *label = NULL;
+  if (!ostree_sepolicy_get_label (sepolicy, path, mode, &label, cancellable, error))
+    return glnx_prefix_error (error, "Getting label for %s", path);
+
+  g_auto(GVariantBuilder) builder;
+  g_variant_builder_init (&builder, (GVariantType*)"a(ayay)");
+  gboolean changed = FALSE;
+  gboolean found = FALSE;
+  const guint n = xattrs ? g_variant_n_children (xattrs) : 0;
+  for (guint i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) value = NULL;
+      g_variant_get_child (xattrs, i, "(^&ay@ay)", &name, &value);
+      if (!g_str_equal (name, "security.selinux"))
+        {
+          g_variant_builder_add (&builder, "(^ay@ay)", name, value);
+          continue;
+        }
+      found = TRUE;
+      /* Note the label is stored including its trailing NUL */
+      gsize len;
+      auto data = static_cast<const char *>(g_variant_get_fixed_array (value, &len, 1));
+      if (!label || len != strlen (label) + 1 || memcmp (data, label, len) != 0)
+        changed = TRUE;
+    }
+
+  if (label)
+    {
+      g_variant_builder_add (&builder, "(^ay@ay)", "security.selinux",
+                             g_variant_new_bytestring (label));
+      changed = changed || !found;
+    }
+
+  if (changed)
+    *out_xattrs = g_variant_ref_sink (g_variant_builder_end (&builder));
+  return TRUE;
+}
+
+/* Relabel a file content object, returning in @out_csum its new checksum.  If
+ * the label didn't change, that's just @csum, and nothing is written.
+ */
+static gboolean
+relabel_file_object (OstreeRepo     *repo,
+                     OstreeSePolicy *sepolicy,
+                     const char     *path,
+                     const char     *csum,
+                     char          **out_csum,
+                     guint          *inout_n_changed,
+                     GCancellable   *cancellable,
+                     GError        **error)
+{
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GFileInfo) finfo = NULL;
+  g_autoptr(GVariant) xattrs = NULL;
+  if (!ostree_repo_load_file (repo, csum, &input, &finfo, &xattrs, cancellable, error))
+    return FALSE;
+
+  g_autoptr(GVariant) new_xattrs = NULL;
+  if (!relabel_xattrs (sepolicy, path, g_file_info_get_attribute_uint32 (finfo, "unix::mode"),
+                       xattrs, &new_xattrs, cancellable, error))
+    return FALSE;
+
+  if (!new_xattrs)
+    {
+      *out_csum = g_strdup (csum);
+      return TRUE; /* Note early return */
+    }
+
+  g_autoptr(GInputStream) content = NULL;
+  guint64 content_len;
+  if (!ostree_raw_file_to_content_stream (input, finfo, new_xattrs, &content, &content_len,
+                                          cancellable, error))
+    return FALSE;
+  g_autofree guchar *csum_bin = NULL;
+  if (!ostree_repo_write_content (repo, NULL, content, content_len, &csum_bin,
+                                  cancellable, error))
+    return FALSE;
+
+  (*inout_n_changed)++;
+  *out_csum = ostree_checksum_from_bytes (csum_bin);
+  return TRUE;
+}
+
+/* Recursively copy the tree at @dirtree_csum/@dirmeta_csum (which lives at
+ * @path in the final filesystem) into @mtree, relabeling along the way.
+ * Objects whose label is unchanged are reused by checksum.
+ */
+static gboolean
+relabel_dir_recurse (OstreeRepo        *repo,
+                     OstreeSePolicy    *sepolicy,
+                     const char        *path,
+                     const char        *dirtree_csum,
+                     const char        *dirmeta_csum,
+                     OstreeMutableTree *mtree,
+                     guint             *inout_n_changed,
+                     GCancellable      *cancellable,
+                     GError           **error)
+{
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  g_autoptr(GVariant) dirmeta = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_META, dirmeta_csum,
+                                 &dirmeta, error))
+    return FALSE;
+  guint32 uid, gid, mode;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_variant_get (dirmeta, "(uuu@a(ayay))", &uid, &gid, &mode, &xattrs);
+
+  g_autoptr(GVariant) new_xattrs = NULL;
+  if (!relabel_xattrs (sepolicy, path, GUINT32_FROM_BE (mode), xattrs, &new_xattrs,
+                       cancellable, error))
+    return FALSE;
+  if (new_xattrs)
+    {
+      /* Note uid/gid/mode are already big-endian */
+      g_autoptr(GVariant) new_dirmeta =
+        g_variant_ref_sink (g_variant_new ("(uuu@a(ayay))", uid, gid, mode, new_xattrs));
+      g_autofree guchar *csum_bin = NULL;
+      if (!ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL, new_dirmeta,
+                                       &csum_bin, cancellable, error))
+        return FALSE;
+      g_autofree char *new_csum = ostree_checksum_from_bytes (csum_bin);
+      ostree_mutable_tree_set_metadata_checksum (mtree, new_csum);
+      (*inout_n_changed)++;
+    }
+  else
+    ostree_mutable_tree_set_metadata_checksum (mtree, dirmeta_csum);
+
+  g_autoptr(GVariant) dirtree = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_csum,
+                                 &dirtree, error))
+    return FALSE;
+
+  g_autoptr(GVariant) files = g_variant_get_child_value (dirtree, 0);
+  const guint n_files = g_variant_n_children (files);
+  for (guint i = 0; i < n_files; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+      g_autofree char *csum = ostree_checksum_from_bytes_v (csum_v);
+      g_autofree char *child_path = g_build_filename (path, name, NULL);
+
+      g_autofree char *new_csum = NULL;
+      if (!relabel_file_object (repo, sepolicy, child_path, csum, &new_csum,
+                                inout_n_changed, cancellable, error))
+        return FALSE;
+      if (!ostree_mutable_tree_replace_file (mtree, name, new_csum, error))
+        return FALSE;
+    }
+
+  g_autoptr(GVariant) dirs = g_variant_get_child_value (dirtree, 1);
+  const guint n_dirs = g_variant_n_children (dirs);
+  for (guint i = 0; i < n_dirs; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &tree_csum_v, &meta_csum_v);
+      g_autofree char *tree_csum = ostree_checksum_from_bytes_v (tree_csum_v);
+      g_autofree char *meta_csum = ostree_checksum_from_bytes_v (meta_csum_v);
+      g_autofree char *child_path = g_build_filename (path, name, NULL);
+
+      g_autoptr(OstreeMutableTree) child_mtree = NULL;
+      if (!ostree_mutable_tree_ensure_dir (mtree, name, &child_mtree, error))
+        return FALSE;
+      if (!relabel_dir_recurse (repo, sepolicy, child_path, tree_csum, meta_csum,
+                                child_mtree, inout_n_changed, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Relabel a package in the pkgcache, returning the number of objects whose
+ * label changed.  We walk the commit's tree in the repo rather than checking
+ * it out and committing it again, so only the relabeled objects get written.
+ */
 static gboolean
 relabel_in_thread_impl (RpmOstreeContext *self,
                         const char       *name,
                         const char       *evr,
                         const char       *arch,
-                        int               tmpdir_dfd,
-                        gboolean         *out_changed,
+                        guint            *out_n_changed,
                         GCancellable     *cancellable,
                         GError          **error)
 {
@@ -2907,7 +4030,6 @@ relabel_in_thread_impl (RpmOstreeContext *self,
   const char *nevra = glnx_strjoina (name, "-", evr, ".", arch);
   const char *errmsg = glnx_strjoina ("Relabeling ", nevra);
   GLNX_AUTO_PREFIX_ERROR (errmsg, error);
-  const char *pkg_dirname = nevra;
 
   OstreeRepo *repo = get_pkgcache_repo (self);
   g_autofree char *cachebranch = rpmostree_get_cache_branch_for_n_evr_a (name, evr, arch);
@@ -2916,47 +4038,33 @@ relabel_in_thread_impl (RpmOstreeContext *self,
                                 &commit_csum, error))
     return FALSE;
 
-  /* Compute the original content checksum */
-  g_autoptr(GVariant) orig_commit = NULL;
-  if (!ostree_repo_load_commit (repo, commit_csum, &orig_commit, NULL, error))
-    return FALSE;
-  g_autofree char *orig_content_checksum = rpmostree_commit_content_checksum (orig_commit);
-
-  /* checkout the pkg and relabel, breaking hardlinks */
-  g_autoptr(OstreeRepoDevInoCache) cache = ostree_repo_devino_cache_new ();
-
-  if (!checkout_package (repo, tmpdir_dfd, pkg_dirname, cache,
-                         commit_csum, NULL, NULL, OSTREE_REPO_CHECKOUT_OVERWRITE_NONE, FALSE,
-                         cancellable, error))
+  g_autoptr(GVariant) commit_var = NULL;
+  if (!ostree_repo_load_commit (repo, commit_csum, &commit_var, NULL, error))
     return FALSE;
 
-  /* write to the tree */
-  g_autoptr(OstreeRepoCommitModifier) modifier =
-    ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME,
-                                       NULL, NULL, NULL);
-  ostree_repo_commit_modifier_set_devino_cache (modifier, cache);
-  ostree_repo_commit_modifier_set_sepolicy (modifier, self->sepolicy);
+  /* Rebuild the tree, relabeling as we go */
+  g_autofree char *root_tree_csum = NULL;
+  g_autofree char *root_meta_csum = NULL;
+  { g_autoptr(GVariant) tree_csum_v = g_variant_get_child_value (commit_var, 6);
+    g_autoptr(GVariant) meta_csum_v = g_variant_get_child_value (commit_var, 7);
+    root_tree_csum = ostree_checksum_from_bytes_v (tree_csum_v);
+    root_meta_csum = ostree_checksum_from_bytes_v (meta_csum_v);
+  }
 
+  guint n_changed = 0;
   g_autoptr(OstreeMutableTree) mtree = ostree_mutable_tree_new ();
-  if (!ostree_repo_write_dfd_to_mtree (repo, tmpdir_dfd, pkg_dirname, mtree,
-                                       modifier, cancellable, error))
-    return glnx_prefix_error (error, "Writing dfd");
+  if (!relabel_dir_recurse (repo, self->sepolicy, "/", root_tree_csum, root_meta_csum,
+                            mtree, &n_changed, cancellable, error))
+    return FALSE;
 
   g_autoptr(GFile) root = NULL;
   if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
     return FALSE;
 
-  /* build metadata and commit */
-  g_autoptr(GVariant) commit_var = NULL;
-  g_autoptr(GVariantDict) meta_dict = NULL;
-
-  if (!ostree_repo_load_commit (repo, commit_csum, &commit_var, NULL, error))
-    return FALSE;
-
   /* let's just copy the metadata from the previous commit and only change the
    * rpmostree.sepolicy value */
   g_autoptr(GVariant) meta = g_variant_get_child_value (commit_var, 0);
-  meta_dict = g_variant_dict_new (meta);
+  g_autoptr(GVariantDict) meta_dict = g_variant_dict_new (meta);
 
   g_variant_dict_insert (meta_dict, "rpmostree.sepolicy", "s",
                          ostree_sepolicy_get_csum (self->sepolicy));
@@ -2968,18 +4076,10 @@ relabel_in_thread_impl (RpmOstreeContext *self,
                                  cancellable, error))
     return FALSE;
 
-  /* Compute new content checksum */
-  g_autoptr(GVariant) new_commit = NULL;
-  if (!ostree_repo_load_commit (repo, new_commit_csum, &new_commit, NULL, error))
-    return FALSE;
-  g_autofree char *new_content_checksum = rpmostree_commit_content_checksum (new_commit);
-
   /* Queue an update to the ref */
   ostree_repo_transaction_set_ref (repo, NULL, cachebranch, new_commit_csum);
 
-  /* Return whether or not we actually changed content */
-  *out_changed = !g_str_equal (orig_content_checksum, new_content_checksum);
-
+  *out_n_changed = n_changed;
   return TRUE;
 }
 
@@ -2993,27 +4093,28 @@ relabel_in_thread (GTask            *task,
   auto self = static_cast<RpmOstreeContext *>(source);
   auto tdata = static_cast<RelabelTaskData *>(task_data);
 
-  gboolean changed = FALSE;
-  if (!relabel_in_thread_impl (self, tdata->name, tdata->evr, tdata->arch,
-                               tdata->tmpdir_dfd, &changed,
-                               cancellable, &local_error))
+  guint n_changed = 0;
+  const gint64 start_time = g_get_monotonic_time ();
+  gboolean ok = relabel_in_thread_impl (self, tdata->name, tdata->evr, tdata->arch,
+                                        &n_changed, cancellable, &local_error);
+  tdata->elapsed_usec = g_get_monotonic_time () - start_time;
+  if (!ok)
     g_task_return_error (task, util::move_nullify (local_error));
   else
-    g_task_return_int (task, changed ? 1 : 0);
+    g_task_return_int (task, n_changed);
 }
 
 static void
 relabel_package_async (RpmOstreeContext   *self,
                        DnfPackage         *pkg,
-                       int                 tmpdir_dfd,
                        GCancellable       *cancellable,
                        GAsyncReadyCallback callback,
                        gpointer            user_data)
 {
   g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
-  RelabelTaskData *tdata = g_new (RelabelTaskData, 1);
+  RelabelTaskData *tdata = g_new0 (RelabelTaskData, 1);
   /* We can assume lifetime is greater than the task */
-  tdata->tmpdir_dfd = tmpdir_dfd;
+  tdata->pkg = pkg;
   tdata->name = dnf_package_get_name (pkg);
   tdata->evr = dnf_package_get_evr (pkg);
   tdata->arch = dnf_package_get_arch (pkg);
@@ -3030,12 +4131,23 @@ relabel_package_async_finish (RpmOstreeContext   *self,
   return g_task_propagate_int ((GTask*)result, error);
 }
 
+typedef struct {
+  DnfPackage *pkg; /* Borrowed */
+  guint64 elapsed_usec;
+  guint n_changed;
+} RpmOstreeRelabelTiming;
+
 typedef struct {
   RpmOstreeContext *self;
+  GPtrArray *pkgs; /* pkgs_to_relabel, in scheduling order */
+  GArray *timings; /* RpmOstreeRelabelTiming */
   guint n_changed_files;
   guint n_changed_pkgs;
 } RpmOstreeAsyncRelabelData;
 
+static void
+async_relabel_mainctx_iter (RpmOstreeAsyncRelabelData *data);
+
 static void
 on_async_relabel_done (GObject                    *obj,
                        GAsyncResult               *res,
@@ -3043,6 +4155,7 @@ on_async_relabel_done (GObject                    *obj,
 {
   auto data = static_cast<RpmOstreeAsyncRelabelData *>(user_data);
   RpmOstreeContext *self = data->self;
+  auto tdata = static_cast<RelabelTaskData *>(g_task_get_task_data (G_TASK (res)));
   gssize n_relabeled =
     relabel_package_async_finish (self, res, self->async_error ? NULL : &self->async_error);
   if (n_relabeled < 0)
@@ -3051,6 +4164,11 @@ on_async_relabel_done (GObject                    *obj,
       if (self->async_cancellable)
         g_cancellable_cancel (self->async_cancellable);
     }
+  else
+    {
+      RpmOstreeRelabelTiming timing = { tdata->pkg, tdata->elapsed_usec, (guint)n_relabeled };
+      g_array_append_val (data->timings, timing);
+    }
 
   g_assert_cmpint (self->n_async_pkgs_relabeled, <, self->pkgs_to_relabel->len);
   self->n_async_pkgs_relabeled++;
@@ -3059,9 +4177,51 @@ on_async_relabel_done (GObject                    *obj,
       data->n_changed_files += n_relabeled;
       data->n_changed_pkgs++;
     }
+  g_assert_cmpint (self->n_async_running, >, 0);
+  self->n_async_running--;
   self->async_progress->nitems_update(self->n_async_pkgs_relabeled);
-  if (self->n_async_pkgs_relabeled == self->pkgs_to_relabel->len)
-    self->async_running = FALSE;
+  async_relabel_mainctx_iter (data);
+}
+
+/* Like async_imports_mainctx_iter(); keeps a bounded number of relabels
+ * running, rather than flooding the thread pool (and page cache) with one
+ * task per package.
+ */
+static void
+async_relabel_mainctx_iter (RpmOstreeAsyncRelabelData *data)
+{
+  RpmOstreeContext *self = data->self;
+
+  while (self->async_index < data->pkgs->len &&
+         self->n_async_running < self->n_async_max &&
+         self->async_error == NULL)
+    {
+      auto pkg = static_cast<DnfPackage *>(data->pkgs->pdata[self->async_index]);
+      relabel_package_async (self, pkg, self->async_cancellable,
+                             on_async_relabel_done, data);
+      self->async_index++;
+      self->n_async_running++;
+    }
+
+  if (self->n_async_running == 0)
+    {
+      self->async_running = FALSE;
+      g_main_context_wakeup (g_main_context_get_thread_default ());
+    }
+}
+
+/* Number of packages whose relabel timings are logged */
+#define RELABEL_N_LOGGED_TIMINGS 10
+
+static int
+compare_relabel_timings_slowest_first (gconstpointer ap,
+                                       gconstpointer bp)
+{
+  auto a = static_cast<const RpmOstreeRelabelTiming *>(ap);
+  auto b = static_cast<const RpmOstreeRelabelTiming *>(bp);
+  if (a->elapsed_usec != b->elapsed_usec)
+    return a->elapsed_usec > b->elapsed_usec ? -1 : 1;
+  return dnf_package_cmp (a->pkg, b->pkg);
 }
 
 static gboolean
@@ -3082,32 +4242,37 @@ relabel_if_necessary (RpmOstreeContext *self,
 
   g_assert (ostreerepo != NULL);
 
-  /* Prep a txn and tmpdir for all of the relabels */
+  auto span = rpmostreecxx::profile_span_begin("relabel");
+  span->add_counter("packages", n);
+
+  /* Prep a txn for all of the relabels */
   g_auto(RpmOstreeRepoAutoTransaction) txn = { 0, };
   if (!rpmostree_repo_auto_transaction_start (&txn, ostreerepo, FALSE, cancellable, error))
     return FALSE;
 
-  g_auto(GLnxTmpDir) relabel_tmpdir = { 0, };
-  if (!glnx_mkdtempat (ostree_repo_get_dfd (ostreerepo), "tmp/rpm-ostree-relabel.XXXXXX", 0700,
-                       &relabel_tmpdir, error))
-    return FALSE;
+  const guint n_to_relabel = self->pkgs_to_relabel->len;
+  g_autoptr(GPtrArray) pkgs = g_ptr_array_sized_new (n_to_relabel);
+  for (guint i = 0; i < n_to_relabel; i++)
+    g_ptr_array_add (pkgs, self->pkgs_to_relabel->pdata[i]);
+  /* Same rationale as for imports */
+  g_ptr_array_sort (pkgs, compare_pkgs_largest_first);
+  g_autoptr(GArray) timings = g_array_sized_new (FALSE, FALSE, sizeof (RpmOstreeRelabelTiming),
+                                                 n_to_relabel);
 
   self->async_running = TRUE;
+  self->async_index = 0;
+  self->n_async_running = 0;
+  self->n_async_max = get_concurrency (self, rpmostreecxx::ConcurrencyPhase::Relabel);
   self->async_cancellable = cancellable;
 
-  RpmOstreeAsyncRelabelData data = { self, 0, };
-  const guint n_to_relabel = self->pkgs_to_relabel->len;
+  RpmOstreeAsyncRelabelData data = { self, pkgs, timings, 0, };
   self->async_progress = rpmostreecxx::progress_nitems_begin(n_to_relabel, "Relabeling");
-  for (guint i = 0; i < n_to_relabel; i++)
-    {
-      auto pkg = static_cast<DnfPackage *>(self->pkgs_to_relabel->pdata[i]);
-      relabel_package_async (self, pkg, relabel_tmpdir.fd, cancellable,
-                             on_async_relabel_done, &data);
-    }
+  const gint64 start_time = g_get_monotonic_time ();
+  self->async_error = NULL;
+  async_relabel_mainctx_iter (&data);
 
   /* Wait for all of the relabeling to complete */
   GMainContext *mainctx = g_main_context_get_thread_default ();
-  self->async_error = NULL;
   while (self->async_running)
     g_main_context_iteration (mainctx, TRUE);
   if (self->async_error)
@@ -3123,9 +4288,33 @@ relabel_if_necessary (RpmOstreeContext *self,
   if (!ostree_repo_commit_transaction (ostreerepo, NULL, cancellable, error))
     return FALSE;
 
+  const guint64 elapsed_usec = g_get_monotonic_time () - start_time;
+  guint64 worker_usec = 0;
+  g_array_sort (timings, compare_relabel_timings_slowest_first);
+  g_autoptr(GString) timings_str = g_string_new ("");
+  for (guint i = 0; i < timings->len; i++)
+    {
+      auto timing = &g_array_index (timings, RpmOstreeRelabelTiming, i);
+      worker_usec += timing->elapsed_usec;
+      /* Only the slowest ones; the rest would just bloat the journal */
+      if (i >= RELABEL_N_LOGGED_TIMINGS)
+        continue;
+      if (i > 0)
+        g_string_append_c (timings_str, ' ');
+      g_string_append_printf (timings_str, "%s:%" G_GUINT64_FORMAT ":%u",
+                              dnf_package_get_nevra (timing->pkg),
+                              timing->elapsed_usec, timing->n_changed);
+    }
+
   sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL(RPMOSTREE_MESSAGE_SELINUX_RELABEL),
                    "MESSAGE=Relabeled %u/%u pkgs", data.n_changed_pkgs, n_to_relabel,
                    "RELABELED_PKGS=%u/%u", data.n_changed_pkgs, n_to_relabel,
+                   "RELABELED_OBJECTS=%u", data.n_changed_files,
+                   "RELABEL_ELAPSED_USEC=%" G_GUINT64_FORMAT, elapsed_usec,
+                   "RELABEL_WORKER_USEC=%" G_GUINT64_FORMAT, worker_usec,
+                   "RELABEL_WORKERS=%u", self->n_async_max,
+                   /* nevra:usec:n_objects, slowest first */
+                   "RELABEL_PKG_TIMINGS=%s", timings_str->str,
                    NULL);
 
   g_clear_pointer (&self->pkgs_to_relabel, (GDestroyNotify)g_ptr_array_unref);
@@ -3165,6 +4354,8 @@ rpmostree_context_force_relabel (RpmOstreeContext *self,
         g_ptr_array_add (self->pkgs_to_relabel, g_object_ref (pkg));
     }
 
+  pkgcache_index_flush_or_warn (self, cancellable);
+
   return relabel_if_necessary (self, cancellable, error);
 }
 
@@ -3226,7 +4417,6 @@ get_package_metainfo (RpmOstreeContext *self,
 
 typedef enum {
   RPMOSTREE_TS_FLAG_UPGRADE = (1 << 0),
-  RPMOSTREE_TS_FLAG_NOVALIDATE_SCRIPTS = (1 << 1),
 } RpmOstreeTsAddInstallFlags;
 
 static gboolean
@@ -3243,11 +4433,8 @@ rpmts_add_install (RpmOstreeContext *self,
   if (!get_package_metainfo (self, path, &hdr, NULL, error))
     return FALSE;
 
-  if (!(flags & RPMOSTREE_TS_FLAG_NOVALIDATE_SCRIPTS))
-    {
-      if (!rpmostree_script_txn_validate (pkg, hdr, cancellable, error))
-        return FALSE;
-    }
+  if (!rpmostree_script_txn_validate (pkg, hdr, cancellable, error))
+    return FALSE;
 
   const gboolean is_upgrade = (flags & RPMOSTREE_TS_FLAG_UPGRADE) > 0;
   if (rpmtsAddInstallElement (ts, hdr, pkg, is_upgrade, NULL) != 0)
@@ -3276,6 +4463,32 @@ rpmts_add_erase (RpmOstreeContext *self,
   return TRUE;
 }
 
+/* Create the sandbox shared by all scripts of one phase; when rofiles is
+ * enabled, this means we only mount rofiles-fuse once per phase rather than
+ * once per script.  As root, the `script-overlayfs` treefile option opts into
+ * the (faster, but newer) kernel overlayfs protection instead; so does
+ * RPMOSTREE_SCRIPT_OVERLAYFS, which also covers client-side layering and
+ * makes comparing the two on the same treefile easy.
+ */
+static rpmostreecxx::BubblewrapMutability
+get_script_mutability (RpmOstreeContext *self)
+{
+  if (!self->enable_rofiles)
+    return rpmostreecxx::BubblewrapMutability::MutateFreely;
+  const gboolean overlayfs = getenv ("RPMOSTREE_SCRIPT_OVERLAYFS") != NULL ||
+    (self->treefile_rs && self->treefile_rs->get_script_overlayfs());
+  if (getuid () == 0 && overlayfs)
+    return rpmostreecxx::BubblewrapMutability::Overlay;
+  return rpmostreecxx::BubblewrapMutability::RoFiles;
+}
+
+static rust::Box<rpmostreecxx::BubblewrapSandbox>
+new_script_sandbox (RpmOstreeContext *self,
+                    int               rootfs_dfd)
+{
+  return rpmostreecxx::bubblewrap_sandbox_new (rootfs_dfd, get_script_mutability (self));
+}
+
 /* Look up the header for a package, and pass it
  * to the script core to execute.
  */
@@ -3283,6 +4496,7 @@ static gboolean
 run_script_sync (RpmOstreeContext *self,
                  int rootfs_dfd,
                  GLnxTmpDir *var_lib_rpm_statedir,
+                 rpmostreecxx::BubblewrapSandbox &sandbox,
                  DnfPackage *pkg,
                  RpmOstreeScriptKind kind,
                  guint        *out_n_run,
@@ -3295,21 +4509,330 @@ run_script_sync (RpmOstreeContext *self,
   if (!get_package_metainfo (self, path, &hdr, NULL, error))
     return FALSE;
 
+  auto span = profile_pkg_span_begin ("script", pkg);
   if (!rpmostree_script_run_sync (pkg, hdr, kind, rootfs_dfd, var_lib_rpm_statedir,
-                                  self->enable_rofiles, out_n_run, cancellable, error))
+                                  sandbox, out_n_run, cancellable, error))
     return FALSE;
 
   return TRUE;
 }
 
+/* 1 means the %post scripts run serially.  With overlayfs, every script's
+ * changes are merged back into the rootfs afterwards, so those can't run
+ * concurrently.
+ */
+static guint
+get_post_script_concurrency (RpmOstreeContext *self)
+{
+  if (get_script_mutability (self) == rpmostreecxx::BubblewrapMutability::Overlay)
+    return 1;
+  return get_concurrency (self, rpmostreecxx::ConcurrencyPhase::PostScripts);
+}
+
+typedef struct {
+  DnfPackage *pkg;
+  Header hdr;
+  /* Indices of the jobs waiting on this one */
+  GArray *dependents;
+  guint n_pending_deps;
+  gboolean started;
+} PostScriptJob;
+
+static void
+post_script_job_clear (gpointer data)
+{
+  auto job = static_cast<PostScriptJob*>(data);
+  g_clear_pointer (&job->hdr, headerFree);
+  g_clear_pointer (&job->dependents, g_array_unref);
+}
+
+typedef struct {
+  RpmOstreeContext *self;
+  int rootfs_dfd;
+  GLnxTmpDir *var_lib_rpm_statedir;
+  GArray *jobs;
+  GMutex lock;
+  GCond cond;
+  guint n_done;
+  guint n_run;
+  GError *error;
+  GCancellable *cancellable;
+} PostScriptScheduler;
+
+static void
+post_script_job_add_dependent (GArray *jobs,
+                               guint   dep,
+                               guint   dependent)
+{
+  auto job = &g_array_index (jobs, PostScriptJob, dep);
+  g_array_append_val (job->dependents, dependent);
+  g_array_index (jobs, PostScriptJob, dependent).n_pending_deps++;
+}
+
+static gpointer
+post_script_worker (gpointer data)
+{
+  auto sched = static_cast<PostScriptScheduler*>(data);
+  /* Each worker has its own sandbox (and hence e.g. rofiles-fuse mounts) */
+  std::optional<rust::Box<rpmostreecxx::BubblewrapSandbox>> sandbox;
+
+  g_mutex_lock (&sched->lock);
+  while (sched->n_done < sched->jobs->len && !sched->error)
+    {
+      /* Prefer the earliest ready job, i.e. stay close to rpmts order */
+      PostScriptJob *job = NULL;
+      for (guint i = 0; i < sched->jobs->len && !job; i++)
+        {
+          auto candidate = &g_array_index (sched->jobs, PostScriptJob, i);
+          if (!candidate->started && candidate->n_pending_deps == 0)
+            job = candidate;
+        }
+      if (!job)
+        {
+          g_cond_wait (&sched->cond, &sched->lock);
+          continue;
+        }
+      job->started = TRUE;
+      g_mutex_unlock (&sched->lock);
+
+      guint n_run = 0;
+      g_autoptr(GError) local_error = NULL;
+      try {
+        if (!sandbox)
+          sandbox = new_script_sandbox (sched->self, sched->rootfs_dfd);
+        auto span = profile_pkg_span_begin ("script", job->pkg);
+        (void) rpmostree_script_run_sync (job->pkg, job->hdr, RPMOSTREE_SCRIPT_POSTIN,
+                                          sched->rootfs_dfd, sched->var_lib_rpm_statedir,
+                                          **sandbox, &n_run, sched->cancellable, &local_error);
+      } catch (std::exception& e) {
+        local_error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED, e.what());
+      }
+
+      g_mutex_lock (&sched->lock);
+      sched->n_done++;
+      sched->n_run += n_run;
+      if (local_error && !sched->error)
+        sched->error = util::move_nullify (local_error);
+      for (guint i = 0; i < job->dependents->len; i++)
+        {
+          guint dependent = g_array_index (job->dependents, guint, i);
+          g_array_index (sched->jobs, PostScriptJob, dependent).n_pending_deps--;
+        }
+      g_cond_broadcast (&sched->cond);
+    }
+  g_mutex_unlock (&sched->lock);
+
+  return NULL;
+}
+
+/* Run the %post scripts of the packages added in @tes (in rpmts order) on
+ * @n_workers threads.  The scripts are scheduled as a DAG: each one waits for
+ * those of the earlier packages satisfying its install-time dependencies
+ * (e.g. Requires(post)), and scripts not known to be parallel safe (see
+ * rpmostree_script_is_parallel_safe()) are barriers which run alone.
+ */
+static gboolean
+run_post_scripts_dag (RpmOstreeContext *self,
+                      GPtrArray        *tes,
+                      int               rootfs_dfd,
+                      GLnxTmpDir       *var_lib_rpm_statedir,
+                      guint             n_workers,
+                      guint            *out_n_run,
+                      GCancellable     *cancellable,
+                      GError          **error)
+{
+  g_autoptr(GArray) jobs = g_array_new (FALSE, TRUE, sizeof (PostScriptJob));
+  g_array_set_clear_func (jobs, post_script_job_clear);
+  g_autoptr(GPtrArray) job_tes = g_ptr_array_new ();
+  /* Provide name -> indices (ascending) of the jobs with that provide */
+  g_autoptr(GHashTable) providers =
+    g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_array_unref);
+
+  for (guint i = 0; i < tes->len; i++)
+    {
+      auto te = static_cast<rpmte>(tes->pdata[i]);
+      auto pkg = (DnfPackage *)(rpmteKey (te));
+      g_autofree char *path = get_package_relpath (pkg);
+      PostScriptJob job = { pkg, NULL, g_array_new (FALSE, FALSE, sizeof (guint)), 0, FALSE };
+      if (!get_package_metainfo (self, path, &job.hdr, NULL, error))
+        {
+          post_script_job_clear (&job);
+          return FALSE;
+        }
+      const guint idx = jobs->len;
+      g_array_append_val (jobs, job);
+      g_ptr_array_add (job_tes, te);
+
+      rpmds provides = rpmdsInit (rpmteDS (te, RPMTAG_PROVIDENAME));
+      while (rpmdsNext (provides) >= 0)
+        {
+          const char *provname = rpmdsN (provides);
+          auto idxs = static_cast<GArray*>(g_hash_table_lookup (providers, provname));
+          if (!idxs)
+            {
+              idxs = g_array_new (FALSE, FALSE, sizeof (guint));
+              g_hash_table_insert (providers, (gpointer)provname, idxs);
+            }
+          if (idxs->len == 0 || g_array_index (idxs, guint, idxs->len - 1) != idx)
+            g_array_append_val (idxs, idx);
+        }
+    }
+
+  /* Build the edges */
+  const auto mutability = get_script_mutability (self);
+  guint n_barriers = 0;
+  gint last_barrier = -1;
+  g_autoptr(GHashTable) deps = g_hash_table_new (NULL, NULL);
+  for (guint i = 0; i < jobs->len; i++)
+    {
+      auto job = &g_array_index (jobs, PostScriptJob, i);
+      /* Everything up to the last barrier finished before it started */
+      const guint first_pending = last_barrier + 1;
+      g_hash_table_remove_all (deps);
+      if (last_barrier >= 0)
+        g_hash_table_add (deps, GUINT_TO_POINTER (last_barrier));
+
+      if (!rpmostree_script_is_parallel_safe (job->pkg, job->hdr, RPMOSTREE_SCRIPT_POSTIN, mutability))
+        {
+          for (guint j = first_pending; j < i; j++)
+            g_hash_table_add (deps, GUINT_TO_POINTER (j));
+          last_barrier = i;
+          n_barriers++;
+        }
+      else
+        {
+          auto te = static_cast<rpmte>(job_tes->pdata[i]);
+          rpmds requires = rpmdsInit (rpmteDS (te, RPMTAG_REQUIRENAME));
+          while (rpmdsNext (requires) >= 0)
+            {
+              if (!isInstallPreReq (rpmdsFlags (requires)))
+                continue;
+              const char *reqname = rpmdsN (requires);
+              if (*reqname == '/')
+                {
+                  for (guint j = first_pending; j < i; j++)
+                    {
+                      g_auto(rpmfiles) files = rpmteFiles (static_cast<rpmte>(job_tes->pdata[j]));
+                      if (files && rpmfilesFindFN (files, reqname) >= 0)
+                        g_hash_table_add (deps, GUINT_TO_POINTER (j));
+                    }
+                }
+              auto idxs = static_cast<GArray*>(g_hash_table_lookup (providers, reqname));
+              for (guint k = 0; idxs && k < idxs->len; k++)
+                {
+                  guint j = g_array_index (idxs, guint, k);
+                  if (j >= i)
+                    break;
+                  if (j < first_pending)
+                    continue;
+                  rpmds provides = rpmdsInit (rpmteDS (static_cast<rpmte>(job_tes->pdata[j]), RPMTAG_PROVIDENAME));
+                  while (rpmdsNext (provides) >= 0)
+                    {
+                      if (rpmdsCompare (provides, requires))
+                        {
+                          g_hash_table_add (deps, GUINT_TO_POINTER (j));
+                          break;
+                        }
+                    }
+                }
+            }
+        }
+
+      GHashTableIter it;
+      gpointer key;
+      g_hash_table_iter_init (&it, deps);
+      while (g_hash_table_iter_next (&it, &key, NULL))
+        post_script_job_add_dependent (jobs, GPOINTER_TO_UINT (key), i);
+    }
+  g_debug ("Scheduling %u %%post jobs on %u workers; %u barriers", jobs->len, n_workers, n_barriers);
+
+  PostScriptScheduler sched = { self, rootfs_dfd, var_lib_rpm_statedir, jobs, };
+  sched.cancellable = cancellable;
+  g_mutex_init (&sched.lock);
+  g_cond_init (&sched.cond);
+  n_workers = MIN (n_workers, MAX (jobs->len, 1));
+  g_autoptr(GPtrArray) workers = g_ptr_array_new ();
+  for (guint i = 0; i < n_workers; i++)
+    g_ptr_array_add (workers, g_thread_new ("post-script", post_script_worker, &sched));
+  for (guint i = 0; i < workers->len; i++)
+    g_thread_join (static_cast<GThread*>(workers->pdata[i]));
+  g_mutex_clear (&sched.lock);
+  g_cond_clear (&sched.cond);
+
+  *out_n_run += sched.n_run;
+  if (sched.error)
+    {
+      g_propagate_error (error, sched.error);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Whether the file @fi is at has an owner, mode or capabilities which
+ * apply_rpmfi_overrides() needs to set after checkout.
+ */
+static gboolean
+rpmfi_needs_override (rpmfi fi)
+{
+  const char *user = rpmfiFUser (fi) ?: "root";
+  const char *group = rpmfiFGroup (fi) ?: "root";
+  const char *fcaps = rpmfiFCaps (fi) ?: "";
+  /* If we hardlinked from a bare-user repo, we won't have these higher bits
+   * set. The intention there is to avoid having transient suid binaries
+   * exposed, but in practice today for rpm-ostree we use the "inaccessible
+   * directory" pattern in repo/tmp.
+   *
+   * Another thing we could do down the line is to not chown things on disk
+   * and instead pass this data down into the commit modifier. That's in
+   * fact how gnome-continuous always worked.
+   */
+  const gboolean has_non_bare_user_mode =
+    (rpmfiFMode (fi) & (S_ISUID | S_ISGID | S_ISVTX)) > 0;
+  return !(g_str_equal (user, "root") &&
+           g_str_equal (group, "root") &&
+           !has_non_bare_user_mode &&
+           fcaps[0] == '\0');
+}
+
+/* Whether apply_rpmfi_overrides() may have anything to do for @pkg */
+static gboolean
+package_has_rpmfi_overrides (RpmOstreeContext *self,
+                             DnfPackage       *pkg,
+                             gboolean         *out_has_overrides,
+                             GError          **error)
+{
+  *out_has_overrides = FALSE;
+  /* See apply_rpmfi_overrides() */
+  if (getuid () != 0)
+    return TRUE;
+
+  g_auto(rpmfi) fi = NULL;
+  g_autofree char *path = get_package_relpath (pkg);
+  if (!get_package_metainfo (self, path, NULL, &fi, error))
+    return FALSE;
+  while (rpmfiNext (fi) >= 0)
+    {
+      if (rpmfi_needs_override (fi))
+        {
+          *out_has_overrides = TRUE;
+          break;
+        }
+    }
+  return TRUE;
+}
+
 static gboolean
 apply_rpmfi_overrides (RpmOstreeContext *self,
                        int            tmprootfs_dfd,
                        DnfPackage    *pkg,
                        rpmostreecxx::PasswdEntries &passwd_entries,
+                       gboolean      *out_modified,
                        GCancellable  *cancellable,
                        GError       **error)
 {
+  if (out_modified)
+    *out_modified = FALSE;
+
   /* In an unprivileged case, we can't do this on the real filesystem. For `ex
    * container`, we want to completely ignore uid/gid.
    *
@@ -3335,22 +4858,8 @@ apply_rpmfi_overrides (RpmOstreeContext *self,
       rpm_mode_t mode = rpmfiFMode (fi);
       rpmfileAttrs fattrs = rpmfiFFlags (fi);
       const gboolean is_ghost = fattrs & RPMFILE_GHOST;
-      /* If we hardlinked from a bare-user repo, we won't have these higher bits
-       * set. The intention there is to avoid having transient suid binaries
-       * exposed, but in practice today for rpm-ostree we use the "inaccessible
-       * directory" pattern in repo/tmp.
-       *
-       * Another thing we could do down the line is to not chown things on disk
-       * and instead pass this data down into the commit modifier. That's in
-       * fact how gnome-continuous always worked.
-       */
-      const gboolean has_non_bare_user_mode =
-        (mode & (S_ISUID | S_ISGID | S_ISVTX)) > 0;
 
-      if (g_str_equal (user, "root") &&
-          g_str_equal (group, "root") &&
-          !has_non_bare_user_mode &&
-          !have_fcaps)
+      if (!rpmfi_needs_override (fi))
         continue;
 
       /* In theory, RPMs could contain block devices or FIFOs; we would normally
@@ -3447,6 +4956,8 @@ apply_rpmfi_overrides (RpmOstreeContext *self,
 
       if (fchownat (tmprootfs_dfd, fn, uid, gid, AT_SYMLINK_NOFOLLOW) != 0)
         return glnx_throw_errno_prefix (error, "fchownat(%s)", fn);
+      if (out_modified)
+        *out_modified = TRUE;
 
       /* the chown clears away file caps, so reapply it here */
       if (have_fcaps)
@@ -3469,6 +4980,58 @@ apply_rpmfi_overrides (RpmOstreeContext *self,
   return TRUE;
 }
 
+/* Run the %post scripts of the packages added in @ordering_ts on @n_workers
+ * threads (see run_post_scripts_dag()), and apply their rpmfi overrides.  As
+ * in the serial path, each package's overrides must be applied after the
+ * scripts of the packages before it and before its own; so the packages are
+ * split into runs at each package which has overrides, and those are applied
+ * between the runs.
+ */
+static gboolean
+run_post_scripts_parallel (RpmOstreeContext *self,
+                           rpmts             ordering_ts,
+                           int               rootfs_dfd,
+                           GLnxTmpDir       *var_lib_rpm_statedir,
+                           rpmostreecxx::PasswdEntries &passwd_entries,
+                           guint             n_workers,
+                           guint            *out_n_run,
+                           GCancellable     *cancellable,
+                           GError          **error)
+{
+  g_autoptr(GPtrArray) run = g_ptr_array_new ();
+  const guint n_rpmts_elements = (guint)rpmtsNElements (ordering_ts);
+  for (guint i = 0; i < n_rpmts_elements; i++)
+    {
+      rpmte te = rpmtsElement (ordering_ts, i);
+      if (rpmteType (te) != TR_ADDED)
+        continue;
+      auto pkg = (DnfPackage *)(rpmteKey (te));
+
+      gboolean has_overrides;
+      if (!package_has_rpmfi_overrides (self, pkg, &has_overrides, error))
+        return FALSE;
+      if (has_overrides)
+        {
+          if (run->len > 0 &&
+              !run_post_scripts_dag (self, run, rootfs_dfd, var_lib_rpm_statedir,
+                                     n_workers, out_n_run, cancellable, error))
+            return FALSE;
+          g_ptr_array_set_size (run, 0);
+          if (!apply_rpmfi_overrides (self, rootfs_dfd, pkg, passwd_entries,
+                                      NULL, cancellable, error))
+            return glnx_prefix_error (error, "While applying overrides for pkg %s",
+                                      dnf_package_get_name (pkg));
+        }
+      g_ptr_array_add (run, te);
+    }
+
+  if (run->len > 0 &&
+      !run_post_scripts_dag (self, run, rootfs_dfd, var_lib_rpm_statedir,
+                             n_workers, out_n_run, cancellable, error))
+    return FALSE;
+  return TRUE;
+}
+
 static gboolean
 add_install (RpmOstreeContext *self,
              DnfPackage       *pkg,
@@ -3520,64 +5083,408 @@ static gboolean
 run_all_transfiletriggers (RpmOstreeContext *self,
                            rpmts         ts,
                            int           rootfs_dfd,
+                           rpmostreecxx::BubblewrapSandbox &sandbox,
                            guint        *out_n_run,
                            GCancellable *cancellable,
                            GError      **error)
 {
+  auto span = rpmostreecxx::profile_span_begin("transfiletriggers");
+  /* Index the rootfs for all triggers, and record which files changed */
+  g_autoptr(RpmOstreeTransFileTriggerIndex) index =
+    rpmostree_transfiletrigger_index_new (rootfs_dfd);
+
+  g_autoptr(GPtrArray) added_headers = g_ptr_array_new_with_free_func ((GDestroyNotify)headerFree);
+  const guint n = (guint)rpmtsNElements (ts);
+  for (guint i = 0; i < n; i++)
+    {
+      rpmte te = rpmtsElement (ts, i);
+      g_auto(rpmfiles) files = rpmteFiles (te);
+      g_auto(rpmfi) fi = rpmfilesIter (files, RPMFI_ITER_FWD);
+      while (rpmfiNext (fi) >= 0)
+        {
+          const char *fn = rpmfiFN (fi);
+          fn += strspn (fn, "/");
+          g_autofree char *fn_owned = canonicalize_non_usrmove_path (self, fn);
+          rpmostree_transfiletrigger_index_add_file (index, fn_owned ?: fn);
+        }
+
+      if (rpmteType (te) != TR_ADDED)
+        continue;
+      DnfPackage *pkg = (DnfPackage*)rpmteKey (te);
+      g_autofree char *path = get_package_relpath (pkg);
+      Header hdr = NULL;
+      if (!get_package_metainfo (self, path, &hdr, NULL, error))
+        return FALSE;
+      g_ptr_array_add (added_headers, hdr);
+    }
+
   /* Triggers from base packages, but only if we already have an rpmdb,
    * otherwise librpm will whine on our stderr.
    */
   if (!glnx_fstatat_allow_noent (rootfs_dfd, RPMOSTREE_RPMDB_LOCATION, NULL, AT_SYMLINK_NOFOLLOW, error))
     return FALSE;
-  if (errno == 0)
+  if (errno == 0)
+    {
+      g_auto(rpmdbMatchIterator) mi = rpmtsInitIterator (ts, RPMDBI_PACKAGES, NULL, 0);
+      Header hdr;
+      while ((hdr = rpmdbNextIterator (mi)) != NULL)
+        {
+          if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, index, FALSE, sandbox,
+                                                     out_n_run,
+                                                     cancellable, error))
+            return FALSE;
+        }
+    }
+
+  /* Triggers from newly added packages */
+  for (guint i = 0; i < added_headers->len; i++)
+    {
+      auto hdr = static_cast<Header>(added_headers->pdata[i]);
+      if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, index, TRUE, sandbox,
+                                                 out_n_run, cancellable, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+/* Set the root directory fd used for assemble(); used
+ * by the sysroot upgrader for the base tree.  This is optional;
+ * assemble() will use a tmpdir if not provided.
+ */
+void
+rpmostree_context_set_tmprootfs_dfd (RpmOstreeContext *self,
+                                     int               dfd)
+{
+  g_assert_cmpint (self->tmprootfs_dfd, ==, -1);
+  self->tmprootfs_dfd = dfd;
+}
+
+int
+rpmostree_context_get_tmprootfs_dfd  (RpmOstreeContext *self)
+{
+  return self->tmprootfs_dfd;
+}
+
+static const char *kernel_names[] = {"kernel", "kernel-core", "kernel-rt", "kernel-rt-core", NULL};
+
+/* Sparse base checkouts: for client-side layering, materializing all of the
+ * base commit just to e.g. remove a package is a lot of I/O.  Instead, we can
+ * check out only the directories a transaction touches (@dirs, whose other
+ * entries are checked out but not their subdirectories), and whole subtrees
+ * of things the transaction or our own postprocessing reads or writes
+ * (@subtrees).  Everything skipped is grafted back in by checksum at commit
+ * time; see sparse_graft_skipped().  Paths are relative, without a leading /.
+ */
+
+static void
+sparse_add_dir (GHashTable *dirs,
+                const char *path)
+{
+  g_autofree char *dir = g_strdup (path);
+  while (!g_hash_table_contains (dirs, dir))
+    {
+      char *slash = strrchr (dir, '/');
+      g_hash_table_add (dirs, g_strdup (dir));
+      if (!slash)
+        {
+          g_hash_table_add (dirs, g_strdup (""));
+          break;
+        }
+      *slash = '\0';
+    }
+}
+
+/* Return the paths which are always needed: the rpmdb, /etc (for the
+ * sepolicy, passwd and repos), and enough of /usr to run the bwrap sanity
+ * check.
+ */
+void
+rpmostree_sparse_paths_new (GHashTable **out_dirs,
+                            GHashTable **out_subtrees)
+{
+  g_autoptr(GHashTable) dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GHashTable) subtrees = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  static const char *bootstrap_dirs[] = { "usr/bin", "usr/sbin", "usr/lib", "usr/lib64" };
+  static const char *bootstrap_subtrees[] = { RPMOSTREE_RPMDB_LOCATION, "usr/etc",
+                                              "usr/lib/rpm", "usr/lib/sysimage",
+                                              "usr/lib/tmpfiles.d" };
+  for (guint i = 0; i < G_N_ELEMENTS (bootstrap_dirs); i++)
+    sparse_add_dir (dirs, bootstrap_dirs[i]);
+  for (guint i = 0; i < G_N_ELEMENTS (bootstrap_subtrees); i++)
+    {
+      g_autofree char *parent = g_path_get_dirname (bootstrap_subtrees[i]);
+      sparse_add_dir (dirs, parent);
+      g_hash_table_add (subtrees, g_strdup (bootstrap_subtrees[i]));
+    }
+  *out_dirs = util::move_nullify (dirs);
+  *out_subtrees = util::move_nullify (subtrees);
+}
+
+typedef struct {
+  GHashTable *dirs;
+  GHashTable *subtrees;
+  GPtrArray  *skipped;
+} SparseFilterData;
+
+static OstreeRepoCheckoutFilterResult
+sparse_checkout_filter (OstreeRepo         *repo,
+                        const char         *path,
+                        struct stat        *st_buf,
+                        gpointer            user_data)
+{
+  auto data = static_cast<SparseFilterData *>(user_data);
+  path += strspn (path, "/");
+
+  /* The other toplevel directories are tiny, and some are mountpoints for bwrap */
+  if (!strchr (path, '/') && !g_str_equal (path, "usr"))
+    return OSTREE_REPO_CHECKOUT_FILTER_ALLOW;
+  /* We only get here for entries of directories we checked out */
+  if (!S_ISDIR (st_buf->st_mode) || g_hash_table_contains (data->dirs, path))
+    return OSTREE_REPO_CHECKOUT_FILTER_ALLOW;
+  g_autofree char *subtree = g_strdup (path);
+  while (TRUE)
+    {
+      if (g_hash_table_contains (data->subtrees, subtree))
+        return OSTREE_REPO_CHECKOUT_FILTER_ALLOW;
+      char *slash = strrchr (subtree, '/');
+      if (!slash)
+        break;
+      *slash = '\0';
+    }
+
+  if (data->skipped)
+    g_ptr_array_add (data->skipped, g_strdup (path));
+  return OSTREE_REPO_CHECKOUT_FILTER_SKIP;
+}
+
+/* Check out @rev to @dfd/@path, or add to an existing checkout of it.  If
+ * @dirs is %NULL, the whole tree is checked out; otherwise, see above.
+ */
+gboolean
+rpmostree_checkout_sparse (OstreeRepo            *repo,
+                           const char            *rev,
+                           int                    dfd,
+                           const char            *path,
+                           OstreeRepoDevInoCache *devino_cache,
+                           GHashTable            *dirs,
+                           GHashTable            *subtrees,
+                           GPtrArray            **out_skipped,
+                           GCancellable          *cancellable,
+                           GError               **error)
+{
+  g_autoptr(GPtrArray) skipped = g_ptr_array_new_with_free_func (g_free);
+  SparseFilterData filter_data = { dirs, subtrees, skipped };
+  /* Anything already there is from @rev too */
+  OstreeRepoCheckoutAtOptions checkout_options =
+    { .overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_ADD_FILES,
+      .devino_to_csum_cache = devino_cache };
+  if (dirs)
+    {
+      g_assert (subtrees);
+      checkout_options.filter = sparse_checkout_filter;
+      checkout_options.filter_user_data = &filter_data;
+    }
+  if (!ostree_repo_checkout_at (repo, &checkout_options, dfd, path, rev,
+                                cancellable, error))
+    return FALSE;
+
+  if (out_skipped)
+    *out_skipped = util::move_nullify (skipped);
+  return TRUE;
+}
+
+/* Add @path from a package file list, canonicalized for usrmove */
+static void
+sparse_add_pkg_path (GHashTable       *dirs,
+                     GHashTable       *subtrees,
+                     const char       *path)
+{
+  g_autofree char *translated = rpmostree_translate_path_for_ostree (path);
+  if (translated)
+    path = translated;
+
+  /* It might be a directory, in which case we need all of it to know
+   * whether it's empty after the removal.
+   */
+  g_hash_table_add (subtrees, g_strdup (path));
+  g_autofree char *parent = g_path_get_dirname (path);
+  sparse_add_dir (dirs, g_str_equal (parent, ".") ? "" : parent);
+}
+
+/* Whether any package in the base rpmdb has a %transfiletriggerin that the
+ * removals in @index would fire.
+ */
+static gboolean
+removals_fire_transfiletriggers (RpmOstreeContext               *self,
+                                 RpmOstreeTransFileTriggerIndex *index)
+{
+  g_auto(rpmts) ts = rpmtsCreate ();
+  rpmtsSetRootDir (ts, dnf_context_get_install_root (self->dnfctx));
+  set_rpm_macro_define ("_dbpath", "/" RPMOSTREE_RPMDB_LOCATION);
+  rpmtsSetVSFlags (ts, _RPMVSF_NOSIGNATURES | _RPMVSF_NODIGESTS);
+
+  g_auto(rpmdbMatchIterator) mi = rpmtsInitIterator (ts, RPMDBI_PACKAGES, NULL, 0);
+  /* If we can't tell, assume they do */
+  if (!mi)
+    return TRUE;
+  Header hdr;
+  while ((hdr = rpmdbNextIterator (mi)) != NULL)
+    {
+      if (rpmostree_transfiletriggers_match (hdr, index))
+        return TRUE;
+    }
+  return FALSE;
+}
+
+/* If the transaction can be done on a sparse checkout of the base at
+ * @rootfs_dfd, return the paths it needs, otherwise %NULL.  Today that's only
+ * the case when we're just removing packages: anything added runs scripts and
+ * %transfiletriggerin, which may look at the whole tree.  The same goes for
+ * removals matching a %transfiletriggerin, since we run those in place of
+ * %transfiletriggerpostun.  Removing the kernel means regenerating the
+ * initramfs, which also needs everything.  The caller is responsible for
+ * checking that its own postprocessing doesn't.
+ */
+gboolean
+rpmostree_context_get_sparse_paths (RpmOstreeContext *self,
+                                    int               rootfs_dfd,
+                                    GHashTable      **out_dirs,
+                                    GHashTable      **out_subtrees,
+                                    GError          **error)
+{
+  *out_dirs = *out_subtrees = NULL;
+  if (self->empty)
+    return TRUE;
+
+  HyGoal goal = dnf_context_get_goal (self->dnfctx);
+  g_autoptr(GPtrArray) installs =
+    dnf_goal_get_packages (goal, DNF_PACKAGE_INFO_INSTALL, DNF_PACKAGE_INFO_UPDATE,
+                           DNF_PACKAGE_INFO_DOWNGRADE, -1);
+  g_autoptr(GPtrArray) removals =
+    dnf_goal_get_packages (goal, DNF_PACKAGE_INFO_REMOVE, DNF_PACKAGE_INFO_OBSOLETE, -1);
+  if (installs->len > 0 || removals->len == 0)
+    return TRUE;
+
+  /* The toplevel symlinks are always checked out */
+  if (!build_rootfs_usrlinks (self, rootfs_dfd, error))
+    return FALSE;
+
+  g_autoptr(GHashTable) dirs = NULL;
+  g_autoptr(GHashTable) subtrees = NULL;
+  rpmostree_sparse_paths_new (&dirs, &subtrees);
+  g_autoptr(RpmOstreeTransFileTriggerIndex) index =
+    rpmostree_transfiletrigger_index_new (rootfs_dfd);
+  for (guint i = 0; i < removals->len; i++)
     {
-      g_auto(rpmdbMatchIterator) mi = rpmtsInitIterator (ts, RPMDBI_PACKAGES, NULL, 0);
-      Header hdr;
-      while ((hdr = rpmdbNextIterator (mi)) != NULL)
+      auto pkg = static_cast<DnfPackage *>(removals->pdata[i]);
+      if (g_strv_contains (kernel_names, dnf_package_get_name (pkg)))
+        return TRUE;
+      g_auto(GStrv) files = dnf_package_get_files (pkg);
+      for (char **it = files; it && *it; it++)
         {
-          if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, self->enable_rofiles,
-                                                     out_n_run,
-                                                     cancellable, error))
-            return FALSE;
+          /* The kernel is handled specially; see rpmostree_kernel_remove() */
+          if (g_str_has_prefix (*it, "/usr/lib/modules/") || g_str_has_prefix (*it, "/boot/"))
+            return TRUE;
+          const char *path = *it + strspn (*it, "/");
+          g_autofree char *canonpath = canonicalize_non_usrmove_path (self, path);
+          if (canonpath)
+            path = canonpath;
+          rpmostree_transfiletrigger_index_add_file (index, path);
+          sparse_add_pkg_path (dirs, subtrees, path);
         }
     }
 
-  /* Triggers from newly added packages */
-  const guint n = (guint)rpmtsNElements (ts);
-  for (guint i = 0; i < n; i++)
-    {
-      rpmte te = rpmtsElement (ts, i);
-      if (rpmteType (te) != TR_ADDED)
-        continue;
-      DnfPackage *pkg = (DnfPackage*)rpmteKey (te);
-      g_autofree char *path = get_package_relpath (pkg);
-      g_auto(Header) hdr = NULL;
-      if (!get_package_metainfo (self, path, &hdr, NULL, error))
-        return FALSE;
+  if (removals_fire_transfiletriggers (self, index))
+    return TRUE;
 
-      if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, self->enable_rofiles,
-                                                 out_n_run, cancellable, error))
-        return FALSE;
-    }
+  *out_dirs = util::move_nullify (dirs);
+  *out_subtrees = util::move_nullify (subtrees);
   return TRUE;
 }
 
-/* Set the root directory fd used for assemble(); used
- * by the sysroot upgrader for the base tree.  This is optional;
- * assemble() will use a tmpdir if not provided.
+/* Tell the context that tmprootfs is a sparse checkout of @base_commit
+ * missing the directories @skipped.
  */
 void
-rpmostree_context_set_tmprootfs_dfd (RpmOstreeContext *self,
-                                     int               dfd)
+rpmostree_context_set_sparse_base (RpmOstreeContext *self,
+                                   const char       *base_commit,
+                                   GPtrArray        *skipped)
 {
-  g_assert_cmpint (self->tmprootfs_dfd, ==, -1);
-  self->tmprootfs_dfd = dfd;
+  g_free (self->sparse_base_commit);
+  self->sparse_base_commit = g_strdup (base_commit);
+  g_clear_pointer (&self->sparse_skipped, g_ptr_array_unref);
+  self->sparse_skipped = g_ptr_array_ref (skipped);
 }
 
-int
-rpmostree_context_get_tmprootfs_dfd  (RpmOstreeContext *self)
+/* Called before committing a sparse tmprootfs.  Anything we skipped which
+ * has since been created (or all of them, if the policy changed and we need
+ * to relabel) gets checked out after all; everything else is grafted into
+ * @mtree after the walk by sparse_graft_skipped().
+ */
+static gboolean
+sparse_complete_skipped (RpmOstreeContext *self,
+                         gboolean          complete_all,
+                         GCancellable     *cancellable,
+                         GError          **error)
 {
-  return self->tmprootfs_dfd;
+  g_autoptr(GPtrArray) to_graft = g_ptr_array_new_with_free_func (g_free);
+  for (guint i = 0; i < self->sparse_skipped->len; i++)
+    {
+      auto path = static_cast<const char *>(self->sparse_skipped->pdata[i]);
+      if (!complete_all)
+        {
+          if (!glnx_fstatat_allow_noent (self->tmprootfs_dfd, path, NULL, AT_SYMLINK_NOFOLLOW, error))
+            return FALSE;
+          if (errno == ENOENT)
+            {
+              g_ptr_array_add (to_graft, g_strdup (path));
+              continue;
+            }
+        }
+
+      g_autofree char *subpath = g_strconcat ("/", path, NULL);
+      OstreeRepoCheckoutAtOptions checkout_options =
+        { .overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_ADD_FILES,
+          .subpath = subpath,
+          .devino_to_csum_cache = self->devino_cache };
+      if (!ostree_repo_checkout_at (self->ostreerepo, &checkout_options,
+                                    self->tmprootfs_dfd, path, self->sparse_base_commit,
+                                    cancellable, error))
+        return glnx_prefix_error (error, "Completing %s", path);
+    }
+
+  g_clear_pointer (&self->sparse_skipped, g_ptr_array_unref);
+  self->sparse_skipped = util::move_nullify (to_graft);
+  return TRUE;
+}
+
+static gboolean
+sparse_graft_skipped (RpmOstreeContext  *self,
+                      OstreeMutableTree *mtree,
+                      GCancellable      *cancellable,
+                      GError           **error)
+{
+  g_autoptr(GFile) base_root = NULL;
+  if (!ostree_repo_read_commit (self->ostreerepo, self->sparse_base_commit, &base_root,
+                                NULL, cancellable, error))
+    return FALSE;
+
+  for (guint i = 0; i < self->sparse_skipped->len; i++)
+    {
+      auto path = static_cast<const char *>(self->sparse_skipped->pdata[i]);
+      g_autoptr(GFile) base_dir = g_file_resolve_relative_path (base_root, path);
+      auto base_repofile = OSTREE_REPO_FILE (base_dir);
+      if (!ostree_repo_file_ensure_resolved (base_repofile, error))
+        return FALSE;
+
+      if (!rpmostree_mtree_graft_dirtree (mtree, path, self->ostreerepo,
+                                          ostree_repo_file_tree_get_contents_checksum (base_repofile),
+                                          ostree_repo_file_tree_get_metadata_checksum (base_repofile),
+                                          error))
+        return glnx_prefix_error (error, "Grafting from base");
+    }
+
+  return TRUE;
 }
 
 /* Determine if a txn element contains vmlinuz via provides.
@@ -3586,7 +5493,6 @@ rpmostree_context_get_tmprootfs_dfd  (RpmOstreeContext *self)
 static gboolean
 rpmte_is_kernel (rpmte te)
 {
-  const char *kernel_names[] = {"kernel", "kernel-core", "kernel-rt", "kernel-rt-core", NULL};
   rpmds provides = rpmdsInit (rpmteDS (te, RPMTAG_PROVIDENAME));
   while (rpmdsNext (provides) >= 0)
    {
@@ -3608,6 +5514,360 @@ rpmostree_context_get_kernel_changed (RpmOstreeContext *self)
   return self->kernel_changed;
 }
 
+/* Splits the packages to check out into groups which can be checked out
+ * concurrently while giving the same result as checking them out one after
+ * the other in rpmts order.  The only things which depend on the order are
+ * paths shipped by more than one package: for files (and for mismatched types)
+ * the later package may win or fail, and for directories the first package
+ * creating one determines its mode.  So any two packages sharing a path are
+ * put into the same group (which is checked out in rpmts order), except for
+ * directories which already exist in the rootfs or which they agree on the
+ * mode of.  Parent directories which aren't listed in the header are created
+ * by the import with mode 0755.
+ */
+typedef struct {
+  int rootfs_dfd;
+  /* lib → usr/lib etc. */
+  GHashTable *usrlinks;
+  /* path → CheckoutPathOwner */
+  GHashTable *owners;
+  /* path → whether it's in the rootfs already */
+  GHashTable *in_rootfs;
+  /* Union-find forest of package indices */
+  GArray *parents;
+} CheckoutPartition;
+
+typedef struct {
+  guint pkg_index;
+  rpm_mode_t mode;
+} CheckoutPathOwner;
+
+static guint
+checkout_partition_find (CheckoutPartition *part,
+                         guint              i)
+{
+  while (g_array_index (part->parents, guint, i) != i)
+    {
+      guint parent = g_array_index (part->parents, guint, i);
+      /* Path halving */
+      g_array_index (part->parents, guint, i) = g_array_index (part->parents, guint, parent);
+      i = parent;
+    }
+  return i;
+}
+
+static void
+checkout_partition_union (CheckoutPartition *part,
+                          guint              a,
+                          guint              b)
+{
+  a = checkout_partition_find (part, a);
+  b = checkout_partition_find (part, b);
+  /* Keep the earliest package as the root */
+  if (a < b)
+    g_array_index (part->parents, guint, b) = a;
+  else if (b < a)
+    g_array_index (part->parents, guint, a) = b;
+}
+
+static gboolean
+checkout_partition_in_rootfs (CheckoutPartition *part,
+                              const char        *path)
+{
+  gpointer val;
+  if (g_hash_table_lookup_extended (part->in_rootfs, path, NULL, &val))
+    return GPOINTER_TO_UINT (val);
+  struct stat stbuf;
+  gboolean exists = fstatat (part->rootfs_dfd, path, &stbuf, AT_SYMLINK_NOFOLLOW) == 0;
+  g_hash_table_insert (part->in_rootfs, g_strdup (path), GUINT_TO_POINTER (exists));
+  return exists;
+}
+
+static void
+checkout_partition_add_path (CheckoutPartition *part,
+                             guint              pkg_index,
+                             const char        *path,
+                             rpm_mode_t         mode)
+{
+  /* We won't touch the metadata of existing directories */
+  if (S_ISDIR (mode) && checkout_partition_in_rootfs (part, path))
+    return;
+
+  auto owner = static_cast<CheckoutPathOwner*>(g_hash_table_lookup (part->owners, path));
+  if (!owner)
+    {
+      owner = g_new0 (CheckoutPathOwner, 1);
+      owner->pkg_index = pkg_index;
+      owner->mode = mode;
+      g_hash_table_insert (part->owners, g_strdup (path), owner);
+    }
+  else if (!S_ISDIR (mode) || owner->mode != mode)
+    checkout_partition_union (part, owner->pkg_index, pkg_index);
+}
+
+/* Converts a path from the rpm header into where it ends up in the rootfs */
+static char *
+checkout_partition_canonicalize (CheckoutPartition *part,
+                                 const char        *fn)
+{
+  const char *path = fn + strspn (fn, "/");
+  g_autofree char *usrmoved = NULL;
+  const char *slash = strchr (path, '/');
+  if (slash)
+    {
+      const char *prefix = strndupa (path, slash - path);
+      auto link = static_cast<const char *>(g_hash_table_lookup (part->usrlinks, prefix));
+      if (link)
+        path = usrmoved = g_build_filename (link, slash + 1, NULL);
+    }
+  return rpmostree_translate_path_for_ostree (path) ?: g_strdup (path);
+}
+
+static void
+checkout_partition_add_package (CheckoutPartition *part,
+                                guint              pkg_index,
+                                rpmte              te)
+{
+  g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GHashTable) seen = g_hash_table_new (g_str_hash, g_str_equal);
+  g_auto(rpmfiles) files = rpmteFiles (te);
+  g_auto(rpmfi) fi = rpmfilesIter (files, RPMFI_ITER_FWD);
+  while (rpmfiNext (fi) >= 0)
+    {
+      char *path = checkout_partition_canonicalize (part, rpmfiFN (fi));
+      checkout_partition_add_path (part, pkg_index, path, rpmfiFMode (fi));
+      g_ptr_array_add (paths, path);
+      g_hash_table_add (seen, path);
+    }
+
+  /* And now the parent directories which aren't in the header */
+  const guint n_explicit = paths->len;
+  for (guint i = 0; i < n_explicit; i++)
+    {
+      char *parent = g_path_get_dirname (static_cast<const char*>(paths->pdata[i]));
+      while (strcmp (parent, ".") != 0 && !g_hash_table_contains (seen, parent))
+        {
+          checkout_partition_add_path (part, pkg_index, parent, S_IFDIR | 0755);
+          g_ptr_array_add (paths, parent);
+          g_hash_table_add (seen, parent);
+          parent = g_path_get_dirname (parent);
+        }
+      g_free (parent);
+    }
+}
+
+/* Everything needed to check out one package, resolved on the main thread */
+typedef struct {
+  DnfPackage *pkg;
+  const char *nevra;
+  const char *commit;
+  GPtrArray *files_remove_regex;
+  OstreeRepoCheckoutOverwriteMode ovwmode;
+} CheckoutJob;
+
+static void
+checkout_job_clear (gpointer data)
+{
+  auto job = static_cast<CheckoutJob*>(data);
+  g_clear_pointer (&job->files_remove_regex, g_ptr_array_unref);
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  int rootfs_dfd;
+  /* Each worker fills its own and merges it into this one at the end */
+  OstreeRepoDevInoCache *devino_cache;
+  GHashTable *files_skip;
+  gboolean force_copy_zerosized;
+  /* Array of GPtrArray of CheckoutJob */
+  GPtrArray *groups;
+  GMutex lock;
+  GCond cond;
+  guint next_group;
+  guint n_done;
+  GError *error;
+  GCancellable *cancellable;
+} CheckoutScheduler;
+
+static gpointer
+checkout_worker (gpointer data)
+{
+  auto sched = static_cast<CheckoutScheduler*>(data);
+  /* A devino cache can't be shared between concurrent checkouts */
+  OstreeRepoDevInoCache *devino_cache =
+    sched->devino_cache ? ostree_repo_devino_cache_new () : NULL;
+
+  g_mutex_lock (&sched->lock);
+  while (sched->next_group < sched->groups->len && !sched->error)
+    {
+      auto group = static_cast<GPtrArray*>(sched->groups->pdata[sched->next_group++]);
+      g_mutex_unlock (&sched->lock);
+
+      for (guint i = 0; i < group->len; i++)
+        {
+          auto job = static_cast<CheckoutJob*>(group->pdata[i]);
+          g_autoptr(GError) local_error = NULL;
+          if (!checkout_package (sched->repo, sched->rootfs_dfd, ".", devino_cache, job->commit,
+                                 sched->files_skip, job->files_remove_regex, job->ovwmode,
+                                 sched->force_copy_zerosized, sched->cancellable, &local_error))
+            g_prefix_error (&local_error, "Checkout %s: ", job->nevra);
+
+          g_mutex_lock (&sched->lock);
+          sched->n_done++;
+          if (local_error && !sched->error)
+            sched->error = util::move_nullify (local_error);
+          g_cond_broadcast (&sched->cond);
+          gboolean failed = sched->error != NULL;
+          g_mutex_unlock (&sched->lock);
+          if (failed)
+            break;
+        }
+
+      g_mutex_lock (&sched->lock);
+    }
+  if (devino_cache)
+    rpmostree_devino_cache_merge (sched->devino_cache, devino_cache);
+  g_mutex_unlock (&sched->lock);
+
+  g_clear_pointer (&devino_cache, (GDestroyNotify)ostree_repo_devino_cache_unref);
+  return NULL;
+}
+
+static int
+compare_checkout_groups (gconstpointer ap,
+                         gconstpointer bp)
+{
+  auto a = *((GPtrArray**)ap);
+  auto b = *((GPtrArray**)bp);
+  if (a->len != b->len)
+    return a->len > b->len ? -1 : 1;
+  return dnf_package_cmp (static_cast<CheckoutJob*>(a->pdata[0])->pkg,
+                          static_cast<CheckoutJob*>(b->pdata[0])->pkg);
+}
+
+/* Check out the packages added in @ordering_ts (except @filesystem_package, which
+ * must already be) into @rootfs_dfd, on @n_workers threads; see CheckoutPartition.
+ * The workers only run ostree_repo_checkout_at(); everything which needs the
+ * context is resolved beforehand.  If the context has a devino cache, each
+ * worker checks out with its own, which are merged into it when done.
+ */
+static gboolean
+checkout_packages_parallel (RpmOstreeContext     *self,
+                            rpmts                 ordering_ts,
+                            int                   rootfs_dfd,
+                            GHashTable           *pkg_to_ostree_commit,
+                            GHashTable           *files_skip,
+                            DnfPackage           *filesystem_package,
+                            DnfPackage           *setup_package,
+                            guint                 n_workers,
+                            rpmostreecxx::Progress &progress,
+                            guint                *inout_n_done,
+                            GCancellable         *cancellable,
+                            GError              **error)
+{
+  g_autoptr(GHashTable) usrlinks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  /* Notably, `filesystem` creates these */
+  if (!scan_rootfs_usrlinks (rootfs_dfd, usrlinks, error))
+    return FALSE;
+  g_autoptr(GHashTable) owners = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autoptr(GHashTable) in_rootfs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GArray) parents = g_array_new (FALSE, FALSE, sizeof (guint));
+  CheckoutPartition part = { rootfs_dfd, usrlinks, owners, in_rootfs, parents };
+
+  g_autoptr(GArray) jobs = g_array_new (FALSE, TRUE, sizeof (CheckoutJob));
+  g_array_set_clear_func (jobs, checkout_job_clear);
+  const guint n_rpmts_elements = (guint)rpmtsNElements (ordering_ts);
+  for (guint i = 0; i < n_rpmts_elements; i++)
+    {
+      rpmte te = rpmtsElement (ordering_ts, i);
+      if (rpmteType (te) != TR_ADDED)
+        continue;
+      auto pkg = (DnfPackage*)rpmteKey (te);
+      if (pkg == filesystem_package)
+        continue;
+      if (rpmte_is_kernel (te))
+        self->kernel_changed = TRUE;
+
+      CheckoutJob job = { pkg, dnf_package_get_nevra (pkg),
+                          static_cast<const char*>(g_hash_table_lookup (pkg_to_ostree_commit, pkg)), };
+      /* See the serial path in rpmostree_context_assemble() */
+      job.ovwmode = (pkg == setup_package) ? OSTREE_REPO_CHECKOUT_OVERWRITE_ADD_FILES :
+        OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_IDENTICAL;
+      if (!prepare_package_checkout (self, pkg, job.commit, &job.files_remove_regex,
+                                     cancellable, error))
+        return FALSE;
+
+      guint pkg_index = jobs->len;
+      g_array_append_val (jobs, job);
+      g_array_append_val (parents, pkg_index);
+      checkout_partition_add_package (&part, pkg_index, te);
+    }
+
+  g_autoptr(GPtrArray) groups = g_ptr_array_new_with_free_func ((GDestroyNotify)g_ptr_array_unref);
+  /* Indexed by the root of each group */
+  g_autoptr(GPtrArray) groups_by_root = g_ptr_array_new ();
+  g_ptr_array_set_size (groups_by_root, jobs->len);
+  for (guint i = 0; i < jobs->len; i++)
+    {
+      guint root = checkout_partition_find (&part, i);
+      auto group = static_cast<GPtrArray*>(groups_by_root->pdata[root]);
+      if (!group)
+        {
+          group = g_ptr_array_new ();
+          groups_by_root->pdata[root] = group;
+          g_ptr_array_add (groups, group);
+        }
+      g_ptr_array_add (group, &g_array_index (jobs, CheckoutJob, i));
+    }
+  /* Start with the biggest groups, so they don't become the long tail */
+  g_ptr_array_sort (groups, compare_checkout_groups);
+  g_debug ("Checking out %u packages in %u groups on %u workers",
+           jobs->len, groups->len, n_workers);
+
+  CheckoutScheduler sched = { get_pkgcache_repo (self), rootfs_dfd, self->devino_cache,
+                              files_skip, !self->enable_rofiles, groups, };
+  sched.cancellable = cancellable;
+  g_mutex_init (&sched.lock);
+  g_cond_init (&sched.cond);
+  n_workers = MIN (n_workers, MAX (groups->len, 1));
+  g_autoptr(GPtrArray) workers = g_ptr_array_new ();
+  for (guint i = 0; i < n_workers; i++)
+    g_ptr_array_add (workers, g_thread_new ("checkout", checkout_worker, &sched));
+
+  /* The progress bar isn't thread-safe, so update it from here */
+  const guint n_done_base = *inout_n_done;
+  guint n_reported = 0;
+  progress.set_sub_message("");
+  g_mutex_lock (&sched.lock);
+  while (sched.n_done < jobs->len && !sched.error)
+    {
+      if (sched.n_done == n_reported)
+        {
+          g_cond_wait (&sched.cond, &sched.lock);
+          continue;
+        }
+      n_reported = sched.n_done;
+      g_mutex_unlock (&sched.lock);
+      progress.nitems_update(n_done_base + n_reported);
+      g_mutex_lock (&sched.lock);
+    }
+  g_mutex_unlock (&sched.lock);
+
+  for (guint i = 0; i < workers->len; i++)
+    g_thread_join (static_cast<GThread*>(workers->pdata[i]));
+  g_mutex_clear (&sched.lock);
+  g_cond_clear (&sched.cond);
+
+  *inout_n_done = n_done_base + sched.n_done;
+  progress.nitems_update(*inout_n_done);
+  if (sched.error)
+    {
+      g_propagate_error (error, sched.error);
+      return FALSE;
+    }
+  return TRUE;
+}
+
 static gboolean
 process_one_ostree_layer (RpmOstreeContext *self,
                           int               rootfs_dfd,
@@ -3677,16 +5937,25 @@ process_ostree_layers (RpmOstreeContext *self,
   return TRUE;
 }
 
+/* Write the rpmdb for the transaction.  @install_order has the packages to
+ * install in the order already computed by rpmtsOrder() for the ordering
+ * transaction, and @install_headers their headers from it; reusing both means
+ * we neither parse every header again nor re-sort the transaction here.  The
+ * headers are released as soon as they're added.
+ */
 static gboolean
 write_rpmdb (RpmOstreeContext      *self,
              int tmprootfs_dfd, 
              GPtrArray *overlays,
              GPtrArray *overrides_replace,
              GPtrArray *overrides_remove,
+             GPtrArray *install_order,
+             GPtrArray *install_headers,
              GCancellable *cancellable,
              GError **error)
 {
   auto task = rpmostreecxx::progress_begin_task("Writing rpmdb");
+  auto span = rpmostreecxx::profile_span_begin("write-rpmdb");
 
 
   if (!glnx_shutil_mkdir_p_at (tmprootfs_dfd, RPMOSTREE_RPMDB_LOCATION, 0755, cancellable, error))
@@ -3732,25 +6001,27 @@ write_rpmdb (RpmOstreeContext      *self,
   tdata.ctx = self;
   rpmtsSetNotifyCallback (rpmdb_ts, ts_callback, &tdata);
 
-  /* Skip validating scripts since we already validated them above */
-  RpmOstreeTsAddInstallFlags rpmdb_instflags = RPMOSTREE_TS_FLAG_NOVALIDATE_SCRIPTS;
-  for (guint i = 0; i < overlays->len; i++)
-    {
-      auto pkg = static_cast<DnfPackage *>(overlays->pdata[i]);
-
-      if (!rpmts_add_install (self, rpmdb_ts, pkg, rpmdb_instflags,
-                              cancellable, error))
-        return FALSE;
-    }
-
+  g_autoptr(GHashTable) upgrades = g_hash_table_new (NULL, NULL);
   for (guint i = 0; i < overrides_replace->len; i++)
+    g_hash_table_add (upgrades, overrides_replace->pdata[i]);
+
+  /* The scripts were already validated when adding to the ordering ts */
+  for (guint i = 0; i < install_order->len; i++)
     {
-      auto pkg = static_cast<DnfPackage *>(overrides_replace->pdata[i]);
+      auto pkg = static_cast<DnfPackage *>(install_order->pdata[i]);
+      g_auto(Header) hdr = static_cast<Header>(util::move_nullify (install_headers->pdata[i]));
+      /* librpm may not have kept it around; parse it again in that case */
+      if (!hdr)
+        {
+          g_autofree char *path = get_package_relpath (pkg);
+          if (!get_package_metainfo (self, path, &hdr, NULL, error))
+            return FALSE;
+        }
 
-      if (!rpmts_add_install (self, rpmdb_ts, pkg,
-                              static_cast<RpmOstreeTsAddInstallFlags>(rpmdb_instflags | RPMOSTREE_TS_FLAG_UPGRADE),
-                              cancellable, error))
-        return FALSE;
+      const gboolean is_upgrade = g_hash_table_contains (upgrades, pkg);
+      if (rpmtsAddInstallElement (rpmdb_ts, hdr, pkg, is_upgrade, NULL) != 0)
+        return glnx_throw (error, "Failed to add install element for %s",
+                           dnf_package_get_filename (pkg));
     }
 
   /* and mark removed packages as such so they drop out of rpmdb */
@@ -3761,7 +6032,9 @@ write_rpmdb (RpmOstreeContext      *self,
         return FALSE;
     }
 
-  rpmtsOrder (rpmdb_ts);
+  /* Note we don't rpmtsOrder() here; the installs are already sorted, and we
+   * aren't running any scripts, so the order of erasures doesn't matter.
+   */
 
   /* NB: Because we're using the real root here (see above for reason why), rpm
    * will see the read-only /usr mount and think that there isn't any disk space
@@ -3808,6 +6081,8 @@ rpmostree_context_assemble (RpmOstreeContext      *self,
                             GCancellable          *cancellable,
                             GError               **error)
 {
+  auto span = rpmostreecxx::profile_span_begin("assemble");
+
   /* Synthesize a tmpdir if we weren't provided a base */
   if (self->tmprootfs_dfd == -1)
     {
@@ -3824,7 +6099,7 @@ rpmostree_context_assemble (RpmOstreeContext      *self,
   /* In e.g. removing a package we walk librpm which doesn't have canonical
    * /usr, so we need to build up a mapping.
    */
-  if (!build_rootfs_usrlinks (self, error))
+  if (!build_rootfs_usrlinks (self, self->tmprootfs_dfd, error))
     return FALSE;
 
   /* We need up to date labels; the set of things needing relabeling
@@ -4012,37 +6287,49 @@ rpmostree_context_assemble (RpmOstreeContext      *self,
     return FALSE;
   g_clear_pointer (&dirs_to_remove, g_sequence_free);
 
-  for (guint i = 0; i < n_rpmts_elements; i++)
+  const guint checkout_concurrency = get_concurrency (self, rpmostreecxx::ConcurrencyPhase::Checkout);
+  if (checkout_concurrency > 1)
     {
-      rpmte te = rpmtsElement (ordering_ts, i);
-      rpmElementType type = rpmteType (te);
-
-      if (type == TR_REMOVED)
-        continue;
-      g_assert (type == TR_ADDED);
+      if (!checkout_packages_parallel (self, ordering_ts, tmprootfs_dfd, pkg_to_ostree_commit,
+                                       files_skip_add, filesystem_package, setup_package,
+                                       checkout_concurrency, *progress, &n_rpmts_done,
+                                       cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      for (guint i = 0; i < n_rpmts_elements; i++)
+        {
+          rpmte te = rpmtsElement (ordering_ts, i);
+          rpmElementType type = rpmteType (te);
 
-      DnfPackage *pkg = (DnfPackage*)rpmteKey (te);
-      if (pkg == filesystem_package)
-        continue;
+          if (type == TR_REMOVED)
+            continue;
+          g_assert (type == TR_ADDED);
 
-      if (rpmte_is_kernel (te))
-        self->kernel_changed = TRUE;
+          DnfPackage *pkg = (DnfPackage*)rpmteKey (te);
+          if (pkg == filesystem_package)
+            continue;
 
-      /* The "setup" package currently contains /etc/passwd; in the treecompose
-       * case we need to inject that beforehand, so use "add files" just for
-       * that.
-       */
-      OstreeRepoCheckoutOverwriteMode ovwmode =
-        (pkg == setup_package) ? OSTREE_REPO_CHECKOUT_OVERWRITE_ADD_FILES :
-        OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_IDENTICAL;
+          if (rpmte_is_kernel (te))
+            self->kernel_changed = TRUE;
 
-      progress->set_sub_message(dnf_package_get_name (pkg));
-      if (!checkout_package_into_root (self, pkg, tmprootfs_dfd, ".", self->devino_cache,
-                                       static_cast<const char*>(g_hash_table_lookup (pkg_to_ostree_commit, pkg)),
-                                       files_skip_add, ovwmode, cancellable, error))
-        return FALSE;
-      n_rpmts_done++;
-      progress->nitems_update(n_rpmts_done);
+          /* The "setup" package currently contains /etc/passwd; in the treecompose
+           * case we need to inject that beforehand, so use "add files" just for
+           * that.
+           */
+          OstreeRepoCheckoutOverwriteMode ovwmode =
+            (pkg == setup_package) ? OSTREE_REPO_CHECKOUT_OVERWRITE_ADD_FILES :
+            OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_IDENTICAL;
+
+          progress->set_sub_message(dnf_package_get_name (pkg));
+          if (!checkout_package_into_root (self, pkg, tmprootfs_dfd, ".", self->devino_cache,
+                                           static_cast<const char*>(g_hash_table_lookup (pkg_to_ostree_commit, pkg)),
+                                           files_skip_add, ovwmode, cancellable, error))
+            return FALSE;
+          n_rpmts_done++;
+          progress->nitems_update(n_rpmts_done);
+        }
     }
 
   progress->end("");
@@ -4107,6 +6394,7 @@ rpmostree_context_assemble (RpmOstreeContext      *self,
        * before applying the overrides, rather than after each %pre.
        */
       { auto task = rpmostreecxx::progress_begin_task("Running pre scripts");
+        auto sandbox = new_script_sandbox (self, tmprootfs_dfd);
         guint n_pre_scripts_run = 0;
         for (guint i = 0; i < n_rpmts_elements; i++)
           {
@@ -4118,7 +6406,7 @@ rpmostree_context_assemble (RpmOstreeContext      *self,
             g_assert (pkg);
 
             task->set_sub_message(dnf_package_get_name(pkg));
-            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir,
+            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, *sandbox,
                                   pkg, RPMOSTREE_SCRIPT_PREIN,
                                   &n_pre_scripts_run, cancellable, error))
               return FALSE;
@@ -4146,29 +6434,44 @@ rpmostree_context_assemble (RpmOstreeContext      *self,
 
       {
       auto task = rpmostreecxx::progress_begin_task("Running post scripts");
+      auto sandbox = new_script_sandbox (self, tmprootfs_dfd);
+      const guint n_post_workers = get_post_script_concurrency (self);
       guint n_post_scripts_run = 0;
 
       /* %post */
-      for (guint i = 0; i < n_rpmts_elements; i++)
+      if (n_post_workers > 1)
         {
-          rpmte te = rpmtsElement (ordering_ts, i);
-          if (rpmteType (te) != TR_ADDED)
-            continue;
-
-          auto pkg = (DnfPackage *)(rpmteKey (te));
-          g_assert (pkg);
-
-          task->set_sub_message(dnf_package_get_name(pkg));
-          if (!apply_rpmfi_overrides (self, tmprootfs_dfd, pkg, *passwd_entries,
-                                      cancellable, error))
-            return glnx_prefix_error (error, "While applying overrides for pkg %s",
-                                      dnf_package_get_name (pkg));
-
-          if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir,
-                                pkg, RPMOSTREE_SCRIPT_POSTIN,
-                                &n_post_scripts_run, cancellable, error))
+          if (!run_post_scripts_parallel (self, ordering_ts, tmprootfs_dfd, &var_lib_rpm_statedir,
+                                          *passwd_entries, n_post_workers, &n_post_scripts_run,
+                                          cancellable, error))
             return FALSE;
         }
+      else
+        {
+          for (guint i = 0; i < n_rpmts_elements; i++)
+            {
+              rpmte te = rpmtsElement (ordering_ts, i);
+              if (rpmteType (te) != TR_ADDED)
+                continue;
+
+              auto pkg = (DnfPackage *)(rpmteKey (te));
+              g_assert (pkg);
+
+              task->set_sub_message(dnf_package_get_name(pkg));
+              gboolean modified;
+              if (!apply_rpmfi_overrides (self, tmprootfs_dfd, pkg, *passwd_entries,
+                                          &modified, cancellable, error))
+                return glnx_prefix_error (error, "While applying overrides for pkg %s",
+                                          dnf_package_get_name (pkg));
+              if (modified)
+                sandbox->invalidate();
+
+              if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, *sandbox,
+                                    pkg, RPMOSTREE_SCRIPT_POSTIN,
+                                    &n_post_scripts_run, cancellable, error))
+                return FALSE;
+            }
+        }
       }
 
       /* Any ostree refs to overlay */
@@ -4177,6 +6480,7 @@ rpmostree_context_assemble (RpmOstreeContext      *self,
 
       {
       auto task = rpmostreecxx::progress_begin_task("Running posttrans scripts");
+      auto sandbox = new_script_sandbox (self, tmprootfs_dfd);
       guint n_posttrans_scripts_run = 0;
 
       /* %posttrans */
@@ -4190,14 +6494,14 @@ rpmostree_context_assemble (RpmOstreeContext      *self,
           g_assert (pkg);
 
           task->set_sub_message(dnf_package_get_name(pkg));
-          if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir,
+          if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, *sandbox,
                                 pkg, RPMOSTREE_SCRIPT_POSTTRANS,
                                 &n_posttrans_scripts_run, cancellable, error))
             return FALSE;
         }
 
       /* file triggers */
-      if (!run_all_transfiletriggers (self, ordering_ts, tmprootfs_dfd,
+      if (!run_all_transfiletriggers (self, ordering_ts, tmprootfs_dfd, *sandbox,
                                       &n_posttrans_scripts_run, cancellable, error))
         return FALSE;
 
@@ -4240,9 +6544,23 @@ rpmostree_context_assemble (RpmOstreeContext      *self,
   if (!glnx_shutil_rm_rf_at (tmprootfs_dfd, "var/lib/rpm-state", cancellable, error))
     return FALSE;
 
+  /* Save the install order and headers for write_rpmdb() */
+  g_autoptr(GPtrArray) install_order = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) install_headers = g_ptr_array_new_with_free_func ((GDestroyNotify)headerFree);
+  for (guint i = 0; i < n_rpmts_elements; i++)
+    {
+      rpmte te = rpmtsElement (ordering_ts, i);
+      if (rpmteType (te) != TR_ADDED)
+        continue;
+      auto pkg = (DnfPackage *)(rpmteKey (te));
+      g_ptr_array_add (install_order, g_object_ref (pkg));
+      g_ptr_array_add (install_headers, rpmteHeader (te));
+    }
+
   g_clear_pointer (&ordering_ts, rpmtsFree);
 
-  if (!write_rpmdb (self, tmprootfs_dfd, overlays, overrides_replace, overrides_remove, cancellable, error))
+  if (!write_rpmdb (self, tmprootfs_dfd, overlays, overrides_replace, overrides_remove,
+                    install_order, install_headers, cancellable, error))
     return glnx_prefix_error (error, "Writing rpmdb");
 
   return TRUE;
@@ -4260,6 +6578,7 @@ rpmostree_context_commit (RpmOstreeContext      *self,
   g_autofree char *ret_commit_checksum = NULL;
 
   auto task = rpmostreecxx::progress_begin_task("Writing OSTree commit");
+  auto span = rpmostreecxx::profile_span_begin("commit");
 
   g_auto(RpmOstreeRepoAutoTransaction) txn = { 0, };
   if (!rpmostree_repo_auto_transaction_start (&txn, self->ostreerepo, FALSE, cancellable, error))
@@ -4340,6 +6659,14 @@ rpmostree_context_commit (RpmOstreeContext      *self,
           return FALSE;
         g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.rpmdb.pkglist", rpmdb);
 
+        /* used by the upgrader to tell if this commit can be reused as is */
+        g_autofree char *passwd_checksum = NULL;
+        if (!rpmostree_context_get_passwd_sha256 (self, &passwd_checksum, error))
+          return FALSE;
+        if (passwd_checksum)
+          g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.passwd-sha256",
+                                 g_variant_new_string (passwd_checksum));
+
         /* be nice to our future selves */
         g_variant_builder_add (&metadata_builder, "{sv}",
                                "rpmostree.clientlayer_version",
@@ -4395,6 +6722,16 @@ rpmostree_context_commit (RpmOstreeContext      *self,
     if (final_sepolicy)
       ostree_repo_commit_modifier_set_sepolicy (commit_modifier, final_sepolicy);
 
+    /* The base trees we graft are labeled with the original policy */
+    if (self->sparse_skipped)
+      {
+        const gboolean policy_changed = self->sepolicy && final_sepolicy &&
+          g_strcmp0 (ostree_sepolicy_get_csum (self->sepolicy),
+                     ostree_sepolicy_get_csum (final_sepolicy)) != 0;
+        if (!sparse_complete_skipped (self, policy_changed, cancellable, error))
+          return FALSE;
+      }
+
     if (self->devino_cache)
       ostree_repo_commit_modifier_set_devino_cache (commit_modifier, self->devino_cache);
 
@@ -4406,6 +6743,9 @@ rpmostree_context_commit (RpmOstreeContext      *self,
                                          cancellable, error))
       return FALSE;
 
+    if (self->sparse_skipped && !sparse_graft_skipped (self, mtree, cancellable, error))
+      return FALSE;
+
     if (!ostree_repo_write_mtree (self->ostreerepo, mtree, &root, cancellable, error))
       return FALSE;
 
@@ -4434,6 +6774,10 @@ rpmostree_context_commit (RpmOstreeContext      *self,
       if (!ostree_repo_commit_transaction (self->ostreerepo, &stats, cancellable, error))
         return FALSE;
 
+      span->add_counter("metadata-objects-written", stats.metadata_objects_written);
+      span->add_counter("content-objects-written", stats.content_objects_written);
+      span->add_counter("content-bytes-written", stats.content_bytes_written);
+
       bytes_written_formatted = g_format_size (stats.content_bytes_written);
       const guint64 end_time_ms = g_get_monotonic_time () / 1000;
       const guint64 elapsed_ms = end_time_ms - start_time_ms;
@@ -126,6 +126,10 @@ void rpmostree_context_set_devino_cache (RpmOstreeContext *self,
 void rpmostree_context_disable_rofiles (RpmOstreeContext *self);
 void rpmostree_context_set_sepolicy (RpmOstreeContext *self,
                                      OstreeSePolicy   *sepolicy);
+void rpmostree_context_set_relabel_concurrency (RpmOstreeContext *self,
+                                                guint             n_workers);
+void rpmostree_context_set_checkout_concurrency (RpmOstreeContext *self,
+                                                 guint             n_workers);
 
 gboolean rpmostree_dnf_add_checksum_goal (GChecksum  *checksum,
                                           HyGoal      goal,
@@ -136,6 +140,10 @@ gboolean rpmostree_context_get_state_sha512 (RpmOstreeContext *self,
                                              char            **out_checksum,
                                              GError          **error);
 
+gboolean rpmostree_context_get_passwd_sha256 (RpmOstreeContext *self,
+                                              char            **out_checksum,
+                                              GError          **error);
+
 gboolean
 rpmostree_pkgcache_find_pkg_header (OstreeRepo    *pkgcache,
                                     const char    *nevra,
@@ -148,6 +156,17 @@ gboolean rpmostree_context_download_metadata (RpmOstreeContext  *context,
                                               DnfContextSetupSackFlags flags,
                                               GCancellable      *cancellable,
                                               GError           **error);
+gboolean rpmostree_context_fetch_rpmmd (RpmOstreeContext  *context,
+                                        DnfContextSetupSackFlags flags,
+                                        GCancellable      *cancellable,
+                                        GError           **error);
+gboolean rpmostree_context_get_rpmmd_checksum (RpmOstreeContext  *context,
+                                               char             **out_checksum,
+                                               GError           **error);
+gboolean rpmostree_context_import_rpmmd (RpmOstreeContext  *context,
+                                         DnfContextSetupSackFlags flags,
+                                         GCancellable      *cancellable,
+                                         GError           **error);
 
 /* This API allocates an install context, use with one of the later ones */
 gboolean rpmostree_context_prepare (RpmOstreeContext     *self,
@@ -184,6 +203,10 @@ gboolean rpmostree_context_import (RpmOstreeContext *self,
                                    GCancellable     *cancellable,
                                    GError          **error);
 
+gboolean rpmostree_context_download_and_import (RpmOstreeContext *self,
+                                                GCancellable     *cancellable,
+                                                GError          **error);
+
 gboolean rpmostree_context_force_relabel (RpmOstreeContext *self,
                                           GCancellable     *cancellable,
                                           GError          **error);
@@ -199,6 +222,27 @@ int rpmostree_context_get_tmprootfs_dfd  (RpmOstreeContext *self);
 
 gboolean rpmostree_context_get_kernel_changed (RpmOstreeContext *self);
 
+void rpmostree_sparse_paths_new (GHashTable **out_dirs,
+                                 GHashTable **out_subtrees);
+gboolean rpmostree_checkout_sparse (OstreeRepo            *repo,
+                                    const char            *rev,
+                                    int                    dfd,
+                                    const char            *path,
+                                    OstreeRepoDevInoCache *devino_cache,
+                                    GHashTable            *dirs,
+                                    GHashTable            *subtrees,
+                                    GPtrArray            **out_skipped,
+                                    GCancellable          *cancellable,
+                                    GError               **error);
+gboolean rpmostree_context_get_sparse_paths (RpmOstreeContext *self,
+                                             int               rootfs_dfd,
+                                             GHashTable      **out_dirs,
+                                             GHashTable      **out_subtrees,
+                                             GError          **error);
+void rpmostree_context_set_sparse_base (RpmOstreeContext *self,
+                                        const char       *base_commit,
+                                        GPtrArray        *skipped);
+
 /* NB: tmprootfs_dfd is allowed to have pre-existing data */
 /* devino_cache can be NULL if no previous cache established */
 gboolean rpmostree_context_assemble (RpmOstreeContext      *self,
@@ -76,6 +76,8 @@ struct RpmOstreeImporter
   char *hdr_sha256;
 
   char *ostree_branch;
+
+  guint64 run_usec; /* Monotonic time spent in rpmostree_importer_run() */
 };
 
 G_DEFINE_TYPE(RpmOstreeImporter, rpmostree_importer, G_TYPE_OBJECT)
@@ -233,6 +235,7 @@ build_rpmfi_overrides (RpmOstreeImporter *self)
  * @pkg: (optional): Package reference, used for metadata
  * @flags: flags
  * @sepolicy: (optional): SELinux policy
+ * @n_concurrent: Number of packages being imported at the same time
  * @error: error
  *
  * Create a new unpacker instance.  The @pkg argument, if
@@ -245,6 +248,7 @@ rpmostree_importer_new_take_fd (int                     *fd,
                                 DnfPackage              *pkg,
                                 RpmOstreeImporterFlags   flags,
                                 OstreeSePolicy          *sepolicy,
+                                guint                    n_concurrent,
                                 GError                 **error)
 {
   RpmOstreeImporter *ret = NULL;
@@ -253,11 +257,11 @@ rpmostree_importer_new_take_fd (int                     *fd,
   struct archive *archive;
   gsize cpio_offset;
 
-  archive = rpmostree_unpack_rpm2cpio (*fd, error);
-  if (archive == NULL)
+  if (!rpmostree_importer_read_metainfo (*fd, &hdr, &cpio_offset, &fi, error))
     goto out;
 
-  if (!rpmostree_importer_read_metainfo (*fd, &hdr, &cpio_offset, &fi, error))
+  archive = rpmostree_unpack_rpm2cpio_full (*fd, hdr, cpio_offset, n_concurrent, error);
+  if (archive == NULL)
     goto out;
 
   ret = (RpmOstreeImporter*)g_object_new (RPMOSTREE_TYPE_IMPORTER, NULL);
@@ -723,12 +727,14 @@ rpmostree_importer_run (RpmOstreeImporter *self,
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
 
+  const gint64 start_time = g_get_monotonic_time ();
   g_autofree char *csum = NULL;
   if (!import_rpm_to_repo (self, &csum, cancellable, error))
     {
       g_autofree char *name = headerGetAsString (self->hdr, RPMTAG_NAME);
       return glnx_prefix_error (error, "Importing package '%s'", name);
     }
+  self->run_usec = g_get_monotonic_time () - start_time;
 
   const char *branch = rpmostree_importer_get_ostree_branch (self);
   ostree_repo_transaction_set_ref (self->repo, NULL, branch, csum);
@@ -789,3 +795,16 @@ rpmostree_importer_get_header_sha256 (RpmOstreeImporter *self)
 {
   return self->hdr_sha256;
 }
+
+/* Returns the uncompressed payload size of the package, and how long
+ * rpmostree_importer_run() took to import it; used for throughput
+ * reporting.
+ */
+void
+rpmostree_importer_get_stats (RpmOstreeImporter *self,
+                              guint64           *out_bytes,
+                              guint64           *out_usec)
+{
+  *out_bytes = self->hdr ? headerGetNumber (self->hdr, RPMTAG_LONGSIZE) : 0;
+  *out_usec = self->run_usec;
+}
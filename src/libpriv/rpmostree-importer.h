@@ -56,6 +56,7 @@ rpmostree_importer_new_take_fd (int                     *fd,
                                 DnfPackage              *pkg,
                                 RpmOstreeImporterFlags   flags,
                                 OstreeSePolicy          *sepolicy,
+                                guint                    n_concurrent,
                                 GError                 **error);
 
 gboolean
@@ -91,4 +92,9 @@ rpmostree_importer_get_nevra (RpmOstreeImporter *self);
 const char *
 rpmostree_importer_get_header_sha256 (RpmOstreeImporter *self);
 
+void
+rpmostree_importer_get_stats (RpmOstreeImporter *self,
+                              guint64           *out_bytes,
+                              guint64           *out_usec);
+
 G_END_DECLS
@@ -624,3 +624,179 @@ rpmostree_run_dracut (int     rootfs_dfd,
   *out_initramfs_tmpf = tmpf; tmpf.initialized = FALSE; /* Transfer */
   return TRUE;
 }
+
+/* Regenerating the initramfs means a full dracut run, which is easily the
+ * most expensive part of client-side assembly.  But most of the time the
+ * result is identical to one we already generated: e.g. changing kargs or
+ * re-layering an unrelated package on the same base.  So we keep the last
+ * few initramfs images in the repo, keyed by everything that goes into them:
+ * the assembled tree (see rpmostree_context_get_state_sha512()), the kernel
+ * version, the dracut arguments, and if the host /etc is used, a fingerprint
+ * of it.  Old entries are expired by `rpm-ostree cleanup`.
+ */
+#define RPMOSTREE_INITRAMFS_CACHE_NAME "initramfs-cache"
+#define RPMOSTREE_INITRAMFS_CACHE_VERSION 1
+#define RPMOSTREE_INITRAMFS_CACHE_MAX_ENTRIES 2
+
+static int
+cmp_strings (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(char**)a, *(char**)b);
+}
+
+/* Fold the metadata of every file under @path into @checksum.  We don't
+ * checksum the contents: /etc may hold secrets, and the change time already
+ * covers any modification to a file.
+ */
+static gboolean
+checksum_tree_metadata (GChecksum    *checksum,
+                        int           dfd,
+                        const char   *path,
+                        GCancellable *cancellable,
+                        GError      **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfd_iter, error))
+    return FALSE;
+
+  g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+      g_ptr_array_add (names, g_strdup (dent->d_name));
+    }
+  /* Directory order isn't stable across e.g. a filesystem copy */
+  g_ptr_array_sort (names, cmp_strings);
+
+  for (guint i = 0; i < names->len; i++)
+    {
+      auto name = static_cast<const char *>(names->pdata[i]);
+      struct stat stbuf;
+      if (!glnx_fstatat (dfd_iter.fd, name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+
+      g_autofree char *subpath = g_build_filename (path, name, NULL);
+      g_autofree char *entry =
+        g_strdup_printf ("%s\t%u\t%u\t%u\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT
+                         "\t%" G_GINT64_FORMAT ".%ld\t%" G_GINT64_FORMAT ".%ld\n",
+                         subpath, stbuf.st_mode, stbuf.st_uid, stbuf.st_gid,
+                         (guint64)stbuf.st_ino, (guint64)stbuf.st_size,
+                         (gint64)stbuf.st_mtim.tv_sec, stbuf.st_mtim.tv_nsec,
+                         (gint64)stbuf.st_ctim.tv_sec, stbuf.st_ctim.tv_nsec);
+      g_checksum_update (checksum, (const guint8*)entry, strlen (entry));
+
+      if (S_ISLNK (stbuf.st_mode))
+        {
+          g_autofree char *target = glnx_readlinkat_malloc (dfd_iter.fd, name, cancellable, error);
+          if (!target)
+            return FALSE;
+          g_checksum_update (checksum, (const guint8*)target, strlen (target) + 1);
+        }
+      else if (S_ISDIR (stbuf.st_mode))
+        {
+          if (!checksum_tree_metadata (checksum, dfd, subpath, cancellable, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Compute the cache key for a dracut run over a tree whose content is
+ * identified by @input_checksum; the other arguments are as for
+ * rpmostree_run_dracut().
+ */
+char *
+rpmostree_initramfs_cache_key (const char         *input_checksum,
+                               const char         *kver,
+                               const char *const  *argv,
+                               const char         *rebuild_from_initramfs,
+                               gboolean            use_root_etc,
+                               GCancellable       *cancellable,
+                               GError            **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree char *header =
+    g_strdup_printf ("%u\t%s\t%s\t%s\t%d\n", RPMOSTREE_INITRAMFS_CACHE_VERSION,
+                     input_checksum, kver ?: "",
+                     rebuild_from_initramfs ?: "", use_root_etc ? 1 : 0);
+  g_checksum_update (checksum, (const guint8*)header, strlen (header));
+  for (char **it = (char**)argv; it && *it; it++)
+    g_checksum_update (checksum, (const guint8*)*it, strlen (*it) + 1);
+
+  if (use_root_etc)
+    {
+      if (!checksum_tree_metadata (checksum, AT_FDCWD, "/etc", cancellable, error))
+        return (char*)glnx_prefix_error_null (error, "Fingerprinting /etc");
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* If we have a cached initramfs for @key, copy it into a new tmpfile in
+ * @rootfs_dfd as rpmostree_run_dracut() would have generated it.  Leaves
+ * @out_initramfs_tmpf uninitialized on a cache miss.
+ */
+gboolean
+rpmostree_initramfs_cache_lookup (OstreeRepo    *repo,
+                                  const char    *key,
+                                  int            rootfs_dfd,
+                                  GLnxTmpfile   *out_initramfs_tmpf,
+                                  GCancellable  *cancellable,
+                                  GError       **error)
+{
+  auto cache = rpmostreecxx::repo_cache_open (*repo, RPMOSTREE_INITRAMFS_CACHE_NAME,
+                                              RPMOSTREE_INITRAMFS_CACHE_MAX_ENTRIES);
+  g_autofree char *name = g_strconcat (key, ".img", NULL);
+  /* This also marks it as most recently used */
+  if (!cache->touch (name))
+    return TRUE; /* Note early return */
+
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_rdonly (cache->get_dfd (), name, TRUE, &fd, error))
+    return FALSE;
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  if (!glnx_open_tmpfile_linkable_at (rootfs_dfd, ".", O_RDWR | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+  if (glnx_regfile_copy_bytes (fd, tmpf.fd, (off_t) -1) < 0)
+    return glnx_throw_errno_prefix (error, "Copying cached initramfs");
+
+  *out_initramfs_tmpf = tmpf; tmpf.initialized = FALSE; /* Transfer */
+  return TRUE;
+}
+
+/* Add the initramfs in @initramfs_tmpf to the cache under @key, evicting the
+ * least recently used entries beyond RPMOSTREE_INITRAMFS_CACHE_MAX_ENTRIES.
+ */
+gboolean
+rpmostree_initramfs_cache_store (OstreeRepo    *repo,
+                                 const char    *key,
+                                 GLnxTmpfile   *initramfs_tmpf,
+                                 GCancellable  *cancellable,
+                                 GError       **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Caching initramfs", error);
+  auto cache = rpmostreecxx::repo_cache_open (*repo, RPMOSTREE_INITRAMFS_CACHE_NAME,
+                                              RPMOSTREE_INITRAMFS_CACHE_MAX_ENTRIES);
+  int cache_dfd = cache->get_dfd ();
+
+  g_autofree char *name = g_strconcat (key, ".img", NULL);
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  if (!glnx_open_tmpfile_linkable_at (cache_dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+  if (lseek (initramfs_tmpf->fd, 0, SEEK_SET) < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+  if (glnx_regfile_copy_bytes (initramfs_tmpf->fd, tmpf.fd, (off_t) -1) < 0)
+    return glnx_throw_errno_prefix (error, "Copying initramfs");
+  if (!glnx_fchmod (tmpf.fd, 0600, error))
+    return FALSE;
+  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE, cache_dfd, name, error))
+    return FALSE;
+
+  cache->prune (name);
+  return TRUE;
+}
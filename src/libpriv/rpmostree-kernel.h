@@ -62,4 +62,28 @@ rpmostree_run_dracut (int     rootfs_dfd,
                       GCancellable  *cancellable,
                       GError **error);
 
+char *
+rpmostree_initramfs_cache_key (const char         *input_checksum,
+                               const char         *kver,
+                               const char *const  *argv,
+                               const char         *rebuild_from_initramfs,
+                               gboolean            use_root_etc,
+                               GCancellable       *cancellable,
+                               GError            **error);
+
+gboolean
+rpmostree_initramfs_cache_lookup (OstreeRepo    *repo,
+                                  const char    *key,
+                                  int            rootfs_dfd,
+                                  GLnxTmpfile   *out_initramfs_tmpf,
+                                  GCancellable  *cancellable,
+                                  GError       **error);
+
+gboolean
+rpmostree_initramfs_cache_store (OstreeRepo    *repo,
+                                 const char    *key,
+                                 GLnxTmpfile   *initramfs_tmpf,
+                                 GCancellable  *cancellable,
+                                 GError       **error);
+
 G_END_DECLS
\ No newline at end of file
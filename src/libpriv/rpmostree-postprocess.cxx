@@ -37,6 +37,7 @@
 #include <stdlib.h>
 #include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
+#include <systemd/sd-journal.h>
 #include <utility>
 #include <vector>
 
@@ -663,29 +664,85 @@ rpmostree_rootfs_postprocess_common (int           rootfs_fd,
   return TRUE;
 }
 
+/* To use multiple cores, rpmostree_compose_commit() splits the rootfs into
+ * shards: every directory two levels down by default (e.g. usr/lib, usr/share,
+ * etc/pki) gets committed into its own mutable tree by a pool of worker threads,
+ * and one more "root" shard commits everything else while skipping those.  The
+ * shard trees are then grafted back in by checksum.
+ */
+#define COMMIT_SHARD_DEPTH_DEFAULT 2
+
+/* To make composes incremental, we also record a manifest alongside the commit
+ * in the build repo: for every directory, a fingerprint of the names, modes,
+ * ownership, xattrs and contents of everything beneath it, and the
+ * dirtree/dirmeta checksums it was committed as.  On the next compose, any
+ * directory whose fingerprint is unchanged is skipped and grafted back in by
+ * checksum rather than labeled and committed again.  We can't trust
+ * (dev, ino, mtime) here: files hardlinked from the pkgcache all have an mtime
+ * of 0, so a recycled inode could look unchanged.  Bump the version if
+ * anything affecting the committed content (e.g. the accepted xattrs) changes.
+ */
+#define RPMOSTREE_COMPOSE_MANIFEST_PATH "extensions/rpmostree/compose-manifest.gv"
+#define RPMOSTREE_COMPOSE_MANIFEST_VERSION 2
+#define RPMOSTREE_COMPOSE_MANIFEST_ENTRY_FORMAT "(sss)"
+#define RPMOSTREE_COMPOSE_MANIFEST_GVARIANT_FORMAT "(ussa{s" RPMOSTREE_COMPOSE_MANIFEST_ENTRY_FORMAT "})"
+
+struct CommitThreadData;
+
+struct CommitShard {
+  char *path; /* Relative to the rootfs; "." for the root shard */
+  OstreeMutableTree *mtree;
+  OstreeRepoCommitModifier *commit_modifier;
+  struct CommitThreadData *tdata;
+  OstreeSePolicy *sepolicy; /* Owned by the worker committing this shard */
+  GHashTable *skip_paths; /* Directories (relative to the shard) to skip */
+  GHashTable *fingerprints; /* Relative to the rootfs: char *path -> char *fingerprint */
+  GHashTable *shard_fingerprints; /* Root shard only: char *path -> fingerprint of that shard */
+  GPtrArray *reused; /* Relative to the rootfs: directories grafted from the manifest */
+  GError *error; /* Set by the worker, or by our callbacks */
+};
+
 struct CommitThreadData {
-  gint done;  /* atomic */
-  off_t n_bytes;
-  off_t n_processed;
-  gint percent;  /* atomic */
+  gint next_shard;  /* atomic */
+  gint n_shards_done;  /* atomic */
+  gint n_workers_done;  /* atomic */
+  gint failed;  /* atomic */
+  gsize n_processed;  /* atomic */
   std::unique_ptr<rpmostreecxx::Progress> progress;
   OstreeRepo *repo;
   int rootfs_fd;
-  OstreeMutableTree *mtree;
   OstreeSePolicy *sepolicy;
-  OstreeRepoCommitModifier *commit_modifier;
-  gboolean success;
+  OstreeRepoDevInoCache *devino_cache;
+  guint shard_depth;
+  GPtrArray *shards; /* CommitShard */
+  GHashTable *shard_paths; /* "/usr/lib" style paths skipped by the root shard */
+  GHashTable *prev_manifest; /* char *path -> GVariant entry; may be %NULL */
+  gboolean fingerprint; /* Whether to fingerprint the shards and write a manifest */
   GCancellable *cancellable;
-  GError **error;
 };
 
+static void
+commit_shard_free (struct CommitShard *shard)
+{
+  g_free (shard->path);
+  g_clear_object (&shard->mtree);
+  g_clear_pointer (&shard->commit_modifier, ostree_repo_commit_modifier_unref);
+  g_clear_pointer (&shard->skip_paths, g_hash_table_unref);
+  g_clear_pointer (&shard->fingerprints, g_hash_table_unref);
+  g_clear_pointer (&shard->shard_fingerprints, g_hash_table_unref);
+  g_clear_pointer (&shard->reused, g_ptr_array_unref);
+  g_clear_error (&shard->error);
+  g_free (shard);
+}
+
 static GVariant *
 filter_xattrs_impl (OstreeRepo     *repo,
                   const char     *relpath,
                   GFileInfo      *file_info,
                   gpointer        user_data)
 {
-  auto tdata = static_cast<struct CommitThreadData *>(user_data);
+  auto shard = static_cast<struct CommitShard *>(user_data);
+  auto tdata = shard->tdata;
   int rootfs_fd = tdata->rootfs_fd;
   /* If you have a use case for something else, file an issue */
   static const char *accepted_xattrs[] =
@@ -703,6 +760,14 @@ filter_xattrs_impl (OstreeRepo     *repo,
   if (relpath[0] == '/')
     relpath++;
 
+  /* The paths we get are relative to the shard; make them relative to the rootfs */
+  g_autofree char *fullpath = NULL;
+  if (!g_str_equal (shard->path, "."))
+    {
+      fullpath = *relpath ? g_build_filename (shard->path, relpath, NULL) : g_strdup (shard->path);
+      relpath = fullpath;
+    }
+
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ayay)"));
 
   if (!*relpath)
@@ -718,10 +783,7 @@ filter_xattrs_impl (OstreeRepo     *repo,
     }
 
   if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_DIRECTORY)
-    {
-      tdata->n_processed += g_file_info_get_size (file_info);
-      g_atomic_int_set (&tdata->percent, (gint)((100.0*tdata->n_processed)/tdata->n_bytes));
-    }
+    g_atomic_pointer_add (&tdata->n_processed, g_file_info_get_size (file_info));
 
   viter = g_variant_iter_new (existing_xattrs);
 
@@ -742,6 +804,29 @@ filter_xattrs_impl (OstreeRepo     *repo,
         }
     }
 
+  /* We do the labeling here rather than via ostree_repo_commit_modifier_set_sepolicy(),
+   * because the latter would see paths relative to the shard.  This is
+   * equivalent to OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED.
+   */
+  if (shard->sepolicy)
+    {
+      g_autofree char *abspath = g_strconcat ("/", relpath, NULL);
+      g_autofree char *label = NULL;
+      if (!ostree_sepolicy_get_label (shard->sepolicy, abspath,
+                                      g_file_info_get_attribute_uint32 (file_info, "unix::mode"),
+                                      &label, NULL, error))
+        util::throw_gerror(local_error);
+      if (!label)
+        {
+          if (!shard->error)
+            glnx_throw (&shard->error, "Unable to find label for path %s", abspath);
+        }
+      else
+        g_variant_builder_add (&builder, "(@ay@ay)",
+                               g_variant_new_bytestring ("security.selinux"),
+                               g_variant_new_bytestring (label));
+    }
+
   return g_variant_ref_sink (g_variant_builder_end (&builder));
 }
 
@@ -763,61 +848,319 @@ filter_xattrs_cb (OstreeRepo     *repo,
   }
 }
 
+/* The root shard skips the directories handled by the other shards, and
+ * the others skip the directories reused from the manifest.
+ */
+static OstreeRepoCommitFilterResult
+shard_filter_cb (OstreeRepo    *repo,
+                 const char    *path,
+                 GFileInfo     *file_info,
+                 gpointer       user_data)
+{
+  auto shard = static_cast<struct CommitShard *>(user_data);
+  if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY &&
+      g_hash_table_contains (shard->skip_paths, path))
+    return OSTREE_REPO_COMMIT_FILTER_SKIP;
+  return OSTREE_REPO_COMMIT_FILTER_ALLOW;
+}
+
+static void
+checksum_update_stat (GChecksum         *checksum,
+                      const struct stat *stbuf)
+{
+  guint64 v[] = { stbuf->st_mode, stbuf->st_uid, stbuf->st_gid,
+                  S_ISREG (stbuf->st_mode) ? (guint64)stbuf->st_size : 0 };
+  g_checksum_update (checksum, (const guint8*)v, sizeof (v));
+}
+
+static gboolean
+checksum_update_contents (GChecksum    *checksum,
+                          int           dfd,
+                          const char   *name,
+                          GError      **error)
+{
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_rdonly (dfd, name, FALSE, &fd, error))
+    return FALSE;
+  g_autoptr(GMappedFile) mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    return glnx_prefix_error (error, "Reading %s", name);
+  g_checksum_update (checksum, (const guint8*)g_mapped_file_get_contents (mfile),
+                     g_mapped_file_get_length (mfile));
+  return TRUE;
+}
+
+/* Compute the fingerprint of the directory at @relpath, recursively, adding it
+ * and all subdirectories to @fingerprints.  Subdirectories in @shard_fingerprints
+ * (if any) are committed as separate shards; we use their fingerprint rather
+ * than recursing.  Regular files found in @devino_cache are fingerprinted
+ * by their object checksum; only files written after the checkout (i.e. by
+ * scripts or postprocessing) have their contents hashed.
+ */
 static gboolean
-count_filesizes (int dfd,
-                 const char *path,
-                 off_t *out_n_bytes,
-                 GCancellable *cancellable,
-                 GError **error)
+fingerprint_dir (int                    rootfs_fd,
+                 const char            *relpath,
+                 OstreeRepoDevInoCache *devino_cache,
+                 GHashTable            *shard_fingerprints,
+                 GHashTable            *fingerprints,
+                 const char           **out_fingerprint,
+                 GCancellable          *cancellable,
+                 GError               **error)
 {
   g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
-  
-  if (!glnx_dirfd_iterator_init_at (dfd, path, TRUE, &dfd_iter, error))
+  if (!glnx_dirfd_iterator_init_at (rootfs_fd, relpath, FALSE, &dfd_iter, error))
     return FALSE;
-  
+
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  struct stat stbuf;
+  if (!glnx_fstat (dfd_iter.fd, &stbuf, error))
+    return FALSE;
+  checksum_update_stat (checksum, &stbuf);
+  g_autoptr(GVariant) xattrs = NULL;
+  if (!glnx_fd_get_all_xattrs (dfd_iter.fd, &xattrs, cancellable, error))
+    return FALSE;
+  g_checksum_update (checksum, (const guint8*)g_variant_get_data (xattrs), g_variant_get_size (xattrs));
+
+  /* readdir() order isn't stable */
+  g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
   while (TRUE)
     {
       struct dirent *dent = NULL;
-
-      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
         return FALSE;
       if (!dent)
         break;
+      g_ptr_array_add (names, g_strdup (dent->d_name));
+    }
+  g_ptr_array_sort (names, (GCompareFunc)rpmostree_ptrarray_sort_compare_strings);
 
-      if (dent->d_type == DT_DIR)
+  for (guint i = 0; i < names->len; i++)
+    {
+      auto name = static_cast<const char *>(names->pdata[i]);
+      g_checksum_update (checksum, (const guint8*)name, strlen (name) + 1);
+      if (!glnx_fstatat (dfd_iter.fd, name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+
+      if (S_ISDIR (stbuf.st_mode))
         {
-          if (!count_filesizes (dfd_iter.fd, dent->d_name, out_n_bytes,
-                                cancellable, error))
+          g_autofree char *subpath =
+            g_str_equal (relpath, ".") ? g_strdup (name) : g_build_filename (relpath, name, NULL);
+          const char *sub_fingerprint = shard_fingerprints ?
+            static_cast<const char*>(g_hash_table_lookup (shard_fingerprints, subpath)) : NULL;
+          if (!sub_fingerprint &&
+              !fingerprint_dir (rootfs_fd, subpath, devino_cache, shard_fingerprints,
+                                fingerprints, &sub_fingerprint, cancellable, error))
             return FALSE;
+          g_checksum_update (checksum, (const guint8*)sub_fingerprint, strlen (sub_fingerprint));
+          continue;
         }
-      else
-        {
-          struct stat stbuf;
 
-          if (!glnx_fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+      checksum_update_stat (checksum, &stbuf);
+      if (S_ISLNK (stbuf.st_mode))
+        {
+          g_autofree char *target = glnx_readlinkat_malloc (dfd_iter.fd, name, cancellable, error);
+          if (!target)
             return FALSE;
+          g_checksum_update (checksum, (const guint8*)target, strlen (target) + 1);
+        }
+      else if (S_ISREG (stbuf.st_mode))
+        {
+          const char *object_csum = rpmostree_devino_cache_lookup (devino_cache, &stbuf);
+          if (object_csum)
+            g_checksum_update (checksum, (const guint8*)object_csum, strlen (object_csum));
+          else if (!checksum_update_contents (checksum, dfd_iter.fd, name, error))
+            return FALSE;
+        }
+      g_clear_pointer (&xattrs, g_variant_unref);
+      if (!glnx_dfd_name_get_all_xattrs (dfd_iter.fd, name, &xattrs, cancellable, error))
+        return FALSE;
+      g_checksum_update (checksum, (const guint8*)g_variant_get_data (xattrs), g_variant_get_size (xattrs));
+    }
+
+  char *fingerprint = g_strdup (g_checksum_get_string (checksum));
+  g_hash_table_replace (fingerprints, g_strdup (relpath), fingerprint);
+  *out_fingerprint = fingerprint;
+  return TRUE;
+}
 
-          (*out_n_bytes) += stbuf.st_size;
+/* Returns @relpath (relative to the rootfs) relative to @shard, without a
+ * leading slash; the empty string for the shard itself.
+ */
+static const char *
+shard_subpath (struct CommitShard *shard,
+               const char         *relpath)
+{
+  if (g_str_equal (shard->path, "."))
+    return g_str_equal (relpath, ".") ? "" : relpath;
+  relpath += strlen (shard->path);
+  while (*relpath == '/')
+    relpath++;
+  return relpath;
+}
+
+/* Returns the manifest entry for @relpath if it's unchanged */
+static GVariant *
+lookup_unchanged_dir (struct CommitThreadData *tdata,
+                      GHashTable              *fingerprints,
+                      const char              *relpath)
+{
+  if (!tdata->prev_manifest)
+    return NULL;
+  auto entry = static_cast<GVariant *>(g_hash_table_lookup (tdata->prev_manifest, relpath));
+  if (!entry)
+    return NULL;
+  const char *prev_fingerprint;
+  g_variant_get_child (entry, 0, "&s", &prev_fingerprint);
+  if (g_strcmp0 (static_cast<const char*>(g_hash_table_lookup (fingerprints, relpath)),
+                 prev_fingerprint) != 0)
+    return NULL;
+  return entry;
+}
+
+/* Find the topmost unchanged directories in @shard whose trees are still
+ * in the repo; since the fingerprints are recursive, everything beneath those
+ * is unchanged too.
+ */
+static gboolean
+find_reusable_dirs (struct CommitShard *shard,
+                    GError            **error)
+{
+  auto tdata = shard->tdata;
+  GLNX_HASH_TABLE_FOREACH (shard->fingerprints, const char*, relpath)
+    {
+      GVariant *entry = lookup_unchanged_dir (tdata, shard->fingerprints, relpath);
+      if (!entry)
+        continue;
+      if (!g_str_equal (relpath, shard->path))
+        {
+          g_autofree char *parent = g_path_get_dirname (relpath);
+          if (lookup_unchanged_dir (tdata, shard->fingerprints, parent))
+            continue;
         }
+
+      const char *contents_csum, *meta_csum;
+      g_variant_get (entry, "(&s&s&s)", NULL, &contents_csum, &meta_csum);
+      gboolean have_contents, have_meta;
+      if (!ostree_repo_has_object (tdata->repo, OSTREE_OBJECT_TYPE_DIR_TREE, contents_csum,
+                                   &have_contents, tdata->cancellable, error))
+        return FALSE;
+      if (!ostree_repo_has_object (tdata->repo, OSTREE_OBJECT_TYPE_DIR_META, meta_csum,
+                                   &have_meta, tdata->cancellable, error))
+        return FALSE;
+      if (!(have_contents && have_meta))
+        continue;
+
+      g_ptr_array_add (shard->reused, g_strdup (relpath));
+      if (!g_str_equal (relpath, shard->path))
+        g_hash_table_add (shard->skip_paths, g_strconcat ("/", shard_subpath (shard, relpath), NULL));
     }
 
   return TRUE;
 }
 
+/* Graft the directories found by find_reusable_dirs() into the shard's tree */
+static gboolean
+graft_reused_dirs (struct CommitShard *shard,
+                   GError            **error)
+{
+  auto tdata = shard->tdata;
+  for (guint i = 0; i < shard->reused->len; i++)
+    {
+      auto relpath = static_cast<const char *>(shard->reused->pdata[i]);
+      auto entry = static_cast<GVariant *>(g_hash_table_lookup (tdata->prev_manifest, relpath));
+      const char *contents_csum, *meta_csum;
+      g_variant_get (entry, "(&s&s&s)", NULL, &contents_csum, &meta_csum);
+
+      if (!rpmostree_mtree_graft_dirtree (shard->mtree, shard_subpath (shard, relpath),
+                                          tdata->repo, contents_csum, meta_csum, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+commit_one_shard (struct CommitShard *shard,
+                  GError            **error)
+{
+  auto tdata = shard->tdata;
+  if (shard->fingerprints)
+    {
+      const char *fingerprint;
+      if (!fingerprint_dir (tdata->rootfs_fd, shard->path, tdata->devino_cache,
+                            shard->shard_fingerprints, shard->fingerprints, &fingerprint,
+                            tdata->cancellable, error))
+        return FALSE;
+      if (!find_reusable_dirs (shard, error))
+        return FALSE;
+    }
+
+  /* If the whole shard is unchanged, there's nothing to commit */
+  const gboolean reuse_all =
+    shard->reused && shard->reused->len == 1 &&
+    g_str_equal (static_cast<const char*>(shard->reused->pdata[0]), shard->path);
+  if (!reuse_all)
+    {
+      if (!ostree_repo_write_dfd_to_mtree (tdata->repo, tdata->rootfs_fd, shard->path,
+                                           shard->mtree, shard->commit_modifier,
+                                           tdata->cancellable, error))
+        return FALSE;
+      /* Check if any of the callbacks set an error */
+      if (shard->error)
+        {
+          g_propagate_error (error, util::move_nullify (shard->error));
+          return FALSE;
+        }
+    }
+
+  if (shard->reused && !graft_reused_dirs (shard, error))
+    return FALSE;
+  return TRUE;
+}
+
+/* The selabel handle isn't safe to use from multiple threads, so each worker
+ * loads its own copy of the policy.
+ */
+struct CommitWorker {
+  struct CommitThreadData *tdata;
+  OstreeSePolicy *sepolicy;
+  GThread *thread;
+};
+
+static void
+commit_worker_free (struct CommitWorker *worker)
+{
+  if (worker->thread)
+    g_thread_join (worker->thread);
+  g_clear_object (&worker->sepolicy);
+  g_free (worker);
+}
+
 static gpointer
 write_dfd_thread (gpointer datap)
 {
-  auto data = static_cast<struct CommitThreadData *>(datap);
+  auto worker = static_cast<struct CommitWorker *>(datap);
+  auto data = worker->tdata;
 
-  if (!ostree_repo_write_dfd_to_mtree (data->repo, data->rootfs_fd, ".",
-                                       data->mtree,
-                                       data->commit_modifier,
-                                       data->cancellable, data->error))
-    goto out;
+  while (!g_atomic_int_get (&data->failed))
+    {
+      guint i = g_atomic_int_add (&data->next_shard, 1);
+      if (i >= data->shards->len)
+        break;
 
-  data->success = TRUE;
- out:
-  g_atomic_int_inc (&data->done);
+      auto shard = static_cast<struct CommitShard *>(data->shards->pdata[i]);
+      shard->sepolicy = worker->sepolicy;
+      g_autoptr(GError) local_error = NULL;
+      if (!commit_one_shard (shard, &local_error))
+        {
+          g_prefix_error (&local_error, "Writing %s: ", shard->path);
+          shard->error = util::move_nullify (local_error);
+          g_atomic_int_set (&data->failed, 1);
+          break;
+        }
+      g_atomic_int_inc (&data->n_shards_done);
+    }
+
+  g_atomic_int_inc (&data->n_workers_done);
   g_main_context_wakeup (NULL);
   return NULL;
 }
@@ -826,10 +1169,245 @@ static gboolean
 on_progress_timeout (gpointer datap)
 {
   auto data = static_cast<struct CommitThreadData *>(datap);
-  const gint percent = g_atomic_int_get (&data->percent);
 
-  /* clamp to 100 if it somehow goes over (XXX: bad counting?) */
-  data->progress->percent_update(MIN(percent, 100));
+  data->progress->nitems_update(g_atomic_int_get (&data->n_shards_done));
+  g_autofree char *processed = g_format_size (g_atomic_pointer_get (&data->n_processed));
+  data->progress->set_sub_message(processed);
+
+  return TRUE;
+}
+
+static struct CommitShard *
+commit_shard_new (struct CommitThreadData *tdata,
+                  const char              *path)
+{
+  struct CommitShard *shard = g_new0 (struct CommitShard, 1);
+  shard->path = g_strdup (path);
+  shard->tdata = tdata;
+  shard->mtree = ostree_mutable_tree_new ();
+
+  /* Also right now we unconditionally use the CONSUME flag, but this will need
+   * to change for the split compose/commit root patches.
+   */
+  auto modifier_flags = static_cast<OstreeRepoCommitModifierFlags>(OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME);
+  /* If changing this, also look at changing rpmostree-unpacker.c */
+  shard->commit_modifier =
+    ostree_repo_commit_modifier_new (modifier_flags, shard_filter_cb, shard, NULL);
+  if (g_str_equal (path, "."))
+    shard->skip_paths = g_hash_table_ref (tdata->shard_paths);
+  else
+    shard->skip_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  if (tdata->fingerprint)
+    {
+      shard->fingerprints = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      shard->reused = g_ptr_array_new_with_free_func (g_free);
+    }
+  ostree_repo_commit_modifier_set_xattr_callback (shard->commit_modifier,
+                                                  filter_xattrs_cb, NULL,
+                                                  shard);
+  if (tdata->devino_cache)
+    ostree_repo_commit_modifier_set_devino_cache (shard->commit_modifier, tdata->devino_cache);
+
+  return shard;
+}
+
+/* Find the directories tdata->shard_depth levels down; note we don't follow symlinks */
+static gboolean
+gather_commit_shards (struct CommitThreadData *tdata,
+                      int                      dfd,
+                      const char              *path,
+                      guint                    depth,
+                      GCancellable            *cancellable,
+                      GError                 **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+      if (dent->d_type != DT_DIR)
+        continue;
+
+      g_autofree char *subpath =
+        g_str_equal (path, ".") ? g_strdup (dent->d_name) : g_build_filename (path, dent->d_name, NULL);
+      if (depth + 1 < tdata->shard_depth)
+        {
+          if (!gather_commit_shards (tdata, dfd, subpath, depth + 1, cancellable, error))
+            return FALSE;
+        }
+      else
+        {
+          g_hash_table_add (tdata->shard_paths, g_strconcat ("/", subpath, NULL));
+          g_ptr_array_add (tdata->shards, commit_shard_new (tdata, subpath));
+        }
+    }
+
+  return TRUE;
+}
+
+/* Whether @path is beneath a directory the root shard reused as a whole */
+static gboolean
+root_shard_reused_path (struct CommitShard *root_shard,
+                        const char         *path)
+{
+  if (!root_shard->reused)
+    return FALSE;
+  for (guint i = 0; i < root_shard->reused->len; i++)
+    {
+      auto reused = static_cast<const char *>(root_shard->reused->pdata[i]);
+      if (g_str_equal (reused, ".") || g_str_equal (reused, path))
+        return TRUE;
+      if (g_str_has_prefix (path, reused) && path[strlen (reused)] == '/')
+        return TRUE;
+    }
+  return FALSE;
+}
+
+/* Graft the tree written for @shard back into @root */
+static gboolean
+graft_commit_shard (OstreeRepo         *repo,
+                    OstreeMutableTree  *root,
+                    struct CommitShard *shard,
+                    GCancellable       *cancellable,
+                    GError            **error)
+{
+  g_autoptr(GFile) shard_root = NULL;
+  if (!ostree_repo_write_mtree (repo, shard->mtree, &shard_root, cancellable, error))
+    return FALSE;
+  auto shard_repofile = OSTREE_REPO_FILE (shard_root);
+  if (!ostree_repo_file_ensure_resolved (shard_repofile, error))
+    return FALSE;
+
+  return rpmostree_mtree_graft_dirtree (root, shard->path, repo,
+                                        ostree_repo_file_tree_get_contents_checksum (shard_repofile),
+                                        ostree_repo_file_tree_get_metadata_checksum (shard_repofile),
+                                        error);
+}
+
+/* Load the manifest written along with @previous_revision, if any and it's
+ * still applicable.
+ */
+static gboolean
+compose_manifest_load (OstreeRepo     *repo,
+                       const char     *previous_revision,
+                       OstreeSePolicy *sepolicy,
+                       GHashTable    **out_manifest,
+                       GError        **error)
+{
+  *out_manifest = NULL;
+  if (!previous_revision)
+    return TRUE;
+
+  glnx_autofd int fd = -1;
+  g_autoptr(GError) local_error = NULL;
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), RPMOSTREE_COMPOSE_MANIFEST_PATH, TRUE,
+                           &fd, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return g_propagate_error (error, util::move_nullify (local_error)), FALSE;
+      return TRUE; /* Note early return */
+    }
+
+  g_autoptr(GMappedFile) mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    return FALSE;
+  g_autoptr(GBytes) bytes = g_mapped_file_get_bytes (mfile);
+  g_autoptr(GVariant) manifest =
+    g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (RPMOSTREE_COMPOSE_MANIFEST_GVARIANT_FORMAT),
+                                                  bytes, FALSE));
+  guint32 version;
+  const char *revision;
+  const char *sepolicy_csum;
+  g_autoptr(GVariant) entries = NULL;
+  g_variant_get (manifest, "(u&s&s@a{s" RPMOSTREE_COMPOSE_MANIFEST_ENTRY_FORMAT "})",
+                 &version, &revision, &sepolicy_csum, &entries);
+  if (version != RPMOSTREE_COMPOSE_MANIFEST_VERSION ||
+      !g_str_equal (revision, previous_revision) ||
+      !g_str_equal (sepolicy_csum, sepolicy ? ostree_sepolicy_get_csum (sepolicy) : ""))
+    return TRUE; /* Note early return; we'll overwrite it */
+
+  g_autoptr(GHashTable) ret_manifest =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+  GVariantIter iter;
+  g_variant_iter_init (&iter, entries);
+  const char *relpath;
+  GVariant *entry;
+  while (g_variant_iter_loop (&iter, "{&s@" RPMOSTREE_COMPOSE_MANIFEST_ENTRY_FORMAT "}", &relpath, &entry))
+    g_hash_table_insert (ret_manifest, g_strdup (relpath), g_variant_ref (entry));
+
+  *out_manifest = util::move_nullify (ret_manifest);
+  return TRUE;
+}
+
+/* Record the manifest for @revision; must be called after the shard trees
+ * have been written.
+ */
+static gboolean
+compose_manifest_write (struct CommitThreadData *tdata,
+                        const char              *revision,
+                        GCancellable            *cancellable,
+                        GError                 **error)
+{
+  g_autoptr(GHashTable) entries =
+    g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_variant_unref);
+  for (guint i = 0; i < tdata->shards->len; i++)
+    {
+      auto shard = static_cast<struct CommitShard *>(tdata->shards->pdata[i]);
+      if (!shard->fingerprints)
+        continue;
+      GLNX_HASH_TABLE_FOREACH_KV (shard->fingerprints, const char*, relpath, const char*, fingerprint)
+        {
+          /* Unchanged directories have the same trees as last time */
+          GVariant *entry = lookup_unchanged_dir (tdata, shard->fingerprints, relpath);
+          if (entry)
+            {
+              g_hash_table_insert (entries, (gpointer)relpath, g_variant_ref (entry));
+              continue;
+            }
+
+          g_autoptr(OstreeMutableTree) subdir =
+            rpmostree_mtree_walk (shard->mtree, shard_subpath (shard, relpath), FALSE, error);
+          if (!subdir)
+            return FALSE;
+          const char *contents_csum = ostree_mutable_tree_get_contents_checksum (subdir);
+          const char *meta_csum = ostree_mutable_tree_get_metadata_checksum (subdir);
+          if (!(contents_csum && meta_csum))
+            continue;
+          g_hash_table_insert (entries, (gpointer)relpath,
+                               g_variant_ref_sink (g_variant_new ("(sss)", fingerprint,
+                                                                  contents_csum, meta_csum)));
+        }
+    }
+
+  /* Sorted, so that the file is stable for the same tree */
+  g_autofree const char **relpaths = (const char**)g_hash_table_get_keys_as_array (entries, NULL);
+  qsort (relpaths, g_hash_table_size (entries), sizeof (char*), rpmostree_ptrarray_sort_compare_strings);
+  g_autoptr(GVariantBuilder) builder =
+    g_variant_builder_new (G_VARIANT_TYPE ("a{s" RPMOSTREE_COMPOSE_MANIFEST_ENTRY_FORMAT "}"));
+  for (const char **it = relpaths; it && *it; it++)
+    g_variant_builder_add (builder, "{s@" RPMOSTREE_COMPOSE_MANIFEST_ENTRY_FORMAT "}", *it,
+                           static_cast<GVariant*>(g_hash_table_lookup (entries, *it)));
+  const char *sepolicy_csum = tdata->sepolicy ? ostree_sepolicy_get_csum (tdata->sepolicy) : "";
+  g_autoptr(GVariant) manifest =
+    g_variant_ref_sink (g_variant_new ("(ussa{s" RPMOSTREE_COMPOSE_MANIFEST_ENTRY_FORMAT "})",
+                                       RPMOSTREE_COMPOSE_MANIFEST_VERSION, revision,
+                                       sepolicy_csum, builder));
+
+  int repo_dfd = ostree_repo_get_dfd (tdata->repo);
+  g_autofree char *dir = g_path_get_dirname (RPMOSTREE_COMPOSE_MANIFEST_PATH);
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, dir, 0755, cancellable, error))
+    return FALSE;
+  if (!glnx_file_replace_contents_at (repo_dfd, RPMOSTREE_COMPOSE_MANIFEST_PATH,
+                                      static_cast<const guint8*>(g_variant_get_data (manifest)),
+                                      g_variant_get_size (manifest),
+                                      GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+    return FALSE;
 
   return TRUE;
 }
@@ -842,10 +1420,12 @@ gboolean
 rpmostree_compose_commit (int            rootfs_fd,
                           OstreeRepo    *repo,
                           const char    *parent_revision,
+                          const char    *previous_revision,
                           GVariant      *src_metadata,
                           const char    *gpg_keyid,
                           gboolean       enable_selinux,
                           OstreeRepoDevInoCache *devino_cache,
+                          guint          shard_depth,
                           char         **out_new_revision,
                           GCancellable  *cancellable,
                           GError       **error)
@@ -858,64 +1438,133 @@ rpmostree_compose_commit (int            rootfs_fd,
         return FALSE;
     }
 
-  g_autoptr(OstreeMutableTree) mtree = ostree_mutable_tree_new ();
   /* We may make this configurable if someone complains about including some
    * unlabeled content, but I think the fix for that is to ensure that policy is
    * labeling it.
-   *
-   * Also right now we unconditionally use the CONSUME flag, but this will need
-   * to change for the split compose/commit root patches.
    */
-  auto modifier_flags = static_cast<OstreeRepoCommitModifierFlags>(OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED |
-    OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME);
-  /* If changing this, also look at changing rpmostree-unpacker.c */
-  g_autoptr(OstreeRepoCommitModifier) commit_modifier =
-    ostree_repo_commit_modifier_new (modifier_flags, NULL, NULL, NULL);
-  struct CommitThreadData tdata = { 0, };
-  ostree_repo_commit_modifier_set_xattr_callback (commit_modifier,
-                                                  filter_xattrs_cb, NULL,
-                                                  &tdata);
-
-  if (sepolicy && ostree_sepolicy_get_name (sepolicy) != NULL)
-    ostree_repo_commit_modifier_set_sepolicy (commit_modifier, sepolicy);
-  else if (enable_selinux)
+  if (sepolicy && ostree_sepolicy_get_name (sepolicy) == NULL)
     return glnx_throw (error, "SELinux enabled, but no policy found");
 
-  if (devino_cache)
-    ostree_repo_commit_modifier_set_devino_cache (commit_modifier, devino_cache);
-
-  off_t n_bytes = 0;
-  if (!count_filesizes (rootfs_fd, ".", &n_bytes, cancellable, error))
-    return FALSE;
+  /* If we have a manifest for the previous commit, we can reuse its unchanged
+   * directories.  Fingerprinting reads everything, so if there's nothing to
+   * compare to, only do it to start a manifest for a tree with history.
+   */
+  g_autoptr(GHashTable) prev_manifest = NULL;
+  if (!compose_manifest_load (repo, previous_revision, sepolicy, &prev_manifest, error))
+    return glnx_prefix_error (error, "Loading compose manifest");
 
-  tdata.n_bytes = n_bytes;
+  g_autoptr(GPtrArray) shards = g_ptr_array_new_with_free_func ((GDestroyNotify)commit_shard_free);
+  g_autoptr(GHashTable) shard_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  struct CommitThreadData tdata = { 0, };
   tdata.repo = repo;
   tdata.rootfs_fd = rootfs_fd;
-  tdata.mtree = mtree;
   tdata.sepolicy = sepolicy;
-  tdata.commit_modifier = commit_modifier;
-  tdata.error = error;
+  tdata.devino_cache = devino_cache;
+  tdata.shard_depth = shard_depth > 0 ? shard_depth : COMMIT_SHARD_DEPTH_DEFAULT;
+  tdata.shards = shards;
+  tdata.shard_paths = shard_paths;
+  tdata.prev_manifest = prev_manifest;
+  tdata.fingerprint = prev_manifest != NULL || previous_revision != NULL;
+  tdata.cancellable = cancellable;
+
+  /* The root shard goes first, but is committed last: its fingerprints
+   * include those of the other shards.
+   */
+  g_ptr_array_add (shards, commit_shard_new (&tdata, "."));
+  tdata.next_shard = 1;
+  if (!gather_commit_shards (&tdata, rootfs_fd, ".", 0, cancellable, error))
+    return FALSE;
 
   {
-    g_autoptr(GThread) commit_thread = g_thread_new ("commit", write_dfd_thread, &tdata);
-
-    tdata.progress = rpmostreecxx::progress_percent_begin("Committing");
+    const guint n_workers = MIN (g_get_num_processors (), shards->len - 1);
+    g_autoptr(GPtrArray) workers = g_ptr_array_new_with_free_func ((GDestroyNotify)commit_worker_free);
+    for (guint i = 0; i < n_workers; i++)
+      {
+        struct CommitWorker *worker = g_new0 (struct CommitWorker, 1);
+        worker->tdata = &tdata;
+        g_ptr_array_add (workers, worker);
+        if (sepolicy)
+          {
+            worker->sepolicy = ostree_sepolicy_new_at (rootfs_fd, cancellable, error);
+            if (!worker->sepolicy)
+              return FALSE;
+          }
+      }
+    tdata.progress = rpmostreecxx::progress_nitems_begin(shards->len, "Committing");
+    for (guint i = 0; i < n_workers; i++)
+      {
+        auto worker = static_cast<struct CommitWorker *>(workers->pdata[i]);
+        worker->thread = g_thread_new ("commit", write_dfd_thread, worker);
+      }
 
     g_autoptr(GSource) progress_src = g_timeout_source_new_seconds (1);
     g_source_set_callback (progress_src, on_progress_timeout, &tdata, NULL);
     g_source_attach (progress_src, NULL);
 
-    while (g_atomic_int_get (&tdata.done) == 0)
+    while (g_atomic_int_get (&tdata.n_workers_done) < (gint)n_workers)
       g_main_context_iteration (NULL, TRUE);
 
     g_source_destroy (progress_src);
-    g_thread_join (util::move_nullify (commit_thread));
-
-    tdata.progress->percent_update(100);
+    for (guint i = 0; i < workers->len; i++)
+      {
+        auto worker = static_cast<struct CommitWorker *>(workers->pdata[i]);
+        g_thread_join (util::move_nullify (worker->thread));
+      }
   }
 
-  if (!tdata.success)
+  for (guint i = 1; i < shards->len; i++)
+    {
+      auto shard = static_cast<struct CommitShard *>(shards->pdata[i]);
+      if (shard->error)
+        {
+          g_propagate_error (error, util::move_nullify (shard->error));
+          return glnx_prefix_error (error, "While writing rootfs to mtree");
+        }
+    }
+
+  auto root_shard = static_cast<struct CommitShard *>(shards->pdata[0]);
+  if (tdata.fingerprint)
+    {
+      root_shard->shard_fingerprints = g_hash_table_new (g_str_hash, g_str_equal);
+      for (guint i = 1; i < shards->len; i++)
+        {
+          auto shard = static_cast<struct CommitShard *>(shards->pdata[i]);
+          g_hash_table_insert (root_shard->shard_fingerprints, shard->path,
+                               g_hash_table_lookup (shard->fingerprints, shard->path));
+        }
+    }
+  root_shard->sepolicy = sepolicy;
+  if (!commit_one_shard (root_shard, error))
     return glnx_prefix_error (error, "While writing rootfs to mtree");
+  g_atomic_int_inc (&tdata.n_shards_done);
+  on_progress_timeout (&tdata);
+
+  OstreeMutableTree *mtree = root_shard->mtree;
+  for (guint i = 1; i < shards->len; i++)
+    {
+      auto shard = static_cast<struct CommitShard *>(shards->pdata[i]);
+      /* Already part of a directory reused by the root shard */
+      if (root_shard_reused_path (root_shard, shard->path))
+        continue;
+      if (!graft_commit_shard (repo, mtree, shard, cancellable, error))
+        return glnx_prefix_error (error, "While writing rootfs to mtree");
+    }
+
+  guint n_reused = 0;
+  for (guint i = 0; i < shards->len; i++)
+    {
+      auto shard = static_cast<struct CommitShard *>(shards->pdata[i]);
+      n_reused += shard->reused ? shard->reused->len : 0;
+    }
+  if (prev_manifest)
+    {
+      g_autofree char *msg = g_strdup_printf ("reused %u unchanged director%s", n_reused,
+                                              n_reused == 1 ? "y" : "ies");
+      tdata.progress->end(msg);
+      sd_journal_print (LOG_INFO, "Reused %u unchanged directories from %s", n_reused, previous_revision);
+    }
+  else
+    tdata.progress->end("");
 
   g_autoptr(GFile) root_tree = NULL;
   if (!ostree_repo_write_mtree (repo, mtree, &root_tree, cancellable, error))
@@ -933,6 +1582,14 @@ rpmostree_compose_commit (int            rootfs_fd,
                                  cancellable, error))
     return glnx_prefix_error (error, "While writing commit");
 
+  /* The manifest is just a cache, so failing to write it shouldn't fail the compose */
+  if (tdata.fingerprint)
+    {
+      g_autoptr(GError) local_error = NULL;
+      if (!compose_manifest_write (&tdata, new_revision, cancellable, &local_error))
+        sd_journal_print (LOG_WARNING, "Failed to write compose manifest: %s", local_error->message);
+    }
+
   if (gpg_keyid)
     {
       if (!ostree_repo_sign_commit (repo, new_revision, gpg_keyid, NULL,
@@ -58,10 +58,12 @@ gboolean
 rpmostree_compose_commit (int            rootfs_dfd,
                           OstreeRepo    *repo,
                           const char    *parent,
+                          const char    *previous_revision,
                           GVariant      *metadata,
                           const char    *gpg_keyid,
                           gboolean       enable_selinux,
                           OstreeRepoDevInoCache *devino_cache,
+                          guint          shard_depth,
                           char         **out_new_revision,
                           GCancellable  *cancellable,
                           GError       **error);
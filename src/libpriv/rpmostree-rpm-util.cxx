@@ -842,9 +842,13 @@ checkout_only_rpmdb (OstreeRepo       *repo,
   return TRUE;
 }
 
+/* If @solv_cachedir is set, libdnf caches its libsolv parse of the rpmdb
+ * there, and uses it instead of librpm on later loads of the same rpmdb.
+ */
 static gboolean
 get_sack_for_root (int               dfd,
                    const char       *path,
+                   const char       *solv_cachedir,
                    DnfSack         **out_sack,
                    GError          **error)
 {
@@ -857,11 +861,14 @@ get_sack_for_root (int               dfd,
 
   g_autoptr(DnfSack) sack = dnf_sack_new ();
   dnf_sack_set_rootdir (sack, fullpath);
+  if (solv_cachedir)
+    dnf_sack_set_cachedir (sack, solv_cachedir);
 
-  if (!dnf_sack_setup (sack, 0, error))
+  if (!dnf_sack_setup (sack, solv_cachedir ? DNF_SACK_SETUP_FLAG_MAKE_CACHE_DIR : 0, error))
     return FALSE;
 
-  if (!dnf_sack_load_system_repo (sack, NULL, 0, error))
+  if (!dnf_sack_load_system_repo (sack, NULL, solv_cachedir ? DNF_SACK_LOAD_FLAG_BUILD_CACHE : 0,
+                                  error))
     return FALSE;
 
   *out_sack = util::move_nullify (sack);
@@ -876,7 +883,7 @@ rpmostree_get_refsack_for_root (int              dfd,
                                 GError         **error)
 {
   g_autoptr(DnfSack) sack = NULL; /* NB: refsack adds a ref to it */
-  if (!get_sack_for_root (dfd, path, &sack, error))
+  if (!get_sack_for_root (dfd, path, NULL, &sack, error))
     return NULL;
   return rpmostree_refsack_new (sack, NULL);
 }
@@ -914,7 +921,7 @@ rpmostree_get_base_refsack_for_root (int                dfd,
     return FALSE;
 
   g_autoptr(DnfSack) sack = NULL; /* NB: refsack adds a ref to it */
-  if (!get_sack_for_root (tmpdir.fd, ".", &sack, error))
+  if (!get_sack_for_root (tmpdir.fd, ".", NULL, &sack, error))
     return FALSE;
 
   *out_sack = rpmostree_refsack_new (sack, &tmpdir);
@@ -922,6 +929,71 @@ rpmostree_get_base_refsack_for_root (int                dfd,
 }
 
 
+/* Loading the sack for a commit (for status, diffs, layering decisions...)
+ * is dominated by parsing the rpmdb through librpm.  So for writable repos,
+ * we keep the rpmdb checkout of the last few commits in the repo, and let
+ * libdnf cache its libsolv parse of each (@System.solv) next to it.  Since the
+ * checkout is stable, libdnf's rpmdb cookie matches on later loads, which are
+ * then just a read of the .solv file.
+ */
+#define RPMOSTREE_SOLV_CACHE_NAME "solv-cache"
+/* Layered commits use two entries: their own rpmdb and the base one */
+#define RPMOSTREE_SOLV_CACHE_MAX_ENTRIES 8
+
+/* Return a sack for the rpmdb at @rpmdb in @ref, loaded via the solv cache;
+ * sets @out_sack to %NULL if the repo isn't writable.
+ */
+static gboolean
+get_cached_refsack_for_commit (OstreeRepo        *repo,
+                               const char        *ref,
+                               const char        *rpmdb,
+                               RpmOstreeRefSack **out_sack,
+                               GCancellable      *cancellable,
+                               GError           **error)
+{
+  *out_sack = NULL;
+  if (!ostree_repo_is_writable (repo, NULL))
+    return TRUE; /* Note early return */
+
+  g_autofree char *commit = NULL;
+  if (!ostree_repo_resolve_rev (repo, ref, FALSE, &commit, error))
+    return FALSE;
+  /* The base rpmdb of a layered commit is a different package set */
+  g_autofree char *name =
+    g_strconcat (commit, g_str_equal (rpmdb, RPMOSTREE_BASE_RPMDB) ? "-base" : "", NULL);
+
+  /* Entries can't be pruned while we hold the cache open */
+  auto cache = rpmostreecxx::repo_cache_open (*repo, RPMOSTREE_SOLV_CACHE_NAME,
+                                              RPMOSTREE_SOLV_CACHE_MAX_ENTRIES);
+  int cache_dfd = cache->get_dfd ();
+
+  /* This also marks it as most recently used */
+  if (!cache->touch (name))
+    {
+      g_auto(GLnxTmpDir) tmpdir = { 0, };
+      g_autofree char *tmpl = g_strconcat (name, ".tmp-XXXXXX", NULL);
+      if (!glnx_mkdtempat (cache_dfd, tmpl, 0755, &tmpdir, error))
+        return FALSE;
+      if (!checkout_only_rpmdb (repo, commit, rpmdb, &tmpdir, cancellable, error))
+        return FALSE;
+      /* If someone else won the race, just use theirs; the tmpdir cleanup
+       * is a no-op if we were the ones to rename it */
+      if (renameat (cache_dfd, tmpdir.path, cache_dfd, name) < 0 &&
+          errno != EEXIST && errno != ENOTEMPTY)
+        return glnx_throw_errno_prefix (error, "renameat(%s)", name);
+
+      cache->prune (name);
+    }
+
+  g_autofree char *solv_cachedir = glnx_fdrel_abspath (cache_dfd, glnx_strjoina (name, "/solv"));
+  g_autoptr(DnfSack) hsack = NULL; /* NB: refsack adds a ref to it */
+  if (!get_sack_for_root (cache_dfd, name, solv_cachedir, &hsack, error))
+    return FALSE;
+
+  *out_sack = rpmostree_refsack_new (hsack, NULL);
+  return TRUE;
+}
+
 /* Given @ref which is an OSTree ref, return a "sack" i.e. database of packages.
  */
 RpmOstreeRefSack *
@@ -930,6 +1002,13 @@ rpmostree_get_refsack_for_commit (OstreeRepo                *repo,
                                   GCancellable              *cancellable,
                                   GError                   **error)
 {
+  RpmOstreeRefSack *cached = NULL;
+  if (!get_cached_refsack_for_commit (repo, ref, RPMOSTREE_RPMDB_LOCATION, &cached,
+                                      cancellable, error))
+    return NULL;
+  if (cached)
+    return cached;
+
   g_auto(GLnxTmpDir) tmpdir = { 0, };
   if (!glnx_mkdtemp ("rpmostree-dbquery-XXXXXX", 0700, &tmpdir, error))
     return NULL;
@@ -939,7 +1018,7 @@ rpmostree_get_refsack_for_commit (OstreeRepo                *repo,
     return NULL;
 
   g_autoptr(DnfSack) hsack = NULL; /* NB: refsack adds a ref to it */
-  if (!get_sack_for_root (tmpdir.fd, ".", &hsack, error))
+  if (!get_sack_for_root (tmpdir.fd, ".", NULL, &hsack, error))
     return NULL;
 
   /* Ownership of tmpdir is transferred */
@@ -955,6 +1034,13 @@ rpmostree_get_base_refsack_for_commit (OstreeRepo                *repo,
                                        GCancellable              *cancellable,
                                        GError                   **error)
 {
+  RpmOstreeRefSack *cached = NULL;
+  if (!get_cached_refsack_for_commit (repo, ref, RPMOSTREE_BASE_RPMDB, &cached,
+                                      cancellable, error))
+    return NULL;
+  if (cached)
+    return cached;
+
   g_auto(GLnxTmpDir) tmpdir = { 0, };
   if (!glnx_mkdtemp ("rpmostree-dbquery-XXXXXX", 0700, &tmpdir, error))
     return NULL;
@@ -968,7 +1054,7 @@ rpmostree_get_base_refsack_for_commit (OstreeRepo                *repo,
     return NULL;
 
   g_autoptr(DnfSack) hsack = NULL; /* NB: refsack adds a ref to it */
-  if (!get_sack_for_root (tmpdir.fd, ".", &hsack, error))
+  if (!get_sack_for_root (tmpdir.fd, ".", NULL, &hsack, error))
     return NULL;
 
   /* Ownership of tmpdir is transferred */
@@ -305,13 +305,23 @@ dump_buffered_output_noerr (const char *prefix,
     g_printerr ("While writing output: %s\n", local_error->message);
 }
 
+/* Whether @pkg_script (<packagename>.<script>) runs directly on the rootfs
+ * rather than in the shared sandbox; see above for why we special case glibc.
+ */
+static gboolean
+script_mutates_freely (const char *pkg_script)
+{
+  return g_str_equal (pkg_script, "glibc-all-langpacks.posttrans") ||
+    g_str_equal (pkg_script, "glibc-common.post");
+}
+
 /* Lowest level script handler in this file; create a bwrap instance and run it
  * synchronously.
  */
 gboolean
 rpmostree_run_script_in_bwrap_container (int rootfs_fd,
                                GLnxTmpDir *var_lib_rpm_statedir,
-                               gboolean    enable_fuse,
+                               rpmostreecxx::BubblewrapSandbox &sandbox,
                                const char *name,
                                const char *scriptdesc,
                                const char *interp,
@@ -335,14 +345,11 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd,
    * var/tmp, so we need to tmpfs mount on top of it. See also
    * https://github.com/projectatomic/bubblewrap/issues/182
    * Similarly for /var/lib/rpm-state.
-   *
-   * See above for why we special case glibc.
    */
-  gboolean is_glibc_locales = strcmp (pkg_script, "glibc-all-langpacks.posttrans") == 0 ||
-    strcmp (pkg_script, "glibc-common.post") == 0;
-  rpmostreecxx::BubblewrapMutability mutability =
-    (is_glibc_locales || !enable_fuse) ? rpmostreecxx::BubblewrapMutability::MutateFreely : rpmostreecxx::BubblewrapMutability::RoFiles;
-  auto bwrap = rpmostreecxx::bubblewrap_new_with_mutability (rootfs_fd, mutability);
+  gboolean is_glibc_locales = script_mutates_freely (pkg_script);
+  auto bwrap = is_glibc_locales
+    ? rpmostreecxx::bubblewrap_new_with_mutability (rootfs_fd, rpmostreecxx::BubblewrapMutability::MutateFreely)
+    : sandbox.new_bwrap();
   /* Scripts can see a /var with compat links like alternatives */
   bwrap->var_tmp_tmpfs();
 
@@ -449,6 +456,9 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd,
   try {
     g_assert(cancellable);
     bwrap->run(*cancellable);
+    /* That one bypassed the sandbox's rofiles-fuse mounts */
+    if (is_glibc_locales)
+      sandbox.invalidate();
   } catch (std::exception&e) {
       dump_buffered_output_noerr(pkg_script, &buffered_output);
       auto msg = e.what();
@@ -467,15 +477,17 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd,
  * ignored. Here we mostly compute arguments/input, then proceed into the lower
  * level bwrap execution.
  */
+/* Find the script to actually run for the @rpmscript of @pkg, taking our
+ * replacements into account; sets @out_script to NULL if it's suppressed.
+ */
 static gboolean
-impl_run_rpm_script (const KnownRpmScriptKind *rpmscript,
-                     DnfPackage    *pkg,
-                     Header         hdr,
-                     int            rootfs_fd,
-                     GLnxTmpDir    *var_lib_rpm_statedir,
-                     gboolean       enable_fuse,
-                     GCancellable  *cancellable,
-                     GError       **error)
+lookup_script (const KnownRpmScriptKind *rpmscript,
+               DnfPackage    *pkg,
+               Header         hdr,
+               char         **out_interp,
+               const char   **out_script,
+               gboolean      *out_expand,
+               GError       **error)
 {
   struct rpmtd_s td;
   g_autofree char **args = NULL;
@@ -483,7 +495,7 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript,
     args = static_cast<char**>(td.data);
 
   const rpmFlags flags = headerGetNumber (hdr, rpmscript->flagtag);
-  const char *script;
+  const char *script = NULL;
   const char *interp = (args && args[0]) ? args[0] : "/bin/sh";
   const char *pkg_scriptid = glnx_strjoina (dnf_package_get_name (pkg), ".", rpmscript->desc + 1);
   gboolean expand = (flags & RPMSCRIPT_FLAG_EXPAND) > 0;
@@ -526,12 +538,43 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript,
             continue;
           /* Is this completely suppressing the script?  If so, we're done */
           if (!repl->interp)
-            return TRUE;
+            {
+              interp = NULL;
+              script = NULL;
+              break;
+            }
           interp = repl->interp;
           script = repl->replacement;
           break;
         }
     }
+
+  /* The interpreter may point into @args */
+  *out_interp = g_strdup (interp);
+  *out_script = script;
+  *out_expand = expand;
+  return TRUE;
+}
+
+static gboolean
+impl_run_rpm_script (const KnownRpmScriptKind *rpmscript,
+                     DnfPackage    *pkg,
+                     Header         hdr,
+                     int            rootfs_fd,
+                     GLnxTmpDir    *var_lib_rpm_statedir,
+                     rpmostreecxx::BubblewrapSandbox &sandbox,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  g_autofree char *interp = NULL;
+  const char *script;
+  gboolean expand;
+  if (!lookup_script (rpmscript, pkg, hdr, &interp, &script, &expand, error))
+    return FALSE;
+  /* Suppressed by a replacement */
+  if (!script)
+    return TRUE;
+
   g_autofree char *script_owned = NULL;
   g_assert (script);
   if (expand)
@@ -564,7 +607,7 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript,
     }
 
   guint64 start_time_ms = g_get_monotonic_time () / 1000;
-  if (!rpmostree_run_script_in_bwrap_container (rootfs_fd, var_lib_rpm_statedir, enable_fuse,
+  if (!rpmostree_run_script_in_bwrap_container (rootfs_fd, var_lib_rpm_statedir, sandbox,
                                       dnf_package_get_name (pkg),
                                       rpmscript->desc, interp, script, script_arg,
                                       -1, cancellable, error))
@@ -591,7 +634,7 @@ run_script (const KnownRpmScriptKind *rpmscript,
             Header                    hdr,
             int                       rootfs_fd,
             GLnxTmpDir               *var_lib_rpm_statedir,
-            gboolean                  enable_fuse,
+            rpmostreecxx::BubblewrapSandbox &sandbox,
             gboolean                 *out_did_run,
             GCancellable             *cancellable,
             GError                  **error)
@@ -614,28 +657,33 @@ run_script (const KnownRpmScriptKind *rpmscript,
 
   *out_did_run = TRUE;
   return impl_run_rpm_script (rpmscript, pkg, hdr, rootfs_fd, var_lib_rpm_statedir,
-                              enable_fuse, cancellable, error);
+                              sandbox, cancellable, error);
 }
 
-static gboolean
-write_filename (FILE *f, GString *prefix,
-                GError **error)
+struct RpmOstreeTransFileTriggerIndex {
+  int rootfs_fd;
+  /* Trigger directory (with a leading /) -> sorted paths of the non-directories
+   * under it; walked lazily, and dropped when a trigger on it runs since the
+   * script may have added files there */
+  GHashTable *dir_files;
+  /* Paths of the files from packages added or removed in this transaction;
+   * sorted lazily */
+  GPtrArray *changed_files;
+  gboolean changed_sorted;
+};
+
+static int
+cmp_strings (gconstpointer a,
+             gconstpointer b)
 {
-  if (fwrite_unlocked (prefix->str, 1, prefix->len, f) != prefix->len)
-    return glnx_throw_errno_prefix (error, "fwrite");
-  if (fputc_unlocked ('\n', f) == EOF)
-    return glnx_throw_errno_prefix (error, "fputc");
-  return TRUE;
+  return strcmp (*(const char * const *)a, *(const char * const *)b);
 }
 
-/* Used for %transfiletriggerin - basically an implementation of `find -type f` that
- * writes the filenames to a tmpfile.
- */
+/* Basically an implementation of `find -type f`, collecting the filenames. */
 static gboolean
-write_subdir (int dfd, const char *path,
+index_subdir (int dfd, const char *path,
               GString *prefix,
-              FILE *f,
-              guint *inout_n_matched,
+              GPtrArray *files,
               GCancellable *cancellable,
               GError **error)
 {
@@ -669,43 +717,154 @@ write_subdir (int dfd, const char *path,
       g_string_append (prefix, dent->d_name);
       if (dent->d_type == DT_DIR)
         {
-          if (!write_subdir (dfd_iter.fd, dent->d_name, prefix, f,
-                             inout_n_matched,
+          if (!index_subdir (dfd_iter.fd, dent->d_name, prefix, files,
                              cancellable, error))
             return FALSE;
         }
       else
-        {
-          if (!write_filename (f, prefix, error))
-            return FALSE;
-          (*inout_n_matched)++;
-        }
+        g_ptr_array_add (files, g_strndup (prefix->str, prefix->len));
       g_string_truncate (prefix, origlen);
     }
 
   return TRUE;
 }
 
-/* Given file trigger @pattern (really a subdirectory), traverse the
- * filesystem @rootfs_fd and write all matches as file names to @f.  Used
- * for %transfiletriggerin.
+/* Index the trigger directories of @rootfs_fd as they're needed, so that
+ * %transfiletriggerin patterns sharing one don't each walk the filesystem.
  */
+RpmOstreeTransFileTriggerIndex *
+rpmostree_transfiletrigger_index_new (int rootfs_fd)
+{
+  auto index = g_new0 (RpmOstreeTransFileTriggerIndex, 1);
+  index->rootfs_fd = rootfs_fd;
+  index->dir_files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)g_ptr_array_unref);
+  index->changed_files = g_ptr_array_new_with_free_func (g_free);
+  index->changed_sorted = TRUE;
+  return index;
+}
+
+/* Record @path (relative, canonicalized for usrmove) as a file of a package
+ * added or removed in this transaction.
+ */
+void
+rpmostree_transfiletrigger_index_add_file (RpmOstreeTransFileTriggerIndex *index,
+                                           const char                     *path)
+{
+  g_assert (*path != '/');
+  g_ptr_array_add (index->changed_files, g_strconcat ("/", path, NULL));
+  index->changed_sorted = FALSE;
+}
+
+void
+rpmostree_transfiletrigger_index_free (RpmOstreeTransFileTriggerIndex *index)
+{
+  g_clear_pointer (&index->dir_files, g_hash_table_unref);
+  g_clear_pointer (&index->changed_files, g_ptr_array_unref);
+  g_free (index);
+}
+
+/* Return the sorted files under trigger directory @dir, walking it if we
+ * haven't yet.
+ */
+static GPtrArray *
+index_get_dir_files (RpmOstreeTransFileTriggerIndex *index,
+                     const char                     *dir,
+                     GCancellable                   *cancellable,
+                     GError                        **error)
+{
+  auto files = static_cast<GPtrArray*>(g_hash_table_lookup (index->dir_files, dir));
+  if (files)
+    return files;
+
+  g_autoptr(GPtrArray) new_files = g_ptr_array_new_with_free_func (g_free);
+  struct stat stbuf;
+  if (!glnx_fstatat_allow_noent (index->rootfs_fd, dir + 1, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+    return NULL;
+  if (errno == 0 && !S_ISDIR (stbuf.st_mode))
+    g_ptr_array_add (new_files, g_strdup (dir)); /* A pattern naming a file */
+  else if (errno == 0)
+    {
+      g_autoptr(GString) prefix = g_string_new (dir);
+      if (!index_subdir (index->rootfs_fd, dir + 1, prefix, new_files, cancellable, error))
+        return (GPtrArray*)glnx_prefix_error_null (error, "Indexing %s", dir);
+    }
+  g_ptr_array_sort (new_files, cmp_strings);
+  files = new_files;
+  g_hash_table_insert (index->dir_files, g_strdup (dir), util::move_nullify (new_files));
+  return files;
+}
+
+/* Whether @a is @b or a directory containing it. */
 static gboolean
-find_and_write_matching_files (int rootfs_fd, const char *pattern,
-                               FILE *f,
-                               guint *out_n_matches,
-                               GCancellable *cancellable,
-                               GError **error)
+path_contains (const char *a,
+               const char *b)
 {
-  GLNX_AUTO_PREFIX_ERROR ("Finding matches", error);
+  const size_t alen = strlen (a);
+  return strncmp (a, b, alen) == 0 && (b[alen] == '/' || b[alen] == '\0');
+}
+
+/* Drop the cached walks overlapping trigger directory @dir. */
+static void
+index_invalidate_dir (RpmOstreeTransFileTriggerIndex *index,
+                      const char                     *dir)
+{
+  GHashTableIter it;
+  gpointer k;
+  g_hash_table_iter_init (&it, index->dir_files);
+  while (g_hash_table_iter_next (&it, &k, NULL))
+    {
+      auto cached = static_cast<const char*>(k);
+      if (path_contains (cached, dir) || path_contains (dir, cached))
+        g_hash_table_iter_remove (&it);
+    }
+}
+
+/* Return the index of the first path in sorted @files which is @dir itself or
+ * is under it, or @files->len if there is none.  Since all paths under
+ * @dir share it as a prefix, they're contiguous from there on.
+ */
+static guint
+index_lookup_dir (GPtrArray  *files,
+                  const char *dir)
+{
+  const size_t dirlen = strlen (dir);
+  guint lo = 0;
+  guint hi = files->len;
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      if (strcmp (static_cast<const char*>(files->pdata[mid]), dir) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  for (; lo < files->len; lo++)
+    {
+      auto path = static_cast<const char*>(files->pdata[lo]);
+      if (strncmp (path, dir, dirlen) != 0)
+        break;
+      if (path[dirlen] == '/' || path[dirlen] == '\0')
+        return lo;
+      /* Otherwise e.g. /usr/lib64 when looking for /usr/lib; keep going */
+    }
+  return files->len;
+}
 
+/* Given file trigger @pattern (really a subdirectory), turn it into the
+ * absolute directory form used by the index; returns %NULL if the pattern
+ * is one we don't support.
+ */
+static char *
+trigger_pattern_to_dir (const char *pattern)
+{
   /* Fontconfig in fedora has /usr/local; we don't support RPM
    * touching /usr/local.  While I'm here, proactively
    * require /usr as a prefix too.
    */
   if (g_str_has_prefix (pattern, "usr/local") ||
       !g_str_has_prefix (pattern, "usr/"))
-    return TRUE;
+    return NULL;
 
   /* The printed buffer does have a leading / */
   g_autoptr(GString) buf = g_string_new ("/");
@@ -713,16 +872,111 @@ find_and_write_matching_files (int rootfs_fd, const char *pattern,
   /* Strip trailing '/' in the mutable copy we have here */
   while (buf->len > 0 && buf->str[buf->len-1] == '/')
     g_string_truncate (buf, buf->len - 1);
+  return g_string_free (util::move_nullify (buf), FALSE);
+}
 
-  guint n_pattern_matches = 0;
-  if (!write_subdir (rootfs_fd, pattern, buf, f, &n_pattern_matches,
-                     cancellable, error))
-    return glnx_prefix_error (error, "pattern '%s'", pattern);
-  *out_n_matches += n_pattern_matches;
+/* Whether any of the files from added or removed packages match @pattern. */
+static gboolean
+index_changed_files_match (RpmOstreeTransFileTriggerIndex *index,
+                           const char                     *pattern)
+{
+  g_autofree char *dir = trigger_pattern_to_dir (pattern);
+  if (!dir)
+    return FALSE;
+  if (!index->changed_sorted)
+    {
+      g_ptr_array_sort (index->changed_files, cmp_strings);
+      index->changed_sorted = TRUE;
+    }
+  return index_lookup_dir (index->changed_files, dir) < index->changed_files->len;
+}
+
+/* Write all paths in the rootfs matching file trigger @pattern to @f.  Used
+ * for %transfiletriggerin.
+ */
+static gboolean
+find_and_write_matching_files (RpmOstreeTransFileTriggerIndex *index,
+                               const char *pattern,
+                               FILE *f,
+                               guint *out_n_matches,
+                               GCancellable *cancellable,
+                               GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Finding matches", error);
+
+  g_autofree char *dir = trigger_pattern_to_dir (pattern);
+  if (!dir)
+    return TRUE;
+
+  GPtrArray *files = index_get_dir_files (index, dir, cancellable, error);
+  if (!files)
+    return FALSE;
+  for (guint i = 0; i < files->len; i++)
+    {
+      auto path = static_cast<const char*>(files->pdata[i]);
+      if (fputs_unlocked (path, f) == EOF || fputc_unlocked ('\n', f) == EOF)
+        return glnx_throw_errno_prefix (error, "fputs");
+      (*out_n_matches)++;
+    }
 
   return TRUE;
 }
 
+static const KnownRpmScriptKind *
+script_kind_lookup (RpmOstreeScriptKind kind)
+{
+  switch (kind)
+    {
+    case RPMOSTREE_SCRIPT_PREIN:
+      return &pre_script;
+    case RPMOSTREE_SCRIPT_POSTIN:
+      return &post_script;
+    case RPMOSTREE_SCRIPT_POSTTRANS:
+      return &posttrans_script;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+/* Whether the @kind script of @pkg (if any) may run concurrently with other
+ * scripts.  This is deny by default: only scripts which don't run at all and
+ * those on the allowlist in scripts.rs qualify.  Note the allowlist applies
+ * to the script we'd actually run, i.e. our replacement if there's one.
+ * Scripts writing directly to the shared rootfs (because the sandbox has
+ * @mutability MutateFreely, or see script_mutates_freely()) never do.
+ */
+gboolean
+rpmostree_script_is_parallel_safe (DnfPackage         *pkg,
+                                   Header              hdr,
+                                   RpmOstreeScriptKind kind,
+                                   rpmostreecxx::BubblewrapMutability mutability)
+{
+  const KnownRpmScriptKind *scriptkind = script_kind_lookup (kind);
+  if (!(headerIsEntry (hdr, scriptkind->tag) || headerIsEntry (hdr, scriptkind->progtag)))
+    return TRUE;
+  if (!headerGetString (hdr, scriptkind->tag))
+    return TRUE;
+  const char *name = dnf_package_get_name (pkg);
+  if (rpmostreecxx::script_is_ignored (name, scriptkind->desc))
+    return TRUE;
+
+  g_autofree char *interp = NULL;
+  const char *script;
+  gboolean expand;
+  /* Unsupported scripts error out when run; not our concern here */
+  if (!lookup_script (scriptkind, pkg, hdr, &interp, &script, &expand, NULL))
+    return FALSE;
+  if (!script)
+    return TRUE;
+
+  const char *pkg_script = glnx_strjoina (name, ".", scriptkind->desc+1);
+  if (mutability == rpmostreecxx::BubblewrapMutability::MutateFreely ||
+      script_mutates_freely (pkg_script))
+    return FALSE;
+
+  return rpmostreecxx::script_is_parallel_safe (name, scriptkind->desc);
+}
+
 /* Execute a supported script.  Note that @cancellable
  * does not currently kill a running script subprocess.
  */
@@ -732,30 +986,15 @@ rpmostree_script_run_sync (DnfPackage    *pkg,
                            RpmOstreeScriptKind kind,
                            int            rootfs_fd,
                            GLnxTmpDir    *var_lib_rpm_statedir,
-                           gboolean       enable_fuse,
+                           rpmostreecxx::BubblewrapSandbox &sandbox,
                            guint         *out_n_run,
                            GCancellable  *cancellable,
                            GError       **error)
 {
-  const KnownRpmScriptKind *scriptkind;
-  switch (kind)
-    {
-    case RPMOSTREE_SCRIPT_PREIN:
-      scriptkind = &pre_script;
-      break;
-    case RPMOSTREE_SCRIPT_POSTIN:
-      scriptkind = &post_script;
-      break;
-    case RPMOSTREE_SCRIPT_POSTTRANS:
-      scriptkind = &posttrans_script;
-      break;
-    default:
-      g_assert_not_reached ();
-    }
-
+  const KnownRpmScriptKind *scriptkind = script_kind_lookup (kind);
   gboolean did_run = FALSE;
   if (!run_script (scriptkind, pkg, hdr, rootfs_fd,
-                   var_lib_rpm_statedir, enable_fuse,
+                   var_lib_rpm_statedir, sandbox,
                    &did_run, cancellable, error))
     return FALSE;
 
@@ -764,13 +1003,56 @@ rpmostree_script_run_sync (DnfPackage    *pkg,
   return TRUE;
 }
 
+/* Whether rpmostree_transfiletriggers_run_sync() would run any of the
+ * %transfiletriggerin of base package @hdr, given the changed files recorded
+ * in @index.
+ */
+gboolean
+rpmostree_transfiletriggers_match (Header                          hdr,
+                                   RpmOstreeTransFileTriggerIndex *index)
+{
+  const char *pkg_name = headerGetString (hdr, RPMTAG_NAME);
+  g_assert (pkg_name);
+  if (rpmostreecxx::script_is_ignored (pkg_name, "%transfiletriggerin"))
+    return FALSE;
+
+  headerGetFlags hgflags = HEADERGET_MINMEM;
+  struct rpmtd_s tname, tflags;
+  headerGet (hdr, RPMTAG_TRANSFILETRIGGERNAME, &tname, hgflags);
+  headerGet (hdr, RPMTAG_TRANSFILETRIGGERFLAGS, &tflags, hgflags);
+
+  const guint n_names = rpmtdCount (&tname);
+  for (guint j = 0; j < n_names; j++)
+    {
+      rpmFlags sense = 0;
+      if (rpmtdSetIndex (&tflags, j) >= 0)
+        sense = rpmtdGetNumber (&tflags);
+      if (!(sense & RPMSENSE_TRIGGERIN))
+        continue;
+
+      g_assert_cmpint (rpmtdSetIndex (&tname, j), ==, j);
+      const char *pattern = rpmtdGetString (&tname);
+      if (!pattern)
+        continue;
+      pattern += strspn (pattern, "/");
+      if (*pattern && index_changed_files_match (index, pattern))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 /* File triggers, as used by e.g. glib2.spec and vagrant.spec in Fedora. More
- * info at <http://rpm.org/user_doc/file_triggers.html>.
+ * info at <http://rpm.org/user_doc/file_triggers.html>.  If @pkg_added, @hdr
+ * is a package added in this transaction, whose triggers always run like in
+ * librpm; otherwise only those matching changed files in @index do.
  */
 gboolean
 rpmostree_transfiletriggers_run_sync (Header        hdr,
                                       int           rootfs_fd,
-                                      gboolean      enable_fuse,
+                                      RpmOstreeTransFileTriggerIndex *index,
+                                      gboolean      pkg_added,
+                                      rpmostreecxx::BubblewrapSandbox &sandbox,
                                       guint        *out_n_run,
                                       GCancellable *cancellable,
                                       GError      **error)
@@ -873,6 +1155,19 @@ rpmostree_transfiletriggers_run_sync (Header        hdr,
       if (patterns->len == 0)
         continue;
 
+      /* Like librpm, only fire if this transaction added a matching file.
+       * Since we don't run %transfiletriggerpostun, also fire on removed
+       * files so that e.g. caches get regenerated without them.
+       */
+      gboolean any_changed = pkg_added;
+      for (guint j = 0; j < patterns->len && !any_changed; j++)
+        any_changed = index_changed_files_match (index, static_cast<const char *>(patterns->pdata[j]));
+      if (!any_changed)
+        {
+          g_debug ("Skipping %%transfiletriggerin for %s; no changed files matched", pkg_name);
+          continue;
+        }
+
       /* Build up the list of files matching the patterns. librpm uses a pipe and
        * doesn't do async writes, and hence is subject to deadlock. We could use
        * a pipe and do async, but an O_TMPFILE is easier for now. There
@@ -896,7 +1191,7 @@ rpmostree_transfiletriggers_run_sync (Header        hdr,
           if (j > 0)
             g_string_append (patterns_joined, ", ");
           g_string_append (patterns_joined, pattern);
-          if (!find_and_write_matching_files (rootfs_fd, pattern, tmpf_file, &n_matched,
+          if (!find_and_write_matching_files (index, pattern, tmpf_file, &n_matched,
                                               cancellable, error))
             return FALSE;
           if (n_matched == 0)
@@ -919,10 +1214,18 @@ rpmostree_transfiletriggers_run_sync (Header        hdr,
 
       /* Run it, and log the result */
       guint64 start_time_ms = g_get_monotonic_time () / 1000;
-      if (!rpmostree_run_script_in_bwrap_container (rootfs_fd, NULL, enable_fuse, pkg_name,
+      if (!rpmostree_run_script_in_bwrap_container (rootfs_fd, NULL, sandbox, pkg_name,
                                           "%transfiletriggerin", interp, script, NULL,
                                           fileno (tmpf_file), cancellable, error))
         return FALSE;
+      /* The trigger may have added files under its directories that later
+       * triggers want to see; anywhere else is its own business. */
+      for (guint j = 0; j < patterns->len; j++)
+        {
+          g_autofree char *dir = trigger_pattern_to_dir (static_cast<const char *>(patterns->pdata[j]));
+          if (dir)
+            index_invalidate_dir (index, dir);
+        }
       guint64 end_time_ms = g_get_monotonic_time () / 1000;
       guint64 elapsed_ms = end_time_ms - start_time_ms;
 
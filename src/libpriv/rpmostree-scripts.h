@@ -31,6 +31,7 @@
 #include <libdnf/libdnf.h>
 
 #include "libglnx.h"
+#include "rpmostree-cxxrs.h"
 
 G_BEGIN_DECLS
 
@@ -52,15 +53,40 @@ rpmostree_script_run_sync (DnfPackage    *pkg,
                            RpmOstreeScriptKind kind,
                            int            rootfs_fd,
                            GLnxTmpDir    *var_lib_rpm_statedir,
-                           gboolean       enable_rofiles,
+                           rpmostreecxx::BubblewrapSandbox &sandbox,
                            guint         *out_n_run,
                            GCancellable  *cancellable,
                            GError       **error);
 
+gboolean
+rpmostree_script_is_parallel_safe (DnfPackage         *pkg,
+                                   Header              hdr,
+                                   RpmOstreeScriptKind kind,
+                                   rpmostreecxx::BubblewrapMutability mutability);
+
+typedef struct RpmOstreeTransFileTriggerIndex RpmOstreeTransFileTriggerIndex;
+
+RpmOstreeTransFileTriggerIndex *
+rpmostree_transfiletrigger_index_new (int rootfs_fd);
+
+void
+rpmostree_transfiletrigger_index_add_file (RpmOstreeTransFileTriggerIndex *index,
+                                           const char                     *path);
+
+void
+rpmostree_transfiletrigger_index_free (RpmOstreeTransFileTriggerIndex *index);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RpmOstreeTransFileTriggerIndex, rpmostree_transfiletrigger_index_free);
+
+gboolean
+rpmostree_transfiletriggers_match (Header                          hdr,
+                                   RpmOstreeTransFileTriggerIndex *index);
+
 gboolean
 rpmostree_transfiletriggers_run_sync (Header         hdr,
                                       int            rootfs_fd,
-                                      gboolean       enable_rofiles,
+                                      RpmOstreeTransFileTriggerIndex *index,
+                                      gboolean       pkg_added,
+                                      rpmostreecxx::BubblewrapSandbox &sandbox,
                                       guint         *out_n_run,
                                       GCancellable  *cancellable,
                                       GError       **error);
@@ -80,7 +106,7 @@ rpmostree_deployment_sanitycheck_rpmdb (int           rootfs_fd,
 gboolean
 rpmostree_run_script_in_bwrap_container (int rootfs_fd,
                                GLnxTmpDir *var_lib_rpm_statedir,
-                               gboolean    enable_fuse,
+                               rpmostreecxx::BubblewrapSandbox &sandbox,
                                const char *name,
                                const char *scriptdesc,
                                const char *interp,
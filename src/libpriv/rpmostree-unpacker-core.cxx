@@ -35,9 +35,28 @@
 #include <rpm/rpmlog.h>
 #include <rpm/rpmfi.h>
 #include <rpm/rpmts.h>
+#include <lzma.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <stdlib.h>
 
+/* Used if we can't mmap() the package for some reason */
+#define RPM2CPIO_FALLBACK_BLOCKSIZE (128 * 1024)
+
+/* lzma_stream_decoder_mt() is stable as of xz 5.4 */
+#if LZMA_VERSION >= 50040002
+#define HAVE_LZMA_MT_DECODER 1
+#endif
+/* Payloads at least this big (uncompressed) are worth spinning up a
+ * multi-threaded decoder for; smaller ones are better served by the
+ * parallelism we already have across packages.
+ */
+#define RPM_PAYLOAD_MT_THRESHOLD (64 * 1024 * 1024)
+#define RPM_PAYLOAD_MT_OUTBUF_SIZE (1024 * 1024)
+/* Never fail decoding with less than this; xz -9 needs ~65MiB single-threaded */
+#define RPM_PAYLOAD_MT_MEMLIMIT_STOP_MIN (256 * 1024 * 1024)
+
 static void
 propagate_libarchive_error (GError      **error,
                             struct archive *a)
@@ -48,6 +67,65 @@ propagate_libarchive_error (GError      **error,
 
 typedef int(*archive_setup_func)(struct archive *);
 
+/* A read-only mapping of an entire RPM, handed to libarchive as a single
+ * contiguous block; the decompression filters then read straight from the page
+ * cache rather than via many small read() calls into an intermediate buffer.
+ */
+typedef struct {
+  void *map;
+  gsize len;
+  gboolean consumed;
+} MappedRpm;
+
+static la_ssize_t
+mapped_rpm_read (struct archive *a,
+                 void           *data,
+                 const void    **buf)
+{
+  auto mapped = static_cast<MappedRpm *>(data);
+  if (mapped->consumed)
+    return 0;
+  mapped->consumed = TRUE;
+  *buf = mapped->map;
+  return mapped->len;
+}
+
+static int
+mapped_rpm_close (struct archive *a,
+                  void           *data)
+{
+  auto mapped = static_cast<MappedRpm *>(data);
+  (void) munmap (mapped->map, mapped->len);
+  g_free (mapped);
+  return ARCHIVE_OK;
+}
+
+/* Open @fd on @a via a mapping if possible, falling back to plain reads
+ * otherwise (e.g. if @fd isn't a regular file).
+ */
+static int
+archive_read_open_rpm_fd (struct archive *a,
+                          int             fd)
+{
+  struct stat stbuf;
+  if (fstat (fd, &stbuf) == 0 && S_ISREG (stbuf.st_mode) && stbuf.st_size > 0)
+    {
+      void *map = mmap (NULL, stbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+        {
+          (void) madvise (map, stbuf.st_size, MADV_SEQUENTIAL);
+          MappedRpm *mapped = g_new0 (MappedRpm, 1);
+          mapped->map = map;
+          mapped->len = stbuf.st_size;
+          /* From here on, libarchive owns the mapping and will call
+           * mapped_rpm_close() even if opening fails. */
+          return archive_read_open (a, mapped, NULL, mapped_rpm_read, mapped_rpm_close);
+        }
+    }
+
+  return archive_read_open_fd (a, fd, RPM2CPIO_FALLBACK_BLOCKSIZE);
+}
+
 /**
  * rpmostree_unpack_rpm2cpio:
  * @fd: An open file descriptor for an RPM package
@@ -89,7 +167,7 @@ rpmostree_unpack_rpm2cpio (int fd, GError **error)
       }
   }
 
-  if (archive_read_open_fd (ret, fd, 10240) != ARCHIVE_OK)
+  if (archive_read_open_rpm_fd (ret, fd) != ARCHIVE_OK)
     {
       propagate_libarchive_error (error, ret);
       glnx_prefix_error (error, "rpmostree_unpack_rpm2cpio");
@@ -107,3 +185,162 @@ rpmostree_unpack_rpm2cpio (int fd, GError **error)
       return NULL;
     }
 }
+
+#ifdef HAVE_LZMA_MT_DECODER
+/* Feeds libarchive the already-decompressed cpio stream from an xz payload,
+ * using liblzma's threaded decoder.  Note that this can only go wide if the
+ * payload was compressed in multiple blocks (e.g. `xz -T`); for single-block
+ * streams liblzma transparently uses one thread.
+ */
+typedef struct {
+  void *map;
+  gsize map_len;
+  lzma_stream strm;
+  guint8 *outbuf;
+  gboolean finished;
+} XzPayloadReader;
+
+static la_ssize_t
+xz_payload_read (struct archive *a,
+                 void           *data,
+                 const void    **buf)
+{
+  auto reader = static_cast<XzPayloadReader *>(data);
+  if (reader->finished)
+    return 0;
+
+  reader->strm.next_out = reader->outbuf;
+  reader->strm.avail_out = RPM_PAYLOAD_MT_OUTBUF_SIZE;
+  while (reader->strm.avail_out == RPM_PAYLOAD_MT_OUTBUF_SIZE)
+    {
+      lzma_ret lret = lzma_code (&reader->strm, LZMA_FINISH);
+      if (lret == LZMA_STREAM_END)
+        {
+          reader->finished = TRUE;
+          break;
+        }
+      else if (lret != LZMA_OK)
+        {
+          archive_set_error (a, ARCHIVE_ERRNO_MISC, "xz payload decompression failed (%d)", lret);
+          return ARCHIVE_FATAL;
+        }
+    }
+
+  *buf = reader->outbuf;
+  return RPM_PAYLOAD_MT_OUTBUF_SIZE - reader->strm.avail_out;
+}
+
+static int
+xz_payload_close (struct archive *a,
+                  void           *data)
+{
+  auto reader = static_cast<XzPayloadReader *>(data);
+  lzma_end (&reader->strm);
+  (void) munmap (reader->map, reader->map_len);
+  g_free (reader->outbuf);
+  g_free (reader);
+  return ARCHIVE_OK;
+}
+
+static struct archive *
+unpack_xz_payload_mt (int       fd,
+                      gsize     cpio_offset,
+                      guint     n_concurrent,
+                      GError  **error)
+{
+  struct stat stbuf;
+  if (!glnx_fstat (fd, &stbuf, error))
+    return NULL;
+  if (cpio_offset >= (gsize)stbuf.st_size)
+    return (struct archive*)glnx_null_throw (error, "Invalid payload offset %" G_GSIZE_FORMAT, cpio_offset);
+
+  void *map = mmap (NULL, stbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return (struct archive*)glnx_null_throw_errno_prefix (error, "mmap");
+  (void) madvise (map, stbuf.st_size, MADV_SEQUENTIAL);
+
+  XzPayloadReader *reader = g_new0 (XzPayloadReader, 1);
+  reader->map = map;
+  reader->map_len = stbuf.st_size;
+  reader->outbuf = (guint8*)g_malloc (RPM_PAYLOAD_MT_OUTBUF_SIZE);
+  { lzma_stream strm_init = LZMA_STREAM_INIT;
+    reader->strm = strm_init; }
+
+  /* Other payloads are being decompressed at the same time, so only take our
+   * share of the processors and memory.  Above memlimit_threading liblzma
+   * falls back to fewer threads; memlimit_stop is the hard ceiling.
+   */
+  const guint64 physmem = lzma_physmem ();
+  lzma_mt mt = { 0, };
+  mt.flags = LZMA_CONCATENATED;
+  mt.threads = MAX (g_get_num_processors () / n_concurrent, 1);
+  mt.memlimit_threading = physmem / 4 / n_concurrent;
+  mt.memlimit_stop = MAX (physmem / 2 / n_concurrent, RPM_PAYLOAD_MT_MEMLIMIT_STOP_MIN);
+  lzma_ret lret = lzma_stream_decoder_mt (&reader->strm, &mt);
+  if (lret != LZMA_OK)
+    {
+      (void) xz_payload_close (NULL, reader);
+      return (struct archive*)glnx_null_throw (error, "Initializing xz decoder (%d)", lret);
+    }
+  reader->strm.next_in = (const guint8*)map + cpio_offset;
+  reader->strm.avail_in = stbuf.st_size - cpio_offset;
+
+  struct archive *ret = archive_read_new ();
+  g_assert (ret);
+  /* The payload is already decompressed, so there's no filter; just cpio */
+  if (archive_read_support_format_cpio (ret) != ARCHIVE_OK)
+    {
+      propagate_libarchive_error (error, ret);
+      (void) archive_read_free (ret);
+      (void) xz_payload_close (NULL, reader);
+      return NULL;
+    }
+
+  /* From here on, libarchive owns the reader */
+  if (archive_read_open (ret, reader, NULL, xz_payload_read, xz_payload_close) != ARCHIVE_OK)
+    {
+      propagate_libarchive_error (error, ret);
+      (void) archive_read_free (ret);
+      return (struct archive*)glnx_prefix_error_null (error, "rpmostree_unpack_rpm2cpio_full");
+    }
+
+  return ret;
+}
+#endif
+
+/**
+ * rpmostree_unpack_rpm2cpio_full:
+ * @fd: An open file descriptor for an RPM package
+ * @hdr: The already parsed header of @fd
+ * @cpio_offset: Offset of the payload in @fd
+ * @n_concurrent: Number of payloads being decompressed at the same time
+ * @error: GError
+ *
+ * Like rpmostree_unpack_rpm2cpio(), but uses @hdr to pick a faster way to
+ * decompress the payload where one is available; currently this is a
+ * multi-threaded decoder for large xz payloads, which gets 1/@n_concurrent
+ * of the processors and memory.  Everything else (including
+ * zstd, for which there is no multi-threaded decoder) takes the libarchive
+ * filter path.
+ */
+struct archive *
+rpmostree_unpack_rpm2cpio_full (int          fd,
+                                Header       hdr,
+                                gsize        cpio_offset,
+                                guint        n_concurrent,
+                                GError     **error)
+{
+  n_concurrent = MAX (n_concurrent, 1);
+#ifdef HAVE_LZMA_MT_DECODER
+  const char *compressor = headerGetString (hdr, RPMTAG_PAYLOADCOMPRESSOR);
+  const guint64 payload_size = headerGetNumber (hdr, RPMTAG_LONGSIZE);
+  /* For tests; use the multi-threaded decoder for all xz payloads */
+  const gboolean force_mt = getenv ("RPMOSTREE_FORCE_PAYLOAD_MT") != NULL;
+  if (g_strcmp0 (compressor, "xz") == 0 &&
+      (force_mt || (payload_size >= RPM_PAYLOAD_MT_THRESHOLD &&
+                    g_get_num_processors () / n_concurrent > 1)))
+    return unpack_xz_payload_mt (fd, cpio_offset, n_concurrent, error);
+#endif
+
+  return rpmostree_unpack_rpm2cpio (fd, error);
+}
@@ -32,4 +32,7 @@ G_BEGIN_DECLS
 
 struct archive * rpmostree_unpack_rpm2cpio (int fd, GError **error);
 
+struct archive * rpmostree_unpack_rpm2cpio_full (int fd, Header hdr, gsize cpio_offset,
+                                                 guint n_concurrent, GError **error);
+
 G_END_DECLS
\ No newline at end of file
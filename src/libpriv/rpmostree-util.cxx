@@ -762,6 +762,60 @@ rpmostree_commit_content_checksum (GVariant *commit)
   return g_strdup (g_checksum_get_string (hasher));
 }
 
+/* Walk @mtree down the relative @subpath; if @create is set, directories are
+ * created as needed, otherwise they must exist.
+ */
+OstreeMutableTree *
+rpmostree_mtree_walk (OstreeMutableTree *mtree,
+                      const char        *subpath,
+                      gboolean           create,
+                      GError           **error)
+{
+  g_autoptr(OstreeMutableTree) parent = (OstreeMutableTree*)g_object_ref (mtree);
+  g_auto(GStrv) components = g_strsplit (subpath, "/", -1);
+  for (char **it = components; it && *it; it++)
+    {
+      if (!**it || g_str_equal (*it, "."))
+        continue;
+      g_autoptr(OstreeMutableTree) child = NULL;
+      if (create)
+        {
+          if (!ostree_mutable_tree_ensure_dir (parent, *it, &child, error))
+            return NULL;
+        }
+      else
+        {
+          g_autofree char *file_checksum = NULL;
+          if (!ostree_mutable_tree_lookup (parent, *it, &file_checksum, &child, error))
+            return NULL;
+          if (!child)
+            return (OstreeMutableTree*)glnx_null_throw (error, "Not a directory: %s", subpath);
+        }
+      g_clear_object (&parent);
+      parent = util::move_nullify (child);
+    }
+  return util::move_nullify (parent);
+}
+
+/* Make @subpath of @mtree the already written tree with the given checksums;
+ * it must not have any content yet.
+ */
+gboolean
+rpmostree_mtree_graft_dirtree (OstreeMutableTree *mtree,
+                               const char        *subpath,
+                               OstreeRepo        *repo,
+                               const char        *contents_checksum,
+                               const char        *metadata_checksum,
+                               GError           **error)
+{
+  g_autoptr(OstreeMutableTree) subdir = rpmostree_mtree_walk (mtree, subpath, TRUE, error);
+  if (!subdir)
+    return FALSE;
+  if (!ostree_mutable_tree_fill_empty_from_dirtree (subdir, repo, contents_checksum, metadata_checksum))
+    return glnx_throw (error, "Failed to graft tree at %s", *subpath ? subpath : "/");
+  return TRUE;
+}
+
 char*
 rpmostree_generate_diff_summary (guint upgraded,
                                  guint downgraded,
@@ -1162,3 +1216,44 @@ rpmostree_variant_native_to_be (GVariant **v)
 {
   rpmostree_variant_be_to_native (v);
 }
+
+/* Mirrors libostree's private OstreeDevIno, the key (and value) of the hash
+ * table behind OstreeRepoDevInoCache; its hash and equality functions only
+ * look at the device and inode.  libostree has no API to read the cache, so
+ * the helpers below use this.
+ */
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  char checksum[OSTREE_SHA256_STRING_LEN+1];
+} RpmOstreeDevIno;
+
+/* Returns the object checksum of the file checked out (hardlinked) with
+ * @devino_cache at @stbuf, or %NULL if it was written after the checkout.
+ */
+const char *
+rpmostree_devino_cache_lookup (OstreeRepoDevInoCache *devino_cache,
+                               const struct stat     *stbuf)
+{
+  if (!devino_cache || stbuf->st_nlink < 2)
+    return NULL;
+  RpmOstreeDevIno key = { stbuf->st_dev, stbuf->st_ino, { 0, } };
+  auto found = static_cast<RpmOstreeDevIno*>(g_hash_table_lookup ((GHashTable*)devino_cache, &key));
+  return found ? found->checksum : NULL;
+}
+
+/* Add the entries of @other to @devino_cache. */
+void
+rpmostree_devino_cache_merge (OstreeRepoDevInoCache *devino_cache,
+                              OstreeRepoDevInoCache *other)
+{
+  GHashTableIter it;
+  gpointer k;
+  g_hash_table_iter_init (&it, (GHashTable*)other);
+  while (g_hash_table_iter_next (&it, &k, NULL))
+    {
+      auto copy = g_new (RpmOstreeDevIno, 1);
+      memcpy (copy, k, sizeof (RpmOstreeDevIno));
+      g_hash_table_add ((GHashTable*)devino_cache, copy);
+    }
+}
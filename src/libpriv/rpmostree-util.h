@@ -27,6 +27,7 @@
 // C includes
 #include <gio/gio.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <ostree.h>
 #include <libdnf/libdnf.h>
@@ -273,6 +274,20 @@ rpmostree_get_deployment_root (OstreeSysroot     *sysroot,
 char *
 rpmostree_commit_content_checksum (GVariant *commit);
 
+OstreeMutableTree *
+rpmostree_mtree_walk (OstreeMutableTree *mtree,
+                      const char        *subpath,
+                      gboolean           create,
+                      GError           **error);
+
+gboolean
+rpmostree_mtree_graft_dirtree (OstreeMutableTree *mtree,
+                               const char        *subpath,
+                               OstreeRepo        *repo,
+                               const char        *contents_checksum,
+                               const char        *metadata_checksum,
+                               GError           **error);
+
 /* https://github.com/ostreedev/ostree/pull/1132 */
 typedef struct {
   gboolean initialized;
@@ -338,4 +353,12 @@ rpmostree_variant_be_to_native (GVariant **v);
 void
 rpmostree_variant_native_to_be (GVariant **v);
 
+const char *
+rpmostree_devino_cache_lookup (OstreeRepoDevInoCache *devino_cache,
+                               const struct stat     *stbuf);
+
+void
+rpmostree_devino_cache_merge (OstreeRepoDevInoCache *devino_cache,
+                              OstreeRepoDevInoCache *other);
+
 G_END_DECLS
@@ -145,7 +145,7 @@ License: GPLv2+
 EOF
 
     local build= install= files= pretrans= pre= post= posttrans= post_args=
-    local verifyscript= uinfo=
+    local verifyscript= uinfo= payload=
     local transfiletriggerin= transfiletriggerin_patterns=
     local transfiletriggerin2= transfiletriggerin2_patterns=
     local transfiletriggerun= transfiletriggerun_patterns=
@@ -163,7 +163,7 @@ EOF
             echo "Conflicts: $arg" >> $spec;;
         post_args)
             post_args="$arg";;
-        version|release|epoch|arch|build|install|files|pretrans|pre|post|posttrans|verifyscript|uinfo)
+        version|release|epoch|arch|build|install|files|pretrans|pre|post|posttrans|verifyscript|uinfo|payload)
             declare $section="$arg";;
         transfiletriggerin)
             transfiletriggerin_patterns="$arg";
@@ -246,7 +246,8 @@ EOF
         --define "_builddir $PWD/.build" \
         --define "_srcrpmdir $PWD" \
         --define "_rpmdir $test_tmpdir/yumrepo/packages" \
-        --define "_buildrootdir $PWD")
+        --define "_buildrootdir $PWD" \
+        ${payload:+--define "_binary_payload $payload"})
     # use --keep-all-metadata to retain previous updateinfo
     (cd $test_tmpdir/yumrepo &&
      createrepo_c --no-database --update --keep-all-metadata .)
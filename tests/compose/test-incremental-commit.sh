@@ -0,0 +1,43 @@
+#!/bin/bash
+set -xeuo pipefail
+
+dn=$(cd "$(dirname "$0")" && pwd)
+# shellcheck source=libcomposetest.sh
+. "${dn}/libcomposetest.sh"
+
+manifest=${repo}/extensions/rpmostree/compose-manifest.gv
+
+treefile_append "repos" '["test-repo"]'
+build_rpm rpmostree-incremental-test \
+  install "mkdir -p %{buildroot}/usr/share/rpmostree-incremental-test && echo aaaa > %{buildroot}/usr/share/rpmostree-incremental-test/data" \
+  files "/usr/share/rpmostree-incremental-test"
+echo gpgcheck=0 >> yumrepo.repo
+ln "$PWD/yumrepo.repo" config/yumrepo.repo
+treefile_append "packages" '["rpmostree-incremental-test"]'
+
+# Nothing to compare to yet, so no fingerprinting
+runcompose
+test ! -f "${manifest}"
+echo "ok no manifest without history"
+
+runcompose --force-nocache
+test -f "${manifest}"
+echo "ok manifest"
+
+# Same size, so only the contents differ
+build_rpm rpmostree-incremental-test version 2.0 \
+  install "mkdir -p %{buildroot}/usr/share/rpmostree-incremental-test && echo bbbb > %{buildroot}/usr/share/rpmostree-incremental-test/data" \
+  files "/usr/share/rpmostree-incremental-test"
+runcompose |& tee out.txt
+assert_file_has_content_literal out.txt 'reused'
+ostree --repo="${repo}" cat "${treeref}" /usr/share/rpmostree-incremental-test/data > data.txt
+assert_file_has_content_literal data.txt bbbb
+ostree --repo="${repo}" ls -R -C -X "${treeref}" > incremental.txt
+echo "ok incremental commit"
+
+# And it matches a full commit of the same rootfs
+rm "${manifest}"
+runcompose --force-nocache
+ostree --repo="${repo}" ls -R -C -X "${treeref}" > full.txt
+diff -u incremental.txt full.txt
+echo "ok incremental commit matches full commit"
@@ -0,0 +1,27 @@
+#!/bin/bash
+set -xeuo pipefail
+
+dn=$(cd "$(dirname "$0")" && pwd)
+# shellcheck source=libcomposetest.sh
+. "${dn}/libcomposetest.sh"
+
+# Packages are only checked out in parallel without the devino cache, i.e.
+# without --cachedir.  The treefile checksum doesn't include `concurrency`,
+# hence --force-nocache for the second run.
+runcompose_nocachedir() {
+  runasroot rpm-ostree compose tree --unified-core --repo="${repo}" \
+    --force-nocache "${treefile}" "$@"
+}
+
+runcompose_nocachedir
+ostree --repo="${repo}" ls -R -C -X "${treeref}" > serial.txt
+echo "ok serial checkout"
+
+treefile_set "concurrency" '{"checkout": 8}'
+runcompose_nocachedir
+ostree --repo="${repo}" rev-parse "${treeref}^" >/dev/null
+ostree --repo="${repo}" ls -R -C -X "${treeref}" > parallel.txt
+# Same paths, modes, ownership, xattrs and content objects; files which were
+# hardlinks in the rootfs share the same object, so this covers those too.
+diff -u serial.txt parallel.txt
+echo "ok parallel checkout matches serial"
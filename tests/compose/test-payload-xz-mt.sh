@@ -0,0 +1,30 @@
+#!/bin/bash
+set -xeuo pipefail
+
+dn=$(cd "$(dirname "$0")" && pwd)
+# shellcheck source=libcomposetest.sh
+. "${dn}/libcomposetest.sh"
+
+# Large xz payloads are decompressed with liblzma's multi-threaded decoder;
+# force it for this small test package, and check the import is intact.
+# Multiple xz blocks (-T0 when building) are what the decoder parallelizes.
+treefile_append "repos" '["test-repo"]'
+head -c 4M /dev/urandom > payload-mt-test.bin
+build_rpm rpmostree-payload-mt-test \
+  payload "w2T0.xzdio" \
+  install "mkdir -p %{buildroot}/usr/share && install -m 0644 ${PWD}/payload-mt-test.bin %{buildroot}/usr/share" \
+  files "/usr/share/payload-mt-test.bin"
+rpm -qp --qf '%{PAYLOADCOMPRESSOR}\n' yumrepo/packages/x86_64/rpmostree-payload-mt-test-1.0-1.x86_64.rpm > compressor.txt
+assert_file_has_content compressor.txt '^xz$'
+echo gpgcheck=0 >> yumrepo.repo
+ln "$PWD/yumrepo.repo" config/yumrepo.repo
+treefile_append "packages" '["rpmostree-payload-mt-test"]'
+
+export RPMOSTREE_FORCE_PAYLOAD_MT=1
+runcompose
+unset RPMOSTREE_FORCE_PAYLOAD_MT
+echo "ok compose"
+
+ostree --repo="${repo}" cat "${treeref}" /usr/share/payload-mt-test.bin > out.bin
+cmp payload-mt-test.bin out.bin
+echo "ok multi-threaded xz payload decoder"
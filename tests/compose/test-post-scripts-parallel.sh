@@ -0,0 +1,35 @@
+#!/bin/bash
+set -xeuo pipefail
+
+dn=$(cd "$(dirname "$0")" && pwd)
+# shellcheck source=libcomposetest.sh
+. "${dn}/libcomposetest.sh"
+
+# Both %post scripts are on the parallel-safe allowlist (see scripts.rs).  The
+# dep is ordered first; its %post must run before the test package's rpmfi
+# overrides (the chgrp below) are applied, and the test package's after, just
+# like when running the scripts serially.
+treefile_append "repos" '["test-repo"]'
+build_rpm rpmostree-parallel-post-test-dep \
+  post "stat -c %G /usr/lib/rpmostree-parallel-post-test-owned > /usr/share/rpmostree-parallel-post-test-dep.group"
+build_rpm rpmostree-parallel-post-test \
+  requires rpmostree-parallel-post-test-dep \
+  install "mkdir -p %{buildroot}/usr/lib && echo owned > %{buildroot}/usr/lib/rpmostree-parallel-post-test-owned" \
+  files "%attr(0640, root, adm) /usr/lib/rpmostree-parallel-post-test-owned" \
+  post "(cat /usr/share/rpmostree-parallel-post-test-dep.group
+stat -c %G /usr/lib/rpmostree-parallel-post-test-owned) > /usr/share/rpmostree-parallel-post-test.out"
+echo gpgcheck=0 >> yumrepo.repo
+ln "$PWD/yumrepo.repo" config/yumrepo.repo
+treefile_append "packages" '["rpmostree-parallel-post-test"]'
+treefile_set "concurrency" '{"post-scripts": 4}'
+
+runcompose
+echo "ok compose"
+
+ostree --repo="${repo}" cat "${treeref}" /usr/share/rpmostree-parallel-post-test.out > out.txt
+cat > expected.txt <<EOF2
+root
+adm
+EOF2
+diff -u expected.txt out.txt
+echo "ok rpmfi overrides ordered relative to parallel %post"
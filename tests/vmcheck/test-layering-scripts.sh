@@ -162,6 +162,31 @@ done
 # We really need a reset command to go back to the base layer
 vm_rpmostree uninstall scriptpkg{4,5}
 echo "ok transfiletriggerin"
+
+# Triggers from base packages only run when the transaction changes a
+# matching path; /lib here also checks that we canonicalize for usrmove.
+orig_base=$(vm_cmd ostree rev-parse vmcheck)
+vm_build_rpm trigger-base \
+             transfiletriggerin "/usr/lib/trigger-test" 'sort >/usr/share/transfiletriggerin-trigger-test.txt'
+vm_build_rpm trigger-test-files \
+             files "/lib/trigger-test/a" \
+             install 'mkdir -p %{buildroot}/lib/trigger-test && touch %{buildroot}/lib/trigger-test/a'
+vm_build_rpm trigger-test-unrelated
+vm_rpmostree install trigger-base
+vm_ostree_commit_layered_as_base $(vm_get_pending_csum) vmcheck
+vm_rpmostree cleanup -p
+vm_rpmostree upgrade
+cursor=$(vm_get_journal_cursor)
+vm_rpmostree install trigger-test-unrelated
+vm_get_journal_after_cursor "$cursor" journal.txt
+assert_not_file_has_content journal.txt 'transfiletriggerin(trigger-base)'
+vm_rpmostree install trigger-test-files
+root=$(vm_get_deployment_root 0)
+vm_cmd cat $root/usr/share/transfiletriggerin-trigger-test.txt > trigger-test.txt
+assert_file_has_content trigger-test.txt '^/usr/lib/trigger-test/a$'
+vm_rpmostree cleanup -p
+vm_cmd ostree reset vmcheck "$orig_base"
+echo "ok transfiletriggerin only for changed paths"
 fi
 
 # Should work now that we're using --copyup
@@ -80,7 +80,14 @@ vm_cmd mv /var/tmp/vmcheck/yumrepo{,.bak}
 # nevra of each gv_nevra element.
 
 # remove just bar first to check deletion handling
-vm_rpmostree override remove bar
+vm_rpmostree override remove bar | tee out.txt
+# Only removing a package, so only its directories get checked out; the rest is
+# grafted back in from the base, and should be exactly the same
+assert_file_has_content out.txt 'Checking out modified directories'
+for csum in $(vm_get_booted_csum) $(vm_get_pending_csum); do
+  vm_cmd ostree ls -R -C ${csum} /usr/bin /usr/share | grep -v -e '^d' -e ' /usr/share/rpm' > ls-${csum}.txt
+done
+diff -u ls-$(vm_get_booted_csum).txt ls-$(vm_get_pending_csum).txt
 vm_assert_status_jq \
   '.deployments[0]["base-removals"]|length == 1' \
   '[.deployments[0]["base-removals"][][.0]]|index("bar-1.0-1.x86_64") >= 0' \